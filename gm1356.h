@@ -0,0 +1,44 @@
+/* gm1356.h -- Protocol constants for the GM1356 Sound Level Meter
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define GM1356_SPLMETER_VID         0x64bd
+#define GM1356_SPLMETER_PID         0x74e3
+
+#define GM1356_FAST_MODE            0x40
+#define GM1356_HOLD_MAX_MODE        0x20
+#define GM1356_MEASURE_DBC          0x10
+
+#define GM1356_RANGE_30_130_DB      0x0
+#define GM1356_RANGE_30_80_DB       0x1
+#define GM1356_RANGE_50_100_DB      0x2
+#define GM1356_RANGE_60_110_DB      0x3
+#define GM1356_RANGE_80_130_DB      0x4
+
+#define GM1356_FLAGS_RANGE_MASK     0xf
+
+#define GM1356_COMMAND_CAPTURE      0xb3
+#define GM1356_COMMAND_CONFIGURE    0x56
+
+static inline
+const char *gm1356_range_name(uint8_t flags)
+{
+    static const char *range_str[] = {
+        "30-130",
+        "30-80",
+        "50-100",
+        "60-110",
+        "80-130",
+    };
+    uint8_t range = flags & GM1356_FLAGS_RANGE_MASK;
+
+    return range > GM1356_RANGE_80_130_DB ? "UNKNOWN" : range_str[range];
+}
@@ -0,0 +1,194 @@
+/* splarena.c -- Startup-only allocation from a fixed arena
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define SPL_ARENA_ALIGN             16
+
+/*
+ * Each block carries its size, so that spl_realloc() knows how much to copy
+ */
+struct spl_arena_block {
+    size_t size;
+    size_t _resv;
+};
+
+static
+uint8_t *arena_base = NULL;
+
+static
+size_t arena_size = 0;
+
+static
+size_t arena_used = 0;
+
+static
+bool arena_sealed = false;
+
+static
+bool _in_arena(void const *ptr)
+{
+    return NULL != arena_base && (uint8_t const *)ptr >= arena_base && (uint8_t const *)ptr < arena_base + arena_size;
+}
+
+int spl_arena_init(size_t size)
+{
+    int ret = A_OK;
+
+    void *base = MAP_FAILED;
+
+    ASSERT_ARG(0 != size);
+    ASSERT_ARG(NULL == arena_base);
+
+    size = (size + SPL_ARENA_ALIGN - 1) & ~(size_t)(SPL_ARENA_ALIGN - 1);
+
+    /* MAP_POPULATE, so the whole arena is resident now, not as it's used */
+    if (MAP_FAILED == (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                    -1, 0)))
+    {
+        SPL_MSG(SEV_ERROR, "ARENA-FAIL", "Failed to set aside %zu bytes for the arena", size);
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    arena_base = base;
+    arena_size = size;
+    arena_used = 0;
+    arena_sealed = false;
+
+done:
+    return ret;
+}
+
+void spl_arena_seal(void)
+{
+    arena_sealed = true;
+}
+
+bool spl_arena_active(void)
+{
+    return NULL != arena_base;
+}
+
+size_t spl_arena_used(void)
+{
+    return arena_used;
+}
+
+size_t spl_arena_size(void)
+{
+    return arena_size;
+}
+
+void *spl_zalloc(size_t size)
+{
+    struct spl_arena_block *block = NULL;
+    size_t need = sizeof(*block) + ((size + SPL_ARENA_ALIGN - 1) & ~(size_t)(SPL_ARENA_ALIGN - 1));
+
+    if (NULL == arena_base) {
+        return calloc(1, 0 == size ? 1 : size);
+    }
+
+    if (true == arena_sealed) {
+        SPL_MSG(SEV_ERROR, "ALLOC-AFTER-STARTUP", "Refusing to allocate %zu bytes after startup", size);
+        return NULL;
+    }
+
+    if (need > arena_size - arena_used) {
+        SPL_MSG(SEV_ERROR, "ARENA-FULL", "Arena is full (%zu of %zu bytes used, %zu more wanted)", arena_used,
+                arena_size, need);
+        return NULL;
+    }
+
+    /* The arena starts out zeroed, and nothing is ever handed back to it */
+    block = (struct spl_arena_block *)(arena_base + arena_used);
+    block->size = size;
+    arena_used += need;
+
+    return block + 1;
+}
+
+void *spl_realloc(void *ptr, size_t size)
+{
+    struct spl_arena_block const *block = NULL;
+    void *new_ptr = NULL;
+
+    if (NULL == arena_base || (NULL != ptr && false == _in_arena(ptr))) {
+        return realloc(ptr, size);
+    }
+
+    if (NULL == (new_ptr = spl_zalloc(size))) {
+        return NULL;
+    }
+
+    if (NULL != ptr) {
+        block = (struct spl_arena_block const *)ptr - 1;
+        memcpy(new_ptr, ptr, block->size < size ? block->size : size);
+    }
+
+    return new_ptr;
+}
+
+void spl_free(void *ptr)
+{
+    if (false == _in_arena(ptr)) {
+        free(ptr);
+    }
+}
+
+char *spl_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = NULL;
+
+    if (NULL != (copy = spl_zalloc(len))) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+wchar_t *spl_wcsdup(const wchar_t *str)
+{
+    size_t len = (wcslen(str) + 1) * sizeof(wchar_t);
+    wchar_t *copy = NULL;
+
+    if (NULL != (copy = spl_zalloc(len))) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+int spl_asprintf(char **pstr, const char *fmt, ...)
+{
+    va_list ap;
+    int len = 0;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (0 > len || NULL == (*pstr = spl_zalloc(len + 1))) {
+        *pstr = NULL;
+        return -1;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(*pstr, len + 1, fmt, ap);
+    va_end(ap);
+
+    return len;
+}
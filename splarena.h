@@ -0,0 +1,47 @@
+/* splarena.h -- Startup-only allocation from a fixed arena
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <wchar.h>
+
+/*
+ * Everything that lives for as long as splread runs (device tables, rings, aggregators,
+ * output buffers) is allocated through these. Normally they're just the C library's
+ * allocator. In fixed-footprint mode, spl_arena_init() sets aside one region, touched up
+ * front so that it's all resident, and every allocation is carved from it; freeing is a
+ * no-op. Once startup is done, spl_arena_seal() makes any further allocation fail (loudly),
+ * so there's no way for the footprint to creep up while running.
+ *
+ * spl_free() and spl_realloc() can be handed memory from either source.
+ */
+
+/**
+ * Switch to allocating from an arena of the given size
+ */
+int spl_arena_init(size_t size);
+
+/**
+ * Startup is over: from now on, allocations fail
+ */
+void spl_arena_seal(void);
+
+bool spl_arena_active(void);
+size_t spl_arena_used(void);
+size_t spl_arena_size(void);
+
+void *spl_zalloc(size_t size);
+void *spl_realloc(void *ptr, size_t size);
+void spl_free(void *ptr);
+char *spl_strdup(const char *str);
+wchar_t *spl_wcsdup(const wchar_t *str);
+int spl_asprintf(char **pstr, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
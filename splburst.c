@@ -0,0 +1,247 @@
+/* splburst.c -- Pre-trigger burst recording of full-rate clips around loud events
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splburst.h>
+#include <splstore.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int spl_burst_parse(struct spl_burst_config *cfg, const char *spec)
+{
+    int ret = A_OK;
+
+    unsigned long long interval_ms = 0,
+                       pre_sec = 0,
+                       post_sec = 0;
+    double trigger_db = 0.0;
+    int end = 0;
+
+    ASSERT_ARG(NULL != cfg);
+    ASSERT_ARG(NULL != spec);
+
+    if (4 != sscanf(spec, "%llu:%llu:%llu:%lf%n", &interval_ms, &pre_sec, &post_sec, &trigger_db, &end) ||
+            '\0' != spec[end] || 0 == interval_ms || 0 == pre_sec + post_sec || trigger_db <= 0.0 ||
+            pre_sec > SPL_BURST_MAX_CLIP_SEC || post_sec > SPL_BURST_MAX_CLIP_SEC)
+    {
+        SPL_MSG(SEV_ERROR, "BAD-BURST", "Bad burst specification '%s', expected <interval ms>:<pre s>:<post s>:<trigger dB>",
+                spec);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    cfg->interval_ms = interval_ms;
+    cfg->pre_ns = pre_sec * SPL_NS_PER_SEC;
+    cfg->post_ns = post_sec * SPL_NS_PER_SEC;
+    cfg->trigger_ddb = (uint16_t)(trigger_db * 10.0 + 0.5);
+
+done:
+    return ret;
+}
+
+int spl_burst_init(struct spl_burst *burst, struct spl_burst_config const *cfg, uint16_t device)
+{
+    int ret = A_OK;
+
+    ASSERT_ARG(NULL != burst);
+    ASSERT_ARG(NULL != cfg);
+
+    memset(burst, 0, sizeof(*burst));
+
+    burst->cfg = cfg;
+    burst->device = device;
+
+    burst->clip_dir_fd = -1;
+
+    /* Enough for the pre-trigger window, with some slack for jitter in the poll timing */
+    burst->ring_cap = cfg->pre_ns / (cfg->interval_ms * SPL_NS_PER_MS) + 16;
+
+    /* A clip can't run on past SPL_BURST_MAX_CLIP_SEC, so it never needs to grow */
+    burst->clip_cap = burst->ring_cap + SPL_BURST_MAX_CLIP_SEC * 1000 / cfg->interval_ms + 16;
+
+    if (NULL == (burst->ring = spl_zalloc(burst->ring_cap * sizeof(struct spl_sample))) ||
+            NULL == (burst->clip = spl_zalloc(burst->clip_cap * sizeof(struct spl_sample))))
+    {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+void spl_burst_cleanup(struct spl_burst *burst)
+{
+    /* Only close the clips directory if we got as far as initializing */
+    if (NULL != burst->ring && 0 <= burst->clip_dir_fd) {
+        close(burst->clip_dir_fd);
+    }
+    spl_free(burst->ring);
+    spl_free(burst->clip);
+    memset(burst, 0, sizeof(*burst));
+    burst->clip_dir_fd = -1;
+}
+
+static
+void _burst_clip_append(struct spl_burst *burst, struct spl_sample const *sample)
+{
+    burst->clip[burst->clip_nr++] = *sample;
+}
+
+static
+void _burst_ring_push(struct spl_burst *burst, struct spl_sample const *sample)
+{
+    size_t tail = (burst->ring_head + burst->ring_nr) % burst->ring_cap;
+
+    burst->ring[tail] = *sample;
+
+    if (burst->ring_nr == burst->ring_cap) {
+        burst->ring_head = (burst->ring_head + 1) % burst->ring_cap;
+    } else {
+        burst->ring_nr++;
+    }
+}
+
+static
+int _burst_write_clip(struct spl_burst *burst, const char *dir)
+{
+    int ret = A_OK;
+
+    char name[SPL_SEG_NAME_LEN];
+    struct spl_seg_header hdr = {
+        .magic = SPL_SEG_MAGIC,
+        .version = SPL_SEG_VERSION,
+        .rec_size = sizeof(struct spl_sample),
+        .kind = SPL_SEG_KIND_RAW,
+    };
+
+    if (0 == burst->clip_nr) {
+        goto done;
+    }
+
+    hdr.start_ns = burst->clip[0].ts_ns;
+    hdr.span_ns = burst->clip[burst->clip_nr - 1].ts_ns - hdr.start_ns + 1;
+
+    /* Keep hold of the clips directory, so writing a clip doesn't need to build any paths */
+    if (0 > burst->clip_dir_fd) {
+        int dir_fd = -1;
+
+        if (0 > (dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) ||
+                (0 > mkdirat(dir_fd, SPL_BURST_CLIP_DIR, 0755) && EEXIST != errno) ||
+                0 > (burst->clip_dir_fd = openat(dir_fd, SPL_BURST_CLIP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+        {
+            SPL_MSG(SEV_ERROR, "CLIP-DIR-FAIL", "Failed to create clip directory %s/%s: %s", dir, SPL_BURST_CLIP_DIR,
+                    strerror(errno));
+            burst->clip_dir_fd = -1;
+            ret = A_E_IO;
+        }
+
+        if (0 <= dir_fd) {
+            close(dir_fd);
+        }
+
+        if (FAILED(ret)) {
+            goto done;
+        }
+    }
+
+    snprintf(name, sizeof(name), "clip-%u-%012llu.seg", burst->device,
+            (unsigned long long)(hdr.start_ns / SPL_NS_PER_SEC));
+
+    if (FAILED(ret = spl_seg_write_atomic_at(burst->clip_dir_fd, name, &hdr, burst->clip, burst->clip_nr))) {
+        goto done;
+    }
+
+    SPL_MSG(SEV_INFO, "CLIP", "Wrote %zu samples (%.1f s) from device %u to %s/%s/%s", burst->clip_nr,
+            (double)hdr.span_ns / 1e9, burst->device, dir, SPL_BURST_CLIP_DIR, name);
+
+done:
+    burst->active = false;
+    burst->clip_nr = 0;
+
+    return ret;
+}
+
+int spl_burst_feed(struct spl_burst *burst, struct spl_sample const *sample, const char *dir)
+{
+    int ret = A_OK;
+
+    bool triggered = false;
+
+    ASSERT_ARG(NULL != burst);
+    ASSERT_ARG(NULL != sample);
+    ASSERT_ARG(NULL != dir);
+
+    triggered = sample->deci_db >= burst->cfg->trigger_ddb;
+
+    if (false == burst->active) {
+        if (false == triggered) {
+            _burst_ring_push(burst, sample);
+            goto done;
+        }
+
+        /* Start a clip with whatever's in the ring from the pre-trigger window */
+        burst->active = true;
+        burst->clip_start_ns = sample->ts_ns;
+        burst->clip_nr = 0;
+
+        for (size_t i = 0; i < burst->ring_nr; i++) {
+            struct spl_sample const *old = &burst->ring[(burst->ring_head + i) % burst->ring_cap];
+
+            if (old->ts_ns + burst->cfg->pre_ns < sample->ts_ns) {
+                continue;
+            }
+
+            _burst_clip_append(burst, old);
+        }
+
+        burst->ring_nr = 0;
+        burst->ring_head = 0;
+    }
+
+    _burst_clip_append(burst, sample);
+
+    /* Every sample over the trigger pushes the end of the clip out */
+    if (true == triggered) {
+        burst->clip_end_ns = sample->ts_ns + burst->cfg->post_ns;
+    }
+
+    if (sample->ts_ns >= burst->clip_end_ns ||
+            sample->ts_ns - burst->clip_start_ns >= SPL_BURST_MAX_CLIP_SEC * SPL_NS_PER_SEC ||
+            burst->clip_nr == burst->clip_cap)
+    {
+        ret = _burst_write_clip(burst, dir);
+    }
+
+done:
+    if (FAILED(ret) && true == burst->active) {
+        SPL_MSG(SEV_WARNING, "CLIP-LOST", "Dropping clip from device %u", burst->device);
+        burst->active = false;
+        burst->clip_nr = 0;
+    }
+
+    return ret;
+}
+
+int spl_burst_flush(struct spl_burst *burst, const char *dir)
+{
+    ASSERT_ARG(NULL != burst);
+    ASSERT_ARG(NULL != dir);
+
+    if (false == burst->active) {
+        return A_OK;
+    }
+
+    return _burst_write_clip(burst, dir);
+}
@@ -0,0 +1,81 @@
+/* splburst.h -- Pre-trigger burst recording of full-rate clips around loud events
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * In burst mode, devices are polled at a high rate, and every sample goes into a ring
+ * holding the last few seconds. Only every so often is a sample passed on to the normal
+ * output, the store and event detection, so they carry on at the configured rate. When a
+ * sample reaches the trigger level, the ring is copied out as the start of a clip, and
+ * every sample after it is added until the level has stayed below the trigger for the
+ * post-trigger window. The clip is then written out in the segment format (see
+ * splstore.h), as a raw segment of its own:
+ *
+ *   <store dir>/clips/clip-<device>-<start seconds, 12 digits>.seg
+ */
+#define SPL_BURST_CLIP_DIR          "clips"
+
+/* No clip runs on for longer than this, however long the noise goes on for */
+#define SPL_BURST_MAX_CLIP_SEC      600ull
+
+struct spl_burst_config {
+    /* How often to poll, in burst mode */
+    uint64_t interval_ms;
+    /* How much to keep from before the trigger */
+    uint64_t pre_ns;
+    /* How long to keep recording once the level drops below the trigger */
+    uint64_t post_ns;
+    uint16_t trigger_ddb;
+};
+
+struct spl_burst {
+    struct spl_burst_config const *cfg;
+    uint16_t device;
+
+    /* Ring of the most recent samples, oldest at ring_head */
+    struct spl_sample *ring;
+    size_t ring_cap;
+    size_t ring_head;
+    size_t ring_nr;
+
+    /* The clip being recorded, if active */
+    bool active;
+    uint64_t clip_start_ns;
+    uint64_t clip_end_ns;
+    struct spl_sample *clip;
+    size_t clip_nr;
+    size_t clip_cap;
+    /* The clips directory, once we've written a clip to it */
+    int clip_dir_fd;
+};
+
+/**
+ * Parse a burst specification, "<interval ms>:<pre-trigger s>:<post-trigger s>:<trigger dB>"
+ */
+int spl_burst_parse(struct spl_burst_config *cfg, const char *spec);
+
+int spl_burst_init(struct spl_burst *burst, struct spl_burst_config const *cfg, uint16_t device);
+void spl_burst_cleanup(struct spl_burst *burst);
+
+/**
+ * Feed a full-rate sample. If this completes a clip, it is written to the clips directory
+ * under dir.
+ */
+int spl_burst_feed(struct spl_burst *burst, struct spl_sample const *sample, const char *dir);
+
+/**
+ * Write out the clip being recorded, if there is one, cut short.
+ */
+int spl_burst_flush(struct spl_burst *burst, const char *dir);
@@ -0,0 +1,90 @@
+/* splcommon.h -- Common definitions shared by splread and its tools
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <spllog.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define SEV_SUCCESS     "S"
+#define SEV_INFO        "I"
+#define SEV_WARNING     "W"
+#define SEV_ERROR       "E"
+#define SEV_FATAL       "F"
+
+/* Messages go through spllog, which rate limits them and keeps them from blocking the caller */
+#define MESSAGE(subsys, severity, ident, message, ...) \
+        do { \
+            spl_log(subsys, severity, ident, __FILE__, __LINE__, __FUNCTION__, message, ##__VA_ARGS__); \
+        } while (0)
+#define SPL_MSG(sev, ident, message, ...)     MESSAGE("SPL", sev, ident, message, ##__VA_ARGS__)
+
+#define ASSERT_ARG(_x_) \
+    do { \
+        if (!(_x_)) { \
+            SPL_MSG(SEV_FATAL, "BAD-AGUMENTS", "Bad arguments - %s:%d (function %s): " #_x_ " is FALSE", __FILE__, __LINE__, __FUNCTION__); \
+            return A_E_BADARGS; \
+        } \
+    } while (0)
+
+#define DIAG(...) /* Define as an alias to MESSAGE for debug output */
+
+#define FAILED(_x_)                 (0 != (_x_))
+
+#define A_OK                        0
+#define A_E_NOTFOUND                -1
+#define A_E_BADARGS                 -2
+#define A_E_INVAL                   -3
+#define A_E_EMPTY                   -4
+#define A_E_TIMEOUT                 -5
+#define A_E_NOMEM                   -6
+#define A_E_IO                      -7
+#define A_E_BUSY                    -8
+
+#define SPL_NS_PER_MS               1000000ull
+#define SPL_NS_PER_SEC              1000000000ull
+
+/**
+ * A single decoded measurement, as it is handed to every consumer (output, store, event
+ * detection). Laid out so it can be written to disk as-is.
+ */
+struct spl_sample {
+    /* Wall-clock time of the measurement, in nanoseconds since the UNIX epoch */
+    uint64_t ts_ns;
+    /* Sound level, in tenths of a dB */
+    uint16_t deci_db;
+    /* Index of the device that produced this sample */
+    uint16_t device;
+    /* GM1356 response flags (mode, weighting, range) */
+    uint8_t flags;
+    uint8_t _resv0;
+    /*
+     * How far ts_ns could be from when the meter actually took the measurement, either way,
+     * in microseconds; 0 if that isn't known (and in samples recorded before it was)
+     */
+    uint16_t ts_err_us;
+} __attribute__((packed));
+
+static inline
+uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec *  1000000000ull + ts.tv_nsec;
+}
+
+static inline
+uint64_t get_mono_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,798 @@
+/* splcompact.c -- Tiered retention and downsampling compaction of the sample store
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splcompact.h>
+#include <splkern.h>
+#include <splstore.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* From linux/ioprio.h, which isn't reliably installed */
+#define IOPRIO_CLASS_SHIFT          13
+#define IOPRIO_CLASS_IDLE           3
+#define IOPRIO_WHO_PROCESS          1
+#define IOPRIO_PRIO_VALUE(_c, _d)   (((_c) << IOPRIO_CLASS_SHIFT) | (_d))
+
+struct spl_compactor {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+    char *dir;
+    struct spl_retention policy;
+    unsigned interval_sec;
+};
+
+/**
+ * Rollup state for one device while building an output segment
+ */
+struct _rollup_dev {
+    uint16_t device;
+    bool active;
+    uint64_t bucket_ns;
+    uint32_t nr_samples;
+    uint16_t min_ddb;
+    uint16_t max_ddb;
+    uint8_t flags;
+    double energy;
+    /* Raw levels in the current bucket, so they can go through the batch kernels */
+    uint16_t *ddb;
+    size_t nr_ddb;
+    size_t cap_ddb;
+};
+
+struct _rollup_builder {
+    uint64_t res_ns;
+    struct _rollup_dev *devs;
+    size_t nr_devs;
+    struct spl_rollup *out;
+    size_t nr_out;
+    size_t cap_out;
+};
+
+/**
+ * A segment we found in the store directory
+ */
+struct _seg_ent {
+    char *path;
+    uint64_t start_ns;
+};
+
+struct _seg_list {
+    const char *prefix;
+    struct _seg_ent *ents;
+    size_t nr;
+    size_t cap;
+};
+
+static
+bool _parse_duration_sec(const char *str, size_t len, uint64_t *psecs)
+{
+    char *end = NULL;
+    unsigned long long val = 0;
+
+    if (7 == len && 0 == strncmp(str, "forever", 7)) {
+        *psecs = SPL_RETENTION_FOREVER;
+        return true;
+    }
+
+    val = strtoull(str, &end, 10);
+    if (end == str || (size_t)(end - str) + 1 != len) {
+        return false;
+    }
+
+    switch (*end) {
+    case 's': *psecs = val; break;
+    case 'm': *psecs = val * 60ull; break;
+    case 'h': *psecs = val * 3600ull; break;
+    case 'd': *psecs = val * 86400ull; break;
+    case 'w': *psecs = val * 7ull * 86400ull; break;
+    case 'y': *psecs = val * 365ull * 86400ull; break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+int spl_retention_parse(struct spl_retention *policy, const char *spec)
+{
+    int ret = A_OK;
+
+    const char *cur = spec;
+
+    ASSERT_ARG(NULL != policy);
+    ASSERT_ARG(NULL != spec);
+
+    memset(policy, 0, sizeof(*policy));
+
+    while ('\0' != *cur) {
+        const char *eq = strchr(cur, '='),
+                   *end = strchrnul(cur, ',');
+        uint64_t res_sec = 0,
+                 keep_sec = 0;
+        size_t k = policy->nr_tiers;
+
+        if (NULL == eq || eq > end || SPL_RETENTION_MAX_TIERS == k) {
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (0 == k) {
+            if (3 != eq - cur || 0 != strncmp(cur, "raw", 3)) {
+                SPL_MSG(SEV_ERROR, "BAD-RETENTION", "The first retention tier must be 'raw'");
+                ret = A_E_INVAL;
+                goto done;
+            }
+        } else if (false == _parse_duration_sec(cur, eq - cur, &res_sec) ||
+                0 == res_sec || SPL_RETENTION_FOREVER == res_sec ||
+                res_sec <= policy->tiers[k - 1].res_sec ||
+                (0 != policy->tiers[k - 1].res_sec && 0 != res_sec % policy->tiers[k - 1].res_sec) ||
+                0 != SPL_ROLLUP_SPAN_SEC % res_sec)
+        {
+            SPL_MSG(SEV_ERROR, "BAD-RETENTION", "Bad rollup resolution '%.*s' (must be a multiple of the previous tier, and divide a day evenly)",
+                    (int)(eq - cur), cur);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (false == _parse_duration_sec(eq + 1, end - eq - 1, &keep_sec)) {
+            SPL_MSG(SEV_ERROR, "BAD-RETENTION", "Bad retention period '%.*s'", (int)(end - eq - 1), eq + 1);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        policy->tiers[k].res_sec = res_sec;
+        policy->tiers[k].keep_sec = keep_sec;
+        policy->nr_tiers++;
+
+        cur = ('\0' == *end) ? end : end + 1;
+    }
+
+    if (0 == policy->nr_tiers) {
+        ret = A_E_INVAL;
+    }
+
+done:
+    return ret;
+}
+
+static
+void _tier_prefix(char *buf, size_t len, uint32_t res_sec)
+{
+    if (0 == res_sec) {
+        snprintf(buf, len, "raw-");
+    } else {
+        snprintf(buf, len, "r%u-", res_sec);
+    }
+}
+
+static
+int _seg_list_add(const char *path, void *arg)
+{
+    struct _seg_list *list = arg;
+    const char *name = strrchr(path, '/');
+
+    if (list->nr == list->cap) {
+        size_t new_cap = 0 == list->cap ? 64 : list->cap * 2;
+        struct _seg_ent *new_ents = realloc(list->ents, new_cap * sizeof(*new_ents));
+
+        if (NULL == new_ents) {
+            return A_E_NOMEM;
+        }
+
+        list->ents = new_ents;
+        list->cap = new_cap;
+    }
+
+    name = (NULL == name) ? path : name + 1;
+
+    if (NULL == (list->ents[list->nr].path = strdup(path))) {
+        return A_E_NOMEM;
+    }
+
+    list->ents[list->nr].start_ns = strtoull(name + strlen(list->prefix), NULL, 10) * SPL_NS_PER_SEC;
+    list->nr++;
+
+    return A_OK;
+}
+
+static
+void _seg_list_free(struct _seg_list *list)
+{
+    for (size_t i = 0; i < list->nr; i++) {
+        free(list->ents[i].path);
+    }
+
+    free(list->ents);
+    list->ents = NULL;
+    list->nr = list->cap = 0;
+}
+
+static
+void _rollup_dev_flush(struct _rollup_builder *bld, struct _rollup_dev *dev)
+{
+    struct spl_rollup *rec = NULL;
+
+    if (false == dev->active) {
+        return;
+    }
+
+    /* Fold in any raw levels that are still waiting */
+    if (0 != dev->nr_ddb) {
+        uint16_t lo = 0,
+                 hi = 0;
+
+        spl_kern->minmax(dev->ddb, dev->nr_ddb, &lo, &hi);
+        dev->energy += spl_kern->energy_sum(dev->ddb, dev->nr_ddb);
+        dev->nr_samples += dev->nr_ddb;
+        if (lo < dev->min_ddb) dev->min_ddb = lo;
+        if (hi > dev->max_ddb) dev->max_ddb = hi;
+        dev->nr_ddb = 0;
+    }
+
+    if (bld->nr_out == bld->cap_out) {
+        size_t new_cap = 0 == bld->cap_out ? 1024 : bld->cap_out * 2;
+        struct spl_rollup *new_out = realloc(bld->out, new_cap * sizeof(*new_out));
+
+        if (NULL == new_out) {
+            SPL_MSG(SEV_ERROR, "ROLLUP-NOMEM", "Out of memory building rollups, dropping a bucket");
+            dev->active = false;
+            return;
+        }
+
+        bld->out = new_out;
+        bld->cap_out = new_cap;
+    }
+
+    rec = &bld->out[bld->nr_out++];
+    memset(rec, 0, sizeof(*rec));
+    rec->ts_ns = dev->bucket_ns;
+    rec->nr_samples = dev->nr_samples;
+    rec->min_ddb = dev->min_ddb;
+    rec->max_ddb = dev->max_ddb;
+    rec->leq_ddb = spl_kern_energy_to_ddb(dev->energy / (double)dev->nr_samples);
+    rec->device = dev->device;
+    rec->flags = dev->flags;
+
+    dev->active = false;
+}
+
+static
+struct _rollup_dev *_rollup_dev_get(struct _rollup_builder *bld, uint16_t device, uint64_t ts_ns)
+{
+    struct _rollup_dev *dev = NULL;
+    uint64_t bucket_ns = ts_ns - (ts_ns % bld->res_ns);
+
+    for (size_t i = 0; i < bld->nr_devs; i++) {
+        if (bld->devs[i].device == device) {
+            dev = &bld->devs[i];
+            break;
+        }
+    }
+
+    if (NULL == dev) {
+        struct _rollup_dev *new_devs = realloc(bld->devs, (bld->nr_devs + 1) * sizeof(*new_devs));
+
+        if (NULL == new_devs) {
+            return NULL;
+        }
+
+        bld->devs = new_devs;
+        dev = &bld->devs[bld->nr_devs++];
+        memset(dev, 0, sizeof(*dev));
+        dev->device = device;
+    }
+
+    if (true == dev->active && dev->bucket_ns != bucket_ns) {
+        _rollup_dev_flush(bld, dev);
+    }
+
+    if (false == dev->active) {
+        dev->active = true;
+        dev->bucket_ns = bucket_ns;
+        dev->nr_samples = 0;
+        dev->min_ddb = UINT16_MAX;
+        dev->max_ddb = 0;
+        dev->energy = 0.0;
+        dev->nr_ddb = 0;
+    }
+
+    return dev;
+}
+
+static
+int _rollup_add_sample(struct _rollup_builder *bld, struct spl_sample const *sample)
+{
+    struct _rollup_dev *dev = NULL;
+
+    if (NULL == (dev = _rollup_dev_get(bld, sample->device, sample->ts_ns))) {
+        return A_E_NOMEM;
+    }
+
+    if (dev->nr_ddb == dev->cap_ddb) {
+        size_t new_cap = 0 == dev->cap_ddb ? 64 : dev->cap_ddb * 2;
+        uint16_t *new_ddb = realloc(dev->ddb, new_cap * sizeof(uint16_t));
+
+        if (NULL == new_ddb) {
+            return A_E_NOMEM;
+        }
+
+        dev->ddb = new_ddb;
+        dev->cap_ddb = new_cap;
+    }
+
+    dev->ddb[dev->nr_ddb++] = sample->deci_db;
+    dev->flags = sample->flags;
+
+    return A_OK;
+}
+
+static
+int _rollup_add_rollup(struct _rollup_builder *bld, struct spl_rollup const *rec)
+{
+    struct _rollup_dev *dev = NULL;
+
+    if (NULL == (dev = _rollup_dev_get(bld, rec->device, rec->ts_ns))) {
+        return A_E_NOMEM;
+    }
+
+    dev->nr_samples += rec->nr_samples;
+    dev->energy += spl_kern_energy(rec->leq_ddb) * (double)rec->nr_samples;
+    if (rec->min_ddb < dev->min_ddb) dev->min_ddb = rec->min_ddb;
+    if (rec->max_ddb > dev->max_ddb) dev->max_ddb = rec->max_ddb;
+    dev->flags = rec->flags;
+
+    return A_OK;
+}
+
+static
+int _rollup_cmp(void const *a, void const *b)
+{
+    struct spl_rollup const *ra = a,
+                            *rb = b;
+
+    if (ra->ts_ns != rb->ts_ns) {
+        return ra->ts_ns < rb->ts_ns ? -1 : 1;
+    }
+
+    return (int)ra->device - (int)rb->device;
+}
+
+static
+void _rollup_free(struct _rollup_builder *bld)
+{
+    for (size_t i = 0; i < bld->nr_devs; i++) {
+        free(bld->devs[i].ddb);
+    }
+
+    free(bld->devs);
+    free(bld->out);
+    memset(bld, 0, sizeof(*bld));
+}
+
+/**
+ * Rename a segment we couldn't read out of the way, so it's kept for a look later rather than
+ * being deleted along with the inputs that were rolled up
+ */
+static
+void _compact_set_aside(const char *path)
+{
+    char *bad_path = NULL;
+
+    if (0 > asprintf(&bad_path, "%s.bad", path)) {
+        return;
+    }
+
+    if (0 > rename(path, bad_path)) {
+        SPL_MSG(SEV_WARNING, "COMPACT-SET-ASIDE-FAIL", "Could not move %s aside: %s", path, strerror(errno));
+    } else {
+        SPL_MSG(SEV_WARNING, "COMPACT-SET-ASIDE", "Could not read %s, moved it to %s", path, bad_path);
+    }
+
+    free(bad_path);
+}
+
+/**
+ * Load an output segment that already exists into the builder, keeping a copy of its records
+ * (sorted by time, then device) to check which buckets it covers
+ */
+static
+int _compact_load_output(struct _rollup_builder *bld, const char *path, struct spl_rollup **pcovered,
+        size_t *pnr_covered)
+{
+    int ret = A_OK;
+
+    struct spl_seg_map map;
+    struct spl_rollup *covered = NULL;
+    void const *recs = NULL;
+    size_t off = 0,
+           nr_recs = 0,
+           nr_covered = 0;
+
+    if (FAILED(spl_seg_map(&map, path))) {
+        SPL_MSG(SEV_ERROR, "COMPACT-RESUME-FAIL", "%s already exists but can't be read, leaving its inputs be", path);
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (SPL_SEG_KIND_ROLLUP != map.hdr->kind || sizeof(struct spl_rollup) != map.hdr->rec_size) {
+        SPL_MSG(SEV_ERROR, "COMPACT-RESUME-FAIL", "%s isn't a rollup segment, leaving its inputs be", path);
+        ret = A_E_INVAL;
+        goto unmap;
+    }
+
+    if (NULL == (covered = calloc(map.nr_recs + 1, sizeof(struct spl_rollup)))) {
+        ret = A_E_NOMEM;
+        goto unmap;
+    }
+
+    while (!FAILED(ret) && true == spl_seg_next_batch(&map, &off, &recs, &nr_recs)) {
+        memcpy(&covered[nr_covered], recs, nr_recs * sizeof(struct spl_rollup));
+        for (size_t r = 0; r < nr_recs && !FAILED(ret); r++) {
+            ret = _rollup_add_rollup(bld, &covered[nr_covered + r]);
+        }
+        nr_covered += nr_recs;
+    }
+
+    qsort(covered, nr_covered, sizeof(struct spl_rollup), _rollup_cmp);
+
+unmap:
+    spl_seg_unmap(&map);
+
+done:
+    if (FAILED(ret)) {
+        free(covered);
+        covered = NULL;
+        nr_covered = 0;
+    }
+
+    *pcovered = covered;
+    *pnr_covered = nr_covered;
+
+    return ret;
+}
+
+/**
+ * Roll up the segments ents[0..nr) into a single segment at out_res_sec resolution, spanning
+ * [out_start_ns, out_start_ns + SPL_ROLLUP_SPAN_SEC).
+ */
+static
+int _compact_group(const char *dir, struct _seg_ent const *ents, size_t nr, uint32_t out_res_sec, uint64_t out_start_ns)
+{
+    int ret = A_OK;
+
+    struct _rollup_builder bld = { .res_ns = out_res_sec * SPL_NS_PER_SEC };
+    struct spl_seg_header hdr = {
+        .magic = SPL_SEG_MAGIC,
+        .version = SPL_SEG_VERSION,
+        .rec_size = sizeof(struct spl_rollup),
+        .kind = SPL_SEG_KIND_ROLLUP,
+        .res_sec = out_res_sec,
+        .start_ns = out_start_ns,
+        .span_ns = SPL_ROLLUP_SPAN_SEC * SPL_NS_PER_SEC,
+    };
+    char prefix[16];
+    char *out_path = NULL;
+    struct spl_rollup *covered = NULL;
+    size_t nr_covered = 0;
+    uint64_t nr_added = 0,
+             nr_had = 0;
+    bool resume = false;
+
+    _tier_prefix(prefix, sizeof(prefix), out_res_sec);
+
+    if (0 > asprintf(&out_path, "%s/%s%012llu.seg", dir, prefix, (unsigned long long)(out_start_ns / SPL_NS_PER_SEC))) {
+        out_path = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    /*
+     * Each output segment is normally written once, when its whole span has expired from the
+     * tier below. If it already exists, either we crashed after writing it but before removing
+     * all of its inputs, or something (spltool import, or a sample that turned up very late)
+     * has written into the span since. Either way, start from what it has, and only add what
+     * the leftover inputs have for buckets it doesn't: anything in a bucket it does have, it
+     * already counted.
+     */
+    if (0 == access(out_path, F_OK)) {
+        resume = true;
+        if (FAILED(ret = _compact_load_output(&bld, out_path, &covered, &nr_covered))) {
+            goto done;
+        }
+    }
+
+    for (size_t i = 0; i < nr; i++) {
+        struct spl_seg_map map;
+        void const *recs = NULL;
+        size_t off = 0,
+               nr_recs = 0;
+
+        if (FAILED(spl_seg_map(&map, ents[i].path))) {
+            _compact_set_aside(ents[i].path);
+            continue;
+        }
+
+        while (!FAILED(ret) && true == spl_seg_next_batch(&map, &off, &recs, &nr_recs)) {
+            for (size_t r = 0; r < nr_recs && !FAILED(ret); r++) {
+                struct spl_rollup key;
+
+                if (SPL_SEG_KIND_RAW == map.hdr->kind) {
+                    struct spl_sample const *sample = &((struct spl_sample const *)recs)[r];
+                    key.ts_ns = sample->ts_ns;
+                    key.device = sample->device;
+                } else {
+                    struct spl_rollup const *rollup = &((struct spl_rollup const *)recs)[r];
+                    key.ts_ns = rollup->ts_ns;
+                    key.device = rollup->device;
+                }
+
+                key.ts_ns -= key.ts_ns % bld.res_ns;
+                if (true == resume && NULL != bsearch(&key, covered, nr_covered, sizeof(struct spl_rollup), _rollup_cmp)) {
+                    nr_had++;
+                    continue;
+                }
+
+                if (SPL_SEG_KIND_RAW == map.hdr->kind) {
+                    ret = _rollup_add_sample(&bld, &((struct spl_sample const *)recs)[r]);
+                } else {
+                    ret = _rollup_add_rollup(&bld, &((struct spl_rollup const *)recs)[r]);
+                }
+                nr_added++;
+            }
+        }
+
+        spl_seg_unmap(&map);
+
+        if (FAILED(ret)) {
+            goto done;
+        }
+    }
+
+    if (true == resume) {
+        SPL_MSG(SEV_INFO, "COMPACT-RESUME", "%s already exists; of %zu leftover inputs, %llu records were already "
+                "rolled up, %llu more are being added", out_path, nr, (unsigned long long)nr_had,
+                (unsigned long long)nr_added);
+        if (0 == nr_added) {
+            goto remove_inputs;
+        }
+    }
+
+    for (size_t i = 0; i < bld.nr_devs; i++) {
+        _rollup_dev_flush(&bld, &bld.devs[i]);
+    }
+
+    qsort(bld.out, bld.nr_out, sizeof(struct spl_rollup), _rollup_cmp);
+
+    if (FAILED(ret = spl_seg_write_atomic(out_path, &hdr, bld.out, bld.nr_out))) {
+        goto done;
+    }
+
+    DIAG("Compacted %zu segments into %s (%zu rollups)", nr, out_path, bld.nr_out);
+
+remove_inputs:
+    for (size_t i = 0; i < nr; i++) {
+        if (0 > unlink(ents[i].path) && ENOENT != errno) {
+            SPL_MSG(SEV_WARNING, "COMPACT-UNLINK-FAIL", "Failed to remove %s: %s", ents[i].path, strerror(errno));
+        }
+    }
+
+done:
+    _rollup_free(&bld);
+    free(covered);
+    free(out_path);
+    return ret;
+}
+
+static
+int _compact_tier(const char *dir, struct spl_retention const *policy, size_t k, uint64_t now_ns)
+{
+    int ret = A_OK;
+
+    uint32_t res_sec = policy->tiers[k].res_sec;
+    uint64_t keep_sec = policy->tiers[k].keep_sec,
+             in_span_ns = (0 == res_sec ? SPL_SEG_RAW_SPAN_SEC : SPL_ROLLUP_SPAN_SEC) * SPL_NS_PER_SEC,
+             out_span_ns = SPL_ROLLUP_SPAN_SEC * SPL_NS_PER_SEC,
+             cutoff_ns = 0;
+    char prefix[16];
+    struct _seg_list list = { .prefix = prefix };
+    bool last_tier = (k + 1 == policy->nr_tiers);
+
+    if (SPL_RETENTION_FOREVER == keep_sec) {
+        goto done;
+    }
+
+    /* Never go near a segment that might still be getting written to */
+    if (keep_sec * SPL_NS_PER_SEC < in_span_ns) {
+        keep_sec = in_span_ns / SPL_NS_PER_SEC;
+    }
+
+    if (now_ns < keep_sec * SPL_NS_PER_SEC) {
+        goto done;
+    }
+
+    cutoff_ns = now_ns - keep_sec * SPL_NS_PER_SEC;
+
+    _tier_prefix(prefix, sizeof(prefix), res_sec);
+
+    if (FAILED(ret = spl_store_for_each_segment(dir, prefix, 0, cutoff_ns, _seg_list_add, &list))) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < list.nr;) {
+        uint64_t out_start_ns = list.ents[i].start_ns - (list.ents[i].start_ns % out_span_ns);
+        size_t j = i;
+
+        if (true == last_tier) {
+            /* Nowhere to roll up to; expire segments outright */
+            if (list.ents[i].start_ns + in_span_ns <= cutoff_ns) {
+                if (0 > unlink(list.ents[i].path)) {
+                    SPL_MSG(SEV_WARNING, "EXPIRE-FAIL", "Failed to remove %s: %s", list.ents[i].path, strerror(errno));
+                }
+            }
+            i++;
+            continue;
+        }
+
+        while (j < list.nr && list.ents[j].start_ns < out_start_ns + out_span_ns) {
+            j++;
+        }
+
+        /* Only compact once the whole output span has expired from this tier */
+        if (out_start_ns + out_span_ns <= cutoff_ns) {
+            if (FAILED(ret = _compact_group(dir, &list.ents[i], j - i, policy->tiers[k + 1].res_sec, out_start_ns))) {
+                goto done;
+            }
+        }
+
+        i = j;
+    }
+
+done:
+    _seg_list_free(&list);
+    return ret;
+}
+
+int spl_compact_run(const char *dir, struct spl_retention const *policy, uint64_t now_ns)
+{
+    int ret = A_OK;
+
+    ASSERT_ARG(NULL != dir);
+    ASSERT_ARG(NULL != policy);
+
+    /* Work from the coarsest tier down, so each pass only moves data down one tier */
+    for (size_t k = policy->nr_tiers; k > 0; k--) {
+        if (FAILED(ret = _compact_tier(dir, policy, k - 1, now_ns))) {
+            SPL_MSG(SEV_ERROR, "COMPACT-FAIL", "Compaction of tier %zu failed, will retry later", k - 1);
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
+
+static
+void *_compactor_thread(void *arg)
+{
+    struct spl_compactor *comp = arg;
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    /* Stay out of the way of the acquisition loop, both on disk and on the CPU */
+    if (0 > syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0))) {
+        SPL_MSG(SEV_WARNING, "IOPRIO-FAIL", "Could not drop compaction to idle I/O priority: %s", strerror(errno));
+    }
+
+    if (0 > setpriority(PRIO_PROCESS, tid, 19)) {
+        SPL_MSG(SEV_WARNING, "NICE-FAIL", "Could not lower compaction CPU priority: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&comp->lock);
+
+    while (false == comp->stop) {
+        struct timespec deadline;
+
+        pthread_mutex_unlock(&comp->lock);
+        spl_compact_run(comp->dir, &comp->policy, get_time_ns());
+        pthread_mutex_lock(&comp->lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += comp->interval_sec;
+
+        while (false == comp->stop) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&comp->wake, &comp->lock, &deadline)) {
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&comp->lock);
+
+    return NULL;
+}
+
+int spl_compactor_start(struct spl_compactor **pcomp, const char *dir, struct spl_retention const *policy,
+        unsigned interval_sec)
+{
+    int ret = A_OK;
+
+    struct spl_compactor *comp = NULL;
+
+    ASSERT_ARG(NULL != pcomp);
+    ASSERT_ARG(NULL != dir);
+    ASSERT_ARG(NULL != policy);
+    ASSERT_ARG(0 != interval_sec);
+
+    *pcomp = NULL;
+
+    if (NULL == (comp = calloc(1, sizeof(*comp)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (NULL == (comp->dir = strdup(dir))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    comp->policy = *policy;
+    comp->interval_sec = interval_sec;
+    pthread_mutex_init(&comp->lock, NULL);
+    pthread_cond_init(&comp->wake, NULL);
+
+    if (0 != pthread_create(&comp->thread, NULL, _compactor_thread, comp)) {
+        SPL_MSG(SEV_ERROR, "COMPACTOR-START-FAIL", "Failed to start the compaction thread");
+        pthread_cond_destroy(&comp->wake);
+        pthread_mutex_destroy(&comp->lock);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    *pcomp = comp;
+
+done:
+    if (FAILED(ret) && NULL != comp) {
+        free(comp->dir);
+        free(comp);
+    }
+
+    return ret;
+}
+
+void spl_compactor_stop(struct spl_compactor **pcomp)
+{
+    struct spl_compactor *comp = NULL;
+
+    if (NULL == pcomp || NULL == *pcomp) {
+        return;
+    }
+
+    comp = *pcomp;
+
+    pthread_mutex_lock(&comp->lock);
+    comp->stop = true;
+    pthread_cond_signal(&comp->wake);
+    pthread_mutex_unlock(&comp->lock);
+
+    pthread_join(comp->thread, NULL);
+
+    pthread_cond_destroy(&comp->wake);
+    pthread_mutex_destroy(&comp->lock);
+    free(comp->dir);
+    free(comp);
+
+    *pcomp = NULL;
+}
@@ -0,0 +1,62 @@
+/* splcompact.h -- Tiered retention and downsampling compaction of the sample store
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SPL_RETENTION_MAX_TIERS     4
+
+/* Retention age meaning "never expire" */
+#define SPL_RETENTION_FOREVER       UINT64_MAX
+
+/*
+ * Rollup segments cover a day each; this keeps the number of files for "forever" tiers
+ * manageable without making any single compaction step large.
+ */
+#define SPL_ROLLUP_SPAN_SEC         86400ull
+
+/**
+ * A retention policy is an ordered list of tiers, finest resolution first. The first tier is
+ * always the raw samples. Once a segment of tier k is older than that tier's retention, it
+ * is rewritten at the resolution of tier k + 1, or deleted if k is the last tier.
+ *
+ * Written on the command line as, for example:
+ *   raw=14d,1s=90d,1m=forever
+ */
+struct spl_retention {
+    size_t nr_tiers;
+    struct {
+        /* Resolution in seconds, 0 for raw */
+        uint32_t res_sec;
+        /* How long to keep data at this resolution, in seconds */
+        uint64_t keep_sec;
+    } tiers[SPL_RETENTION_MAX_TIERS];
+};
+
+struct spl_compactor;
+
+int spl_retention_parse(struct spl_retention *policy, const char *spec);
+
+/**
+ * Run a single compaction pass over the store, as if the time were now_ns. Only ever
+ * touches segments whose span ended at least one full segment span ago, so it is safe to
+ * run while splread is appending to the store.
+ */
+int spl_compact_run(const char *dir, struct spl_retention const *policy, uint64_t now_ns);
+
+/**
+ * Start a background thread that runs a compaction pass every interval_sec seconds, at idle
+ * I/O priority.
+ */
+int spl_compactor_start(struct spl_compactor **pcomp, const char *dir, struct spl_retention const *policy,
+        unsigned interval_sec);
+void spl_compactor_stop(struct spl_compactor **pcomp);
@@ -0,0 +1,136 @@
+/* splcrc.c -- CRC32C (Castagnoli) used to frame everything splread writes to disk
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splcrc.h>
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SPL_CRC_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define SPL_CRC_ARM
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32                 (1 << 7)
+#endif
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define SPL_CRC32C_POLY             0x82f63b78ul
+
+static
+uint32_t spl_crc32c_tab[256];
+
+static
+uint32_t (*_crc32c_update)(uint32_t crc, uint8_t const *buf, size_t len) = NULL;
+
+static
+const char *_crc32c_name = "table";
+
+static
+uint32_t _crc32c_table(uint32_t crc, uint8_t const *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        crc = spl_crc32c_tab[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef SPL_CRC_X86
+__attribute__((target("sse4.2")))
+static
+uint32_t _crc32c_sse42(uint32_t crc, uint8_t const *buf, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len > 0 && 0 != ((uintptr_t)buf & 7)) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+        len--;
+    }
+
+    return (uint32_t)crc64;
+}
+#endif /* SPL_CRC_X86 */
+
+#ifdef SPL_CRC_ARM
+__attribute__((target("+crc")))
+static
+uint32_t _crc32c_armv8(uint32_t crc, uint8_t const *buf, size_t len)
+{
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32cd(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = __crc32cb(crc, *buf++);
+        len--;
+    }
+
+    return crc;
+}
+#endif /* SPL_CRC_ARM */
+
+uint32_t spl_crc32c(uint32_t crc, void const *buf, size_t len)
+{
+    return ~_crc32c_update(~crc, buf, len);
+}
+
+const char *spl_crc32c_impl(void)
+{
+    return _crc32c_name;
+}
+
+__attribute__((constructor))
+static
+void _crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ SPL_CRC32C_POLY : c >> 1;
+        }
+        spl_crc32c_tab[i] = c;
+    }
+
+    _crc32c_update = _crc32c_table;
+
+#ifdef SPL_CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        _crc32c_update = _crc32c_sse42;
+        _crc32c_name = "sse4.2";
+    }
+#endif
+
+#ifdef SPL_CRC_ARM
+    if (0 != (getauxval(AT_HWCAP) & HWCAP_CRC32)) {
+        _crc32c_update = _crc32c_armv8;
+        _crc32c_name = "armv8-crc";
+    }
+#endif
+}
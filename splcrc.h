@@ -0,0 +1,23 @@
+/* splcrc.h -- CRC32C (Castagnoli) used to frame everything splread writes to disk
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the CRC32C of buf, continuing from a previous CRC (pass 0 to start). Uses the
+ * SSE4.2 or ARMv8 CRC instructions when the CPU has them.
+ */
+uint32_t spl_crc32c(uint32_t crc, void const *buf, size_t len);
+
+/**
+ * Name of the implementation in use, for diagnostics
+ */
+const char *spl_crc32c_impl(void);
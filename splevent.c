@@ -0,0 +1,424 @@
+/* splevent.c -- Exceedance event detection and the on-disk event index
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splcrc.h>
+#include <splevent.h>
+#include <splkern.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct spl_event_index {
+    int fd;
+    bool writable;
+    struct spl_event_index_header hdr;
+    /* Sequence number of the next record to be appended */
+    uint32_t next_seq;
+    /* End time of the last record in the index */
+    uint64_t last_end_ns;
+};
+
+static
+uint32_t _event_crc(struct spl_event const *evt)
+{
+    struct spl_event check = *evt;
+
+    check.crc = 0;
+
+    return spl_crc32c(0, &check, sizeof(check));
+}
+
+static
+bool _event_valid(struct spl_event const *evt, uint32_t seq)
+{
+    return evt->seq == seq && evt->crc == _event_crc(evt);
+}
+
+/**
+ * Find how many records at the start of the index are intact. Only the last record can be
+ * damaged by a crash while appending, so check that first and only fall back to walking the
+ * whole index if it is bad.
+ */
+static
+size_t _event_index_recover(int fd, size_t nr_evts)
+{
+    struct spl_event evt;
+    size_t good = 0;
+
+    if (0 == nr_evts) {
+        return 0;
+    }
+
+    if (sizeof(evt) == pread(fd, &evt, sizeof(evt), sizeof(struct spl_event_index_header) + (nr_evts - 1) * sizeof(evt)) &&
+            true == _event_valid(&evt, nr_evts - 1))
+    {
+        return nr_evts;
+    }
+
+    for (good = 0; good < nr_evts; good++) {
+        if (sizeof(evt) != pread(fd, &evt, sizeof(evt), sizeof(struct spl_event_index_header) + good * sizeof(evt)) ||
+                false == _event_valid(&evt, good))
+        {
+            break;
+        }
+    }
+
+    return good;
+}
+
+void spl_event_detector_init(struct spl_event_detector *det, uint16_t device, uint16_t threshold_ddb)
+{
+    memset(det, 0, sizeof(*det));
+    det->device = device;
+    det->threshold_ddb = threshold_ddb;
+}
+
+static
+void _event_close(struct spl_event_detector *det, struct spl_event *evt)
+{
+    *evt = det->cur;
+    evt->leq_ddb = spl_kern_energy_to_ddb(det->energy / (double)det->cur.nr_samples);
+    det->active = false;
+}
+
+bool spl_event_detector_feed(struct spl_event_detector *det, struct spl_sample const *sample, struct spl_event *evt)
+{
+    if (sample->deci_db < det->threshold_ddb) {
+        if (true == det->active) {
+            _event_close(det, evt);
+            return true;
+        }
+        return false;
+    }
+
+    if (false == det->active) {
+        memset(&det->cur, 0, sizeof(det->cur));
+        det->cur.start_ns = sample->ts_ns;
+        det->cur.device = det->device;
+        det->cur.threshold_ddb = det->threshold_ddb;
+        det->energy = 0.0;
+        det->active = true;
+    }
+
+    det->cur.end_ns = sample->ts_ns;
+    det->cur.nr_samples++;
+    if (sample->deci_db > det->cur.peak_ddb) {
+        det->cur.peak_ddb = sample->deci_db;
+    }
+    det->energy += spl_kern_energy(sample->deci_db);
+
+    return false;
+}
+
+bool spl_event_detector_finish(struct spl_event_detector *det, struct spl_event *evt)
+{
+    if (false == det->active) {
+        return false;
+    }
+
+    _event_close(det, evt);
+
+    return true;
+}
+
+int spl_event_index_open(struct spl_event_index **pidx, const char *dir, bool writable)
+{
+    int ret = A_OK;
+
+    struct spl_event_index *idx = NULL;
+    char *path = NULL;
+    struct stat st;
+
+    ASSERT_ARG(NULL != pidx);
+    ASSERT_ARG(NULL != dir);
+
+    *pidx = NULL;
+
+    if (0 > asprintf(&path, "%s/" SPL_EVENT_INDEX_NAME, dir)) {
+        path = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (NULL == (idx = spl_zalloc(sizeof(*idx)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    idx->fd = -1;
+    idx->writable = writable;
+
+    if (0 > (idx->fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644))) {
+        SPL_MSG(SEV_ERROR, "EVENT-INDEX-OPEN-FAIL", "Failed to open event index %s: %s", path, strerror(errno));
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    if (0 > fstat(idx->fd, &st)) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (0 == st.st_size && true == writable) {
+        idx->hdr.magic = SPL_EVENT_INDEX_MAGIC;
+        idx->hdr.version = SPL_EVENT_INDEX_VERSION;
+        idx->hdr.rec_size = sizeof(struct spl_event);
+        if (sizeof(idx->hdr) != pwrite(idx->fd, &idx->hdr, sizeof(idx->hdr), 0)) {
+            ret = A_E_IO;
+            goto done;
+        }
+    } else {
+        if (sizeof(idx->hdr) != pread(idx->fd, &idx->hdr, sizeof(idx->hdr), 0) ||
+                SPL_EVENT_INDEX_MAGIC != idx->hdr.magic ||
+                SPL_EVENT_INDEX_VERSION != idx->hdr.version ||
+                sizeof(struct spl_event) != idx->hdr.rec_size)
+        {
+            SPL_MSG(SEV_ERROR, "BAD-EVENT-INDEX", "File %s is not a valid event index", path);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (true == writable) {
+            size_t nr_evts = (st.st_size - sizeof(idx->hdr)) / sizeof(struct spl_event);
+            off_t good_len = 0;
+
+            idx->next_seq = _event_index_recover(idx->fd, nr_evts);
+            good_len = sizeof(idx->hdr) + (off_t)idx->next_seq * sizeof(struct spl_event);
+
+            if (good_len != st.st_size) {
+                SPL_MSG(SEV_WARNING, "EVENT-INDEX-TORN-TAIL", "Dropping %lld bytes of damaged records from %s",
+                        (long long)(st.st_size - good_len), path);
+                if (0 > ftruncate(idx->fd, good_len)) {
+                    ret = A_E_IO;
+                    goto done;
+                }
+            }
+
+            if (0 != idx->next_seq) {
+                struct spl_event last;
+
+                if (sizeof(last) != pread(idx->fd, &last, sizeof(last), good_len - sizeof(last))) {
+                    ret = A_E_IO;
+                    goto done;
+                }
+
+                idx->last_end_ns = last.end_ns;
+            }
+        }
+    }
+
+    *pidx = idx;
+
+done:
+    if (FAILED(ret)) {
+        spl_event_index_close(&idx);
+    }
+
+    free(path);
+
+    return ret;
+}
+
+/**
+ * Write an event record at the given position in the index, with its sequence number set to
+ * match
+ */
+static
+int _event_index_put(struct spl_event_index *idx, struct spl_event const *evt, uint32_t seq)
+{
+    struct spl_event rec = *evt;
+
+    rec.seq = seq;
+    rec.crc = _event_crc(&rec);
+
+    if (sizeof(rec) != pwrite(idx->fd, &rec, sizeof(rec), sizeof(idx->hdr) + (off_t)seq * sizeof(rec))) {
+        SPL_MSG(SEV_ERROR, "EVENT-WRITE-FAIL", "Failed to write event to index: %s", strerror(errno));
+        return A_E_IO;
+    }
+
+    return A_OK;
+}
+
+int spl_event_index_append(struct spl_event_index *idx, struct spl_event const *evt)
+{
+    int ret = A_OK;
+
+    uint32_t pos = 0;
+
+    ASSERT_ARG(NULL != idx);
+    ASSERT_ARG(NULL != evt);
+    ASSERT_ARG(true == idx->writable);
+
+    pos = idx->next_seq;
+
+    /*
+     * Each device has its own detector, polled at its own interval, so an event on a slow
+     * device can close after one that ended later on a faster device. Queries rely on the
+     * index being sorted by end time, so move the (few) records that end later up by one,
+     * last first, and put this event in the gap. A crash part way through leaves one record
+     * in the index twice, rather than losing any.
+     */
+    if (0 != pos && evt->end_ns < idx->last_end_ns) {
+        while (0 != pos) {
+            struct spl_event prev;
+
+            if (sizeof(prev) != pread(idx->fd, &prev, sizeof(prev), sizeof(idx->hdr) + (off_t)(pos - 1) * sizeof(prev))) {
+                ret = A_E_IO;
+                goto done;
+            }
+
+            if (prev.end_ns <= evt->end_ns) {
+                break;
+            }
+
+            if (FAILED(ret = _event_index_put(idx, &prev, pos))) {
+                goto done;
+            }
+
+            pos--;
+        }
+    } else {
+        idx->last_end_ns = evt->end_ns;
+    }
+
+    if (FAILED(ret = _event_index_put(idx, evt, pos))) {
+        goto done;
+    }
+
+    idx->next_seq++;
+
+    if (evt->end_ns - evt->start_ns > idx->hdr.max_duration_ns) {
+        idx->hdr.max_duration_ns = evt->end_ns - evt->start_ns;
+        if (sizeof(idx->hdr) != pwrite(idx->fd, &idx->hdr, sizeof(idx->hdr), 0)) {
+            ret = A_E_IO;
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
+
+static
+bool _event_matches(struct spl_event const *evt, struct spl_event_query const *query)
+{
+    if (0 != query->from_ns && evt->end_ns < query->from_ns) {
+        return false;
+    }
+
+    if (0 != query->to_ns && evt->start_ns > query->to_ns) {
+        return false;
+    }
+
+    if (evt->end_ns - evt->start_ns < query->min_duration_ns) {
+        return false;
+    }
+
+    if (evt->leq_ddb < query->min_leq_ddb || evt->peak_ddb < query->min_peak_ddb) {
+        return false;
+    }
+
+    if (true == query->filter_device && evt->device != query->device) {
+        return false;
+    }
+
+    return true;
+}
+
+int spl_event_index_query(struct spl_event_index *idx, struct spl_event_query const *query,
+        spl_event_query_cb_t cb, void *arg)
+{
+    int ret = A_OK;
+
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    struct spl_event const *evts = NULL;
+    size_t nr_evts = 0,
+           lo = 0,
+           hi = 0;
+    uint64_t stop_ns = UINT64_MAX;
+
+    ASSERT_ARG(NULL != idx);
+    ASSERT_ARG(NULL != query);
+    ASSERT_ARG(NULL != cb);
+
+    if (0 > fstat(idx->fd, &st)) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    nr_evts = (st.st_size - sizeof(idx->hdr)) / sizeof(struct spl_event);
+    if (0 == nr_evts) {
+        goto done;
+    }
+
+    if (MAP_FAILED == (ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, idx->fd, 0))) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    evts = (struct spl_event const *)((uint8_t const *)ptr + sizeof(idx->hdr));
+
+    /* Find the first event that ends at or after the start of the window */
+    hi = nr_evts;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (evts[mid].end_ns < query->from_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* No event that ends after this point can have started inside the window */
+    if (0 != query->to_ns && UINT64_MAX - query->to_ns > idx->hdr.max_duration_ns) {
+        stop_ns = query->to_ns + idx->hdr.max_duration_ns;
+    }
+
+    for (size_t i = lo; i < nr_evts && evts[i].end_ns <= stop_ns; i++) {
+        if (true == _event_matches(&evts[i], query)) {
+            if (false == _event_valid(&evts[i], i)) {
+                SPL_MSG(SEV_WARNING, "EVENT-DAMAGED", "Skipping damaged event record %zu", i);
+                continue;
+            }
+            cb(&evts[i], arg);
+        }
+    }
+
+done:
+    if (MAP_FAILED != ptr) {
+        munmap(ptr, st.st_size);
+    }
+
+    return ret;
+}
+
+void spl_event_index_close(struct spl_event_index **pidx)
+{
+    struct spl_event_index *idx = NULL;
+
+    if (NULL == pidx || NULL == *pidx) {
+        return;
+    }
+
+    idx = *pidx;
+
+    if (0 <= idx->fd) {
+        close(idx->fd);
+    }
+
+    spl_free(idx);
+
+    *pidx = NULL;
+}
@@ -0,0 +1,99 @@
+/* splevent.h -- Exceedance event detection and the on-disk event index
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The event index lives in the store directory as events.idx. It is a short header followed
+ * by fixed-size event records, sorted by end time, which is what queries binary search on.
+ * Events are mostly appended in the order they closed, which is end time order for any one
+ * device; an event that closes after a later one from a faster polled device is slotted in
+ * ahead of it. The header tracks the longest event ever recorded, which
+ * bounds how far past the end of a query window we have to look for overlapping events.
+ *
+ * Each record carries its own sequence number and CRC32C, so a torn final record from a
+ * power cut is spotted and dropped when the index is next opened for writing.
+ */
+#define SPL_EVENT_INDEX_NAME        "events.idx"
+#define SPL_EVENT_INDEX_MAGIC       0x53504c45ul /* 'SPLE' */
+#define SPL_EVENT_INDEX_VERSION     2
+
+struct spl_event_index_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    uint64_t max_duration_ns;
+} __attribute__((packed));
+
+struct spl_event {
+    /* Timestamp of the first sample at or above the threshold */
+    uint64_t start_ns;
+    /* Timestamp of the last sample at or above the threshold */
+    uint64_t end_ns;
+    /* Maximum level seen during the event, in tenths of a dB */
+    uint16_t peak_ddb;
+    /* Equivalent continuous level over the event, in tenths of a dB */
+    uint16_t leq_ddb;
+    /* Device the event was seen on */
+    uint16_t device;
+    /* The detection threshold in force when the event was recorded */
+    uint16_t threshold_ddb;
+    /* Number of samples that made up the event */
+    uint32_t nr_samples;
+    /* Position of this record in the index, starting from 0 */
+    uint32_t seq;
+    uint32_t _resv;
+    /* CRC32C of this record, computed with this field set to 0 */
+    uint32_t crc;
+} __attribute__((packed));
+
+/**
+ * Per-device exceedance detection state. An event runs from the first sample at or above
+ * the threshold to the last one before the level drops below it again.
+ */
+struct spl_event_detector {
+    uint16_t device;
+    uint16_t threshold_ddb;
+    bool active;
+    struct spl_event cur;
+    /* Sum of the linear energy of all samples in the current event */
+    double energy;
+};
+
+/**
+ * Filter for querying the event index. Zero for any field means "don't care".
+ */
+struct spl_event_query {
+    uint64_t from_ns;
+    uint64_t to_ns;
+    uint64_t min_duration_ns;
+    uint16_t min_leq_ddb;
+    uint16_t min_peak_ddb;
+    bool filter_device;
+    uint16_t device;
+};
+
+struct spl_event_index;
+
+typedef void (*spl_event_query_cb_t)(struct spl_event const *evt, void *arg);
+
+void spl_event_detector_init(struct spl_event_detector *det, uint16_t device, uint16_t threshold_ddb);
+bool spl_event_detector_feed(struct spl_event_detector *det, struct spl_sample const *sample, struct spl_event *evt);
+bool spl_event_detector_finish(struct spl_event_detector *det, struct spl_event *evt);
+
+int spl_event_index_open(struct spl_event_index **pidx, const char *dir, bool writable);
+int spl_event_index_append(struct spl_event_index *idx, struct spl_event const *evt);
+int spl_event_index_query(struct spl_event_index *idx, struct spl_event_query const *query,
+        spl_event_query_cb_t cb, void *arg);
+void spl_event_index_close(struct spl_event_index **pidx);
@@ -0,0 +1,368 @@
+/* splexport.c -- Streaming export of the sample store to CSV or JSON Lines
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splburst.h>
+#include <splexport.h>
+#include <splfmt.h>
+#include <splstore.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Each segment is formatted into its own buffer, which is written out with a single write()
+ * once it (and every segment before it) is done. With multiple threads, at most this many
+ * formatted segments per thread are held in memory waiting for their turn.
+ */
+#define SPL_EXPORT_WINDOW_PER_THREAD    2
+
+/* Initial size of a segment's output buffer */
+#define SPL_EXPORT_BUF_INIT             (1ul << 20)
+
+struct _export_chunk {
+    char *buf;
+    size_t len;
+    size_t cap;
+    uint64_t nr_recs;
+    bool done;
+    int ret;
+};
+
+struct _export_ctx {
+    struct spl_export_opts const *opts;
+    char **paths;
+    size_t nr_paths;
+    size_t cap_paths;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Next segment to hand out to a formatting thread */
+    size_t next_job;
+    /* Next segment to be written out */
+    size_t next_write;
+    size_t window;
+    struct _export_chunk *chunks;
+    bool abort;
+};
+
+static
+int _export_add_path(const char *path, void *arg)
+{
+    struct _export_ctx *ctx = arg;
+
+    if (ctx->nr_paths == ctx->cap_paths) {
+        size_t new_cap = 0 == ctx->cap_paths ? 64 : ctx->cap_paths * 2;
+        char **new_paths = realloc(ctx->paths, new_cap * sizeof(char *));
+
+        if (NULL == new_paths) {
+            return A_E_NOMEM;
+        }
+
+        ctx->paths = new_paths;
+        ctx->cap_paths = new_cap;
+    }
+
+    if (NULL == (ctx->paths[ctx->nr_paths] = strdup(path))) {
+        return A_E_NOMEM;
+    }
+
+    ctx->nr_paths++;
+
+    return A_OK;
+}
+
+static inline
+bool _export_reserve(struct _export_chunk *chunk)
+{
+    if (chunk->cap - chunk->len < SPL_FMT_MAX_RECORD) {
+        size_t new_cap = 0 == chunk->cap ? SPL_EXPORT_BUF_INIT : chunk->cap * 2;
+        char *new_buf = realloc(chunk->buf, new_cap);
+
+        if (NULL == new_buf) {
+            return false;
+        }
+
+        chunk->buf = new_buf;
+        chunk->cap = new_cap;
+    }
+
+    return true;
+}
+
+/**
+ * Format all the matching records of one segment into chunk
+ */
+static
+int _export_format_segment(struct spl_export_opts const *opts, const char *path, struct _export_chunk *chunk)
+{
+    int ret = A_OK;
+
+    struct spl_seg_map map;
+    void const *recs = NULL;
+    size_t off = 0,
+           nr_recs = 0;
+
+    if (FAILED(spl_seg_map(&map, path))) {
+        /* Damaged or foreign files are skipped, not fatal */
+        goto done;
+    }
+
+    while (true == spl_seg_next_batch(&map, &off, &recs, &nr_recs)) {
+        for (size_t i = 0; i < nr_recs; i++) {
+            uint64_t ts_ns = 0;
+            uint16_t device = 0;
+            char *p = NULL;
+
+            if (false == _export_reserve(chunk)) {
+                ret = A_E_NOMEM;
+                goto done;
+            }
+
+            p = chunk->buf + chunk->len;
+
+            if (SPL_SEG_KIND_RAW == map.hdr->kind) {
+                struct spl_sample const *sample = &((struct spl_sample const *)recs)[i];
+                ts_ns = sample->ts_ns;
+                device = sample->device;
+                if (ts_ns < opts->from_ns || (0 != opts->to_ns && ts_ns >= opts->to_ns) ||
+                        (true == opts->filter_device && device != opts->device))
+                {
+                    continue;
+                }
+                p = (SPL_EXPORT_CSV == opts->format) ?
+                    spl_fmt_sample_csv(p, sample) :
+                    spl_fmt_sample_json_device(p, sample);
+            } else {
+                struct spl_rollup const *rollup = &((struct spl_rollup const *)recs)[i];
+                ts_ns = rollup->ts_ns;
+                device = rollup->device;
+                if (ts_ns < opts->from_ns || (0 != opts->to_ns && ts_ns >= opts->to_ns) ||
+                        (true == opts->filter_device && device != opts->device))
+                {
+                    continue;
+                }
+                p = (SPL_EXPORT_CSV == opts->format) ?
+                    spl_fmt_rollup_csv(p, rollup, map.hdr->res_sec) :
+                    spl_fmt_rollup_json(p, rollup, map.hdr->res_sec);
+            }
+
+            chunk->len = p - chunk->buf;
+            chunk->nr_recs++;
+        }
+    }
+
+done:
+    spl_seg_unmap(&map);
+    return ret;
+}
+
+static
+int _export_write(int fd, char const *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+
+        if (0 > written) {
+            if (EINTR == errno) {
+                continue;
+            }
+            SPL_MSG(SEV_ERROR, "EXPORT-WRITE-FAIL", "Failed to write export output: %s", strerror(errno));
+            return A_E_IO;
+        }
+
+        buf += written;
+        len -= written;
+    }
+
+    return A_OK;
+}
+
+static
+void *_export_worker(void *arg)
+{
+    struct _export_ctx *ctx = arg;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    for (;;) {
+        size_t job = 0;
+        struct _export_chunk *chunk = NULL;
+        int ret = A_OK;
+
+        /* Don't run too far ahead of the writer, or we'd buffer the whole export */
+        while (false == ctx->abort && ctx->next_job < ctx->nr_paths && ctx->next_job >= ctx->next_write + ctx->window) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+
+        if (true == ctx->abort || ctx->next_job >= ctx->nr_paths) {
+            break;
+        }
+
+        job = ctx->next_job++;
+        chunk = &ctx->chunks[job % ctx->window];
+
+        pthread_mutex_unlock(&ctx->lock);
+        ret = _export_format_segment(ctx->opts, ctx->paths[job], chunk);
+        pthread_mutex_lock(&ctx->lock);
+
+        chunk->ret = ret;
+        chunk->done = true;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+int spl_export(struct spl_export_opts const *opts, struct spl_export_stats *stats)
+{
+    int ret = A_OK;
+
+    struct _export_ctx ctx = { .opts = opts };
+    char prefix[32];
+    char *clip_dir = NULL;
+    pthread_t *threads = NULL;
+    size_t nr_threads = 0;
+
+    ASSERT_ARG(NULL != opts);
+    ASSERT_ARG(NULL != opts->dir);
+    ASSERT_ARG(NULL != stats);
+    ASSERT_ARG(false == opts->clips || (0 == opts->res_sec && true == opts->filter_device));
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    if (true == opts->clips) {
+        snprintf(prefix, sizeof(prefix), "clip-%u-", opts->device);
+        if (0 > asprintf(&clip_dir, "%s/%s", opts->dir, SPL_BURST_CLIP_DIR)) {
+            clip_dir = NULL;
+            ret = A_E_NOMEM;
+            goto done;
+        }
+    } else if (0 == opts->res_sec) {
+        snprintf(prefix, sizeof(prefix), "raw-");
+    } else {
+        snprintf(prefix, sizeof(prefix), "r%u-", opts->res_sec);
+    }
+
+    if (FAILED(ret = spl_store_for_each_segment(NULL != clip_dir ? clip_dir : opts->dir, prefix, opts->from_ns,
+                    opts->to_ns, _export_add_path, &ctx)))
+    {
+        goto done;
+    }
+
+    if (SPL_EXPORT_CSV == opts->format) {
+        if (0 == opts->res_sec) {
+            ret = _export_write(opts->out_fd, SPL_FMT_SAMPLE_CSV_HEADER, sizeof(SPL_FMT_SAMPLE_CSV_HEADER) - 1);
+        } else {
+            ret = _export_write(opts->out_fd, SPL_FMT_ROLLUP_CSV_HEADER, sizeof(SPL_FMT_ROLLUP_CSV_HEADER) - 1);
+        }
+        if (FAILED(ret)) {
+            goto done;
+        }
+    }
+
+    ctx.window = (0 == opts->nr_threads ? 1 : opts->nr_threads) * SPL_EXPORT_WINDOW_PER_THREAD;
+
+    if (NULL == (ctx.chunks = calloc(ctx.window, sizeof(struct _export_chunk)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (opts->nr_threads > 1) {
+        if (NULL == (threads = calloc(opts->nr_threads, sizeof(pthread_t)))) {
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        for (nr_threads = 0; nr_threads < opts->nr_threads; nr_threads++) {
+            if (0 != pthread_create(&threads[nr_threads], NULL, _export_worker, &ctx)) {
+                break;
+            }
+        }
+
+        if (0 == nr_threads) {
+            SPL_MSG(SEV_ERROR, "EXPORT-THREAD-FAIL", "Could not start any export threads");
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+    /* Write out segments strictly in order, as they're finished */
+    for (size_t i = 0; i < ctx.nr_paths; i++) {
+        struct _export_chunk *chunk = &ctx.chunks[i % ctx.window];
+
+        if (0 == nr_threads) {
+            chunk->ret = _export_format_segment(opts, ctx.paths[i], chunk);
+        } else {
+            pthread_mutex_lock(&ctx.lock);
+            while (false == chunk->done) {
+                pthread_cond_wait(&ctx.cond, &ctx.lock);
+            }
+            pthread_mutex_unlock(&ctx.lock);
+        }
+
+        if (FAILED(ret = chunk->ret) || FAILED(ret = _export_write(opts->out_fd, chunk->buf, chunk->len))) {
+            goto done;
+        }
+
+        stats->nr_recs += chunk->nr_recs;
+        stats->nr_bytes += chunk->len;
+        stats->nr_segments++;
+
+        /* Keep the buffer around for the next segment that lands in this slot */
+        chunk->len = 0;
+        chunk->nr_recs = 0;
+
+        if (0 != nr_threads) {
+            pthread_mutex_lock(&ctx.lock);
+            chunk->done = false;
+            ctx.next_write = i + 1;
+            pthread_cond_broadcast(&ctx.cond);
+            pthread_mutex_unlock(&ctx.lock);
+        }
+    }
+
+done:
+    if (0 != nr_threads) {
+        pthread_mutex_lock(&ctx.lock);
+        ctx.abort = true;
+        pthread_cond_broadcast(&ctx.cond);
+        pthread_mutex_unlock(&ctx.lock);
+
+        for (size_t i = 0; i < nr_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+
+    free(threads);
+
+    if (NULL != ctx.chunks) {
+        for (size_t i = 0; i < ctx.window; i++) {
+            free(ctx.chunks[i].buf);
+        }
+        free(ctx.chunks);
+    }
+
+    for (size_t i = 0; i < ctx.nr_paths; i++) {
+        free(ctx.paths[i]);
+    }
+    free(ctx.paths);
+    free(clip_dir);
+
+    return ret;
+}
@@ -0,0 +1,46 @@
+/* splexport.h -- Streaming export of the sample store to CSV or JSON Lines
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum spl_export_format {
+    SPL_EXPORT_JSONL,
+    SPL_EXPORT_CSV,
+};
+
+struct spl_export_opts {
+    /* Store directory to read from */
+    const char *dir;
+    /* Which tier to export: 0 for raw samples, otherwise the rollup resolution in seconds */
+    uint32_t res_sec;
+    /* Export the burst clips of the given device instead (see splburst.h) */
+    bool clips;
+    /* Time window to export, [from_ns, to_ns); a to_ns of 0 means no upper bound */
+    uint64_t from_ns;
+    uint64_t to_ns;
+    bool filter_device;
+    uint16_t device;
+    enum spl_export_format format;
+    /* Number of threads formatting segments in parallel; output order is always preserved */
+    unsigned nr_threads;
+    /* Where to write the output */
+    int out_fd;
+};
+
+struct spl_export_stats {
+    uint64_t nr_recs;
+    uint64_t nr_bytes;
+    uint64_t nr_segments;
+};
+
+int spl_export(struct spl_export_opts const *opts, struct spl_export_stats *stats);
@@ -0,0 +1,361 @@
+/* splflight.c -- Crash-surviving flight recorder of recent raw reports
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splflight.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static
+size_t _flight_file_len(uint64_t nr_slots)
+{
+    return SPL_FLIGHT_HEADER_SIZE + nr_slots * sizeof(struct spl_flight_rec);
+}
+
+static
+bool _flight_header_valid(struct spl_flight_header const *hdr, size_t file_len)
+{
+    return SPL_FLIGHT_MAGIC == hdr->magic && SPL_FLIGHT_VERSION == hdr->version &&
+           sizeof(struct spl_flight_rec) == hdr->rec_size &&
+           0 != hdr->nr_slots && 0 == (hdr->nr_slots & (hdr->nr_slots - 1)) &&
+           _flight_file_len(hdr->nr_slots) == file_len;
+}
+
+int spl_flight_open(struct spl_flight **pflight, const char *path, size_t nr_slots)
+{
+    int ret = A_OK;
+
+    struct spl_flight *flight = NULL;
+    struct stat st;
+    uint64_t slots = 1;
+    void *map = MAP_FAILED;
+
+    ASSERT_ARG(NULL != pflight);
+    ASSERT_ARG(NULL != path);
+    ASSERT_ARG(0 != nr_slots);
+
+    *pflight = NULL;
+
+    while (slots < nr_slots) {
+        slots <<= 1;
+    }
+
+    if (NULL == (flight = spl_zalloc(sizeof(*flight)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    flight->fd = -1;
+    flight->map_len = _flight_file_len(slots);
+
+    if (0 > (flight->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644))) {
+        SPL_MSG(SEV_ERROR, "FLIGHT-OPEN-FAIL", "Failed to open flight recorder %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (0 > fstat(flight->fd, &st) ||
+            ((size_t)st.st_size != flight->map_len && 0 > ftruncate(flight->fd, flight->map_len)))
+    {
+        SPL_MSG(SEV_ERROR, "FLIGHT-SIZE-FAIL", "Failed to size flight recorder %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (MAP_FAILED == (map = mmap(NULL, flight->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, flight->fd, 0))) {
+        SPL_MSG(SEV_ERROR, "FLIGHT-MAP-FAIL", "Failed to map flight recorder %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    flight->hdr = map;
+    flight->recs = (struct spl_flight_rec *)((uint8_t *)map + SPL_FLIGHT_HEADER_SIZE);
+    flight->mask = slots - 1;
+
+    if (true == _flight_header_valid(flight->hdr, flight->map_len)) {
+        /* Pick up where the last run left off, so its records aren't thrown away */
+        flight->cursor = flight->hdr->cursor;
+    } else {
+        memset(map, 0, flight->map_len);
+        flight->hdr->magic = SPL_FLIGHT_MAGIC;
+        flight->hdr->version = SPL_FLIGHT_VERSION;
+        flight->hdr->rec_size = sizeof(struct spl_flight_rec);
+        flight->hdr->nr_slots = slots;
+        flight->hdr->cursor = 0;
+        flight->cursor = 0;
+    }
+
+    *pflight = flight;
+
+done:
+    if (FAILED(ret)) {
+        spl_flight_close(&flight);
+    }
+
+    return ret;
+}
+
+void spl_flight_close(struct spl_flight **pflight)
+{
+    struct spl_flight *flight = NULL;
+
+    if (NULL == pflight || NULL == *pflight) {
+        return;
+    }
+
+    flight = *pflight;
+
+    if (NULL != flight->hdr) {
+        munmap(flight->hdr, flight->map_len);
+    }
+
+    if (0 <= flight->fd) {
+        close(flight->fd);
+    }
+
+    spl_free(flight);
+    *pflight = NULL;
+}
+
+static
+int _flight_map_ro(const char *path, int *pfd, void **pmap, size_t *plen)
+{
+    int ret = A_OK;
+
+    int fd = -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    *pfd = -1;
+    *pmap = MAP_FAILED;
+    *plen = 0;
+
+    if (0 > (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+        SPL_MSG(SEV_ERROR, "FLIGHT-OPEN-FAIL", "Failed to open flight recorder %s: %s", path, strerror(errno));
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    if (0 > fstat(fd, &st) || (size_t)st.st_size < SPL_FLIGHT_HEADER_SIZE) {
+        SPL_MSG(SEV_ERROR, "FLIGHT-BAD", "%s is not a flight recorder file", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (MAP_FAILED == (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))) {
+        SPL_MSG(SEV_ERROR, "FLIGHT-MAP-FAIL", "Failed to map flight recorder %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (false == _flight_header_valid(map, st.st_size)) {
+        SPL_MSG(SEV_ERROR, "FLIGHT-BAD", "%s is not a flight recorder file", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    *pfd = fd;
+    *pmap = map;
+    *plen = st.st_size;
+
+done:
+    if (FAILED(ret)) {
+        if (MAP_FAILED != map) {
+            munmap(map, st.st_size);
+        }
+
+        if (0 <= fd) {
+            close(fd);
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Copy out record pos, if it's still there and not being rewritten
+ */
+static
+bool _flight_copy_rec(struct spl_flight_rec const *recs, uint64_t mask, uint64_t pos, struct spl_flight_rec *copy)
+{
+    struct spl_flight_rec const *rec = &recs[pos & mask];
+
+    if (pos + 1 != __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE)) {
+        /* Overwritten (or being overwritten) since we read the cursor */
+        return false;
+    }
+
+    memcpy(copy, rec, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return pos + 1 == __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+}
+
+int spl_flight_dump(const char *path, size_t last, spl_flight_cb_t cb, void *arg)
+{
+    int ret = A_OK;
+
+    int fd = -1;
+    size_t map_len = 0;
+    void *map = MAP_FAILED;
+    struct spl_flight_header const *hdr = NULL;
+    struct spl_flight_rec const *recs = NULL;
+    uint64_t cursor = 0,
+             first = 0;
+
+    ASSERT_ARG(NULL != path);
+    ASSERT_ARG(NULL != cb);
+
+    if (FAILED(ret = _flight_map_ro(path, &fd, &map, &map_len))) {
+        goto done;
+    }
+
+    hdr = map;
+    recs = (struct spl_flight_rec const *)((uint8_t const *)map + SPL_FLIGHT_HEADER_SIZE);
+
+    cursor = __atomic_load_n(&hdr->cursor, __ATOMIC_ACQUIRE);
+    first = cursor > hdr->nr_slots ? cursor - hdr->nr_slots : 0;
+    if (0 != last && cursor - first > last) {
+        first = cursor - last;
+    }
+
+    for (uint64_t pos = first; pos < cursor; pos++) {
+        struct spl_flight_rec copy;
+
+        if (false == _flight_copy_rec(recs, hdr->nr_slots - 1, pos, &copy)) {
+            continue;
+        }
+
+        if (FAILED(ret = cb(&copy, arg))) {
+            goto done;
+        }
+    }
+
+done:
+    if (MAP_FAILED != map) {
+        munmap(map, map_len);
+    }
+
+    if (0 <= fd) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+int spl_flight_reader_open(struct spl_flight_reader **preader, const char *path, bool from_oldest)
+{
+    int ret = A_OK;
+
+    struct spl_flight_reader *reader = NULL;
+    void *map = MAP_FAILED;
+    uint64_t cursor = 0;
+
+    ASSERT_ARG(NULL != preader);
+    ASSERT_ARG(NULL != path);
+
+    *preader = NULL;
+
+    if (NULL == (reader = spl_zalloc(sizeof(*reader)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    reader->fd = -1;
+
+    if (FAILED(ret = _flight_map_ro(path, &reader->fd, &map, &reader->map_len))) {
+        goto done;
+    }
+
+    reader->hdr = map;
+    reader->recs = (struct spl_flight_rec const *)((uint8_t const *)map + SPL_FLIGHT_HEADER_SIZE);
+    reader->mask = reader->hdr->nr_slots - 1;
+
+    cursor = __atomic_load_n(&reader->hdr->cursor, __ATOMIC_ACQUIRE);
+    if (true == from_oldest) {
+        reader->next = cursor > reader->hdr->nr_slots ? cursor - reader->hdr->nr_slots : 0;
+    } else {
+        reader->next = cursor;
+    }
+
+    *preader = reader;
+
+done:
+    if (FAILED(ret)) {
+        spl_flight_reader_close(&reader);
+    }
+
+    return ret;
+}
+
+void spl_flight_reader_close(struct spl_flight_reader **preader)
+{
+    struct spl_flight_reader *reader = NULL;
+
+    if (NULL == preader || NULL == *preader) {
+        return;
+    }
+
+    reader = *preader;
+
+    if (NULL != reader->hdr) {
+        munmap((void *)reader->hdr, reader->map_len);
+    }
+
+    if (0 <= reader->fd) {
+        close(reader->fd);
+    }
+
+    spl_free(reader);
+    *preader = NULL;
+}
+
+int spl_flight_reader_next(struct spl_flight_reader *reader, struct spl_flight_rec *recs, size_t nr_recs,
+        size_t *nr_read)
+{
+    int ret = A_OK;
+
+    uint64_t cursor = 0;
+    size_t nr_copied = 0;
+
+    ASSERT_ARG(NULL != reader);
+    ASSERT_ARG(NULL != recs);
+    ASSERT_ARG(NULL != nr_read);
+
+    cursor = __atomic_load_n(&reader->hdr->cursor, __ATOMIC_ACQUIRE);
+
+    if (cursor < reader->next) {
+        /* The file was started over underneath us */
+        reader->next = cursor;
+    }
+
+    if (cursor - reader->next > reader->mask + 1) {
+        /* We fell more than a whole ring behind */
+        reader->nr_missed += cursor - reader->next - (reader->mask + 1);
+        reader->next = cursor - (reader->mask + 1);
+    }
+
+    while (reader->next < cursor && nr_copied < nr_recs) {
+        if (true == _flight_copy_rec(reader->recs, reader->mask, reader->next, &recs[nr_copied])) {
+            nr_copied++;
+        } else {
+            reader->nr_missed++;
+        }
+        reader->next++;
+    }
+
+    *nr_read = nr_copied;
+
+    return ret;
+}
@@ -0,0 +1,128 @@
+/* splflight.h -- Crash-surviving flight recorder of recent raw reports
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The flight recorder is a fixed-size file, mapped shared into splread, holding a ring of
+ * the most recent raw reports from every device. Since the pages belong to the page cache
+ * rather than to the process, whatever was last stored in them is still there if splread
+ * crashes or is killed. (It is not synced to disk, so a power cut can lose the tail.)
+ *
+ * The header is a page of its own and carries the write cursor: the number of records ever
+ * written. Record n lives in slot n % nr_slots, and carries n + 1 as its sequence number,
+ * which is cleared while the record is being rewritten. A reader can take a consistent
+ * snapshot while splread is still running by checking each record's sequence number
+ * before and after copying it.
+ */
+#define SPL_FLIGHT_MAGIC            0x53504c46ul /* 'SPLF' */
+#define SPL_FLIGHT_VERSION          1
+#define SPL_FLIGHT_HEADER_SIZE      4096
+
+#define SPL_FLIGHT_DEFAULT_SLOTS    65536
+
+struct spl_flight_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    /* Always a power of two */
+    uint64_t nr_slots;
+    /* Number of records ever written, updated after each record is complete */
+    uint64_t cursor;
+} __attribute__((packed));
+
+struct spl_flight_rec {
+    /* Sequence number of this record plus one; 0 while the record is being written */
+    uint64_t seq;
+    uint64_t ts_ns;
+    uint16_t device;
+    /* The report exactly as it came back from the device */
+    uint8_t report[8];
+    uint8_t _resv[6];
+} __attribute__((packed));
+
+struct spl_flight {
+    int fd;
+    size_t map_len;
+    struct spl_flight_header *hdr;
+    struct spl_flight_rec *recs;
+    uint64_t mask;
+    /* Our own copy of the cursor, so the writer never has to read the shared one */
+    uint64_t cursor;
+};
+
+/**
+ * Open (or create) a flight recorder file with room for nr_slots records (rounded up to a
+ * power of two). An existing file of the same size carries on from where it left off.
+ */
+int spl_flight_open(struct spl_flight **pflight, const char *path, size_t nr_slots);
+void spl_flight_close(struct spl_flight **pflight);
+
+/**
+ * Record a report. Only ever called from one thread.
+ */
+static inline
+void spl_flight_record(struct spl_flight *flight, uint64_t ts_ns, uint16_t device, uint8_t const *report)
+{
+    uint64_t pos = flight->cursor++;
+    struct spl_flight_rec *rec = &flight->recs[pos & flight->mask];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec->ts_ns = ts_ns;
+    rec->device = device;
+    __builtin_memcpy(rec->report, report, sizeof(rec->report));
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&flight->hdr->cursor, pos + 1, __ATOMIC_RELEASE);
+}
+
+typedef int (*spl_flight_cb_t)(struct spl_flight_rec const *rec, void *arg);
+
+/**
+ * Walk the records in a flight recorder file, oldest first. If last is not 0, only the
+ * last that many records are visited. Records caught mid-write are skipped.
+ */
+int spl_flight_dump(const char *path, size_t last, spl_flight_cb_t cb, void *arg);
+
+/*
+ * A reader follows a flight recorder as splread writes to it, from another process, picking
+ * up each record once. It only ever maps the file read-only. Records overwritten before the
+ * reader got to them (because it fell a whole ring behind) are counted in nr_missed.
+ */
+struct spl_flight_reader {
+    int fd;
+    size_t map_len;
+    struct spl_flight_header const *hdr;
+    struct spl_flight_rec const *recs;
+    uint64_t mask;
+    /* Position of the next record to be read */
+    uint64_t next;
+    uint64_t nr_missed;
+};
+
+/**
+ * Start following a flight recorder file, from the oldest record it still holds, or from
+ * whatever is written next.
+ */
+int spl_flight_reader_open(struct spl_flight_reader **preader, const char *path, bool from_oldest);
+void spl_flight_reader_close(struct spl_flight_reader **preader);
+
+/**
+ * Copy out up to nr_recs records written since the last call, oldest first. Never waits;
+ * nr_read is 0 if nothing new has been written.
+ */
+int spl_flight_reader_next(struct spl_flight_reader *reader, struct spl_flight_rec *recs, size_t nr_recs,
+        size_t *nr_read);
@@ -0,0 +1,801 @@
+/* splfmt.c -- Fast, printf-free formatting of samples and rollups
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <gm1356.h>
+#include <splarena.h>
+#include <splfmt.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static
+const char spl_fmt_digits2[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+#define _APPEND_LIT(_p, _lit) \
+    do { \
+        memcpy((_p), (_lit), sizeof(_lit) - 1); \
+        (_p) += sizeof(_lit) - 1; \
+    } while (0)
+
+static inline
+char *_append_str(char *p, const char *str)
+{
+    size_t len = strlen(str);
+    memcpy(p, str, len);
+    return p + len;
+}
+
+static inline
+char *_fmt_2(char *p, unsigned v)
+{
+    memcpy(p, &spl_fmt_digits2[v * 2], 2);
+    return p + 2;
+}
+
+char *spl_fmt_u64(char *p, uint64_t v)
+{
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
+    size_t len = 0;
+
+    /* Two digits at a time, from the least significant end */
+    while (v >= 100) {
+        t -= 2;
+        memcpy(t, &spl_fmt_digits2[(v % 100) * 2], 2);
+        v /= 100;
+    }
+
+    if (v >= 10) {
+        t -= 2;
+        memcpy(t, &spl_fmt_digits2[v * 2], 2);
+    } else {
+        *--t = '0' + (char)v;
+    }
+
+    len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+
+    return p + len;
+}
+
+/**
+ * Format a level the way splread always has (printf's "%4.2f" of the level in dB). Levels
+ * are only ever in tenths of a dB, so the second decimal is always 0.
+ */
+char *spl_fmt_ddb(char *p, uint16_t ddb)
+{
+    p = spl_fmt_u64(p, ddb / 10);
+    *p++ = '.';
+    *p++ = '0' + ddb % 10;
+    *p++ = '0';
+    return p;
+}
+
+/**
+ * Convert days since the UNIX epoch to a proleptic Gregorian date. From Howard Hinnant's
+ * civil_from_days(); avoids gmtime() and its locking entirely.
+ */
+static
+void _civil_from_days(int64_t days, int *py, unsigned *pm, unsigned *pd)
+{
+    int64_t z = days + 719468,
+            era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097),
+             yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365,
+             doy = doe - (365 * yoe + yoe / 4 - yoe / 100),
+             mp = (5 * doy + 2) / 153,
+             d = doy - (153 * mp + 2) / 5 + 1,
+             m = mp < 10 ? mp + 3 : mp - 9;
+    int64_t y = (int64_t)yoe + era * 400 + (m <= 2);
+
+    *py = (int)y;
+    *pm = m;
+    *pd = d;
+}
+
+static
+char *_fmt_date_time(char *p, uint64_t secs, char sep)
+{
+    unsigned sod = secs % 86400,
+             month = 0,
+             day = 0;
+    int year = 0;
+
+    _civil_from_days((int64_t)(secs / 86400), &year, &month, &day);
+
+    p = _fmt_2(p, (unsigned)year / 100);
+    p = _fmt_2(p, (unsigned)year % 100);
+    *p++ = '-';
+    p = _fmt_2(p, month);
+    *p++ = '-';
+    p = _fmt_2(p, day);
+    *p++ = sep;
+    p = _fmt_2(p, sod / 3600);
+    *p++ = ':';
+    p = _fmt_2(p, (sod / 60) % 60);
+    *p++ = ':';
+    p = _fmt_2(p, sod % 60);
+
+    return p;
+}
+
+char *spl_fmt_utc(char *p, uint64_t ts_ns)
+{
+    p = _fmt_date_time(p, ts_ns / SPL_NS_PER_SEC, ' ');
+    _APPEND_LIT(p, " UTC");
+
+    return p;
+}
+
+static
+char *_fmt_db1(char *p, uint16_t ddb)
+{
+    p = spl_fmt_u64(p, ddb / 10);
+    *p++ = '.';
+    *p++ = '0' + ddb % 10;
+    return p;
+}
+
+static
+char *_fmt_sample_json_body(char *p, struct spl_sample const *sample)
+{
+    p = spl_fmt_ddb(p, sample->deci_db);
+    if (sample->flags & GM1356_FAST_MODE) {
+        _APPEND_LIT(p, ",\"mode\":\"fast\",\"freqMode\":\"");
+    } else {
+        _APPEND_LIT(p, ",\"mode\":\"slow\",\"freqMode\":\"");
+    }
+    if (sample->flags & GM1356_MEASURE_DBC) {
+        _APPEND_LIT(p, "dBC\",\"range\":\"");
+    } else {
+        _APPEND_LIT(p, "dBA\",\"range\":\"");
+    }
+    p = _append_str(p, gm1356_range_name(sample->flags));
+    _APPEND_LIT(p, "\",\"timestamp\":\"");
+    p = spl_fmt_utc(p, sample->ts_ns);
+    *p++ = '"';
+
+    return p;
+}
+
+char *spl_fmt_sample_json(char *p, struct spl_sample const *sample)
+{
+    _APPEND_LIT(p, "{\"measured\":");
+    p = _fmt_sample_json_body(p, sample);
+    _APPEND_LIT(p, "}\n");
+
+    return p;
+}
+
+char *spl_fmt_sample_json_device(char *p, struct spl_sample const *sample)
+{
+    _APPEND_LIT(p, "{\"device\":");
+    p = spl_fmt_u64(p, sample->device);
+    _APPEND_LIT(p, ",\"measured\":");
+    p = _fmt_sample_json_body(p, sample);
+    _APPEND_LIT(p, ",\"timestampErrorUs\":");
+    p = spl_fmt_u64(p, sample->ts_err_us);
+    _APPEND_LIT(p, "}\n");
+
+    return p;
+}
+
+char *spl_fmt_sample_csv(char *p, struct spl_sample const *sample)
+{
+    p = spl_fmt_u64(p, sample->ts_ns);
+    *p++ = ',';
+    p = spl_fmt_u64(p, sample->device);
+    *p++ = ',';
+    p = _fmt_db1(p, sample->deci_db);
+    if (sample->flags & GM1356_FAST_MODE) {
+        _APPEND_LIT(p, ",fast,");
+    } else {
+        _APPEND_LIT(p, ",slow,");
+    }
+    if (sample->flags & GM1356_MEASURE_DBC) {
+        _APPEND_LIT(p, "dBC,");
+    } else {
+        _APPEND_LIT(p, "dBA,");
+    }
+    p = _append_str(p, gm1356_range_name(sample->flags));
+    *p++ = '\n';
+
+    return p;
+}
+
+char *spl_fmt_rollup_json(char *p, struct spl_rollup const *rollup, uint32_t res_sec)
+{
+    _APPEND_LIT(p, "{\"timestamp\":\"");
+    p = spl_fmt_utc(p, rollup->ts_ns);
+    _APPEND_LIT(p, "\",\"resolution\":");
+    p = spl_fmt_u64(p, res_sec);
+    _APPEND_LIT(p, ",\"device\":");
+    p = spl_fmt_u64(p, rollup->device);
+    _APPEND_LIT(p, ",\"samples\":");
+    p = spl_fmt_u64(p, rollup->nr_samples);
+    _APPEND_LIT(p, ",\"min\":");
+    p = _fmt_db1(p, rollup->min_ddb);
+    _APPEND_LIT(p, ",\"max\":");
+    p = _fmt_db1(p, rollup->max_ddb);
+    _APPEND_LIT(p, ",\"leq\":");
+    p = _fmt_db1(p, rollup->leq_ddb);
+    _APPEND_LIT(p, "}\n");
+
+    return p;
+}
+
+char *spl_fmt_rollup_csv(char *p, struct spl_rollup const *rollup, uint32_t res_sec)
+{
+    p = spl_fmt_u64(p, rollup->ts_ns);
+    *p++ = ',';
+    p = spl_fmt_u64(p, res_sec);
+    *p++ = ',';
+    p = spl_fmt_u64(p, rollup->device);
+    *p++ = ',';
+    p = spl_fmt_u64(p, rollup->nr_samples);
+    *p++ = ',';
+    p = _fmt_db1(p, rollup->min_ddb);
+    *p++ = ',';
+    p = _fmt_db1(p, rollup->max_ddb);
+    *p++ = ',';
+    p = _fmt_db1(p, rollup->leq_ddb);
+    *p++ = '\n';
+
+    return p;
+}
+
+static
+const struct {
+    const char *name;
+    uint8_t field;
+    /* Whether the value is a JSON string */
+    bool quoted;
+    uint8_t def_style;
+} spl_fmt_fields[] = {
+    { "level",      SPL_FMT_FIELD_LEVEL,        false,  2 },
+    { "mode",       SPL_FMT_FIELD_MODE,         true,   0 },
+    { "weighting",  SPL_FMT_FIELD_WEIGHTING,    true,   0 },
+    { "range",      SPL_FMT_FIELD_RANGE,        true,   0 },
+    { "time",       SPL_FMT_FIELD_TIME,         true,   SPL_FMT_TIME_UTC },
+    { "device",     SPL_FMT_FIELD_DEVICE,       false,  0 },
+    { "serial",     SPL_FMT_FIELD_SERIAL,       true,   0 },
+    { "timeerr",    SPL_FMT_FIELD_TIME_ERROR,   false,  0 },
+};
+
+static
+const char *spl_fmt_time_styles[] = {
+    [SPL_FMT_TIME_UTC] = "utc",
+    [SPL_FMT_TIME_ISO] = "iso",
+    [SPL_FMT_TIME_S] = "s",
+    [SPL_FMT_TIME_MS] = "ms",
+    [SPL_FMT_TIME_US] = "us",
+    [SPL_FMT_TIME_NS] = "ns",
+};
+
+/**
+ * The most a field can take up once formatted
+ */
+static
+size_t _tmpl_field_max_len(uint8_t field, uint8_t style)
+{
+    switch (field) {
+    case SPL_FMT_FIELD_LEVEL:
+        /* Up to 6553.5 dB, in principle */
+        return 4 + (0 == style ? 0 : 1 + style);
+    case SPL_FMT_FIELD_MODE:
+        return 4;
+    case SPL_FMT_FIELD_WEIGHTING:
+        return 3;
+    case SPL_FMT_FIELD_RANGE:
+        return 7;
+    case SPL_FMT_FIELD_TIME:
+        /* An ISO 8601 date has milliseconds but no " UTC"; the rest are at most 20 digits */
+        return SPL_FMT_TIME_UTC == style ? SPL_FMT_UTC_LEN : SPL_FMT_TIME_ISO == style ? SPL_FMT_UTC_LEN + 1 : 20;
+    case SPL_FMT_FIELD_DEVICE:
+        return 5;
+    case SPL_FMT_FIELD_SERIAL:
+        return SPL_FMT_TMPL_MAX_SERIAL;
+    case SPL_FMT_FIELD_TIME_ERROR:
+        return 5;
+    }
+
+    return 0;
+}
+
+static inline
+bool _tmpl_field_is_flags(uint8_t field)
+{
+    return SPL_FMT_FIELD_MODE == field || SPL_FMT_FIELD_WEIGHTING == field || SPL_FMT_FIELD_RANGE == field;
+}
+
+/**
+ * Which precomputed entry of a run goes with a sample's flags
+ */
+static inline
+unsigned _tmpl_run_key(uint8_t flags)
+{
+    unsigned range = flags & GM1356_FLAGS_RANGE_MASK;
+
+    if (range > GM1356_RANGE_80_130_DB) {
+        range = GM1356_RANGE_80_130_DB + 1;
+    }
+
+    return range * 4 + !!(flags & GM1356_FAST_MODE) * 2 + !!(flags & GM1356_MEASURE_DBC);
+}
+
+static inline __attribute__((always_inline))
+char *_fmt_time(char *p, uint64_t ts_ns, uint8_t style)
+{
+    switch (style) {
+    case SPL_FMT_TIME_UTC:
+        return spl_fmt_utc(p, ts_ns);
+    case SPL_FMT_TIME_ISO:
+        p = _fmt_date_time(p, ts_ns / SPL_NS_PER_SEC, 'T');
+        *p++ = '.';
+        p = _fmt_2(p, (ts_ns / 10000000) % 100);
+        *p++ = '0' + (ts_ns / 1000000) % 10;
+        *p++ = 'Z';
+        return p;
+    case SPL_FMT_TIME_S:
+        return spl_fmt_u64(p, ts_ns / SPL_NS_PER_SEC);
+    case SPL_FMT_TIME_MS:
+        return spl_fmt_u64(p, ts_ns / SPL_NS_PER_MS);
+    case SPL_FMT_TIME_US:
+        return spl_fmt_u64(p, ts_ns / 1000);
+    }
+
+    return spl_fmt_u64(p, ts_ns);
+}
+
+/*
+ * Inlined into the loop in spl_fmt_tmpl_run(), so the common formatters are too; otherwise
+ * this costs the template a good fraction of the fixed formatter's time on every record.
+ */
+static inline __attribute__((always_inline))
+char *_tmpl_field(char *p, struct spl_fmt_tmpl const *tmpl, struct spl_fmt_op const *op,
+        struct spl_sample const *sample, const char *serial, size_t serial_len)
+{
+    switch (op->field) {
+    case SPL_FMT_FIELD_LEVEL:
+        if (2 == op->style) {
+            p = spl_fmt_ddb(p, sample->deci_db);
+        } else if (1 == op->style) {
+            p = _fmt_db1(p, sample->deci_db);
+        } else {
+            /* Round half up */
+            p = spl_fmt_u64(p, (sample->deci_db + 5) / 10);
+        }
+        break;
+    case SPL_FMT_FIELD_MODE:
+        if (sample->flags & GM1356_FAST_MODE) {
+            _APPEND_LIT(p, "fast");
+        } else {
+            _APPEND_LIT(p, "slow");
+        }
+        break;
+    case SPL_FMT_FIELD_WEIGHTING:
+        if (sample->flags & GM1356_MEASURE_DBC) {
+            _APPEND_LIT(p, "dBC");
+        } else {
+            _APPEND_LIT(p, "dBA");
+        }
+        break;
+    case SPL_FMT_FIELD_RANGE:
+        p = _append_str(p, gm1356_range_name(sample->flags));
+        break;
+    case SPL_FMT_FIELD_TIME:
+        p = _fmt_time(p, sample->ts_ns, op->style);
+        break;
+    case SPL_FMT_FIELD_DEVICE:
+        p = spl_fmt_u64(p, sample->device);
+        break;
+    case SPL_FMT_FIELD_SERIAL:
+        if (serial_len > SPL_FMT_TMPL_MAX_SERIAL) {
+            serial_len = SPL_FMT_TMPL_MAX_SERIAL;
+        }
+        memcpy(p, serial, serial_len);
+        p += serial_len;
+        break;
+    case SPL_FMT_FIELD_TIME_ERROR:
+        p = spl_fmt_u64(p, sample->ts_err_us);
+        break;
+    case SPL_FMT_FIELD_RUN: {
+            struct spl_fmt_run const *run = &tmpl->runs[op->style];
+            unsigned key = _tmpl_run_key(sample->flags);
+
+            memcpy(p, run->text[key], SPL_FMT_TMPL_MAX_RUN);
+            p += run->len[key];
+        }
+        break;
+    }
+
+    return p;
+}
+
+static
+int _tmpl_append_lit(struct spl_fmt_tmpl *tmpl, size_t *plit_len, const char *str, size_t len)
+{
+    if (*plit_len + len > SPL_FMT_TMPL_MAX_LIT) {
+        SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "Output template is too long");
+        return A_E_INVAL;
+    }
+
+    memcpy(&tmpl->lit[*plit_len], str, len);
+    *plit_len += len;
+
+    return A_OK;
+}
+
+/**
+ * Replace each run of flag fields (and the literals before, between and after them) with
+ * a lookup in a table of the run formatted for every possible combination of flags.
+ */
+static
+void _tmpl_fuse_runs(struct spl_fmt_tmpl *tmpl)
+{
+    size_t nr_out = 0,
+           i = 0;
+
+    while (i < tmpl->nr_ops) {
+        size_t j = i,
+               run_len = 0;
+        uint16_t *next_lit_len = NULL;
+        struct spl_fmt_run *run = NULL;
+
+        while (j < tmpl->nr_ops && true == _tmpl_field_is_flags(tmpl->ops[j].field)) {
+            run_len += tmpl->ops[j].lit_len + _tmpl_field_max_len(tmpl->ops[j].field, tmpl->ops[j].style);
+            j++;
+        }
+
+        next_lit_len = j < tmpl->nr_ops ? &tmpl->ops[j].lit_len : &tmpl->tail_len;
+        run_len += *next_lit_len;
+
+        if (i == j) {
+            tmpl->ops[nr_out++] = tmpl->ops[i++];
+            continue;
+        }
+
+        if (SPL_FMT_TMPL_MAX_RUNS == tmpl->nr_runs || run_len > SPL_FMT_TMPL_MAX_RUN) {
+            while (i < j) {
+                tmpl->ops[nr_out++] = tmpl->ops[i++];
+            }
+            continue;
+        }
+
+        run = &tmpl->runs[tmpl->nr_runs];
+
+        for (unsigned key = 0; key < SPL_FMT_TMPL_RUN_KEYS; key++) {
+            unsigned range = key / 4;
+            struct spl_sample sample = {
+                .flags = (range > GM1356_RANGE_80_130_DB ? GM1356_FLAGS_RANGE_MASK : range) |
+                         (key & 2 ? GM1356_FAST_MODE : 0) |
+                         (key & 1 ? GM1356_MEASURE_DBC : 0),
+            };
+            char *p = run->text[key];
+
+            for (size_t k = i; k < j; k++) {
+                struct spl_fmt_op const *op = &tmpl->ops[k];
+
+                memcpy(p, &tmpl->lit[op->lit_off], op->lit_len);
+                p += op->lit_len;
+                p = _tmpl_field(p, tmpl, op, &sample, NULL, 0);
+            }
+
+            memcpy(p, &tmpl->lit[j < tmpl->nr_ops ? tmpl->ops[j].lit_off : tmpl->tail_off], *next_lit_len);
+            p += *next_lit_len;
+
+            run->len[key] = p - run->text[key];
+        }
+
+        /* The run now includes the literal after it */
+        *next_lit_len = 0;
+
+        tmpl->ops[nr_out].lit_off = 0;
+        tmpl->ops[nr_out].lit_len = 0;
+        tmpl->ops[nr_out].field = SPL_FMT_FIELD_RUN;
+        tmpl->ops[nr_out].style = tmpl->nr_runs++;
+        nr_out++;
+
+        i = j;
+    }
+
+    tmpl->nr_ops = nr_out;
+}
+
+int spl_fmt_tmpl_compile(struct spl_fmt_tmpl *tmpl, const char *spec)
+{
+    int ret = A_OK;
+
+    const char *item = NULL;
+    size_t lit_len = 0;
+    bool prev_quoted = false;
+    const char *names[SPL_FMT_TMPL_MAX_FIELDS];
+    size_t name_lens[SPL_FMT_TMPL_MAX_FIELDS];
+
+    ASSERT_ARG(NULL != tmpl);
+    ASSERT_ARG(NULL != spec);
+
+    memset(tmpl, 0, sizeof(*tmpl));
+
+    item = spec;
+
+    if ('\0' == *item) {
+        SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "The output template is empty");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    while ('\0' != *item) {
+        const char *end = strchrnul(item, ','),
+                   *eq = memchr(item, '=', end - item),
+                   *field = NULL == eq ? item : eq + 1,
+                   *colon = memchr(field, ':', end - field),
+                   *field_end = NULL == colon ? end : colon,
+                   *name = item;
+        size_t name_len = NULL == eq ? (size_t)(field_end - field) : (size_t)(eq - item),
+               f = 0;
+        struct spl_fmt_op *op = NULL;
+
+        if (tmpl->nr_ops == SPL_FMT_TMPL_MAX_FIELDS) {
+            SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "Too many fields in output template (at most %d)", SPL_FMT_TMPL_MAX_FIELDS);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        for (f = 0; f < sizeof(spl_fmt_fields)/sizeof(spl_fmt_fields[0]); f++) {
+            if (strlen(spl_fmt_fields[f].name) == (size_t)(field_end - field) &&
+                    0 == memcmp(spl_fmt_fields[f].name, field, field_end - field))
+            {
+                break;
+            }
+        }
+
+        if (f == sizeof(spl_fmt_fields)/sizeof(spl_fmt_fields[0])) {
+            SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "Unknown field '%.*s' in output template", (int)(field_end - field), field);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (0 == name_len || name_len > SPL_FMT_TMPL_MAX_NAME) {
+            SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "Field names in output templates must be 1 to %d characters",
+                    SPL_FMT_TMPL_MAX_NAME);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        /* Names go into the JSON as they are, so keep out anything that would need escaping */
+        for (size_t i = 0; i < name_len; i++) {
+            if ('"' == name[i] || '\\' == name[i] || (unsigned char)name[i] < 0x20) {
+                SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "Field name '%.*s' in output template can't contain quotes, "
+                        "backslashes or control characters", (int)name_len, name);
+                ret = A_E_INVAL;
+                goto done;
+            }
+        }
+
+        for (size_t i = 0; i < tmpl->nr_ops; i++) {
+            if (name_lens[i] == name_len && 0 == memcmp(names[i], name, name_len)) {
+                SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "Field name '%.*s' appears twice in output template", (int)name_len,
+                        name);
+                ret = A_E_INVAL;
+                goto done;
+            }
+        }
+
+        names[tmpl->nr_ops] = name;
+        name_lens[tmpl->nr_ops] = name_len;
+
+        op = &tmpl->ops[tmpl->nr_ops];
+        op->field = spl_fmt_fields[f].field;
+        op->style = spl_fmt_fields[f].def_style;
+
+        if (NULL != colon) {
+            const char *style = colon + 1;
+            size_t style_len = end - style;
+            bool found = false;
+
+            if (SPL_FMT_FIELD_LEVEL == op->field) {
+                if (1 == style_len && style[0] >= '0' && style[0] <= '2') {
+                    op->style = style[0] - '0';
+                    found = true;
+                }
+            } else if (SPL_FMT_FIELD_TIME == op->field) {
+                for (size_t s = 0; s < sizeof(spl_fmt_time_styles)/sizeof(spl_fmt_time_styles[0]); s++) {
+                    if (strlen(spl_fmt_time_styles[s]) == style_len &&
+                            0 == memcmp(spl_fmt_time_styles[s], style, style_len))
+                    {
+                        op->style = s;
+                        found = true;
+                        break;
+                    }
+                }
+            }
+
+            if (false == found) {
+                SPL_MSG(SEV_ERROR, "BAD-TEMPLATE", "Bad style '%.*s' for field '%s' in output template", (int)style_len,
+                        style, spl_fmt_fields[f].name);
+                ret = A_E_INVAL;
+                goto done;
+            }
+        }
+
+        /*
+         * The literal before this field closes off the previous value, then opens this one.
+         * Times are only quoted if they're dates.
+         */
+        op->lit_off = lit_len;
+
+        if ((true == prev_quoted && FAILED(ret = _tmpl_append_lit(tmpl, &lit_len, "\"", 1))) ||
+                FAILED(ret = _tmpl_append_lit(tmpl, &lit_len, 0 == tmpl->nr_ops ? "{\"" : ",\"", 2)) ||
+                FAILED(ret = _tmpl_append_lit(tmpl, &lit_len, name, name_len)) ||
+                FAILED(ret = _tmpl_append_lit(tmpl, &lit_len, "\":", 2)))
+        {
+            goto done;
+        }
+
+        prev_quoted = spl_fmt_fields[f].quoted;
+        if (SPL_FMT_FIELD_TIME == op->field && op->style > SPL_FMT_TIME_ISO) {
+            prev_quoted = false;
+        }
+
+        if (true == prev_quoted && FAILED(ret = _tmpl_append_lit(tmpl, &lit_len, "\"", 1))) {
+            goto done;
+        }
+
+        op->lit_len = lit_len - op->lit_off;
+        tmpl->max_len += op->lit_len + _tmpl_field_max_len(op->field, op->style);
+        tmpl->nr_ops++;
+
+        item = '\0' == *end ? end : end + 1;
+    }
+
+    tmpl->tail_off = lit_len;
+
+    if ((true == prev_quoted && FAILED(ret = _tmpl_append_lit(tmpl, &lit_len, "\"", 1))) ||
+            FAILED(ret = _tmpl_append_lit(tmpl, &lit_len, "}\n", 2)))
+    {
+        goto done;
+    }
+
+    tmpl->tail_len = lit_len - tmpl->tail_off;
+    tmpl->max_len += tmpl->tail_len;
+
+    _tmpl_fuse_runs(tmpl);
+
+done:
+    return ret;
+}
+
+/**
+ * Copy a literal a chunk at a time. Fixed size copies compile down to a couple of moves, where
+ * a variable length memcpy() is a call; the overrun lands in the padding at the end of the
+ * literal pool, and in the slack at the end of the output.
+ */
+static inline
+char *_copy_lit(char *p, const char *lit, size_t len)
+{
+    /* Nearly every literal fits in the first chunk, so this loop is almost never taken */
+    memcpy(p, lit, SPL_FMT_TMPL_LIT_CHUNK);
+    for (size_t i = SPL_FMT_TMPL_LIT_CHUNK; i < len; i += SPL_FMT_TMPL_LIT_CHUNK) {
+        memcpy(p + i, lit + i, SPL_FMT_TMPL_LIT_CHUNK);
+    }
+
+    return p + len;
+}
+
+char *spl_fmt_tmpl_run(char *p, struct spl_fmt_tmpl const *tmpl, struct spl_sample const *sample,
+        const char *serial, size_t serial_len)
+{
+    for (size_t i = 0; i < tmpl->nr_ops; i++) {
+        struct spl_fmt_op const *op = &tmpl->ops[i];
+
+        p = _copy_lit(p, &tmpl->lit[op->lit_off], op->lit_len);
+        p = _tmpl_field(p, tmpl, op, sample, serial, serial_len);
+    }
+
+    return _copy_lit(p, &tmpl->lit[tmpl->tail_off], tmpl->tail_len);
+}
+
+/**
+ * Escape a measurement name, tag key or tag value for line protocol. Measurement names only
+ * need commas and spaces escaped, but escaping equals signs too does no harm.
+ */
+static
+char *_lp_escape(char *p, const char *str)
+{
+    for (; '\0' != *str; str++) {
+        if (',' == *str || '=' == *str || ' ' == *str) {
+            *p++ = '\\';
+        }
+        *p++ = *str;
+    }
+
+    return p;
+}
+
+int spl_fmt_lp_prefix(char **pprefix, size_t *pprefix_len, const char *measurement, uint16_t device,
+        const char *serial)
+{
+    int ret = A_OK;
+
+    char *prefix = NULL,
+         *p = NULL;
+
+    ASSERT_ARG(NULL != pprefix);
+    ASSERT_ARG(NULL != pprefix_len);
+    ASSERT_ARG(NULL != measurement);
+
+    *pprefix = NULL;
+    *pprefix_len = 0;
+
+    if ('\0' == *measurement) {
+        SPL_MSG(SEV_ERROR, "BAD-MEASUREMENT", "The line protocol measurement name can't be empty");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* Every character might need escaping */
+    if (NULL == (prefix = spl_zalloc(2 * strlen(measurement) + 2 * (NULL == serial ? 0 : strlen(serial)) + 32))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    p = _lp_escape(prefix, measurement);
+    _APPEND_LIT(p, ",device=");
+    p = spl_fmt_u64(p, device);
+
+    if (NULL != serial && '\0' != *serial) {
+        _APPEND_LIT(p, ",serial=");
+        p = _lp_escape(p, serial);
+    }
+
+    *p++ = ' ';
+
+    *pprefix = prefix;
+    *pprefix_len = p - prefix;
+
+done:
+    return ret;
+}
+
+char *spl_fmt_sample_lp(char *p, const char *prefix, size_t prefix_len, struct spl_sample const *sample)
+{
+    memcpy(p, prefix, prefix_len);
+    p += prefix_len;
+
+    _APPEND_LIT(p, "deci_db=");
+    p = spl_fmt_u64(p, sample->deci_db);
+    if (sample->flags & GM1356_FAST_MODE) {
+        _APPEND_LIT(p, "i,fast=1i,dbc=");
+    } else {
+        _APPEND_LIT(p, "i,fast=0i,dbc=");
+    }
+    if (sample->flags & GM1356_MEASURE_DBC) {
+        _APPEND_LIT(p, "1i,range=");
+    } else {
+        _APPEND_LIT(p, "0i,range=");
+    }
+    p = spl_fmt_u64(p, sample->flags & GM1356_FLAGS_RANGE_MASK);
+    _APPEND_LIT(p, "i,ts_err_us=");
+    p = spl_fmt_u64(p, sample->ts_err_us);
+    _APPEND_LIT(p, "i ");
+    p = spl_fmt_u64(p, sample->ts_ns);
+    *p++ = '\n';
+
+    return p;
+}
@@ -0,0 +1,182 @@
+/* splfmt.h -- Fast, printf-free formatting of samples and rollups
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+#include <splstore.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * All of the formatters write into a caller-supplied buffer, which must have at least this
+ * much room, and return a pointer just past the last character written. Nothing is
+ * NUL-terminated.
+ */
+#define SPL_FMT_MAX_RECORD          256
+
+/* Length of a timestamp as formatted by spl_fmt_utc(), "YYYY-MM-DD HH:MM:SS UTC" */
+#define SPL_FMT_UTC_LEN             23
+
+char *spl_fmt_u64(char *p, uint64_t v);
+char *spl_fmt_ddb(char *p, uint16_t ddb);
+char *spl_fmt_utc(char *p, uint64_t ts_ns);
+
+/**
+ * Format a sample exactly as splread has always printed it, as a line of JSON
+ */
+char *spl_fmt_sample_json(char *p, struct spl_sample const *sample);
+/**
+ * The same, led by the device the sample came from and followed by how far its timestamp
+ * could be off, as splread prints it with several meters (less the serial number, which
+ * the store doesn't keep)
+ */
+char *spl_fmt_sample_json_device(char *p, struct spl_sample const *sample);
+char *spl_fmt_sample_csv(char *p, struct spl_sample const *sample);
+char *spl_fmt_rollup_json(char *p, struct spl_rollup const *rollup, uint32_t res_sec);
+char *spl_fmt_rollup_csv(char *p, struct spl_rollup const *rollup, uint32_t res_sec);
+
+#define SPL_FMT_SAMPLE_CSV_HEADER   "timestamp_ns,device,level_db,mode,weighting,range\n"
+#define SPL_FMT_ROLLUP_CSV_HEADER   "timestamp_ns,resolution_s,device,samples,min_db,max_db,leq_db\n"
+
+/*
+ * Output templates. A template names the fields of each JSON record, in order, as a comma
+ * separated list of [name=]field[:style], for example
+ *
+ *     db=level:1,ts=time:ms,device
+ *
+ * The fields are:
+ *   level      the level in dB, with style 0, 1 or 2 decimal places (default 2)
+ *   mode       "fast" or "slow"
+ *   weighting  "dBA" or "dBC"
+ *   range      the meter's range, e.g. "30-130"
+ *   time       the sample time, with style utc ("YYYY-MM-DD HH:MM:SS UTC", the default),
+ *              iso ("YYYY-MM-DDTHH:MM:SS.mmmZ"), or s, ms, us or ns since the UNIX epoch
+ *   device     the index of the device
+ *   serial     the serial number of the device
+ *   timeerr    how far the sample time could be off, either way, in microseconds (0 if unknown)
+ * If no name is given, the field's own name is used.
+ *
+ * A template is compiled once into a short program of ops, each a literal run of text (the
+ * punctuation, the quoted name, and any quotes around the previous value, all merged
+ * together) followed by a field to format. Fields that only depend on the sample's flags
+ * (mode, weighting and range) have few enough possible values that a run of them, with the
+ * literals around them, is formatted ahead of time for every combination, and becomes a
+ * single table lookup. Running the program is then just a loop of fixed size copies and
+ * calls to the formatters above.
+ */
+#define SPL_FMT_TMPL_DEFAULT        "measured=level:2,mode,freqMode=weighting,range,timestamp=time:utc"
+/* With several devices, each record also says which one it came from */
+#define SPL_FMT_TMPL_DEFAULT_MULTI  "device,serial," SPL_FMT_TMPL_DEFAULT ",timestampErrorUs=timeerr"
+
+#define SPL_FMT_TMPL_MAX_FIELDS     16
+#define SPL_FMT_TMPL_MAX_NAME       64
+#define SPL_FMT_TMPL_MAX_LIT        1280
+/* Serial numbers longer than this are cut short */
+#define SPL_FMT_TMPL_MAX_SERIAL     64
+
+/* Literals are copied in chunks of this many bytes */
+#define SPL_FMT_TMPL_LIT_CHUNK      32
+
+/*
+ * Precomputed runs of flag fields: one entry for each of fast or slow, dBA or dBC, and the
+ * five ranges plus unknown. Runs longer than SPL_FMT_TMPL_MAX_RUN are left as they are.
+ */
+#define SPL_FMT_TMPL_MAX_RUNS       4
+#define SPL_FMT_TMPL_MAX_RUN        64
+#define SPL_FMT_TMPL_RUN_KEYS       24
+
+/* Running a template may scribble this far past the end of the record */
+#define SPL_FMT_TMPL_SLACK          SPL_FMT_TMPL_MAX_RUN
+
+enum spl_fmt_field {
+    SPL_FMT_FIELD_LEVEL,
+    SPL_FMT_FIELD_MODE,
+    SPL_FMT_FIELD_WEIGHTING,
+    SPL_FMT_FIELD_RANGE,
+    SPL_FMT_FIELD_TIME,
+    SPL_FMT_FIELD_DEVICE,
+    SPL_FMT_FIELD_SERIAL,
+    SPL_FMT_FIELD_TIME_ERROR,
+    /* A precomputed run of flag fields; the style is the index of the run */
+    SPL_FMT_FIELD_RUN,
+};
+
+enum spl_fmt_time_style {
+    SPL_FMT_TIME_UTC,
+    SPL_FMT_TIME_ISO,
+    SPL_FMT_TIME_S,
+    SPL_FMT_TIME_MS,
+    SPL_FMT_TIME_US,
+    SPL_FMT_TIME_NS,
+};
+
+struct spl_fmt_op {
+    /* The literal text that comes before the field, in lit */
+    uint16_t lit_off;
+    uint16_t lit_len;
+    uint8_t field;
+    /* Decimal places for levels, an spl_fmt_time_style for times */
+    uint8_t style;
+};
+
+struct spl_fmt_run {
+    uint8_t len[SPL_FMT_TMPL_RUN_KEYS];
+    char text[SPL_FMT_TMPL_RUN_KEYS][SPL_FMT_TMPL_MAX_RUN];
+};
+
+struct spl_fmt_tmpl {
+    size_t nr_ops;
+    struct spl_fmt_op ops[SPL_FMT_TMPL_MAX_FIELDS];
+    /* The text after the last field */
+    uint16_t tail_off;
+    uint16_t tail_len;
+    /* The most that running the template can write, not counting SPL_FMT_TMPL_SLACK */
+    size_t max_len;
+    size_t nr_runs;
+    struct spl_fmt_run runs[SPL_FMT_TMPL_MAX_RUNS];
+    /* Padded, so the last literal can be copied a whole chunk at a time */
+    char lit[SPL_FMT_TMPL_MAX_LIT + SPL_FMT_TMPL_LIT_CHUNK];
+};
+
+/**
+ * Compile a template. Returns A_E_INVAL (with a message saying why) if it can't be parsed.
+ */
+int spl_fmt_tmpl_compile(struct spl_fmt_tmpl *tmpl, const char *spec);
+
+/**
+ * Format a sample as a line of JSON according to a compiled template. There must be at least
+ * tmpl->max_len + SPL_FMT_TMPL_SLACK bytes of room at p.
+ */
+char *spl_fmt_tmpl_run(char *p, struct spl_fmt_tmpl const *tmpl, struct spl_sample const *sample,
+        const char *serial, size_t serial_len);
+
+/*
+ * InfluxDB line protocol. A device's measurement name and tags never change, so they are
+ * escaped and formatted once, into a prefix; each line is then the prefix, the fields as
+ * integers, and the timestamp in nanoseconds:
+ *
+ *     sound,device=0,serial=0123456 deci_db=626i,fast=1i,dbc=0i,range=0i,ts_err_us=350i 1571404301017000000
+ *
+ * The level is in tenths of a dB, as the meter reports it, so that it stays an integer.
+ * ts_err_us is how far the timestamp could be off, either way, in microseconds.
+ */
+
+/* The most a line can take up, after the prefix */
+#define SPL_FMT_LP_MAX_FIELDS       96
+
+/**
+ * Format the prefix for a device's lines into a newly allocated string. The serial number
+ * tag is left out if there is no serial number.
+ */
+int spl_fmt_lp_prefix(char **pprefix, size_t *pprefix_len, const char *measurement, uint16_t device,
+        const char *serial);
+
+char *spl_fmt_sample_lp(char *p, const char *prefix, size_t prefix_len, struct spl_sample const *sample);
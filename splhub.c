@@ -0,0 +1,320 @@
+/* splhub.c -- USB topology lookup and round trip latency tracking
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splhub.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPL_SYSFS_USB_DEVICES       "/sys/bus/usb/devices"
+#define SPL_SYSFS_HIDRAW            "/sys/class/hidraw"
+
+/**
+ * Whether a sysfs name looks like a USB port path (1-1.4), rather than an interface
+ * (1-1.4:1.0), a root hub (usb1) or anything else
+ */
+static
+bool _is_port_path(const char *name, size_t len)
+{
+    bool seen_dash = false;
+
+    if (0 == len || !isdigit((unsigned char)name[0])) {
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if ('-' == name[i]) {
+            seen_dash = true;
+        } else if ('.' != name[i] && !isdigit((unsigned char)name[i])) {
+            return false;
+        }
+    }
+
+    return seen_dash;
+}
+
+static
+bool _read_sysfs_uint(const char *dir, const char *name, unsigned *pval)
+{
+    bool ret = false;
+
+    char *path = NULL;
+    FILE *fp = NULL;
+
+    if (0 > asprintf(&path, "%s/%s", dir, name)) {
+        return false;
+    }
+
+    if (NULL != (fp = fopen(path, "r"))) {
+        ret = 1 == fscanf(fp, "%u", pval);
+        fclose(fp);
+    }
+
+    free(path);
+
+    return ret;
+}
+
+/**
+ * libusb backend paths are "<bus>:<address>:<interface>", in hex. Find the sysfs device with
+ * that bus number and address.
+ */
+static
+int _port_from_bus_addr(unsigned bus, unsigned addr, char *port, size_t port_len)
+{
+    int ret = A_E_NOTFOUND;
+
+    DIR *dir = NULL;
+    struct dirent *ent = NULL;
+
+    if (NULL == (dir = opendir(SPL_SYSFS_USB_DEVICES))) {
+        goto done;
+    }
+
+    while (NULL != (ent = readdir(dir))) {
+        char *dev_dir = NULL;
+        unsigned dev_bus = 0,
+                 dev_addr = 0;
+        bool match = false;
+
+        if (false == _is_port_path(ent->d_name, strlen(ent->d_name))) {
+            continue;
+        }
+
+        if (0 > asprintf(&dev_dir, "%s/%s", SPL_SYSFS_USB_DEVICES, ent->d_name)) {
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        match = true == _read_sysfs_uint(dev_dir, "busnum", &dev_bus) &&
+                true == _read_sysfs_uint(dev_dir, "devnum", &dev_addr) &&
+                bus == dev_bus && addr == dev_addr;
+
+        free(dev_dir);
+
+        if (true == match) {
+            snprintf(port, port_len, "%s", ent->d_name);
+            ret = A_OK;
+            break;
+        }
+    }
+
+done:
+    if (NULL != dir) {
+        closedir(dir);
+    }
+
+    return ret;
+}
+
+/**
+ * hidraw nodes link back into the device tree; the closest ancestor that's a USB port is
+ * the device we want.
+ */
+static
+int _port_from_hidraw(const char *hid_path, char *port, size_t port_len)
+{
+    int ret = A_E_NOTFOUND;
+
+    const char *node = strrchr(hid_path, '/');
+    char *link = NULL,
+         *real = NULL,
+         *end = NULL;
+
+    node = NULL == node ? hid_path : node + 1;
+
+    if (0 > asprintf(&link, "%s/%s/device", SPL_SYSFS_HIDRAW, node)) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (NULL == (real = realpath(link, NULL))) {
+        goto done;
+    }
+
+    /* Walk up the path a component at a time */
+    end = real + strlen(real);
+    while (end > real) {
+        char *start = end;
+
+        while (start > real && '/' != start[-1]) {
+            start--;
+        }
+
+        if (true == _is_port_path(start, end - start)) {
+            snprintf(port, port_len, "%.*s", (int)(end - start), start);
+            ret = A_OK;
+            break;
+        }
+
+        end = start > real ? start - 1 : real;
+    }
+
+done:
+    free(link);
+    free(real);
+    return ret;
+}
+
+int spl_usb_port_path(const char *hid_path, char *port, size_t port_len)
+{
+    unsigned bus = 0,
+             addr = 0,
+             intf = 0;
+
+    ASSERT_ARG(NULL != hid_path);
+    ASSERT_ARG(NULL != port);
+    ASSERT_ARG(0 != port_len);
+
+    port[0] = '\0';
+
+    if (3 == sscanf(hid_path, "%x:%x:%x", &bus, &addr, &intf)) {
+        return _port_from_bus_addr(bus, addr, port, port_len);
+    }
+
+    return _port_from_hidraw(hid_path, port, port_len);
+}
+
+void spl_usb_hub_name(const char *port, char *hub, size_t hub_len)
+{
+    const char *dot = strrchr(port, '.');
+
+    if (NULL != dot) {
+        /* 1-1.4.2 is on port 2 of the hub at 1-1.4 */
+        snprintf(hub, hub_len, "%.*s", (int)(dot - port), port);
+    } else {
+        /* 1-4 is on port 4 of the root hub of bus 1 */
+        snprintf(hub, hub_len, "usb%u", (unsigned)strtoul(port, NULL, 10));
+    }
+}
+
+static
+int _write_sysfs(const char *dir, const char *name, const char *value)
+{
+    int ret = A_OK;
+
+    char *path = NULL;
+    FILE *fp = NULL;
+
+    if (0 > asprintf(&path, "%s/%s", dir, name)) {
+        path = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (NULL == (fp = fopen(path, "w"))) {
+        SPL_MSG(SEV_WARNING, "SYSFS-WRITE-FAIL", "Could not open %s for writing: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    /* sysfs reports a rejected value when the write is flushed, not when it's buffered */
+    if (0 > fputs(value, fp) || 0 != fflush(fp)) {
+        SPL_MSG(SEV_WARNING, "SYSFS-WRITE-FAIL", "Could not write '%s' to %s: %s", value, path, strerror(errno));
+        ret = A_E_IO;
+    }
+
+done:
+    if (NULL != fp) {
+        fclose(fp);
+    }
+
+    free(path);
+
+    return ret;
+}
+
+int spl_usb_allow_autosuspend(const char *port, unsigned delay_ms)
+{
+    int ret = A_OK;
+
+    char *power_dir = NULL,
+         delay[16];
+
+    ASSERT_ARG(NULL != port);
+
+    if (0 > asprintf(&power_dir, "%s/%s/power", SPL_SYSFS_USB_DEVICES, port)) {
+        power_dir = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    snprintf(delay, sizeof(delay), "%u", delay_ms);
+
+    /* Set the delay first, so the device isn't suspended under us with whatever the old one was */
+    if (FAILED(ret = _write_sysfs(power_dir, "autosuspend_delay_ms", delay))) {
+        goto done;
+    }
+
+    ret = _write_sysfs(power_dir, "control", "auto");
+
+done:
+    free(power_dir);
+    return ret;
+}
+
+void spl_latency_add(struct spl_latency *lat, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned bucket = 0;
+
+    /* Bucket b holds latencies under 2^b microseconds */
+    while (bucket < SPL_LATENCY_BUCKETS - 1 && us >= (1ull << bucket)) {
+        bucket++;
+    }
+
+    lat->buckets[bucket]++;
+    lat->nr++;
+    lat->sum_ns += ns;
+    if (ns > lat->max_ns) {
+        lat->max_ns = ns;
+    }
+}
+
+void spl_latency_merge(struct spl_latency *lat, struct spl_latency const *other)
+{
+    for (size_t i = 0; i < SPL_LATENCY_BUCKETS; i++) {
+        lat->buckets[i] += other->buckets[i];
+    }
+
+    lat->nr += other->nr;
+    lat->sum_ns += other->sum_ns;
+    if (other->max_ns > lat->max_ns) {
+        lat->max_ns = other->max_ns;
+    }
+}
+
+uint64_t spl_latency_quantile(struct spl_latency const *lat, double q)
+{
+    uint64_t target = 0,
+             seen = 0;
+
+    if (0 == lat->nr) {
+        return 0;
+    }
+
+    target = (uint64_t)(q * lat->nr);
+    if (target >= lat->nr) {
+        target = lat->nr - 1;
+    }
+
+    for (unsigned bucket = 0; bucket < SPL_LATENCY_BUCKETS; bucket++) {
+        seen += lat->buckets[bucket];
+        if (seen > target) {
+            uint64_t upper_ns = (1ull << bucket) * 1000;
+            return upper_ns < lat->max_ns ? upper_ns : lat->max_ns;
+        }
+    }
+
+    return lat->max_ns;
+}
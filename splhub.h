@@ -0,0 +1,63 @@
+/* splhub.h -- USB topology lookup and round trip latency tracking
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPL_USB_PORT_LEN            64
+
+/**
+ * Find the USB port path of a device (as sysfs names it, "<bus>-<port>[.<port>...]", e.g.
+ * 1-1.4.2) from the path hidapi reports for it. Both the libusb backend's
+ * "<bus>:<address>:<interface>" paths and the hidraw backend's /dev/hidrawN paths are
+ * understood.
+ */
+int spl_usb_port_path(const char *hid_path, char *port, size_t port_len);
+
+/**
+ * Name the hub a device is plugged into, given its port path. This is the port path of
+ * the hub itself, or usb<bus> for a port on the root hub.
+ */
+void spl_usb_hub_name(const char *port, char *hub, size_t hub_len);
+
+/**
+ * Let the kernel suspend the USB device at the given port path once it's been idle for
+ * delay_ms. It's resumed as soon as anything is sent to it. Needs write access to the
+ * device's power attributes in sysfs, which is normally root's.
+ */
+int spl_usb_allow_autosuspend(const char *port, unsigned delay_ms);
+
+/*
+ * Latencies are kept in a histogram of power-of-two buckets of microseconds, which is
+ * plenty to see a long tail, and cheap enough to update on every poll.
+ */
+#define SPL_LATENCY_BUCKETS         24
+
+struct spl_latency {
+    uint64_t nr;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[SPL_LATENCY_BUCKETS];
+};
+
+void spl_latency_add(struct spl_latency *lat, uint64_t ns);
+
+/**
+ * Add the latencies seen in other to lat
+ */
+void spl_latency_merge(struct spl_latency *lat, struct spl_latency const *other);
+
+/**
+ * Estimate the given quantile (0 to 1) of the latencies seen, to within a factor of two.
+ * Returns the upper bound of the bucket the quantile falls in.
+ */
+uint64_t spl_latency_quantile(struct spl_latency const *lat, double q);
@@ -0,0 +1,997 @@
+/* splimport.c -- Bulk import of splread's JSON output into the sample store
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <gm1356.h>
+#include <splcompact.h>
+#include <splimport.h>
+#include <splstore.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Files are cut into chunks of about this many bytes (each runs on to the end of its last
+ * line). As with export, at most this many parsed chunks per thread are held in memory
+ * waiting for their turn to be written out.
+ */
+#define SPL_IMPORT_CHUNK_LEN            (8ul << 20)
+#define SPL_IMPORT_WINDOW_PER_THREAD    2
+
+/* No sample line is shorter than this, so a chunk never holds more than len / this samples */
+#define SPL_IMPORT_MIN_LINE             64
+
+struct _import_file {
+    uint8_t const *base;
+    size_t len;
+};
+
+struct _import_job {
+    size_t file;
+    size_t off;
+    size_t len;
+};
+
+struct _import_chunk {
+    struct spl_sample *samples;
+    size_t nr_samples;
+    size_t cap;
+    uint64_t nr_skipped;
+    bool done;
+    int ret;
+};
+
+struct _import_ctx {
+    struct spl_import_opts const *opts;
+    struct _import_file *files;
+    struct _import_job *jobs;
+    size_t nr_jobs;
+    size_t cap_jobs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Next chunk to hand out to a parsing thread */
+    size_t next_job;
+    /* Next chunk to be written out */
+    size_t next_write;
+    size_t window;
+    struct _import_chunk *chunks;
+    bool abort;
+};
+
+/*
+ * The raw segment being gathered up, written out whole once a sample from another span
+ * turns up
+ */
+struct _import_seg {
+    const char *dir;
+    int dir_fd;
+    /* UINT64_MAX while there's no segment */
+    uint64_t start_ns;
+    struct spl_sample *recs;
+    size_t nr_recs;
+    size_t cap;
+    /* Whether every sample so far came after the one before it */
+    bool sorted;
+    struct spl_sample *tmp;
+    size_t tmp_cap;
+    /* Start of each day the store already has rollups for, sorted */
+    uint64_t *compacted;
+    size_t nr_compacted;
+    size_t cap_compacted;
+};
+
+/**
+ * Days since the UNIX epoch of a proleptic Gregorian date; the inverse of splfmt.c's
+ * _civil_from_days(), after Howard Hinnant's days_from_civil()
+ */
+static inline
+int64_t _import_days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    int64_t era = 0;
+    unsigned yoe = 0,
+             doy = 0,
+             doe = 0;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned)(y - era * 400);
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+static inline
+bool _import_lit(char const **pp, char const *end, const char *lit, size_t len)
+{
+    if ((size_t)(end - *pp) < len || 0 != memcmp(*pp, lit, len)) {
+        return false;
+    }
+
+    *pp += len;
+
+    return true;
+}
+
+#define _LIT(_pp, _end, _lit)       _import_lit((_pp), (_end), (_lit), sizeof(_lit) - 1)
+
+/**
+ * Take a run of up to max_digits digits (at least one)
+ */
+static inline
+bool _import_uint(char const **pp, char const *end, unsigned max_digits, uint64_t *pv)
+{
+    char const *p = *pp;
+    uint64_t v = 0;
+
+    while (p < end && (unsigned)(p - *pp) < max_digits && *p >= '0' && *p <= '9') {
+        v = v * 10 + (unsigned)(*p++ - '0');
+    }
+
+    if (p == *pp) {
+        return false;
+    }
+
+    *pp = p;
+    *pv = v;
+
+    return true;
+}
+
+/**
+ * Take exactly nr_digits digits, followed by sep (unless sep is '\0')
+ */
+static inline
+bool _import_field(char const **pp, char const *end, unsigned nr_digits, char sep, unsigned *pv)
+{
+    char const *p = *pp;
+    unsigned v = 0;
+
+    if ((size_t)(end - p) < nr_digits + ('\0' != sep)) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < nr_digits; i++, p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        v = v * 10 + (unsigned)(*p - '0');
+    }
+
+    if ('\0' != sep && sep != *p++) {
+        return false;
+    }
+
+    *pp = p;
+    *pv = v;
+
+    return true;
+}
+
+/**
+ * Parse one line (without its newline) into a sample. Returns false if it isn't a sample.
+ */
+static
+bool _import_parse_line(char const *p, char const *end, uint16_t def_device, struct spl_sample *sample)
+{
+    uint64_t v = 0,
+             whole = 0;
+    unsigned year = 0,
+             month = 0,
+             day = 0,
+             hour = 0,
+             min = 0,
+             sec = 0,
+             hundredths = 0;
+    uint8_t flags = 0;
+    char const *q = NULL;
+    bool found = false;
+
+    if (p < end && '\r' == end[-1]) {
+        end--;
+    }
+
+    memset(sample, 0, sizeof(*sample));
+    sample->device = def_device;
+
+    if (true == _LIT(&p, end, "{\"device\":")) {
+        if (false == _import_uint(&p, end, 5, &v) || v > UINT16_MAX) {
+            return false;
+        }
+        sample->device = (uint16_t)v;
+
+        /* splread's output has the serial number next; spltool export's doesn't */
+        if (true == _LIT(&p, end, ",\"serial\":\"")) {
+            /* Serial numbers never have quotes in them */
+            if (NULL == (q = memchr(p, '"', end - p))) {
+                return false;
+            }
+            p = q + 1;
+        }
+
+        if (false == _LIT(&p, end, ",\"measured\":")) {
+            return false;
+        }
+    } else if (false == _LIT(&p, end, "{\"measured\":")) {
+        return false;
+    }
+
+    /* The level, with two decimal places, of which the second is always 0 */
+    if (false == _import_uint(&p, end, 4, &whole) || false == _LIT(&p, end, ".") ||
+            false == _import_field(&p, end, 2, '\0', &hundredths))
+    {
+        return false;
+    }
+    v = whole * 10 + (hundredths + 5) / 10;
+    if (v > UINT16_MAX) {
+        return false;
+    }
+    sample->deci_db = (uint16_t)v;
+
+    if (true == _LIT(&p, end, ",\"mode\":\"fast\",\"freqMode\":\"dB")) {
+        flags |= GM1356_FAST_MODE;
+    } else if (false == _LIT(&p, end, ",\"mode\":\"slow\",\"freqMode\":\"dB")) {
+        return false;
+    }
+
+    if (true == _LIT(&p, end, "C\",\"range\":\"")) {
+        flags |= GM1356_MEASURE_DBC;
+    } else if (false == _LIT(&p, end, "A\",\"range\":\"")) {
+        return false;
+    }
+
+    for (uint8_t r = GM1356_RANGE_30_130_DB; r <= GM1356_RANGE_80_130_DB + 1 && false == found; r++) {
+        const char *name = gm1356_range_name(r);
+
+        if (true == _import_lit(&p, end, name, strlen(name))) {
+            flags |= r > GM1356_RANGE_80_130_DB ? GM1356_FLAGS_RANGE_MASK : r;
+            found = true;
+        }
+    }
+
+    if (false == found || false == _LIT(&p, end, "\",\"timestamp\":\"") ||
+            false == _import_field(&p, end, 4, '-', &year) ||
+            false == _import_field(&p, end, 2, '-', &month) ||
+            false == _import_field(&p, end, 2, ' ', &day) ||
+            false == _import_field(&p, end, 2, ':', &hour) ||
+            false == _import_field(&p, end, 2, ':', &min) ||
+            false == _import_field(&p, end, 2, '\0', &sec) ||
+            false == _LIT(&p, end, " UTC\""))
+    {
+        return false;
+    }
+
+    if (year < 1970 || 0 == month || month > 12 || 0 == day || day > 31 || hour > 23 || min > 59 || sec > 60) {
+        return false;
+    }
+
+    sample->ts_ns = ((uint64_t)_import_days_from_civil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec) *
+        SPL_NS_PER_SEC;
+    sample->flags = flags;
+
+    if (true == _LIT(&p, end, ",\"timestampErrorUs\":")) {
+        if (false == _import_uint(&p, end, 5, &v) || v > UINT16_MAX) {
+            return false;
+        }
+        sample->ts_err_us = (uint16_t)v;
+    }
+
+    return true == _LIT(&p, end, "}") && p == end;
+}
+
+/**
+ * Parse every line of a chunk
+ */
+static
+int _import_parse_chunk(struct spl_import_opts const *opts, char const *buf, size_t len, struct _import_chunk *chunk)
+{
+    int ret = A_OK;
+
+    char const *p = buf,
+               *end = buf + len;
+    size_t need = len / SPL_IMPORT_MIN_LINE + 1;
+
+    if (chunk->cap < need) {
+        struct spl_sample *samples = realloc(chunk->samples, need * sizeof(struct spl_sample));
+
+        if (NULL == samples) {
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        chunk->samples = samples;
+        chunk->cap = need;
+    }
+
+    while (p < end) {
+        /* glibc's memchr() looks at a vector's worth of the line at a time */
+        char const *eol = memchr(p, '\n', end - p);
+
+        if (NULL == eol) {
+            eol = end;
+        }
+
+        if (eol > p) {
+            if (true == _import_parse_line(p, eol, opts->device, &chunk->samples[chunk->nr_samples])) {
+                chunk->nr_samples++;
+            } else {
+                chunk->nr_skipped++;
+            }
+        }
+
+        p = eol + 1;
+    }
+
+done:
+    return ret;
+}
+
+static
+void *_import_worker(void *arg)
+{
+    struct _import_ctx *ctx = arg;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    for (;;) {
+        size_t job = 0;
+        struct _import_chunk *chunk = NULL;
+        struct _import_job const *j = NULL;
+        int ret = A_OK;
+
+        /* Don't run too far ahead of the writer, or we'd hold the whole archive in memory */
+        while (false == ctx->abort && ctx->next_job < ctx->nr_jobs && ctx->next_job >= ctx->next_write + ctx->window) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+
+        if (true == ctx->abort || ctx->next_job >= ctx->nr_jobs) {
+            break;
+        }
+
+        job = ctx->next_job++;
+        chunk = &ctx->chunks[job % ctx->window];
+        j = &ctx->jobs[job];
+
+        pthread_mutex_unlock(&ctx->lock);
+        ret = _import_parse_chunk(ctx->opts, (char const *)ctx->files[j->file].base + j->off, j->len, chunk);
+        pthread_mutex_lock(&ctx->lock);
+
+        chunk->ret = ret;
+        chunk->done = true;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+/**
+ * Cut a mapped file into chunks, each ending at the end of a line
+ */
+static
+int _import_add_jobs(struct _import_ctx *ctx, size_t file)
+{
+    struct _import_file const *f = &ctx->files[file];
+    size_t off = 0;
+
+    while (off < f->len) {
+        size_t end = off + SPL_IMPORT_CHUNK_LEN;
+
+        if (end >= f->len) {
+            end = f->len;
+        } else {
+            uint8_t const *nl = memchr(f->base + end, '\n', f->len - end);
+            end = NULL == nl ? f->len : (size_t)(nl - f->base) + 1;
+        }
+
+        if (ctx->nr_jobs == ctx->cap_jobs) {
+            size_t new_cap = 0 == ctx->cap_jobs ? 64 : ctx->cap_jobs * 2;
+            struct _import_job *new_jobs = realloc(ctx->jobs, new_cap * sizeof(struct _import_job));
+
+            if (NULL == new_jobs) {
+                return A_E_NOMEM;
+            }
+
+            ctx->jobs = new_jobs;
+            ctx->cap_jobs = new_cap;
+        }
+
+        ctx->jobs[ctx->nr_jobs].file = file;
+        ctx->jobs[ctx->nr_jobs].off = off;
+        ctx->jobs[ctx->nr_jobs].len = end - off;
+        ctx->nr_jobs++;
+
+        off = end;
+    }
+
+    return A_OK;
+}
+
+static
+int _import_map_file(const char *path, struct _import_file *f)
+{
+    int ret = A_OK;
+
+    int fd = -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (0 > (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+        SPL_MSG(SEV_ERROR, "IMPORT-OPEN-FAIL", "Failed to open %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (0 > fstat(fd, &st)) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (0 == st.st_size) {
+        goto done;
+    }
+
+    if (MAP_FAILED == (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) {
+        SPL_MSG(SEV_ERROR, "IMPORT-MAP-FAIL", "Failed to map %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    f->base = map;
+    f->len = st.st_size;
+
+done:
+    if (-1 != fd) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+/**
+ * A stable merge sort by time of nr of the segment's samples, from first, so samples from the
+ * same second stay in the order they were printed in
+ */
+static
+int _import_seg_sort(struct _import_seg *seg, size_t first, size_t nr)
+{
+    struct spl_sample *src = &seg->recs[first],
+                      *dst = NULL;
+
+    if (seg->tmp_cap < nr) {
+        struct spl_sample *tmp = realloc(seg->tmp, seg->cap * sizeof(struct spl_sample));
+
+        if (NULL == tmp) {
+            return A_E_NOMEM;
+        }
+
+        seg->tmp = tmp;
+        seg->tmp_cap = seg->cap;
+    }
+
+    dst = seg->tmp;
+
+    for (size_t width = 1; width < nr; width *= 2) {
+        struct spl_sample *swap = NULL;
+
+        for (size_t lo = 0; lo < nr; lo += 2 * width) {
+            size_t mid = lo + width < nr ? lo + width : nr,
+                   hi = lo + 2 * width < nr ? lo + 2 * width : nr,
+                   i = lo,
+                   j = mid,
+                   k = lo;
+
+            while (i < mid && j < hi) {
+                dst[k++] = src[j].ts_ns < src[i].ts_ns ? src[j++] : src[i++];
+            }
+            while (i < mid) {
+                dst[k++] = src[i++];
+            }
+            while (j < hi) {
+                dst[k++] = src[j++];
+            }
+        }
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != &seg->recs[first]) {
+        memcpy(&seg->recs[first], src, nr * sizeof(struct spl_sample));
+    }
+
+    return A_OK;
+}
+
+static inline
+bool _import_same_sample(struct spl_sample const *stored, struct spl_sample const *imported)
+{
+    return stored->ts_ns / SPL_NS_PER_SEC == imported->ts_ns / SPL_NS_PER_SEC &&
+        stored->device == imported->device &&
+        stored->deci_db == imported->deci_db &&
+        stored->flags == imported->flags;
+}
+
+/**
+ * Drop the imported samples (those after the first nr_stored, both sorted by time) that are
+ * already in the store. Each stored sample accounts for at most one imported one, so a second
+ * that really did have the same reading twice keeps both.
+ */
+static
+int _import_seg_dedup(struct _import_seg *seg, size_t nr_stored, struct spl_import_stats *stats)
+{
+    int ret = A_OK;
+
+    bool *taken = NULL;
+    size_t sec_first = 0,
+           nr_kept = nr_stored;
+
+    if (NULL == (taken = calloc(nr_stored + 1, sizeof(bool)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    for (size_t i = nr_stored; i < seg->nr_recs; i++) {
+        struct spl_sample const *sample = &seg->recs[i];
+        uint64_t sec = sample->ts_ns / SPL_NS_PER_SEC;
+        bool dup = false;
+
+        /* Only a handful of samples share a second, so just look through all of them */
+        while (sec_first < nr_stored && seg->recs[sec_first].ts_ns / SPL_NS_PER_SEC < sec) {
+            sec_first++;
+        }
+
+        for (size_t j = sec_first; j < nr_stored && seg->recs[j].ts_ns / SPL_NS_PER_SEC == sec; j++) {
+            if (false == taken[j] && true == _import_same_sample(&seg->recs[j], sample)) {
+                taken[j] = true;
+                dup = true;
+                break;
+            }
+        }
+
+        if (true == dup) {
+            stats->nr_dups++;
+        } else {
+            seg->recs[nr_kept++] = *sample;
+        }
+    }
+
+    seg->nr_recs = nr_kept;
+
+done:
+    free(taken);
+    return ret;
+}
+
+static
+int _import_seg_reserve(struct _import_seg *seg, size_t nr)
+{
+    if (seg->cap - seg->nr_recs < nr) {
+        size_t new_cap = 0 == seg->cap ? 4096 : seg->cap;
+        struct spl_sample *recs = NULL;
+
+        while (new_cap - seg->nr_recs < nr) {
+            new_cap *= 2;
+        }
+
+        if (NULL == (recs = realloc(seg->recs, new_cap * sizeof(struct spl_sample)))) {
+            return A_E_NOMEM;
+        }
+
+        seg->recs = recs;
+        seg->cap = new_cap;
+    }
+
+    return A_OK;
+}
+
+/**
+ * Put whatever was already in the store for this segment ahead of the samples we're adding,
+ * leaving out the ones it already has
+ */
+static
+int _import_seg_merge(struct _import_seg *seg, const char *name, size_t *pnr_stored, struct spl_import_stats *stats)
+{
+    int ret = A_OK;
+
+    struct spl_seg_map map;
+    char *path = NULL;
+    void const *recs = NULL;
+    size_t off = 0,
+           nr_recs = 0,
+           pos = 0;
+
+    memset(&map, 0, sizeof(map));
+
+    if (0 > asprintf(&path, "%s/%s", seg->dir, name)) {
+        path = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (FAILED(spl_seg_map(&map, path))) {
+        SPL_MSG(SEV_ERROR, "IMPORT-MERGE-FAIL", "Segment %s is already in the store, but can't be read; not "
+                "replacing it", path);
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (SPL_SEG_KIND_RAW != map.hdr->kind || sizeof(struct spl_sample) != map.hdr->rec_size) {
+        SPL_MSG(SEV_ERROR, "IMPORT-MERGE-FAIL", "Segment %s isn't a raw segment, not replacing it", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (FAILED(ret = _import_seg_reserve(seg, map.nr_recs))) {
+        goto done;
+    }
+
+    memmove(&seg->recs[map.nr_recs], seg->recs, seg->nr_recs * sizeof(struct spl_sample));
+    seg->nr_recs += map.nr_recs;
+
+    while (true == spl_seg_next_batch(&map, &off, &recs, &nr_recs)) {
+        memcpy(&seg->recs[pos], recs, nr_recs * sizeof(struct spl_sample));
+        pos += nr_recs;
+    }
+
+    if (FAILED(ret = _import_seg_sort(seg, 0, map.nr_recs)) ||
+            (false == seg->sorted && FAILED(ret = _import_seg_sort(seg, map.nr_recs, seg->nr_recs - map.nr_recs))) ||
+            FAILED(ret = _import_seg_dedup(seg, map.nr_recs, stats)))
+    {
+        goto done;
+    }
+
+    *pnr_stored = map.nr_recs;
+    seg->sorted = false;
+
+done:
+    spl_seg_unmap(&map);
+    free(path);
+    return ret;
+}
+
+static
+int _import_u64_cmp(void const *a, void const *b)
+{
+    uint64_t va = *(uint64_t const *)a,
+             vb = *(uint64_t const *)b;
+
+    return va < vb ? -1 : va > vb;
+}
+
+static
+int _import_note_compacted(const char *path, void *arg)
+{
+    struct _import_seg *seg = arg;
+    const char *name = strrchr(path, '/'),
+               *dash = NULL;
+
+    name = NULL == name ? path : name + 1;
+
+    /* Only rollup segments, r<resolution>-<start>.seg */
+    if ('r' != name[0] || name[1] < '0' || name[1] > '9' || NULL == (dash = strchr(name, '-'))) {
+        return A_OK;
+    }
+
+    if (seg->nr_compacted == seg->cap_compacted) {
+        size_t new_cap = 0 == seg->cap_compacted ? 64 : seg->cap_compacted * 2;
+        uint64_t *new_compacted = realloc(seg->compacted, new_cap * sizeof(uint64_t));
+
+        if (NULL == new_compacted) {
+            return A_E_NOMEM;
+        }
+
+        seg->compacted = new_compacted;
+        seg->cap_compacted = new_cap;
+    }
+
+    seg->compacted[seg->nr_compacted++] = strtoull(dash + 1, NULL, 10) * SPL_NS_PER_SEC;
+
+    return A_OK;
+}
+
+static
+int _import_seg_flush(struct _import_seg *seg, struct spl_import_stats *stats)
+{
+    int ret = A_OK;
+
+    char name[SPL_SEG_NAME_LEN];
+    size_t nr_stored = 0;
+    struct spl_seg_header hdr = {
+        .magic = SPL_SEG_MAGIC,
+        .version = SPL_SEG_VERSION,
+        .rec_size = sizeof(struct spl_sample),
+        .kind = SPL_SEG_KIND_RAW,
+        .start_ns = seg->start_ns,
+        .span_ns = SPL_SEG_RAW_SPAN_SEC * SPL_NS_PER_SEC,
+    };
+    uint64_t day_ns = seg->start_ns - seg->start_ns % (SPL_ROLLUP_SPAN_SEC * SPL_NS_PER_SEC);
+    int seg_fd = -1;
+    struct stat st;
+    bool written = false;
+
+    if (0 == seg->nr_recs) {
+        goto done;
+    }
+
+    snprintf(name, sizeof(name), "raw-%012llu.seg", (unsigned long long)(seg->start_ns / SPL_NS_PER_SEC));
+
+    /*
+     * Once a day has been compacted, its raw samples are gone, so there's nothing to check
+     * these against, and nothing would roll them up into what's there
+     */
+    if (NULL != bsearch(&day_ns, seg->compacted, seg->nr_compacted, sizeof(uint64_t), _import_u64_cmp)) {
+        SPL_MSG(SEV_WARNING, "IMPORT-COMPACTED", "Not importing %zu samples for %s: that day has already been "
+                "compacted into rollups", seg->nr_recs, name);
+        stats->nr_refused += seg->nr_recs;
+        goto done;
+    }
+
+    /*
+     * Lock the segment (creating it, if need be) so splread can't start appending to a file
+     * we're about to replace; if it already is, leave this hour be
+     */
+    if (0 > (seg_fd = openat(seg->dir_fd, name, O_RDONLY | O_CREAT | O_CLOEXEC, 0644)) || 0 > fstat(seg_fd, &st)) {
+        SPL_MSG(SEV_ERROR, "IMPORT-OPEN-FAIL", "Failed to open %s/%s: %s", seg->dir, name, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (0 > flock(seg_fd, LOCK_EX | LOCK_NB)) {
+        SPL_MSG(SEV_WARNING, "IMPORT-BUSY", "Not importing %zu samples for %s: splread is recording to it; import "
+                "them again once that hour is over", seg->nr_recs, name);
+        stats->nr_refused += seg->nr_recs;
+        goto done;
+    }
+
+    if (0 != st.st_size) {
+        if (FAILED(ret = _import_seg_merge(seg, name, &nr_stored, stats))) {
+            goto done;
+        }
+
+        /* The store already had every one of them, so leave the segment be */
+        if (nr_stored == seg->nr_recs) {
+            written = true;
+            goto done;
+        }
+
+        stats->nr_merged++;
+    }
+
+    if (false == seg->sorted && FAILED(ret = _import_seg_sort(seg, 0, seg->nr_recs))) {
+        goto done;
+    }
+
+    if (FAILED(ret = spl_seg_write_atomic_at(seg->dir_fd, name, &hdr, seg->recs, seg->nr_recs))) {
+        goto done;
+    }
+
+    written = true;
+    stats->nr_segments++;
+
+done:
+    if (-1 != seg_fd) {
+        /* Don't leave behind the empty file we locked, if nothing replaced it */
+        if (false == written && 0 == st.st_size && 0 == flock(seg_fd, LOCK_EX | LOCK_NB)) {
+            unlinkat(seg->dir_fd, name, 0);
+        }
+        close(seg_fd);
+    }
+
+    seg->nr_recs = 0;
+    seg->sorted = true;
+    return ret;
+}
+
+static
+int _import_seg_add(struct _import_seg *seg, struct spl_sample const *samples, size_t nr_samples,
+        struct spl_import_stats *stats)
+{
+    int ret = A_OK;
+
+    uint64_t span_ns = SPL_SEG_RAW_SPAN_SEC * SPL_NS_PER_SEC;
+
+    for (size_t i = 0; i < nr_samples; i++) {
+        struct spl_sample const *sample = &samples[i];
+
+        if (sample->ts_ns < seg->start_ns || sample->ts_ns - seg->start_ns >= span_ns) {
+            if (FAILED(ret = _import_seg_flush(seg, stats))) {
+                goto done;
+            }
+            seg->start_ns = sample->ts_ns - sample->ts_ns % span_ns;
+        }
+
+        if (FAILED(ret = _import_seg_reserve(seg, 1))) {
+            goto done;
+        }
+
+        if (0 != seg->nr_recs && sample->ts_ns < seg->recs[seg->nr_recs - 1].ts_ns) {
+            seg->sorted = false;
+        }
+
+        seg->recs[seg->nr_recs++] = *sample;
+    }
+
+done:
+    return ret;
+}
+
+int spl_import(struct spl_import_opts const *opts, struct spl_import_stats *stats)
+{
+    int ret = A_OK;
+
+    struct _import_ctx ctx = { .opts = opts };
+    struct _import_seg seg = {
+        .dir = opts->dir,
+        .dir_fd = -1,
+        .start_ns = UINT64_MAX,
+        .sorted = true,
+    };
+    pthread_t *threads = NULL;
+    size_t nr_threads = 0;
+
+    ASSERT_ARG(NULL != opts);
+    ASSERT_ARG(NULL != opts->dir);
+    ASSERT_ARG(NULL != opts->paths || 0 == opts->nr_paths);
+    ASSERT_ARG(NULL != stats);
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    if (0 > mkdir(opts->dir, 0755) && EEXIST != errno) {
+        SPL_MSG(SEV_ERROR, "STORE-MKDIR-FAIL", "Failed to create store directory %s: %s", opts->dir, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (0 > (seg.dir_fd = open(opts->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+        SPL_MSG(SEV_ERROR, "STORE-OPEN-FAIL", "Failed to open store directory %s: %s", opts->dir, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (FAILED(ret = spl_store_for_each_segment(opts->dir, "r", 0, 0, _import_note_compacted, &seg))) {
+        goto done;
+    }
+    qsort(seg.compacted, seg.nr_compacted, sizeof(uint64_t), _import_u64_cmp);
+
+    if (NULL == (ctx.files = calloc(opts->nr_paths + 1, sizeof(struct _import_file)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < opts->nr_paths; i++) {
+        if (FAILED(ret = _import_map_file(opts->paths[i], &ctx.files[i])) ||
+                FAILED(ret = _import_add_jobs(&ctx, i)))
+        {
+            goto done;
+        }
+    }
+
+    ctx.window = (0 == opts->nr_threads ? 1 : opts->nr_threads) * SPL_IMPORT_WINDOW_PER_THREAD;
+
+    if (NULL == (ctx.chunks = calloc(ctx.window, sizeof(struct _import_chunk)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (opts->nr_threads > 1) {
+        if (NULL == (threads = calloc(opts->nr_threads, sizeof(pthread_t)))) {
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        for (nr_threads = 0; nr_threads < opts->nr_threads; nr_threads++) {
+            if (0 != pthread_create(&threads[nr_threads], NULL, _import_worker, &ctx)) {
+                break;
+            }
+        }
+
+        if (0 == nr_threads) {
+            SPL_MSG(SEV_ERROR, "IMPORT-THREAD-FAIL", "Could not start any import threads");
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+    /* Write out the samples strictly in file order, as chunks are finished */
+    for (size_t i = 0; i < ctx.nr_jobs; i++) {
+        struct _import_chunk *chunk = &ctx.chunks[i % ctx.window];
+        struct _import_job const *job = &ctx.jobs[i];
+
+        if (0 == nr_threads) {
+            chunk->ret = _import_parse_chunk(opts, (char const *)ctx.files[job->file].base + job->off, job->len,
+                    chunk);
+        } else {
+            pthread_mutex_lock(&ctx.lock);
+            while (false == chunk->done) {
+                pthread_cond_wait(&ctx.cond, &ctx.lock);
+            }
+            pthread_mutex_unlock(&ctx.lock);
+        }
+
+        if (FAILED(ret = chunk->ret) || FAILED(ret = _import_seg_add(&seg, chunk->samples, chunk->nr_samples, stats))) {
+            goto done;
+        }
+
+        stats->nr_bytes += job->len;
+        stats->nr_samples += chunk->nr_samples;
+        stats->nr_skipped += chunk->nr_skipped;
+
+        /* Keep the buffer around for the next chunk that lands in this slot */
+        chunk->nr_samples = 0;
+        chunk->nr_skipped = 0;
+
+        if (0 != nr_threads) {
+            pthread_mutex_lock(&ctx.lock);
+            chunk->done = false;
+            ctx.next_write = i + 1;
+            pthread_cond_broadcast(&ctx.cond);
+            pthread_mutex_unlock(&ctx.lock);
+        }
+    }
+
+    ret = _import_seg_flush(&seg, stats);
+
+done:
+    if (0 != nr_threads) {
+        pthread_mutex_lock(&ctx.lock);
+        ctx.abort = true;
+        pthread_cond_broadcast(&ctx.cond);
+        pthread_mutex_unlock(&ctx.lock);
+
+        for (size_t i = 0; i < nr_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+
+    free(threads);
+
+    if (NULL != ctx.chunks) {
+        for (size_t i = 0; i < ctx.window; i++) {
+            free(ctx.chunks[i].samples);
+        }
+        free(ctx.chunks);
+    }
+
+    if (NULL != ctx.files) {
+        for (size_t i = 0; i < opts->nr_paths; i++) {
+            if (NULL != ctx.files[i].base) {
+                munmap((void *)ctx.files[i].base, ctx.files[i].len);
+            }
+        }
+        free(ctx.files);
+    }
+    free(ctx.jobs);
+
+    free(seg.recs);
+    free(seg.tmp);
+    free(seg.compacted);
+    if (-1 != seg.dir_fd) {
+        close(seg.dir_fd);
+    }
+
+    return ret;
+}
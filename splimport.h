@@ -0,0 +1,67 @@
+/* splimport.h -- Bulk import of splread's JSON output into the sample store
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Archives are files of JSON Lines exactly as splread prints them with its default output
+ * templates (and as spltool export -f jsonl writes them):
+ *
+ *     {"measured":62.60,"mode":"fast","freqMode":"dBA","range":"30-130","timestamp":"2019-10-18 13:11:41 UTC"}
+ *
+ * optionally starting with "device" and "serial", and ending with "timestampErrorUs", as they
+ * do with several meters. Nothing else is understood: this is not a JSON parser, it only
+ * matches that one shape, so anything else on a line (alerts, plugin records, lines cut off
+ * when splread was killed) is skipped and counted.
+ *
+ * Each file is mapped and cut into chunks on line boundaries, which are parsed in parallel,
+ * and the samples are written to raw segments in file order, a whole segment at a time. A
+ * segment that's already in the store has the imported samples merged into it, so archives
+ * can be imported in any order, and into a store splread has been recording to. Imported
+ * samples the store already has (the same device, second, level and flags) are dropped, so
+ * an import that failed part way can just be run again.
+ *
+ * Two kinds of samples are refused, and counted: those for an hour splread is recording to
+ * right now (it holds a lock on that segment), and those for a day that has already been
+ * compacted into rollups, whose raw samples are gone.
+ */
+struct spl_import_opts {
+    /* Store directory to import into; created if need be */
+    const char *dir;
+    /* The archives */
+    char *const *paths;
+    size_t nr_paths;
+    /* Device index for samples whose lines don't give one */
+    uint16_t device;
+    /* Number of threads parsing chunks in parallel */
+    unsigned nr_threads;
+};
+
+struct spl_import_stats {
+    uint64_t nr_bytes;
+    uint64_t nr_samples;
+    /* Lines that weren't samples */
+    uint64_t nr_skipped;
+    uint64_t nr_segments;
+    /* Segments that were already in the store, and were merged into */
+    uint64_t nr_merged;
+    /* Samples that were already in the store */
+    uint64_t nr_dups;
+    /*
+     * Samples left out because their day has been compacted already, or their hour is being
+     * recorded to
+     */
+    uint64_t nr_refused;
+};
+
+int spl_import(struct spl_import_opts const *opts, struct spl_import_stats *stats);
@@ -0,0 +1,400 @@
+/* splkern.c -- Batch aggregation kernels over arrays of deci-dB levels
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splkern.h>
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPL_KERN_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SPL_KERN_NEON
+#endif
+
+double spl_kern_energy_tab[SPL_KERN_MAX_DDB + 1];
+
+struct spl_kern_ops const *spl_kern = NULL;
+
+uint16_t spl_kern_energy_to_ddb(double energy)
+{
+    if (energy <= 1.0) {
+        return 0;
+    }
+
+    return (uint16_t)lround(100.0 * log10(energy));
+}
+
+/*
+ * Scalar reference implementation. Everything else is checked against this.
+ */
+static
+double _scalar_energy_sum(uint16_t const *ddb, size_t nr)
+{
+    double sum = 0.0;
+
+    for (size_t i = 0; i < nr; i++) {
+        sum += spl_kern_energy(ddb[i]);
+    }
+
+    return sum;
+}
+
+static
+void _scalar_to_energy(uint16_t const *ddb, double *energy, size_t nr)
+{
+    for (size_t i = 0; i < nr; i++) {
+        energy[i] = spl_kern_energy(ddb[i]);
+    }
+}
+
+static
+void _scalar_minmax(uint16_t const *ddb, size_t nr, uint16_t *pmin, uint16_t *pmax)
+{
+    uint16_t lo = UINT16_MAX,
+             hi = 0;
+
+    for (size_t i = 0; i < nr; i++) {
+        if (ddb[i] < lo) lo = ddb[i];
+        if (ddb[i] > hi) hi = ddb[i];
+    }
+
+    *pmin = lo;
+    *pmax = hi;
+}
+
+static
+void _scalar_histogram(uint16_t const *ddb, size_t nr, uint32_t *bins, size_t nr_bins)
+{
+    size_t last = nr_bins - 1;
+
+    for (size_t i = 0; i < nr; i++) {
+        bins[ddb[i] < last ? ddb[i] : last]++;
+    }
+}
+
+/*
+ * Histograms don't vectorize in any useful way (there's no conflict-free scatter-increment
+ * short of AVX-512CD), but consecutive samples of a slowly varying level land in the same
+ * bin, and the read-modify-write chain through that bin is what limits the scalar loop.
+ * Spreading consecutive samples over four sub-histograms breaks that chain. Used by all of
+ * the SIMD implementations.
+ */
+static
+void _unrolled_histogram(uint16_t const *ddb, size_t nr, uint32_t *bins, size_t nr_bins)
+{
+    static _Thread_local uint32_t sub[3][SPL_KERN_MAX_DDB + 1];
+    size_t last = nr_bins - 1,
+           i = 0;
+
+    /* Merging the sub-histograms costs a pass over the bins, so only bother for big batches */
+    if (nr_bins > SPL_KERN_MAX_DDB + 1 || nr < 4 * nr_bins) {
+        _scalar_histogram(ddb, nr, bins, nr_bins);
+        return;
+    }
+
+    for (size_t s = 0; s < 3; s++) {
+        memset(sub[s], 0, sizeof(sub[s][0]) * nr_bins);
+    }
+
+    for (i = 0; i + 4 <= nr; i += 4) {
+        bins[ddb[i] < last ? ddb[i] : last]++;
+        sub[0][ddb[i + 1] < last ? ddb[i + 1] : last]++;
+        sub[1][ddb[i + 2] < last ? ddb[i + 2] : last]++;
+        sub[2][ddb[i + 3] < last ? ddb[i + 3] : last]++;
+    }
+
+    for (; i < nr; i++) {
+        bins[ddb[i] < last ? ddb[i] : last]++;
+    }
+
+    for (size_t b = 0; b < nr_bins; b++) {
+        bins[b] += sub[0][b] + sub[1][b] + sub[2][b];
+    }
+}
+
+static
+const struct spl_kern_ops spl_kern_scalar = {
+    .name = "scalar",
+    .energy_sum = _scalar_energy_sum,
+    .to_energy = _scalar_to_energy,
+    .minmax = _scalar_minmax,
+    .histogram = _scalar_histogram,
+};
+
+#ifdef SPL_KERN_X86
+/*
+ * SSE4.1: min/max 8 levels at a time. There's no gather, so the energy conversion stays a
+ * table lookup per level, but we keep two independent accumulators going.
+ */
+__attribute__((target("sse4.1")))
+static
+double _sse41_energy_sum(uint16_t const *ddb, size_t nr)
+{
+    __m128d acc0 = _mm_setzero_pd(),
+            acc1 = _mm_setzero_pd();
+    double sum = 0.0;
+    size_t i = 0;
+
+    for (i = 0; i + 4 <= nr; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_set_pd(spl_kern_energy(ddb[i + 1]), spl_kern_energy(ddb[i])));
+        acc1 = _mm_add_pd(acc1, _mm_set_pd(spl_kern_energy(ddb[i + 3]), spl_kern_energy(ddb[i + 2])));
+    }
+
+    acc0 = _mm_add_pd(acc0, acc1);
+    sum = _mm_cvtsd_f64(acc0) + _mm_cvtsd_f64(_mm_unpackhi_pd(acc0, acc0));
+
+    for (; i < nr; i++) {
+        sum += spl_kern_energy(ddb[i]);
+    }
+
+    return sum;
+}
+
+__attribute__((target("sse4.1")))
+static
+void _sse41_minmax(uint16_t const *ddb, size_t nr, uint16_t *pmin, uint16_t *pmax)
+{
+    __m128i vlo = _mm_set1_epi16((short)UINT16_MAX),
+            vhi = _mm_setzero_si128();
+    uint16_t lo = UINT16_MAX,
+             hi = 0;
+    size_t i = 0;
+
+    for (i = 0; i + 8 <= nr; i += 8) {
+        __m128i v = _mm_loadu_si128((__m128i const *)&ddb[i]);
+        vlo = _mm_min_epu16(vlo, v);
+        vhi = _mm_max_epu16(vhi, v);
+    }
+
+    /* minpos gives us the horizontal minimum directly; for the max, minimize the complement */
+    lo = (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(vlo));
+    hi = (uint16_t)~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(vhi, _mm_set1_epi16(-1))));
+
+    for (; i < nr; i++) {
+        if (ddb[i] < lo) lo = ddb[i];
+        if (ddb[i] > hi) hi = ddb[i];
+    }
+
+    *pmin = lo;
+    *pmax = hi;
+}
+
+static
+const struct spl_kern_ops spl_kern_sse41 = {
+    .name = "sse4.1",
+    .energy_sum = _sse41_energy_sum,
+    .to_energy = _scalar_to_energy,
+    .minmax = _sse41_minmax,
+    .histogram = _unrolled_histogram,
+};
+
+/*
+ * AVX2: widen 4 levels to 32-bit indices, clamp, and gather their energies from the table
+ * in one instruction. Two accumulators to hide the add latency.
+ */
+__attribute__((target("avx2")))
+static inline
+__m256d _avx2_gather_energy(uint16_t const *ddb)
+{
+    __m128i idx = _mm_cvtepu16_epi32(_mm_loadl_epi64((__m128i const *)ddb));
+    idx = _mm_min_epu32(idx, _mm_set1_epi32(SPL_KERN_MAX_DDB));
+    return _mm256_i32gather_pd(spl_kern_energy_tab, idx, 8);
+}
+
+__attribute__((target("avx2")))
+static
+double _avx2_energy_sum(uint16_t const *ddb, size_t nr)
+{
+    __m256d acc0 = _mm256_setzero_pd(),
+            acc1 = _mm256_setzero_pd();
+    __m128d half;
+    double sum = 0.0;
+    size_t i = 0;
+
+    for (i = 0; i + 8 <= nr; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _avx2_gather_energy(&ddb[i]));
+        acc1 = _mm256_add_pd(acc1, _avx2_gather_energy(&ddb[i + 4]));
+    }
+
+    acc0 = _mm256_add_pd(acc0, acc1);
+    half = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+    sum = _mm_cvtsd_f64(half) + _mm_cvtsd_f64(_mm_unpackhi_pd(half, half));
+
+    for (; i < nr; i++) {
+        sum += spl_kern_energy(ddb[i]);
+    }
+
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static
+void _avx2_to_energy(uint16_t const *ddb, double *energy, size_t nr)
+{
+    size_t i = 0;
+
+    for (i = 0; i + 4 <= nr; i += 4) {
+        _mm256_storeu_pd(&energy[i], _avx2_gather_energy(&ddb[i]));
+    }
+
+    for (; i < nr; i++) {
+        energy[i] = spl_kern_energy(ddb[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static
+void _avx2_minmax(uint16_t const *ddb, size_t nr, uint16_t *pmin, uint16_t *pmax)
+{
+    __m256i vlo = _mm256_set1_epi16((short)UINT16_MAX),
+            vhi = _mm256_setzero_si256();
+    __m128i lo128,
+            hi128;
+    uint16_t lo = UINT16_MAX,
+             hi = 0;
+    size_t i = 0;
+
+    for (i = 0; i + 16 <= nr; i += 16) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)&ddb[i]);
+        vlo = _mm256_min_epu16(vlo, v);
+        vhi = _mm256_max_epu16(vhi, v);
+    }
+
+    lo128 = _mm_min_epu16(_mm256_castsi256_si128(vlo), _mm256_extracti128_si256(vlo, 1));
+    hi128 = _mm_max_epu16(_mm256_castsi256_si128(vhi), _mm256_extracti128_si256(vhi, 1));
+    lo = (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(lo128));
+    hi = (uint16_t)~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(hi128, _mm_set1_epi16(-1))));
+
+    for (; i < nr; i++) {
+        if (ddb[i] < lo) lo = ddb[i];
+        if (ddb[i] > hi) hi = ddb[i];
+    }
+
+    *pmin = lo;
+    *pmax = hi;
+}
+
+static
+const struct spl_kern_ops spl_kern_avx2 = {
+    .name = "avx2",
+    .energy_sum = _avx2_energy_sum,
+    .to_energy = _avx2_to_energy,
+    .minmax = _avx2_minmax,
+    .histogram = _unrolled_histogram,
+};
+#endif /* SPL_KERN_X86 */
+
+#ifdef SPL_KERN_NEON
+/*
+ * NEON is part of the ARMv8 baseline, so no runtime check is needed. No gather here either;
+ * the win is in min/max over 8 levels at a time.
+ */
+static
+double _neon_energy_sum(uint16_t const *ddb, size_t nr)
+{
+    float64x2_t acc0 = vdupq_n_f64(0.0),
+                acc1 = vdupq_n_f64(0.0);
+    double sum = 0.0;
+    size_t i = 0;
+
+    for (i = 0; i + 4 <= nr; i += 4) {
+        double e0[2] = { spl_kern_energy(ddb[i]), spl_kern_energy(ddb[i + 1]) },
+               e1[2] = { spl_kern_energy(ddb[i + 2]), spl_kern_energy(ddb[i + 3]) };
+        acc0 = vaddq_f64(acc0, vld1q_f64(e0));
+        acc1 = vaddq_f64(acc1, vld1q_f64(e1));
+    }
+
+    sum = vaddvq_f64(vaddq_f64(acc0, acc1));
+
+    for (; i < nr; i++) {
+        sum += spl_kern_energy(ddb[i]);
+    }
+
+    return sum;
+}
+
+static
+void _neon_minmax(uint16_t const *ddb, size_t nr, uint16_t *pmin, uint16_t *pmax)
+{
+    uint16x8_t vlo = vdupq_n_u16(UINT16_MAX),
+               vhi = vdupq_n_u16(0);
+    uint16_t lo = UINT16_MAX,
+             hi = 0;
+    size_t i = 0;
+
+    for (i = 0; i + 8 <= nr; i += 8) {
+        uint16x8_t v = vld1q_u16(&ddb[i]);
+        vlo = vminq_u16(vlo, v);
+        vhi = vmaxq_u16(vhi, v);
+    }
+
+    lo = vminvq_u16(vlo);
+    hi = vmaxvq_u16(vhi);
+
+    for (; i < nr; i++) {
+        if (ddb[i] < lo) lo = ddb[i];
+        if (ddb[i] > hi) hi = ddb[i];
+    }
+
+    *pmin = lo;
+    *pmax = hi;
+}
+
+static
+const struct spl_kern_ops spl_kern_neon = {
+    .name = "neon",
+    .energy_sum = _neon_energy_sum,
+    .to_energy = _scalar_to_energy,
+    .minmax = _neon_minmax,
+    .histogram = _unrolled_histogram,
+};
+#endif /* SPL_KERN_NEON */
+
+size_t spl_kern_available(struct spl_kern_ops const **ops, size_t max_ops)
+{
+    size_t nr = 0;
+
+    if (nr < max_ops) ops[nr++] = &spl_kern_scalar;
+
+#ifdef SPL_KERN_X86
+    if (__builtin_cpu_supports("sse4.1") && nr < max_ops) ops[nr++] = &spl_kern_sse41;
+    if (__builtin_cpu_supports("avx2") && nr < max_ops) ops[nr++] = &spl_kern_avx2;
+#endif
+
+#ifdef SPL_KERN_NEON
+    if (nr < max_ops) ops[nr++] = &spl_kern_neon;
+#endif
+
+    return nr;
+}
+
+/*
+ * Fill in the energy table and pick the best implementation before main() runs, so nothing
+ * can ever observe an empty table or a NULL spl_kern.
+ */
+__attribute__((constructor))
+static
+void _kern_init(void)
+{
+    struct spl_kern_ops const *ops[4];
+    size_t nr = 0;
+
+    for (size_t i = 0; i <= SPL_KERN_MAX_DDB; i++) {
+        spl_kern_energy_tab[i] = pow(10.0, (double)i / 100.0);
+    }
+
+#ifdef SPL_KERN_X86
+    __builtin_cpu_init();
+#endif
+
+    nr = spl_kern_available(ops, sizeof(ops)/sizeof(ops[0]));
+    spl_kern = ops[nr - 1];
+}
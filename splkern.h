@@ -0,0 +1,59 @@
+/* splkern.h -- Batch aggregation kernels over arrays of deci-dB levels
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Levels above this are clamped when converting to energy. 204.7 dB is far beyond anything
+ * the GM1356 (or any air-coupled microphone) will report.
+ */
+#define SPL_KERN_MAX_DDB            2047
+
+/*
+ * Linear energy of each deci-dB level, 10^(ddb/100). Converting through this table instead of
+ * pow() is what lets the conversion be vectorized with gathers.
+ */
+extern double spl_kern_energy_tab[SPL_KERN_MAX_DDB + 1];
+
+/**
+ * One implementation of the kernels. All implementations produce identical min/max and
+ * histogram results; energy sums may differ in the last few ULPs due to summation order.
+ */
+struct spl_kern_ops {
+    const char *name;
+    /* Sum of the linear energy of all levels */
+    double (*energy_sum)(uint16_t const *ddb, size_t nr);
+    /* Convert each level to its linear energy */
+    void (*to_energy)(uint16_t const *ddb, double *energy, size_t nr);
+    /* Minimum and maximum level. nr must be non-zero. */
+    void (*minmax)(uint16_t const *ddb, size_t nr, uint16_t *pmin, uint16_t *pmax);
+    /* Accumulate a histogram of levels, one bin per deci-dB, clamping to the last bin */
+    void (*histogram)(uint16_t const *ddb, size_t nr, uint32_t *bins, size_t nr_bins);
+};
+
+/*
+ * The best implementation for the CPU we are running on, chosen at startup.
+ */
+extern struct spl_kern_ops const *spl_kern;
+
+static inline
+double spl_kern_energy(uint16_t ddb)
+{
+    return spl_kern_energy_tab[ddb > SPL_KERN_MAX_DDB ? SPL_KERN_MAX_DDB : ddb];
+}
+
+uint16_t spl_kern_energy_to_ddb(double energy);
+
+/**
+ * Get the list of implementations usable on this CPU. The first entry is always the scalar
+ * reference implementation.
+ */
+size_t spl_kern_available(struct spl_kern_ops const **ops, size_t max_ops);
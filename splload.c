@@ -0,0 +1,76 @@
+/* splload.c -- Overload detection and load shedding
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splload.h>
+
+#include <string.h>
+
+void spl_load_init(struct spl_load *load, uint64_t lag_limit_ns, uint64_t now_ns)
+{
+    memset(load, 0, sizeof(*load));
+    load->lag_limit_ns = lag_limit_ns;
+    load->period_start_ns = now_ns;
+}
+
+bool spl_load_update(struct spl_load *load, uint64_t lag_ns, uint64_t now_ns)
+{
+    uint64_t max_lag_ns = 0;
+
+    if (lag_ns > load->period_max_lag_ns) {
+        load->period_max_lag_ns = lag_ns;
+    }
+
+    if (now_ns - load->period_start_ns < SPL_LOAD_PERIOD_MS * SPL_NS_PER_MS) {
+        return false;
+    }
+
+    max_lag_ns = load->period_max_lag_ns;
+    load->period_start_ns = now_ns;
+    load->period_max_lag_ns = 0;
+
+    if (SPL_LOAD_NORMAL != load->level && max_lag_ns > load->worst_lag_ns) {
+        load->worst_lag_ns = max_lag_ns;
+    }
+
+    if (max_lag_ns > load->lag_limit_ns) {
+        load->calm_since_ns = 0;
+
+        if (SPL_LOAD_MAX_LEVEL == load->level) {
+            return false;
+        }
+
+        if (SPL_LOAD_NORMAL == load->level) {
+            load->nr_overloads++;
+            load->worst_lag_ns = max_lag_ns;
+        }
+
+        load->level++;
+
+        return true;
+    }
+
+    if (SPL_LOAD_NORMAL == load->level || max_lag_ns > load->lag_limit_ns / 4) {
+        load->calm_since_ns = 0;
+        return false;
+    }
+
+    if (0 == load->calm_since_ns) {
+        load->calm_since_ns = now_ns;
+        return false;
+    }
+
+    if (now_ns - load->calm_since_ns < SPL_LOAD_RECOVER_SEC * SPL_NS_PER_SEC) {
+        return false;
+    }
+
+    /* Each step down needs its own quiet spell */
+    load->calm_since_ns = now_ns;
+    load->level--;
+
+    return true;
+}
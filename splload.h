@@ -0,0 +1,77 @@
+/* splload.h -- Overload detection and load shedding
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * splread does everything from one loop, so when the host is short of CPU, or whatever is
+ * reading the output can't keep up, the cost shows up as polls starting late. The overload
+ * controller watches that lag, and when the worst lag over a second is beyond the limit, it
+ * steps up one shedding level. Work is shed in a fixed order:
+ *
+ *   1. Optional analyses: burst capture (and its high poll rate) and phase-lock relearning
+ *   2. Raw output: only every 2nd sample of each device is printed, then every 4th, 8th
+ *      and 16th, a level at a time
+ *
+ * Everything that is aggregated (the store, exceedance events and alert rules) always sees
+ * every sample. Once the lag has stayed under a quarter of the limit for
+ * SPL_LOAD_RECOVER_SEC, the controller steps back down a level, and so on back to normal.
+ */
+#define SPL_LOAD_PERIOD_MS          1000
+#define SPL_LOAD_RECOVER_SEC        10
+
+enum spl_load_level {
+    SPL_LOAD_NORMAL = 0,
+    SPL_LOAD_SHED_ANALYSES = 1,
+    SPL_LOAD_DECIMATE_2 = 2,
+    SPL_LOAD_DECIMATE_16 = 5,
+    SPL_LOAD_MAX_LEVEL = SPL_LOAD_DECIMATE_16,
+};
+
+struct spl_load {
+    uint64_t lag_limit_ns;
+    unsigned level;
+    uint64_t period_start_ns;
+    uint64_t period_max_lag_ns;
+    /* When the lag last went quiet, or 0 if it isn't */
+    uint64_t calm_since_ns;
+    /* The worst lag seen while shedding */
+    uint64_t worst_lag_ns;
+
+    /* What has been shed, since startup */
+    uint64_t nr_output_shed;
+    uint64_t nr_analysis_shed;
+    uint64_t nr_overloads;
+};
+
+void spl_load_init(struct spl_load *load, uint64_t lag_limit_ns, uint64_t now_ns);
+
+/**
+ * Note how late a poll started. Returns true if this changed the shedding level.
+ */
+bool spl_load_update(struct spl_load *load, uint64_t lag_ns, uint64_t now_ns);
+
+static inline
+bool spl_load_shed_analyses(struct spl_load const *load)
+{
+    return load->level >= SPL_LOAD_SHED_ANALYSES;
+}
+
+/**
+ * Print only one in this many samples
+ */
+static inline
+unsigned spl_load_decimation(struct spl_load const *load)
+{
+    return load->level < SPL_LOAD_DECIMATE_2 ? 1 : 1u << (load->level - SPL_LOAD_SHED_ANALYSES);
+}
@@ -0,0 +1,522 @@
+/* spllog.c -- Rate-limited logging, optionally queued and to the systemd journal
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splcommon.h>
+#include <spllog.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SPL_LOG_JOURNAL_SOCKET      "/run/systemd/journal/socket"
+/* Distinct message IDs we keep rate limits for; any beyond are never limited */
+#define SPL_LOG_RATE_SLOTS          256
+#define SPL_LOG_JOURNAL_MAX         1024
+
+struct spl_log_rec {
+    const char *subsys;
+    const char *severity;
+    const char *ident;
+    const char *file;
+    const char *func;
+    int line;
+    char text[SPL_LOG_MSG_LEN];
+};
+
+struct spl_log_rate {
+    const char *ident;
+    const char *subsys;
+    uint64_t period_start_ns;
+    unsigned nr_logged;
+    uint64_t nr_suppressed;
+};
+
+/* Protects everything below */
+static
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+static
+pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+
+static
+struct spl_log_rate log_rates[SPL_LOG_RATE_SLOTS];
+
+/* Whether the writer thread is running, and so whether messages are queued */
+static
+bool log_queued = false;
+
+static
+bool log_stop = false;
+
+static
+pthread_t log_thread;
+
+static
+struct spl_log_rec log_queue[SPL_LOG_QUEUE_LEN];
+
+static
+uint64_t log_head = 0;
+
+static
+uint64_t log_tail = 0;
+
+static
+uint64_t log_nr_dropped = 0;
+
+/* Connected to the journal's native socket, if that's where stderr goes */
+static
+int log_journal_fd = -1;
+
+static
+struct spl_log_rate *_log_rate(const char *ident, const char *subsys)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const char *p = ident; '\0' != *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+
+    for (size_t i = 0; i < SPL_LOG_RATE_SLOTS; i++) {
+        struct spl_log_rate *rate = &log_rates[(hash + i) % SPL_LOG_RATE_SLOTS];
+
+        if (NULL == rate->ident) {
+            rate->ident = ident;
+            rate->subsys = subsys;
+            return rate;
+        }
+
+        if (0 == strcmp(rate->ident, ident) && 0 == strcmp(rate->subsys, subsys)) {
+            return rate;
+        }
+    }
+
+    return NULL;
+}
+
+static
+int _log_journal_priority(const char *severity)
+{
+    switch (severity[0]) {
+    case 'F':
+        return 2;
+    case 'E':
+        return 3;
+    case 'W':
+        return 4;
+    }
+
+    return 6;
+}
+
+/**
+ * Send a message to the journal as a structured entry. Returns false if it couldn't be sent.
+ */
+static
+bool _log_write_journal(struct spl_log_rec const *rec)
+{
+    char entry[SPL_LOG_JOURNAL_MAX];
+    int len = 0;
+
+    len = snprintf(entry, sizeof(entry), "PRIORITY=%d\nSYSLOG_IDENTIFIER=%s\n%s_MSG_ID=%s\n%s_SEVERITY=%s\n"
+            "CODE_FILE=%s\nCODE_LINE=%d\nCODE_FUNC=%s\nMESSAGE=%s, %s\n",
+            _log_journal_priority(rec->severity), program_invocation_short_name, rec->subsys, rec->ident,
+            rec->subsys, rec->severity, rec->file, rec->line, rec->func, rec->ident, rec->text);
+
+    if (len < 0 || (size_t)len >= sizeof(entry)) {
+        return false;
+    }
+
+    return len == send(log_journal_fd, entry, len, MSG_NOSIGNAL);
+}
+
+static
+void _log_write(struct spl_log_rec const *rec)
+{
+    if (0 <= log_journal_fd && true == _log_write_journal(rec)) {
+        return;
+    }
+
+    fprintf(stderr, "%%%s-%s-%s, %s (%s:%d in %s)\n", rec->subsys, rec->severity, rec->ident, rec->text, rec->file,
+            rec->line, rec->func);
+}
+
+/**
+ * Hand a message on to be written: straight out, or onto the queue
+ */
+static
+void _log_put(struct spl_log_rec const *rec)
+{
+    pthread_mutex_lock(&log_lock);
+
+    if (false == log_queued) {
+        /* Keep messages from different threads from interleaving */
+        _log_write(rec);
+    } else if (SPL_LOG_QUEUE_LEN == log_tail - log_head) {
+        log_nr_dropped++;
+    } else {
+        log_queue[log_tail++ % SPL_LOG_QUEUE_LEN] = *rec;
+        pthread_cond_signal(&log_wake);
+    }
+
+    pthread_mutex_unlock(&log_lock);
+}
+
+static
+void _log_summary(const char *subsys, const char *ident, uint64_t nr_repeated)
+{
+    struct spl_log_rec rec = {
+        .subsys = subsys,
+        .severity = SEV_INFO,
+        .ident = "SUPPRESSED",
+        .file = __FILE__,
+        .line = __LINE__,
+        .func = __FUNCTION__,
+    };
+
+    snprintf(rec.text, sizeof(rec.text), "Message %s repeated %llu more times", ident,
+            (unsigned long long)nr_repeated);
+    _log_put(&rec);
+}
+
+/**
+ * Summarize any messages that were held back in a period that has now ended (or all of them,
+ * if flushing)
+ */
+static
+void _log_summarize_expired(uint64_t now_ns, bool flush)
+{
+    for (size_t i = 0; i < SPL_LOG_RATE_SLOTS; i++) {
+        struct spl_log_rate *rate = &log_rates[i];
+        uint64_t nr_repeated = 0;
+
+        pthread_mutex_lock(&log_lock);
+        if (NULL != rate->ident && 0 != rate->nr_suppressed &&
+                (true == flush || now_ns - rate->period_start_ns >= SPL_LOG_RATE_SEC * SPL_NS_PER_SEC))
+        {
+            nr_repeated = rate->nr_suppressed;
+            rate->nr_suppressed = 0;
+        }
+        pthread_mutex_unlock(&log_lock);
+
+        if (0 != nr_repeated) {
+            _log_summary(rate->subsys, rate->ident, nr_repeated);
+        }
+    }
+}
+
+void spl_log(const char *subsys, const char *severity, const char *ident, const char *file, int line,
+        const char *func, const char *fmt, ...)
+{
+    struct spl_log_rec rec = {
+        .subsys = subsys,
+        .severity = severity,
+        .ident = ident,
+        .file = file,
+        .line = line,
+        .func = func,
+    };
+    struct spl_log_rate *rate = NULL;
+    bool fatal = 0 == strcmp(severity, SEV_FATAL);
+    uint64_t now_ns = get_mono_time_ns(),
+             nr_repeated = 0;
+    va_list ap;
+
+    pthread_mutex_lock(&log_lock);
+
+    if (false == fatal && NULL != (rate = _log_rate(ident, subsys))) {
+        if (now_ns - rate->period_start_ns >= SPL_LOG_RATE_SEC * SPL_NS_PER_SEC) {
+            nr_repeated = rate->nr_suppressed;
+            rate->period_start_ns = now_ns;
+            rate->nr_logged = 0;
+            rate->nr_suppressed = 0;
+        }
+
+        if (SPL_LOG_RATE_BURST == rate->nr_logged) {
+            if (0 == rate->nr_suppressed++) {
+                /* The writer needs to know to come back and summarize this */
+                pthread_cond_signal(&log_wake);
+            }
+            pthread_mutex_unlock(&log_lock);
+            return;
+        }
+
+        rate->nr_logged++;
+    }
+
+    pthread_mutex_unlock(&log_lock);
+
+    if (0 != nr_repeated) {
+        _log_summary(subsys, ident, nr_repeated);
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(rec.text, sizeof(rec.text), fmt, ap);
+    va_end(ap);
+
+    _log_put(&rec);
+
+    if (true == fatal) {
+        /* We're likely about to exit, so make sure this (and everything before it) gets out */
+        pthread_mutex_lock(&log_lock);
+        while (true == log_queued && log_head != log_tail) {
+            pthread_cond_wait(&log_drained, &log_lock);
+        }
+        pthread_mutex_unlock(&log_lock);
+    }
+}
+
+/**
+ * When the next summary of held back messages is due, or UINT64_MAX if nothing is being held
+ * back. Called with log_lock held.
+ */
+static
+uint64_t _log_next_summary_ns(void)
+{
+    uint64_t next_ns = UINT64_MAX;
+
+    for (size_t i = 0; i < SPL_LOG_RATE_SLOTS; i++) {
+        struct spl_log_rate const *rate = &log_rates[i];
+        uint64_t due_ns = rate->period_start_ns + SPL_LOG_RATE_SEC * SPL_NS_PER_SEC;
+
+        if (NULL != rate->ident && 0 != rate->nr_suppressed && due_ns < next_ns) {
+            next_ns = due_ns;
+        }
+    }
+
+    return next_ns;
+}
+
+static
+void *_log_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&log_lock);
+
+    for (;;) {
+        struct spl_log_rec rec;
+        uint64_t nr_dropped = 0;
+
+        /* Sleep until there's something to write, or a summary is due; an idle log never wakes */
+        while (log_head == log_tail && false == log_stop && 0 == log_nr_dropped) {
+            uint64_t due_ns = _log_next_summary_ns(),
+                     now_ns = get_mono_time_ns(),
+                     wait_ns = 0;
+            struct timespec deadline;
+
+            if (UINT64_MAX == due_ns) {
+                pthread_cond_wait(&log_wake, &log_lock);
+                continue;
+            }
+
+            if (due_ns <= now_ns) {
+                break;
+            }
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            wait_ns = due_ns - now_ns + deadline.tv_nsec;
+            deadline.tv_sec += wait_ns / SPL_NS_PER_SEC;
+            deadline.tv_nsec = wait_ns % SPL_NS_PER_SEC;
+
+            if (ETIMEDOUT == pthread_cond_timedwait(&log_wake, &log_lock, &deadline)) {
+                break;
+            }
+        }
+
+        if (log_head != log_tail) {
+            rec = log_queue[log_head % SPL_LOG_QUEUE_LEN];
+
+            /* Write it out without holding anyone else up */
+            pthread_mutex_unlock(&log_lock);
+            _log_write(&rec);
+            pthread_mutex_lock(&log_lock);
+
+            log_head++;
+            if (log_head == log_tail) {
+                pthread_cond_broadcast(&log_drained);
+            }
+            continue;
+        }
+
+        if (true == log_stop) {
+            break;
+        }
+
+        nr_dropped = log_nr_dropped;
+        log_nr_dropped = 0;
+        pthread_mutex_unlock(&log_lock);
+
+        if (0 != nr_dropped) {
+            struct spl_log_rec drop_rec = {
+                .subsys = "SPL",
+                .severity = SEV_WARNING,
+                .ident = "LOG-DROPPED",
+                .file = __FILE__,
+                .line = __LINE__,
+                .func = __FUNCTION__,
+            };
+
+            snprintf(drop_rec.text, sizeof(drop_rec.text), "Dropped %llu messages, the log couldn't keep up",
+                    (unsigned long long)nr_dropped);
+            _log_write(&drop_rec);
+        }
+
+        _log_summarize_expired(get_mono_time_ns(), false);
+
+        pthread_mutex_lock(&log_lock);
+    }
+
+    pthread_mutex_unlock(&log_lock);
+
+    return NULL;
+}
+
+/**
+ * systemd says where it connected stderr to the journal in JOURNAL_STREAM, as <dev>:<inode>
+ */
+static
+bool _log_stderr_is_journal(void)
+{
+    const char *stream = getenv("JOURNAL_STREAM");
+    unsigned long long dev = 0,
+                       ino = 0;
+    struct stat st;
+
+    if (NULL == stream || 2 != sscanf(stream, "%llu:%llu", &dev, &ino)) {
+        return false;
+    }
+
+    if (0 > fstat(STDERR_FILENO, &st)) {
+        return false;
+    }
+
+    return (unsigned long long)st.st_dev == dev && (unsigned long long)st.st_ino == ino;
+}
+
+static
+int _log_journal_open(void)
+{
+    int fd = -1;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = SPL_LOG_JOURNAL_SOCKET };
+
+    if (0 > (fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0))) {
+        return -1;
+    }
+
+    if (0 > connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int spl_log_start(void)
+{
+    int ret = A_OK;
+
+    if (true == _log_stderr_is_journal()) {
+        if (0 > (log_journal_fd = _log_journal_open())) {
+            SPL_MSG(SEV_WARNING, "NO-JOURNAL", "Could not connect to the journal, logging to stderr: %s",
+                    strerror(errno));
+        }
+    }
+
+    pthread_mutex_lock(&log_lock);
+    log_stop = false;
+    log_queued = true;
+    pthread_mutex_unlock(&log_lock);
+
+    if (0 != pthread_create(&log_thread, NULL, _log_thread, NULL)) {
+        pthread_mutex_lock(&log_lock);
+        log_queued = false;
+        pthread_mutex_unlock(&log_lock);
+        SPL_MSG(SEV_ERROR, "LOG-START-FAIL", "Failed to start the logging thread, logging directly");
+        ret = A_E_INVAL;
+    }
+
+    return ret;
+}
+
+void spl_log_stop(void)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&log_lock);
+    queued = log_queued;
+    log_stop = true;
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
+
+    if (true == queued) {
+        pthread_join(log_thread, NULL);
+
+        pthread_mutex_lock(&log_lock);
+        log_queued = false;
+        pthread_mutex_unlock(&log_lock);
+
+        if (0 != log_nr_dropped) {
+            SPL_MSG(SEV_WARNING, "LOG-DROPPED", "Dropped %llu messages, the log couldn't keep up",
+                    (unsigned long long)log_nr_dropped);
+            log_nr_dropped = 0;
+        }
+    }
+
+    _log_summarize_expired(get_mono_time_ns(), true);
+
+    if (0 <= log_journal_fd) {
+        close(log_journal_fd);
+        log_journal_fd = -1;
+    }
+}
+
+void spl_log_flush(void)
+{
+    _log_summarize_expired(get_mono_time_ns(), true);
+
+    pthread_mutex_lock(&log_lock);
+    while (true == log_queued && log_head != log_tail) {
+        pthread_cond_wait(&log_drained, &log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+void spl_log_after_fork(void)
+{
+    bool queued = log_queued;
+
+    /* The writer thread didn't come with us, and may have been holding the lock when we forked */
+    pthread_mutex_init(&log_lock, NULL);
+    pthread_cond_init(&log_wake, NULL);
+    pthread_cond_init(&log_drained, NULL);
+
+    /* Whatever was queued is the parent's to write out */
+    log_head = log_tail;
+    log_nr_dropped = 0;
+    log_queued = false;
+
+    if (0 <= log_journal_fd) {
+        close(log_journal_fd);
+        log_journal_fd = -1;
+    }
+
+    if (true == queued) {
+        spl_log_start();
+    }
+}
@@ -0,0 +1,57 @@
+/* spllog.h -- Rate-limited logging, optionally queued and to the systemd journal
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+/*
+ * Every message logged through MESSAGE (and so SPL_MSG) ends up here. Each message ID (the
+ * ident, e.g. "TIMEOUT") may be logged SPL_LOG_RATE_BURST times in SPL_LOG_RATE_SEC seconds;
+ * after that it's counted but not logged, and once the period is up a summary says how many
+ * times it repeated. Fatal messages are never held back.
+ *
+ * Until spl_log_start() is called, messages are written to stderr as they're logged. After,
+ * they're formatted into an in-memory queue and written out by a thread of their own, so a
+ * slow or stuck stderr never holds up the caller; if the queue fills up, messages are
+ * dropped, and counted. If stderr is connected to the systemd journal, messages are sent
+ * to the journal directly instead, as structured entries carrying the message ID, severity
+ * and source location as fields of their own.
+ */
+#define SPL_LOG_RATE_SEC            10
+#define SPL_LOG_RATE_BURST          5
+/* Messages the queue can hold */
+#define SPL_LOG_QUEUE_LEN           256
+#define SPL_LOG_MSG_LEN             384
+
+/**
+ * Log a message. Use the MESSAGE or SPL_MSG macros rather than calling this directly.
+ */
+void spl_log(const char *subsys, const char *severity, const char *ident, const char *file, int line,
+        const char *func, const char *fmt, ...) __attribute__((format(printf, 7, 8)));
+
+/**
+ * Start queueing messages, to be written out by a thread of their own
+ */
+int spl_log_start(void);
+
+/**
+ * Write out everything queued, and any pending repeat summaries, then go back to writing
+ * messages out as they're logged
+ */
+void spl_log_stop(void);
+
+/**
+ * Summarize any messages being held back, and wait until everything queued has been written
+ * out, while carrying on queueing
+ */
+void spl_log_flush(void);
+
+/**
+ * In a child process, just after fork(): forget anything queued (the parent still has it),
+ * and start a writer thread of our own if the parent had one
+ */
+void spl_log_after_fork(void);
@@ -0,0 +1,257 @@
+/* splmeter.c -- Talking to a single GM1356 over hidapi
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splmeter.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+static
+uint64_t nr_calls = 0;
+
+static
+void _meter_count_call(void)
+{
+    __atomic_fetch_add(&nr_calls, 1, __ATOMIC_RELAXED);
+}
+
+int spl_meter_send(hid_device *hid, uint8_t const *report)
+{
+    int ret = A_OK;
+
+    int written = 0;
+
+    ASSERT_ARG(NULL != hid);
+    ASSERT_ARG(NULL != report);
+
+    _meter_count_call();
+    if (SPL_METER_REPORT_LEN != (written = hid_write(hid, report, SPL_METER_REPORT_LEN))) {
+        SPL_MSG(SEV_ERROR, "REQUEST-FAIL", "Failed to write 8 bytes to device (wrote %d): %ls", written, hid_error(hid));
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    DIAG("Wrote %d bytes, waiting for response", written);
+
+done:
+    return ret;
+}
+
+int spl_meter_read(hid_device *hid, uint8_t *report, size_t len, uint64_t timeout_ns)
+{
+    int ret = A_OK;
+
+    int read_bytes = 0,
+        timeout_ms = timeout_ns / SPL_NS_PER_MS > INT_MAX ? INT_MAX : (int)(timeout_ns / SPL_NS_PER_MS);
+    uint64_t start_time = 0;
+
+    ASSERT_ARG(NULL != hid);
+    ASSERT_ARG(NULL != report);
+    ASSERT_ARG(SPL_METER_REPORT_LEN <= len);
+
+    start_time = get_mono_time_ns();
+
+    while (SPL_METER_REPORT_LEN != read_bytes) {
+        int nr_bytes = 0;
+        _meter_count_call();
+        if (0 > (nr_bytes = hid_read_timeout(hid, &report[read_bytes], len - read_bytes, timeout_ms))) {
+            SPL_MSG(SEV_ERROR, "READ-FAIL", "Failed to read back an 8 byte report (got %d): %ls", read_bytes, hid_error(hid));
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        read_bytes += nr_bytes;
+
+        /* A whole report that turned up just as we ran out of time is still an answer */
+        if (SPL_METER_REPORT_LEN != read_bytes && get_mono_time_ns() - start_time > timeout_ns) {
+            SPL_MSG(SEV_WARNING, "TIMEOUT", "Timeout waiting for response from device, skipping this read");
+            ret = A_E_TIMEOUT;
+            goto done;
+        }
+    }
+
+#ifdef DEBUG_MESSAGES
+    SPL_MSG(SEV_INFO, "RESPONSE", "%02x:%02x:%02x:%02x - %02x:%02x:%02x:%02x",
+            report[0],
+            report[1],
+            report[2],
+            report[3],
+            report[4],
+            report[5],
+            report[6],
+            report[7]);
+#endif
+
+done:
+    return ret;
+}
+
+int spl_meter_read_waiting(hid_device *hid, uint8_t *report, size_t len)
+{
+    int ret = A_OK;
+
+    int nr_bytes = 0;
+
+    ASSERT_ARG(NULL != hid);
+    ASSERT_ARG(NULL != report);
+    ASSERT_ARG(SPL_METER_REPORT_LEN < len);
+
+    _meter_count_call();
+    if (0 > (nr_bytes = hid_read_timeout(hid, report, len, 0))) {
+        SPL_MSG(SEV_ERROR, "READ-FAIL", "Failed to read a waiting report: %ls", hid_error(hid));
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 == nr_bytes) {
+        ret = A_E_EMPTY;
+    }
+
+done:
+    return ret;
+}
+
+int spl_meter_configure(hid_device *hid, unsigned range, bool fast, bool dbc)
+{
+    int ret = A_OK;
+
+    uint8_t command[SPL_METER_REPORT_LEN] = { 0x0 };
+    int rret = A_OK;
+
+    ASSERT_ARG(NULL != hid);
+    ASSERT_ARG(range <= 0x4);
+
+    command[0] = GM1356_COMMAND_CONFIGURE;
+    command[1] |= range;
+
+    if (true == fast) {
+        command[1] |= GM1356_FAST_MODE;
+    }
+
+    if (true == dbc) {
+        command[1] |= GM1356_MEASURE_DBC;
+    }
+
+    if (FAILED(spl_meter_send(hid, command))) {
+        SPL_MSG(SEV_FATAL, "CONFIG-FAIL", "Failed to set configuration for SPL meter, aborting");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* Always wait 500ms for the configuration to succeed */
+    if (FAILED(rret = spl_meter_read(hid, command, sizeof(command), 500ul * 1000ul * 1000ul))) {
+        SPL_MSG(SEV_FATAL, "CONFIG-NO-ACK", "Did not get the configuration packet acknowledgement, aborting.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+uint64_t spl_meter_midpoint(struct spl_meter_rtt *rtt, uint64_t sent_ns, uint64_t recv_ns, uint64_t recv_wall_ns,
+        uint16_t *err_us)
+{
+    uint64_t rtt_ns = recv_ns - sent_ns,
+             min_ns = 0,
+             excess_us = 0;
+
+    if (0 == rtt->nr || rtt_ns < rtt->min_ns) {
+        rtt->min_ns = rtt_ns;
+    }
+
+    min_ns = rtt->min_ns;
+    if (0 != rtt->prev_min_ns && rtt->prev_min_ns < min_ns) {
+        min_ns = rtt->prev_min_ns;
+    }
+
+    if (SPL_METER_RTT_WINDOW == ++rtt->nr) {
+        rtt->prev_min_ns = rtt->min_ns;
+        rtt->nr = 0;
+    }
+
+    excess_us = (rtt_ns - min_ns) / 2000;
+    *err_us = excess_us > UINT16_MAX ? UINT16_MAX : (uint16_t)excess_us;
+
+    return recv_wall_ns - rtt_ns / 2;
+}
+
+int spl_meter_poll(hid_device *hid, uint16_t device, struct spl_meter_rtt *rtt, struct spl_sample *samples,
+        size_t nr_samples, uint64_t interval_ns, size_t *nr_read)
+{
+    int ret = A_OK;
+
+    uint64_t start_ns = 0;
+    size_t nr_good = 0;
+
+    ASSERT_ARG(NULL != hid);
+    ASSERT_ARG(NULL != rtt);
+    ASSERT_ARG(NULL != samples);
+    ASSERT_ARG(0 != interval_ns);
+    ASSERT_ARG(NULL != nr_read);
+
+    *nr_read = 0;
+
+    start_ns = get_mono_time_ns();
+
+    for (size_t i = 0; i < nr_samples; i++) {
+        uint8_t request[SPL_METER_REPORT_LEN] = { GM1356_COMMAND_CAPTURE },
+                report[SPL_METER_REPORT_LEN + 1] = { 0 };
+        uint64_t due_ns = start_ns + i * interval_ns,
+                 sent_ns = 0,
+                 now_ns = 0;
+        uint16_t err_us = 0;
+        struct timespec due_ts = {
+            .tv_sec = due_ns / SPL_NS_PER_SEC,
+            .tv_nsec = due_ns % SPL_NS_PER_SEC,
+        };
+        int tret = A_OK;
+
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due_ts, NULL)) {
+        }
+
+        /* Anything waiting is an answer to a poll we already gave up on */
+        while (A_OK == (tret = spl_meter_read_waiting(hid, report, sizeof(report)))) {
+        }
+
+        if (A_E_EMPTY != tret) {
+            ret = tret;
+            goto done;
+        }
+
+        sent_ns = get_mono_time_ns();
+        if (FAILED(ret = spl_meter_send(hid, request))) {
+            goto done;
+        }
+
+        now_ns = get_mono_time_ns();
+        if (A_E_TIMEOUT == (tret = spl_meter_read(hid, report, sizeof(report),
+                        due_ns + interval_ns > now_ns ? due_ns + interval_ns - now_ns : 0)))
+        {
+            continue;
+        } else if (FAILED(tret)) {
+            ret = tret;
+            goto done;
+        }
+
+        now_ns = get_mono_time_ns();
+        spl_meter_decode(report, spl_meter_midpoint(rtt, sent_ns, now_ns, get_time_ns(), &err_us), device,
+                &samples[nr_good]);
+        samples[nr_good++].ts_err_us = err_us;
+    }
+
+done:
+    *nr_read = nr_good;
+    return ret;
+}
+
+uint64_t spl_meter_nr_calls(void)
+{
+    return __atomic_load_n(&nr_calls, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,102 @@
+/* splmeter.h -- Talking to a single GM1356 over hidapi
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <gm1356.h>
+#include <splcommon.h>
+
+#include <hidapi.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The request/response exchange with a meter, shared by splread and the Python bindings.
+ * Every request and every response is an 8 byte report. None of this keeps any state of
+ * its own beyond a count of calls made into hidapi, so it's safe to use on different
+ * devices from different threads.
+ */
+#define SPL_METER_REPORT_LEN        8
+
+/**
+ * Send an 8 byte request to the meter
+ */
+int spl_meter_send(hid_device *hid, uint8_t const *report);
+
+/**
+ * Read back an 8 byte report, waiting up to timeout_ns for it. report must have room for
+ * len bytes, at least SPL_METER_REPORT_LEN. Returns A_E_TIMEOUT if no report turned up.
+ */
+int spl_meter_read(hid_device *hid, uint8_t *report, size_t len, uint64_t timeout_ns);
+
+/**
+ * Pick up a report, if there's one waiting, without waiting for one. Returns A_E_EMPTY if
+ * there isn't.
+ */
+int spl_meter_read_waiting(hid_device *hid, uint8_t *report, size_t len);
+
+/**
+ * Set the range, time weighting and frequency weighting, and wait for the meter to
+ * acknowledge the change.
+ */
+int spl_meter_configure(hid_device *hid, unsigned range, bool fast, bool dbc);
+
+/*
+ * All we know of when a meter took the measurement it sends back is that it was some time
+ * between the request going out and the response coming back. The shortest round trips are
+ * the ones that didn't queue behind anything, so the measurement is placed in the middle of
+ * the round trip, give or take half of however much longer than the shortest recent round
+ * trip it took. The shortest is kept over the last one to two windows of round trips, so it
+ * follows a meter that's been moved somewhere slower.
+ */
+#define SPL_METER_RTT_WINDOW        64
+
+struct spl_meter_rtt {
+    /* The shortest round trip in this window, and in the last one (0 before there was one) */
+    uint64_t min_ns;
+    uint64_t prev_min_ns;
+    uint32_t nr;
+};
+
+/**
+ * Work out the wall clock time of a measurement, given when its request went out and its
+ * response came back on the monotonic clock, and the wall clock time at recv_ns. *err_us is
+ * set to how far off that could be, in microseconds, at most UINT16_MAX.
+ */
+uint64_t spl_meter_midpoint(struct spl_meter_rtt *rtt, uint64_t sent_ns, uint64_t recv_ns, uint64_t recv_wall_ns,
+        uint16_t *err_us);
+
+/**
+ * Poll the meter nr_samples times, interval_ns apart, decoding each response into
+ * samples[]. A poll the meter doesn't answer within the interval is skipped, so
+ * nr_read can come back short. rtt carries the shortest round trips seen from one call
+ * to the next.
+ */
+int spl_meter_poll(hid_device *hid, uint16_t device, struct spl_meter_rtt *rtt, struct spl_sample *samples,
+        size_t nr_samples, uint64_t interval_ns, size_t *nr_read);
+
+/**
+ * How many calls into hidapi have been made, by every caller, so far
+ */
+uint64_t spl_meter_nr_calls(void);
+
+/**
+ * Turn a response report into a sample
+ */
+static inline
+void spl_meter_decode(uint8_t const *report, uint64_t ts_ns, uint16_t device, struct spl_sample *sample)
+{
+    sample->ts_ns = ts_ns;
+    sample->deci_db = report[0] << 8 | report[1];
+    sample->device = device;
+    sample->flags = report[2];
+    sample->_resv0 = 0;
+    sample->ts_err_us = 0;
+}
@@ -0,0 +1,221 @@
+/* splphase.c -- Locking polls to the meter's own display update cadence
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splphase.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static
+void _phase_start_learning(struct spl_phase *phase, uint64_t now_ns)
+{
+    phase->learning = true;
+    phase->learn_start_ns = now_ns;
+    phase->last_poll_ns = 0;
+    phase->nr_changes = 0;
+}
+
+void spl_phase_init(struct spl_phase *phase, uint64_t now_ns)
+{
+    memset(phase, 0, sizeof(*phase));
+    _phase_start_learning(phase, now_ns);
+}
+
+static
+int _cmp_u64(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a,
+             y = *(uint64_t const *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Fit a period and phase to the change times seen while learning
+ */
+static
+bool _phase_fit(struct spl_phase *phase)
+{
+    uint64_t gaps[SPL_PHASE_NR_CHANGES - 1];
+    size_t nr_gaps = phase->nr_changes - 1;
+    uint64_t const *changes = phase->changes;
+    uint64_t guess = 0,
+             ref_ns = 0,
+             period = 0;
+    double sum_n = 0.0,
+           sum_t = 0.0,
+           sum_nn = 0.0,
+           sum_nt = 0.0,
+           slope = 0.0,
+           intercept = 0.0,
+           denom = 0.0,
+           last_n = 0.0;
+
+    for (size_t i = 0; i < nr_gaps; i++) {
+        gaps[i] = changes[i + 1] - changes[i];
+    }
+
+    /*
+     * The shortest gaps are most likely a single period, but are also the most affected by
+     * poll jitter. Take the lower quartile as a first guess at the period.
+     */
+    qsort(gaps, nr_gaps, sizeof(gaps[0]), _cmp_u64);
+    guess = gaps[nr_gaps / 4];
+
+    if (guess < 2 * SPL_PHASE_LEARN_POLL_MS * SPL_NS_PER_MS) {
+        /* Changing on (nearly) every poll; we can't see the cadence from here */
+        return false;
+    }
+
+    /*
+     * Number each change by how many periods it is after the first, a gap at a time so the
+     * error in the guess doesn't add up, then fit a line through them: the slope is the
+     * period, and the line gives the time of a refresh.
+     */
+    for (size_t i = 0; i < phase->nr_changes; i++) {
+        double t = (double)(changes[i] - changes[0]);
+
+        if (0 != i) {
+            last_n += (double)((changes[i] - changes[i - 1] + guess / 2) / guess);
+        }
+
+        sum_n += last_n;
+        sum_t += t;
+        sum_nn += last_n * last_n;
+        sum_nt += last_n * t;
+    }
+
+    denom = sum_nn * phase->nr_changes - sum_n * sum_n;
+    if (denom <= 0.0) {
+        return false;
+    }
+
+    slope = (sum_nt * phase->nr_changes - sum_n * sum_t) / denom;
+    intercept = (sum_t - slope * sum_n) / phase->nr_changes;
+
+    if (slope < guess / 2 || slope > guess * 2) {
+        return false;
+    }
+
+    period = (uint64_t)slope;
+    ref_ns = changes[0] + (uint64_t)(intercept + slope * last_n);
+
+    /*
+     * If we were locked before, count the periods since the refresh we knew of then. Over a
+     * baseline that long, the period comes out far more precisely.
+     */
+    if (0 != phase->period_ns && ref_ns > phase->ref_ns) {
+        uint64_t span = ref_ns - phase->ref_ns,
+                 nr_periods = (span + period / 2) / period;
+
+        if (0 != nr_periods) {
+            uint64_t refined = span / nr_periods;
+
+            /* Only if it agrees with what we just measured, else we've miscounted */
+            if (refined > period - period / 100 && refined < period + period / 100) {
+                period = refined;
+                phase->relearn_sec *= 2;
+            }
+        }
+    }
+
+    if (phase->relearn_sec < SPL_PHASE_RELEARN_MIN_SEC) {
+        phase->relearn_sec = SPL_PHASE_RELEARN_MIN_SEC;
+    } else if (phase->relearn_sec > SPL_PHASE_RELEARN_MAX_SEC) {
+        phase->relearn_sec = SPL_PHASE_RELEARN_MAX_SEC;
+    }
+
+    phase->period_ns = period;
+    phase->ref_ns = ref_ns;
+
+    return true;
+}
+
+bool spl_phase_feed(struct spl_phase *phase, uint64_t poll_ns, bool changed)
+{
+    uint64_t last_poll_ns = phase->last_poll_ns;
+
+    if (false == phase->learning) {
+        return false;
+    }
+
+    phase->last_poll_ns = poll_ns;
+
+    /* Only trust a change if we know roughly when the previous poll was */
+    if (0 == last_poll_ns || poll_ns - last_poll_ns > 3 * SPL_PHASE_LEARN_POLL_MS * SPL_NS_PER_MS || false == changed) {
+        return false;
+    }
+
+    phase->changes[phase->nr_changes++] = last_poll_ns + (poll_ns - last_poll_ns) / 2;
+
+    if (phase->nr_changes < SPL_PHASE_NR_CHANGES) {
+        return false;
+    }
+
+    phase->learning = false;
+    phase->locked = _phase_fit(phase);
+    phase->locked_at_ns = poll_ns;
+
+    return phase->locked;
+}
+
+uint64_t spl_phase_next_poll(struct spl_phase *phase, uint64_t prev_due_ns, uint64_t interval_ns, uint64_t now_ns)
+{
+    uint64_t target = prev_due_ns + interval_ns,
+             relearn_sec = 0 == phase->relearn_sec ? SPL_PHASE_RELEARN_MIN_SEC : phase->relearn_sec,
+             refresh = 0;
+
+    if (true == phase->learning) {
+        if (now_ns - phase->learn_start_ns > SPL_PHASE_LEARN_MAX_SEC * SPL_NS_PER_SEC) {
+            /* Not enough changes to go on (a quiet room); try again later */
+            phase->learning = false;
+            phase->locked = false;
+            phase->locked_at_ns = now_ns;
+        } else {
+            return prev_due_ns + SPL_PHASE_LEARN_POLL_MS * SPL_NS_PER_MS;
+        }
+    }
+
+    if (now_ns - phase->locked_at_ns > relearn_sec * SPL_NS_PER_SEC) {
+        _phase_start_learning(phase, now_ns);
+        return now_ns;
+    }
+
+    if (false == phase->locked) {
+        return target;
+    }
+
+    /* Find the refresh closest to where we'd like to poll, but never one in the past */
+    if (target >= phase->ref_ns) {
+        refresh = target - (target - phase->ref_ns) % phase->period_ns;
+    } else {
+        refresh = phase->ref_ns;
+    }
+
+    if (target - refresh > phase->period_ns / 2) {
+        refresh += phase->period_ns;
+    }
+
+    while (refresh + SPL_PHASE_GUARD_MS * SPL_NS_PER_MS <= now_ns ||
+            refresh + SPL_PHASE_GUARD_MS * SPL_NS_PER_MS <= prev_due_ns)
+    {
+        refresh += phase->period_ns;
+    }
+
+    return refresh + SPL_PHASE_GUARD_MS * SPL_NS_PER_MS;
+}
+
+bool spl_phase_hold(struct spl_phase *phase, uint64_t now_ns)
+{
+    bool was_learning = phase->learning;
+
+    phase->learning = false;
+    phase->locked_at_ns = now_ns;
+
+    return was_learning;
+}
@@ -0,0 +1,94 @@
+/* splphase.h -- Locking polls to the meter's own display update cadence
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The GM1356 only refreshes its reading at its own fixed rate. Polling faster than that
+ * just reads the same value again, and polling at an arbitrary phase means the value can
+ * be up to a whole refresh period old by the time we get it.
+ *
+ * To learn the refresh cadence, we poll quickly for a while and note when the value
+ * changes. A refresh happened somewhere between the poll that saw the change and the one
+ * before it, so we take the midpoint. The gaps between changes are all (roughly) whole
+ * multiples of the period, since refreshes that don't change the value go unseen, so a
+ * line fitted through the change times (numbered by period) gives both the period and the
+ * time of a refresh. From then on, polls are scheduled just after each refresh.
+ *
+ * The meter's clock drifts against ours, and any error in the period adds up, so every so
+ * often the cadence is learned again.
+ */
+
+/* How often to poll while learning */
+#define SPL_PHASE_LEARN_POLL_MS     20
+
+/* How many value changes to see before locking on */
+#define SPL_PHASE_NR_CHANGES        16
+
+/* Give up learning (and poll at the plain interval for a while) if it takes this long */
+#define SPL_PHASE_LEARN_MAX_SEC     60
+
+/*
+ * Relearn the cadence this soon after first locking on. Each relearn measures the period
+ * again over the whole time since the previous one, which pins it down far more precisely
+ * than a few seconds of learning can, so the time between relearns doubles each time, up
+ * to the maximum.
+ */
+#define SPL_PHASE_RELEARN_MIN_SEC   30
+#define SPL_PHASE_RELEARN_MAX_SEC   600
+
+/* How long after the estimated refresh to poll */
+#define SPL_PHASE_GUARD_MS          10
+
+struct spl_phase {
+    bool learning;
+    bool locked;
+    uint64_t learn_start_ns;
+    uint64_t locked_at_ns;
+
+    /* The previous poll while learning, if there was one */
+    uint64_t last_poll_ns;
+
+    /* Estimated times of value changes, while learning */
+    uint64_t changes[SPL_PHASE_NR_CHANGES];
+    size_t nr_changes;
+
+    /* The learned cadence: refreshes happen at ref_ns + n * period_ns */
+    uint64_t period_ns;
+    uint64_t ref_ns;
+    uint64_t relearn_sec;
+};
+
+void spl_phase_init(struct spl_phase *phase, uint64_t now_ns);
+
+/**
+ * Feed the (monotonic) time a poll was sent, and whether its value differed from the
+ * previous poll's. Returns true if this locked on to the meter's cadence.
+ */
+bool spl_phase_feed(struct spl_phase *phase, uint64_t poll_ns, bool changed);
+
+/**
+ * Work out when to poll next, given the time the previous poll was due and the interval
+ * we'd like between polls. While learning, this is simply SPL_PHASE_LEARN_POLL_MS later;
+ * once locked, it is just after the refresh closest to prev_due_ns + interval_ns. If it
+ * is time to relearn, this starts learning again.
+ */
+uint64_t spl_phase_next_poll(struct spl_phase *phase, uint64_t prev_due_ns, uint64_t interval_ns, uint64_t now_ns);
+
+/**
+ * Don't learn the cadence again for a while, and stop learning it if we are, so the device can
+ * be polled at its normal rate. Whatever was learned before is kept. Returns true if learning
+ * was cut short.
+ */
+bool spl_phase_hold(struct spl_phase *phase, uint64_t now_ns);
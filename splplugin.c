@@ -0,0 +1,542 @@
+/* splplugin.c -- Loadable processing stages
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splkern.h>
+#include <splplugin.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SPL_PLUGIN_PATH_LEN         512
+
+/*
+ * Message IDs plugins have logged with. The log holds on to an ident for rate limiting and
+ * while a message is queued, well past when the plugin that owned the string was unloaded,
+ * so every ident is copied here first.
+ */
+#define SPL_PLUGIN_IDENTS           64
+#define SPL_PLUGIN_IDENT_LEN        32
+
+/* The part of struct spl_plugin_ops that version 1 plugins all have */
+#define SPL_PLUGIN_OPS_V1_SIZE      (offsetof(struct spl_plugin_ops, fini) + sizeof(void (*)(void *)))
+
+struct spl_plugin_batch {
+    size_t nr_samples;
+    size_t nr_windows;
+    struct spl_sample samples[SPL_PLUGIN_BATCH_SAMPLES];
+    struct spl_rollup windows[SPL_PLUGIN_BATCH_WINDOWS];
+    /* How many samples were batched ahead of each window */
+    size_t window_at[SPL_PLUGIN_BATCH_WINDOWS];
+};
+
+/*
+ * The window a device is part way through, for one plugin
+ */
+struct spl_plugin_window {
+    uint64_t start_ns;
+    double energy;
+    uint32_t nr_samples;
+    uint16_t min_ddb;
+    uint16_t max_ddb;
+    uint8_t flags;
+};
+
+struct spl_plugin {
+    /* Runs the batch in batches[job_batch] on the pool */
+    struct spl_pool_job job;
+    struct spl_plugins *set;
+    void *dl;
+    struct spl_plugin_ops const *ops;
+    void *state;
+    char name[SPL_PLUGIN_NAME_LEN];
+    uint64_t window_ns;
+    /* One per device */
+    struct spl_plugin_window *windows;
+    /* One batch is filled while the pool works on the other */
+    struct spl_plugin_batch batches[2];
+    unsigned fill;
+    unsigned job_batch;
+    bool busy;
+    uint64_t nr_dropped;
+    /* Without a pool, batches run inline, and are timed here instead */
+    struct spl_pool_stats stats;
+};
+
+struct spl_plugins {
+    struct spl_pool *pool;
+    size_t nr_devs;
+    spl_plugin_publish_cb_t publish;
+    void *publish_arg;
+    struct spl_plugin_host host;
+    size_t nr_plugins;
+    struct spl_plugin *plugins[SPL_PLUGIN_MAX];
+};
+
+static
+pthread_mutex_t plugin_ident_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+char plugin_idents[SPL_PLUGIN_IDENTS][SPL_PLUGIN_IDENT_LEN];
+
+static
+size_t plugin_nr_idents = 0;
+
+/**
+ * Our own copy of a plugin's message ID, or NULL if it's too long or there's no room left
+ */
+static
+const char *_plugin_intern_ident(const char *ident)
+{
+    const char *interned = NULL;
+
+    if (strlen(ident) >= SPL_PLUGIN_IDENT_LEN) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&plugin_ident_lock);
+
+    for (size_t i = 0; i < plugin_nr_idents && NULL == interned; i++) {
+        if (0 == strcmp(plugin_idents[i], ident)) {
+            interned = plugin_idents[i];
+        }
+    }
+
+    if (NULL == interned && plugin_nr_idents < SPL_PLUGIN_IDENTS) {
+        strcpy(plugin_idents[plugin_nr_idents], ident);
+        interned = plugin_idents[plugin_nr_idents++];
+    }
+
+    pthread_mutex_unlock(&plugin_ident_lock);
+
+    return interned;
+}
+
+static
+int _plugin_publish(void *ctx, char const *record, size_t len)
+{
+    struct spl_plugins *set = ctx;
+
+    if (NULL == record) {
+        return A_E_BADARGS;
+    }
+
+    return set->publish(record, len, set->publish_arg);
+}
+
+static
+void _plugin_log(void *ctx, const char *severity, const char *ident, const char *message)
+{
+    const char *sev = SEV_INFO,
+               *interned = NULL;
+
+    (void)ctx;
+
+    /* Only ever hand the log strings of our own, which outlive the plugin */
+    switch (NULL == severity ? '\0' : severity[0]) {
+    case 'F':
+        sev = SEV_FATAL;
+        break;
+    case 'E':
+        sev = SEV_ERROR;
+        break;
+    case 'W':
+        sev = SEV_WARNING;
+        break;
+    case 'S':
+        sev = SEV_SUCCESS;
+        break;
+    }
+
+    if (NULL == ident || NULL == (interned = _plugin_intern_ident(ident))) {
+        spl_log("PLG", sev, "PLUGIN-MESSAGE", __FILE__, __LINE__, __FUNCTION__, "%s: %s",
+                NULL == ident ? "(none)" : ident, message);
+        return;
+    }
+
+    spl_log("PLG", sev, interned, __FILE__, __LINE__, __FUNCTION__, "%s", message);
+}
+
+static
+void _plugin_run(struct spl_plugin *plugin, struct spl_plugin_batch *batch)
+{
+    size_t next_sample = 0;
+
+    /* Each window goes after the samples in it, which were all batched ahead of it */
+    for (size_t w = 0; w < batch->nr_windows; w++) {
+        if (next_sample < batch->window_at[w]) {
+            plugin->ops->samples(plugin->state, &batch->samples[next_sample], batch->window_at[w] - next_sample);
+            next_sample = batch->window_at[w];
+        }
+
+        plugin->ops->window(plugin->state, &batch->windows[w]);
+    }
+
+    if (next_sample < batch->nr_samples) {
+        plugin->ops->samples(plugin->state, &batch->samples[next_sample], batch->nr_samples - next_sample);
+    }
+
+    batch->nr_samples = 0;
+    batch->nr_windows = 0;
+}
+
+static
+void _plugin_job(struct spl_pool_job *job)
+{
+    struct spl_plugin *plugin = (struct spl_plugin *)((char *)job - offsetof(struct spl_plugin, job));
+
+    _plugin_run(plugin, &plugin->batches[plugin->job_batch]);
+
+    __atomic_store_n(&plugin->busy, false, __ATOMIC_RELEASE);
+}
+
+static
+bool _plugin_batch_full(struct spl_plugin_batch const *batch)
+{
+    return SPL_PLUGIN_BATCH_SAMPLES == batch->nr_samples || SPL_PLUGIN_BATCH_WINDOWS == batch->nr_windows;
+}
+
+/**
+ * Hand the batch being filled to the plugin. Without a pool, that's a direct call.
+ */
+static
+void _plugin_dispatch(struct spl_plugin *plugin)
+{
+    struct spl_plugin_batch *batch = &plugin->batches[plugin->fill];
+
+    if (0 == batch->nr_samples && 0 == batch->nr_windows) {
+        return;
+    }
+
+    if (NULL == plugin->set->pool) {
+        uint64_t start_ns = get_mono_time_ns();
+
+        _plugin_run(plugin, batch);
+        spl_latency_add(&plugin->stats.run, get_mono_time_ns() - start_ns);
+        return;
+    }
+
+    if (false == __atomic_load_n(&plugin->busy, __ATOMIC_ACQUIRE)) {
+        plugin->job_batch = plugin->fill;
+        plugin->busy = true;
+
+        if (!FAILED(spl_pool_submit(plugin->set->pool, &plugin->job))) {
+            plugin->fill ^= 1;
+            return;
+        }
+
+        plugin->busy = false;
+    }
+
+    /* The plugin (or the pool) is still busy; keep filling, until there's no more room */
+    if (true == _plugin_batch_full(batch)) {
+        plugin->nr_dropped += batch->nr_samples;
+        batch->nr_samples = 0;
+        batch->nr_windows = 0;
+    }
+}
+
+static
+void _plugin_close_window(struct spl_plugin *plugin, struct spl_plugin_window *win, uint16_t device)
+{
+    struct spl_plugin_batch *batch = &plugin->batches[plugin->fill];
+    struct spl_rollup *rollup = &batch->windows[batch->nr_windows];
+
+    batch->window_at[batch->nr_windows++] = batch->nr_samples;
+
+    memset(rollup, 0, sizeof(*rollup));
+    rollup->ts_ns = win->start_ns;
+    rollup->nr_samples = win->nr_samples;
+    rollup->min_ddb = win->min_ddb;
+    rollup->max_ddb = win->max_ddb;
+    rollup->leq_ddb = spl_kern_energy_to_ddb(win->energy / (double)win->nr_samples);
+    rollup->device = device;
+    rollup->flags = win->flags;
+
+    win->nr_samples = 0;
+
+    if (true == _plugin_batch_full(batch)) {
+        _plugin_dispatch(plugin);
+    }
+}
+
+static
+void _plugin_add_window_sample(struct spl_plugin *plugin, struct spl_sample const *sample)
+{
+    struct spl_plugin_window *win = &plugin->windows[sample->device];
+    uint64_t start_ns = sample->ts_ns - sample->ts_ns % plugin->window_ns;
+
+    if (0 != win->nr_samples && start_ns != win->start_ns) {
+        _plugin_close_window(plugin, win, sample->device);
+    }
+
+    if (0 == win->nr_samples) {
+        win->start_ns = start_ns;
+        win->energy = 0.0;
+        win->min_ddb = UINT16_MAX;
+        win->max_ddb = 0;
+    }
+
+    win->energy += spl_kern_energy(sample->deci_db);
+    win->nr_samples++;
+    if (sample->deci_db < win->min_ddb) win->min_ddb = sample->deci_db;
+    if (sample->deci_db > win->max_ddb) win->max_ddb = sample->deci_db;
+    win->flags = sample->flags;
+}
+
+static
+void _plugin_unload(struct spl_plugin *plugin)
+{
+    if (NULL == plugin) {
+        return;
+    }
+
+    if (NULL != plugin->ops && NULL != plugin->ops->fini) {
+        plugin->ops->fini(plugin->state);
+    }
+
+    if (NULL != plugin->dl) {
+        dlclose(plugin->dl);
+    }
+
+    spl_free(plugin->windows);
+    spl_free(plugin);
+}
+
+int spl_plugins_new(struct spl_plugins **pset, size_t nr_devs, struct spl_pool *pool,
+        spl_plugin_publish_cb_t publish, void *publish_arg)
+{
+    int ret = A_OK;
+
+    struct spl_plugins *set = NULL;
+
+    ASSERT_ARG(NULL != pset);
+    ASSERT_ARG(0 != nr_devs);
+    ASSERT_ARG(NULL != publish);
+
+    *pset = NULL;
+
+    if (NULL == (set = spl_zalloc(sizeof(*set)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    set->pool = pool;
+    set->nr_devs = nr_devs;
+    set->publish = publish;
+    set->publish_arg = publish_arg;
+
+    set->host.abi_version = SPL_PLUGIN_ABI_VERSION;
+    set->host.nr_devices = nr_devs;
+    set->host.ctx = set;
+    set->host.publish = _plugin_publish;
+    set->host.log = _plugin_log;
+
+    *pset = set;
+
+done:
+    return ret;
+}
+
+int spl_plugins_load(struct spl_plugins *set, const char *spec)
+{
+    int ret = A_OK;
+
+    struct spl_plugin *plugin = NULL;
+    char path[SPL_PLUGIN_PATH_LEN];
+    const char *args = NULL;
+    size_t path_len = 0;
+    spl_plugin_entry_t entry = NULL;
+    struct spl_plugin_ops const *ops = NULL;
+
+    ASSERT_ARG(NULL != set);
+    ASSERT_ARG(NULL != spec);
+
+    if (SPL_PLUGIN_MAX == set->nr_plugins) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-TOO-MANY", "At most %d plugins can be loaded", SPL_PLUGIN_MAX);
+        ret = A_E_BUSY;
+        goto done;
+    }
+
+    if (NULL != (args = strchr(spec, ':'))) {
+        path_len = args - spec;
+        args++;
+    } else {
+        path_len = strlen(spec);
+        args = "";
+    }
+
+    if (0 == path_len || path_len >= sizeof(path)) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-BAD-PATH", "Bad plugin path in '%s'", spec);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    memcpy(path, spec, path_len);
+    path[path_len] = '\0';
+
+    if (NULL == (plugin = spl_zalloc(sizeof(*plugin)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    plugin->set = set;
+
+    if (NULL == (plugin->dl = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-LOAD-FAIL", "Failed to load plugin %s: %s", path, dlerror());
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    if (NULL == (*(void **)&entry = dlsym(plugin->dl, SPL_PLUGIN_ENTRY))) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-NO-ENTRY", "%s has no %s(), so isn't a plugin", path, SPL_PLUGIN_ENTRY);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (NULL == (ops = entry(SPL_PLUGIN_ABI_VERSION))) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-ABI-MISMATCH", "Plugin %s doesn't support plugin ABI version %d", path,
+                SPL_PLUGIN_ABI_VERSION);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (SPL_PLUGIN_ABI_VERSION != ops->abi_version || ops->ops_size < SPL_PLUGIN_OPS_V1_SIZE) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-ABI-MISMATCH", "Plugin %s was built for plugin ABI version %u, not %d", path,
+                ops->abi_version, SPL_PLUGIN_ABI_VERSION);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (NULL == ops->name || NULL == ops->init || NULL == ops->samples ||
+            (0 != ops->window_sec && NULL == ops->window))
+    {
+        SPL_MSG(SEV_ERROR, "PLUGIN-INCOMPLETE", "Plugin %s is missing a name or callbacks", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    snprintf(plugin->name, sizeof(plugin->name), "%s", ops->name);
+    plugin->window_ns = (uint64_t)ops->window_sec * SPL_NS_PER_SEC;
+
+    if (0 != plugin->window_ns && NULL == (plugin->windows = spl_zalloc(set->nr_devs * sizeof(*plugin->windows)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    plugin->job.fn = _plugin_job;
+    if (NULL != set->pool && FAILED(ret = spl_pool_stage(set->pool, plugin->name, &plugin->job.stage))) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-NO-STAGE", "Could not add plugin %s as a stage of the pool", plugin->name);
+        goto done;
+    }
+    snprintf(plugin->stats.name, sizeof(plugin->stats.name), "%s", plugin->name);
+
+    if (FAILED(ops->init(&plugin->state, args, &set->host))) {
+        SPL_MSG(SEV_ERROR, "PLUGIN-INIT-FAIL", "Plugin %s (from %s) failed to start", plugin->name, path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* Only now is there anything for fini() to clean up */
+    plugin->ops = ops;
+
+    SPL_MSG(SEV_INFO, "PLUGIN", "Loaded plugin %s from %s%s", plugin->name, path,
+            0 != plugin->window_ns ? ", with windows" : "");
+
+    set->plugins[set->nr_plugins++] = plugin;
+    plugin = NULL;
+
+done:
+    _plugin_unload(plugin);
+    return ret;
+}
+
+size_t spl_plugins_count(struct spl_plugins const *set)
+{
+    return NULL == set ? 0 : set->nr_plugins;
+}
+
+void spl_plugins_feed(struct spl_plugins *set, struct spl_sample const *sample)
+{
+    for (size_t i = 0; i < set->nr_plugins; i++) {
+        struct spl_plugin *plugin = set->plugins[i];
+        struct spl_plugin_batch *batch = NULL;
+
+        if (0 != plugin->window_ns && sample->device < set->nr_devs) {
+            _plugin_add_window_sample(plugin, sample);
+        }
+
+        /* Closing a window can have handed over the batch */
+        batch = &plugin->batches[plugin->fill];
+        batch->samples[batch->nr_samples++] = *sample;
+
+        if (true == _plugin_batch_full(batch)) {
+            _plugin_dispatch(plugin);
+        }
+    }
+}
+
+void spl_plugins_flush(struct spl_plugins *set)
+{
+    for (size_t i = 0; i < set->nr_plugins; i++) {
+        _plugin_dispatch(set->plugins[i]);
+    }
+}
+
+int spl_plugins_stats(struct spl_plugins *set, size_t idx, struct spl_pool_stats *stats, uint64_t *nr_dropped)
+{
+    int ret = A_OK;
+
+    struct spl_plugin const *plugin = NULL;
+
+    ASSERT_ARG(NULL != set);
+    ASSERT_ARG(idx < set->nr_plugins);
+    ASSERT_ARG(NULL != stats);
+    ASSERT_ARG(NULL != nr_dropped);
+
+    plugin = set->plugins[idx];
+
+    if (NULL != set->pool) {
+        ret = spl_pool_stats(set->pool, plugin->job.stage, stats);
+    } else {
+        *stats = plugin->stats;
+    }
+
+    *nr_dropped = plugin->nr_dropped;
+
+    return ret;
+}
+
+void spl_plugins_free(struct spl_plugins **pset)
+{
+    struct spl_plugins *set = NULL;
+
+    if (NULL == pset || NULL == *pset) {
+        return;
+    }
+
+    set = *pset;
+
+    for (size_t i = 0; i < set->nr_plugins; i++) {
+        struct spl_plugin *plugin = set->plugins[i];
+
+        while (true == __atomic_load_n(&plugin->busy, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+
+        /* Whatever is left runs here and now; windows still open are never closed */
+        _plugin_run(plugin, &plugin->batches[plugin->fill]);
+        _plugin_unload(plugin);
+    }
+
+    spl_free(set);
+    *pset = NULL;
+}
@@ -0,0 +1,119 @@
+/* splplugin.h -- Loadable processing stages
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+#include <splpool.h>
+#include <splstore.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A plugin is a shared object, loaded with dlopen(), that exports
+ *
+ *     struct spl_plugin_ops const *spl_plugin_entry(uint32_t host_abi_version);
+ *
+ * returning its operations, or NULL if it can't work with that version of the ABI. A plugin
+ * is never called once per sample. It's handed batches: every sample from every device, in
+ * the order they were read, a contiguous array at a time, and if it asks for windows, a
+ * summary of each device's window as it closes (after all of that window's samples). The
+ * callbacks for one plugin are never called at the same time, but with a pool (-j) they run
+ * on the pool's workers rather than on the thread polling the meters, so they should not
+ * block for long either way. Each plugin is a stage of its own, and its batches are timed
+ * like any other stage's jobs.
+ *
+ * The ABI version only changes when something existing changes; new fields are added to the
+ * end of struct spl_plugin_ops, and ops_size says how much of it a plugin knows about.
+ */
+#define SPL_PLUGIN_ABI_VERSION      1
+#define SPL_PLUGIN_ENTRY            "spl_plugin_entry"
+
+/* Samples and closed windows handed over at once, at most */
+#define SPL_PLUGIN_BATCH_SAMPLES    256
+#define SPL_PLUGIN_BATCH_WINDOWS    32
+
+#define SPL_PLUGIN_MAX              4
+#define SPL_PLUGIN_NAME_LEN         32
+
+/*
+ * What the host gives a plugin, for as long as it's loaded
+ */
+struct spl_plugin_host {
+    uint32_t abi_version;
+    uint32_t nr_devices;
+    /* Pass back to publish() and log() */
+    void *ctx;
+    /* Publish a record (one line, without its newline) to splread's output */
+    int (*publish)(void *ctx, char const *record, size_t len);
+    /* Log a message, through splread's log; severity is one of the SEV_ letters */
+    void (*log)(void *ctx, const char *severity, const char *ident, const char *message);
+};
+
+struct spl_plugin_ops {
+    /* SPL_PLUGIN_ABI_VERSION and sizeof(struct spl_plugin_ops), as the plugin was built */
+    uint32_t abi_version;
+    uint32_t ops_size;
+    const char *name;
+    /* Window length for window(), in seconds, aligned to the UNIX epoch; 0 for no windows */
+    uint32_t window_sec;
+    /* args is whatever followed the ':' in -X, or "". Returns A_OK, or the plugin isn't loaded. */
+    int (*init)(void **pstate, const char *args, struct spl_plugin_host const *host);
+    void (*samples)(void *state, struct spl_sample const *samples, size_t nr_samples);
+    /* A window closed; window->ts_ns is its start. Windows nothing was read in aren't passed on. */
+    void (*window)(void *state, struct spl_rollup const *window);
+    void (*fini)(void *state);
+};
+
+typedef struct spl_plugin_ops const *(*spl_plugin_entry_t)(uint32_t host_abi_version);
+
+/*
+ * The host side
+ */
+struct spl_plugins;
+
+typedef int (*spl_plugin_publish_cb_t)(char const *record, size_t len, void *arg);
+
+/**
+ * Set up to load plugins, for samples from nr_devs devices. With a pool, plugins run as jobs
+ * on it. publish is called (possibly from the pool's workers) for each record plugins publish.
+ */
+int spl_plugins_new(struct spl_plugins **pset, size_t nr_devs, struct spl_pool *pool,
+        spl_plugin_publish_cb_t publish, void *publish_arg);
+
+/**
+ * Load a plugin, from a spec of the form path[:args]
+ */
+int spl_plugins_load(struct spl_plugins *set, const char *spec);
+
+size_t spl_plugins_count(struct spl_plugins const *set);
+
+/**
+ * Batch a sample up for every plugin, closing any windows it ends
+ */
+void spl_plugins_feed(struct spl_plugins *set, struct spl_sample const *sample);
+
+/**
+ * Hand over whatever has been batched up. A plugin still busy with its last batch gets
+ * this one later, unless it fills up first, in which case it's dropped (and counted).
+ */
+void spl_plugins_flush(struct spl_plugins *set);
+
+/**
+ * How long a plugin's batches have been taking, and how many samples it's had dropped
+ * because it was too slow to keep up
+ */
+int spl_plugins_stats(struct spl_plugins *set, size_t idx, struct spl_pool_stats *stats, uint64_t *nr_dropped);
+
+/**
+ * Hand over anything still batched, wait for it to be done with, and unload every plugin.
+ * If there's a pool, free it first, so that nothing is left queued on it.
+ */
+void spl_plugins_free(struct spl_plugins **pset);
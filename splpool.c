@@ -0,0 +1,330 @@
+/* splpool.c -- A small work-stealing thread pool for analysis stages
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splpool.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* How far below the acquisition thread workers run */
+#define SPL_POOL_NICE               10
+
+struct spl_pool_worker {
+    struct spl_pool *pool;
+    unsigned id;
+    pthread_t thread;
+    /* Protects the queue and the accounting */
+    pthread_mutex_t lock;
+    /* A ring of max_jobs entries; the owner takes from the tail, thieves from the head */
+    struct spl_pool_job **queue;
+    uint64_t head;
+    uint64_t tail;
+    struct spl_latency wait[SPL_POOL_MAX_STAGES];
+    struct spl_latency run[SPL_POOL_MAX_STAGES];
+};
+
+struct spl_pool {
+    /* Protects everything below, and is what idle workers sleep on */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+    unsigned max_jobs;
+    /* Jobs submitted and not yet finished */
+    unsigned nr_jobs;
+    /* Jobs sitting in a queue, not yet picked up */
+    unsigned nr_queued;
+    unsigned next_worker;
+    /* Workers with a running thread, out of nr_workers */
+    unsigned nr_threads;
+    unsigned nr_stages;
+    char stage_names[SPL_POOL_MAX_STAGES][SPL_POOL_STAGE_NAME_LEN];
+    uint64_t nr_busy[SPL_POOL_MAX_STAGES];
+    unsigned nr_workers;
+    struct spl_pool_worker workers[];
+};
+
+/**
+ * Take a job from the worker's own queue, newest first, or failing that steal the oldest job
+ * from someone else's
+ */
+static
+struct spl_pool_job *_pool_take(struct spl_pool *pool, struct spl_pool_worker *self)
+{
+    struct spl_pool_job *job = NULL;
+
+    pthread_mutex_lock(&self->lock);
+    if (self->head != self->tail) {
+        job = self->queue[--self->tail % pool->max_jobs];
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    for (unsigned i = 1; NULL == job && i < pool->nr_workers; i++) {
+        struct spl_pool_worker *victim = &pool->workers[(self->id + i) % pool->nr_workers];
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head != victim->tail) {
+            job = victim->queue[victim->head++ % pool->max_jobs];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return job;
+}
+
+static
+void *_pool_worker_thread(void *arg)
+{
+    struct spl_pool_worker *self = arg;
+    struct spl_pool *pool = self->pool;
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    if (0 > setpriority(PRIO_PROCESS, tid, SPL_POOL_NICE)) {
+        SPL_MSG(SEV_WARNING, "NICE-FAIL", "Could not lower analysis worker CPU priority: %s", strerror(errno));
+    }
+
+    for (;;) {
+        struct spl_pool_job *job = _pool_take(pool, self);
+        uint64_t start_ns = 0,
+                 submit_ns = 0;
+        unsigned stage = 0;
+
+        if (NULL == job) {
+            pthread_mutex_lock(&pool->lock);
+            while (0 == pool->nr_queued && false == pool->stop) {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+            if (0 == pool->nr_queued && true == pool->stop) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->nr_queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* The job may be submitted again as soon as fn returns, so note what we need first */
+        stage = job->stage;
+        submit_ns = job->submit_ns;
+        start_ns = get_mono_time_ns();
+        job->fn(job);
+
+        pthread_mutex_lock(&self->lock);
+        spl_latency_add(&self->wait[stage], start_ns - submit_ns);
+        spl_latency_add(&self->run[stage], get_mono_time_ns() - start_ns);
+        pthread_mutex_unlock(&self->lock);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->nr_jobs--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+int spl_pool_new(struct spl_pool **ppool, unsigned nr_workers, unsigned max_jobs)
+{
+    int ret = A_OK;
+
+    struct spl_pool *pool = NULL;
+
+    ASSERT_ARG(NULL != ppool);
+
+    *ppool = NULL;
+
+    if (0 == nr_workers) {
+        long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_workers = nr_cpus > 0 ? (unsigned)nr_cpus : 1;
+    }
+
+    if (nr_workers > SPL_POOL_MAX_WORKERS) {
+        nr_workers = SPL_POOL_MAX_WORKERS;
+    }
+
+    if (0 == max_jobs) {
+        max_jobs = 4 * nr_workers;
+    }
+
+    if (NULL == (pool = spl_zalloc(sizeof(*pool) + nr_workers * sizeof(struct spl_pool_worker)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pool->max_jobs = max_jobs;
+    pool->nr_workers = nr_workers;
+
+    for (unsigned i = 0; i < nr_workers; i++) {
+        struct spl_pool_worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->id = i;
+        pthread_mutex_init(&worker->lock, NULL);
+
+        /* No queue ever holds more than the pool allows in total */
+        if (NULL == (worker->queue = spl_zalloc(max_jobs * sizeof(struct spl_pool_job *)))) {
+            ret = A_E_NOMEM;
+            goto done;
+        }
+    }
+
+    for (pool->nr_threads = 0; pool->nr_threads < nr_workers; pool->nr_threads++) {
+        if (0 != pthread_create(&pool->workers[pool->nr_threads].thread, NULL, _pool_worker_thread,
+                    &pool->workers[pool->nr_threads]))
+        {
+            SPL_MSG(SEV_ERROR, "POOL-START-FAIL", "Failed to start analysis worker %u", pool->nr_threads);
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+    *ppool = pool;
+
+done:
+    if (FAILED(ret) && NULL != pool) {
+        /* Stop whatever did start, then tear it all down */
+        spl_pool_free(&pool);
+    }
+
+    return ret;
+}
+
+void spl_pool_free(struct spl_pool **ppool)
+{
+    struct spl_pool *pool = NULL;
+
+    if (NULL == ppool || NULL == *ppool) {
+        return;
+    }
+
+    pool = *ppool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->nr_threads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    /* On a failed start, some workers may never have got as far as a lock or a queue */
+    for (unsigned i = 0; i < pool->nr_workers && NULL != pool->workers[i].pool; i++) {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        spl_free(pool->workers[i].queue);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    spl_free(pool);
+
+    *ppool = NULL;
+}
+
+unsigned spl_pool_nr_workers(struct spl_pool const *pool)
+{
+    return pool->nr_workers;
+}
+
+int spl_pool_stage(struct spl_pool *pool, const char *name, unsigned *pstage)
+{
+    int ret = A_OK;
+
+    ASSERT_ARG(NULL != pool);
+    ASSERT_ARG(NULL != name);
+    ASSERT_ARG(NULL != pstage);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (SPL_POOL_MAX_STAGES == pool->nr_stages) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    snprintf(pool->stage_names[pool->nr_stages], SPL_POOL_STAGE_NAME_LEN, "%s", name);
+    *pstage = pool->nr_stages++;
+
+done:
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+int spl_pool_submit(struct spl_pool *pool, struct spl_pool_job *job)
+{
+    int ret = A_OK;
+
+    struct spl_pool_worker *worker = NULL;
+
+    ASSERT_ARG(NULL != pool);
+    ASSERT_ARG(NULL != job);
+    ASSERT_ARG(NULL != job->fn);
+    ASSERT_ARG(job->stage < pool->nr_stages);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nr_jobs == pool->max_jobs) {
+        pool->nr_busy[job->stage]++;
+        pthread_mutex_unlock(&pool->lock);
+        ret = A_E_BUSY;
+        goto done;
+    }
+    pool->nr_jobs++;
+    worker = &pool->workers[pool->next_worker++ % pool->nr_workers];
+    pthread_mutex_unlock(&pool->lock);
+
+    job->submit_ns = get_mono_time_ns();
+
+    pthread_mutex_lock(&worker->lock);
+    worker->queue[worker->tail++ % pool->max_jobs] = job;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->nr_queued++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+done:
+    return ret;
+}
+
+int spl_pool_stats(struct spl_pool *pool, unsigned stage, struct spl_pool_stats *stats)
+{
+    int ret = A_OK;
+
+    ASSERT_ARG(NULL != pool);
+    ASSERT_ARG(NULL != stats);
+    ASSERT_ARG(stage < pool->nr_stages);
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&pool->lock);
+    snprintf(stats->name, sizeof(stats->name), "%s", pool->stage_names[stage]);
+    stats->nr_busy = pool->nr_busy[stage];
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->nr_workers; i++) {
+        struct spl_pool_worker *worker = &pool->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        spl_latency_merge(&stats->wait, &worker->wait[stage]);
+        spl_latency_merge(&stats->run, &worker->run[stage]);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    return ret;
+}
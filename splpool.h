@@ -0,0 +1,85 @@
+/* splpool.h -- A small work-stealing thread pool for analysis stages
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+#include <splhub.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Analysis stages hand work that can't be done on the acquisition thread (typically whatever
+ * happens when a window closes) to the pool as jobs. Each worker has its own queue; jobs are
+ * handed out round-robin, a worker runs its own jobs newest first, and a worker that runs out
+ * steals the oldest job from another's queue.
+ *
+ * Jobs are embedded in the stage's own state, so submitting never allocates. The number of
+ * jobs queued or running at once is bounded: once the pool is full, submitting fails with
+ * A_E_BUSY, and it's up to the stage to hold on to the work and try again later. A job is
+ * owned by the pool from when it's submitted until its function returns, and must not be
+ * submitted again before then.
+ *
+ * Workers run at a lower CPU priority than the acquisition thread, so a burst of analysis
+ * can't hold up polling.
+ */
+#define SPL_POOL_MAX_WORKERS        64
+#define SPL_POOL_MAX_STAGES         8
+#define SPL_POOL_STAGE_NAME_LEN     32
+
+struct spl_pool;
+struct spl_pool_job;
+
+typedef void (*spl_pool_job_fn_t)(struct spl_pool_job *job);
+
+struct spl_pool_job {
+    spl_pool_job_fn_t fn;
+    /* The stage this job belongs to, from spl_pool_stage() */
+    unsigned stage;
+    /* Filled in by the pool: when the job was submitted, in monotonic ns */
+    uint64_t submit_ns;
+};
+
+/*
+ * Per-stage accounting: how long jobs waited to start, and how long they took to run
+ */
+struct spl_pool_stats {
+    char name[SPL_POOL_STAGE_NAME_LEN];
+    uint64_t nr_busy;
+    struct spl_latency wait;
+    struct spl_latency run;
+};
+
+/**
+ * Start a pool of nr_workers threads (0 for one per CPU), allowing up to max_jobs jobs to be
+ * queued or running at once (0 for four per worker)
+ */
+int spl_pool_new(struct spl_pool **ppool, unsigned nr_workers, unsigned max_jobs);
+
+/**
+ * Run every job already submitted, then stop the workers and free the pool
+ */
+void spl_pool_free(struct spl_pool **ppool);
+
+unsigned spl_pool_nr_workers(struct spl_pool const *pool);
+
+/**
+ * Register a stage, for accounting. Returns the stage number to put in its jobs.
+ */
+int spl_pool_stage(struct spl_pool *pool, const char *name, unsigned *pstage);
+
+/**
+ * Hand a job to the pool. Returns A_E_BUSY if the pool already has as many jobs as it allows.
+ */
+int spl_pool_submit(struct spl_pool *pool, struct spl_pool_job *job);
+
+/**
+ * Get the accounting for a stage, summed across all workers
+ */
+int spl_pool_stats(struct spl_pool *pool, unsigned stage, struct spl_pool_stats *stats);
@@ -0,0 +1,567 @@
+/* splpy.c -- Python bindings: batches of samples from a meter or a flight recorder
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+
+/* Python.h has to come before anything else that pulls in the system headers */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <gm1356.h>
+#include <splcommon.h>
+#include <splflight.h>
+#include <splmeter.h>
+
+#include <hidapi.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+/*
+ * Samples are never turned into Python objects one at a time. A Batch owns an array of
+ * struct spl_sample and hands it out through the buffer protocol, with a struct format
+ * that NumPy turns into a structured dtype, so numpy.asarray(batch) is a view onto the
+ * samples with nothing copied. memoryview(batch) works without NumPy.
+ */
+#define SPLPY_SAMPLE_FORMAT         "T{<Q:ts_ns:<H:deci_db:<H:device:<B:flags:<B:_resv0:<H:ts_err_us:}"
+
+/* Records copied out of the flight recorder at a time, on the stack */
+#define SPLPY_FLIGHT_CHUNK          32
+
+#define SPLPY_FLIGHT_DEFAULT_MAX    65536
+
+PyMODINIT_FUNC PyInit_gm1356(void);
+
+typedef struct {
+    PyObject_HEAD
+    struct spl_sample *samples;
+    Py_ssize_t nr_samples;
+    Py_ssize_t shape[1];
+    Py_ssize_t strides[1];
+} splpy_batch_t;
+
+typedef struct {
+    PyObject_HEAD
+    hid_device *hid;
+    uint16_t device;
+    /* The shortest round trips seen lately, for timestamping samples */
+    struct spl_meter_rtt rtt;
+    /* Set while a read is going on with the GIL released */
+    bool busy;
+} splpy_meter_t;
+
+typedef struct {
+    PyObject_HEAD
+    struct spl_flight_reader *reader;
+} splpy_flight_t;
+
+static
+PyTypeObject splpy_batch_type;
+
+static
+PyObject *_splpy_error(int err, const char *what)
+{
+    switch (err) {
+    case A_E_NOMEM:
+        return PyErr_NoMemory();
+    case A_E_NOTFOUND:
+        PyErr_Format(PyExc_FileNotFoundError, "%s: not found", what);
+        break;
+    case A_E_BADARGS:
+    case A_E_INVAL:
+        PyErr_Format(PyExc_ValueError, "%s: invalid", what);
+        break;
+    default:
+        PyErr_Format(PyExc_OSError, "%s: failed (%d)", what, err);
+        break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Batch
+ */
+
+static
+splpy_batch_t *_splpy_batch_new(Py_ssize_t nr_samples)
+{
+    splpy_batch_t *batch = NULL;
+
+    if (NULL == (batch = PyObject_New(splpy_batch_t, &splpy_batch_type))) {
+        return NULL;
+    }
+
+    batch->nr_samples = 0;
+    if (NULL == (batch->samples = PyMem_Calloc(0 == nr_samples ? 1 : nr_samples, sizeof(struct spl_sample)))) {
+        Py_DECREF(batch);
+        return (splpy_batch_t *)PyErr_NoMemory();
+    }
+
+    return batch;
+}
+
+static
+void _splpy_batch_dealloc(PyObject *self)
+{
+    splpy_batch_t *batch = (splpy_batch_t *)self;
+
+    PyMem_Free(batch->samples);
+    PyObject_Free(self);
+}
+
+static
+int _splpy_batch_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+    splpy_batch_t *batch = (splpy_batch_t *)self;
+
+    if (0 != (flags & PyBUF_WRITABLE)) {
+        PyErr_SetString(PyExc_BufferError, "Batch is read-only");
+        view->obj = NULL;
+        return -1;
+    }
+
+    batch->shape[0] = batch->nr_samples;
+    batch->strides[0] = sizeof(struct spl_sample);
+
+    view->obj = Py_NewRef(self);
+    view->buf = batch->samples;
+    view->len = batch->nr_samples * sizeof(struct spl_sample);
+    view->readonly = 1;
+    view->itemsize = sizeof(struct spl_sample);
+    view->format = (flags & PyBUF_FORMAT) ? SPLPY_SAMPLE_FORMAT : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? batch->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? batch->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    return 0;
+}
+
+static
+Py_ssize_t _splpy_batch_len(PyObject *self)
+{
+    return ((splpy_batch_t *)self)->nr_samples;
+}
+
+static
+PyBufferProcs splpy_batch_buffer = {
+    .bf_getbuffer = _splpy_batch_getbuffer,
+};
+
+static
+PySequenceMethods splpy_batch_seq = {
+    .sq_length = _splpy_batch_len,
+};
+
+static
+PyTypeObject splpy_batch_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gm1356.Batch",
+    .tp_doc = PyDoc_STR("Samples, as a buffer of records (ts_ns, deci_db, device, flags, ts_err_us); use numpy.asarray()"),
+    .tp_basicsize = sizeof(splpy_batch_t),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = _splpy_batch_dealloc,
+    .tp_as_buffer = &splpy_batch_buffer,
+    .tp_as_sequence = &splpy_batch_seq,
+};
+
+/*
+ * Meter
+ */
+
+/**
+ * Find the meter to open: the one at path, the one with the given serial number, or the
+ * only one attached.
+ */
+static
+hid_device *_splpy_meter_open(const char *path, const char *serial)
+{
+    struct hid_device_info *hid_devs = NULL;
+    wchar_t wserial[128];
+    char *found = NULL;
+    size_t nr_found = 0;
+    hid_device *hid = NULL;
+
+    if (NULL != path) {
+        return hid_open_path(path);
+    }
+
+    if (NULL != serial && (size_t)-1 == mbstowcs(wserial, serial, sizeof(wserial) / sizeof(wserial[0]))) {
+        return NULL;
+    }
+
+    hid_devs = hid_enumerate(GM1356_SPLMETER_VID, GM1356_SPLMETER_PID);
+
+    for (struct hid_device_info *cur_dev = hid_devs; NULL != cur_dev; cur_dev = cur_dev->next) {
+        if (NULL != serial && (NULL == cur_dev->serial_number || 0 != wcscmp(wserial, cur_dev->serial_number))) {
+            continue;
+        }
+
+        if (0 == nr_found++) {
+            found = strdup(cur_dev->path);
+        }
+    }
+
+    hid_free_enumeration(hid_devs);
+
+    /* Don't guess which of several meters was meant */
+    if (1 == nr_found && NULL != found) {
+        hid = hid_open_path(found);
+    }
+
+    free(found);
+
+    return hid;
+}
+
+static
+int _splpy_meter_init(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = { "path", "serial", "range", "fast", "dbc", "device", NULL };
+    splpy_meter_t *meter = (splpy_meter_t *)self;
+    const char *path = NULL,
+               *serial = NULL;
+    unsigned range = GM1356_RANGE_30_130_DB;
+    int fast = 0,
+        dbc = 0;
+    unsigned short device = 0;
+    int ret = A_OK;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zzIppH", kwlist, &path, &serial, &range, &fast, &dbc,
+                &device))
+    {
+        return -1;
+    }
+
+    if (range > GM1356_RANGE_80_130_DB) {
+        PyErr_SetString(PyExc_ValueError, "range must be 0 to 4");
+        return -1;
+    }
+
+    if (NULL != meter->hid) {
+        hid_close(meter->hid);
+        meter->hid = NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (NULL != (meter->hid = _splpy_meter_open(path, serial))) {
+        ret = spl_meter_configure(meter->hid, range, fast, dbc);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (NULL == meter->hid) {
+        PyErr_SetString(PyExc_OSError, NULL != path ? "Could not open the meter at that path" :
+                "Could not find exactly one matching meter");
+        return -1;
+    }
+
+    if (FAILED(ret)) {
+        hid_close(meter->hid);
+        meter->hid = NULL;
+        _splpy_error(ret, "Configuring meter");
+        return -1;
+    }
+
+    meter->device = device;
+    memset(&meter->rtt, 0, sizeof(meter->rtt));
+    meter->busy = false;
+
+    return 0;
+}
+
+static
+void _splpy_meter_dealloc(PyObject *self)
+{
+    splpy_meter_t *meter = (splpy_meter_t *)self;
+
+    if (NULL != meter->hid) {
+        hid_close(meter->hid);
+    }
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static
+PyObject *_splpy_meter_read(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = { "n", "interval_ms", NULL };
+    splpy_meter_t *meter = (splpy_meter_t *)self;
+    Py_ssize_t nr_samples = 0;
+    unsigned long long interval_ms = 500;
+    splpy_batch_t *batch = NULL;
+    size_t nr_read = 0;
+    int ret = A_OK;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|K", kwlist, &nr_samples, &interval_ms)) {
+        return NULL;
+    }
+
+    if (0 > nr_samples || 0 == interval_ms) {
+        PyErr_SetString(PyExc_ValueError, "n must not be negative, and interval_ms must not be 0");
+        return NULL;
+    }
+
+    if (NULL == meter->hid) {
+        PyErr_SetString(PyExc_ValueError, "Meter is closed");
+        return NULL;
+    }
+
+    /* The GIL is released while we poll, so guard against two threads using the meter at once */
+    if (true == meter->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Meter is already being read from another thread");
+        return NULL;
+    }
+
+    if (NULL == (batch = _splpy_batch_new(nr_samples))) {
+        return NULL;
+    }
+
+    meter->busy = true;
+    Py_BEGIN_ALLOW_THREADS
+    ret = spl_meter_poll(meter->hid, meter->device, &meter->rtt, batch->samples, nr_samples,
+            interval_ms * SPL_NS_PER_MS, &nr_read);
+    Py_END_ALLOW_THREADS
+    meter->busy = false;
+
+    batch->nr_samples = nr_read;
+
+    if (FAILED(ret)) {
+        Py_DECREF(batch);
+        return _splpy_error(ret, "Polling meter");
+    }
+
+    return (PyObject *)batch;
+}
+
+static
+PyObject *_splpy_meter_close(PyObject *self, PyObject *unused)
+{
+    splpy_meter_t *meter = (splpy_meter_t *)self;
+
+    (void)unused;
+
+    if (true == meter->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Meter is being read from another thread");
+        return NULL;
+    }
+
+    if (NULL != meter->hid) {
+        hid_close(meter->hid);
+        meter->hid = NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static
+PyMethodDef splpy_meter_methods[] = {
+    { "read", (PyCFunction)(void (*)(void))_splpy_meter_read, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("read(n, interval_ms=500) -> Batch\n\nPoll the meter n times, interval_ms apart. Polls the "
+                "meter didn't answer in time are left out.") },
+    { "close", _splpy_meter_close, METH_NOARGS, PyDoc_STR("Close the meter") },
+    { NULL, NULL, 0, NULL },
+};
+
+static
+PyTypeObject splpy_meter_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gm1356.Meter",
+    .tp_doc = PyDoc_STR("Meter(path=None, serial=None, range=0, fast=False, dbc=False, device=0)\n\n"
+            "A GM1356, opened by hidapi path, by serial number, or the only one attached"),
+    .tp_basicsize = sizeof(splpy_meter_t),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = _splpy_meter_init,
+    .tp_dealloc = _splpy_meter_dealloc,
+    .tp_methods = splpy_meter_methods,
+};
+
+/*
+ * FlightReader
+ */
+
+static
+int _splpy_flight_init(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = { "path", "from_oldest", NULL };
+    splpy_flight_t *flight = (splpy_flight_t *)self;
+    const char *path = NULL;
+    int from_oldest = 0;
+    int ret = A_OK;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|p", kwlist, &path, &from_oldest)) {
+        return -1;
+    }
+
+    spl_flight_reader_close(&flight->reader);
+
+    if (FAILED(ret = spl_flight_reader_open(&flight->reader, path, from_oldest))) {
+        _splpy_error(ret, path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+void _splpy_flight_dealloc(PyObject *self)
+{
+    splpy_flight_t *flight = (splpy_flight_t *)self;
+
+    spl_flight_reader_close(&flight->reader);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static
+PyObject *_splpy_flight_read(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = { "max", NULL };
+    splpy_flight_t *flight = (splpy_flight_t *)self;
+    Py_ssize_t max_samples = SPLPY_FLIGHT_DEFAULT_MAX;
+    splpy_batch_t *batch = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n", kwlist, &max_samples)) {
+        return NULL;
+    }
+
+    if (0 > max_samples) {
+        PyErr_SetString(PyExc_ValueError, "max must not be negative");
+        return NULL;
+    }
+
+    if (NULL == flight->reader) {
+        PyErr_SetString(PyExc_ValueError, "FlightReader is not open");
+        return NULL;
+    }
+
+    if (NULL == (batch = _splpy_batch_new(max_samples))) {
+        return NULL;
+    }
+
+    /* Records are copied out a chunk at a time and decoded straight into the batch */
+    while (batch->nr_samples < max_samples) {
+        struct spl_flight_rec recs[SPLPY_FLIGHT_CHUNK];
+        size_t want = max_samples - batch->nr_samples < SPLPY_FLIGHT_CHUNK ?
+                        (size_t)(max_samples - batch->nr_samples) : SPLPY_FLIGHT_CHUNK,
+               nr_read = 0;
+
+        spl_flight_reader_next(flight->reader, recs, want, &nr_read);
+
+        for (size_t i = 0; i < nr_read; i++) {
+            spl_meter_decode(recs[i].report, recs[i].ts_ns, recs[i].device, &batch->samples[batch->nr_samples++]);
+        }
+
+        if (nr_read < want) {
+            break;
+        }
+    }
+
+    return (PyObject *)batch;
+}
+
+static
+PyObject *_splpy_flight_get_nr_missed(PyObject *self, void *closure)
+{
+    splpy_flight_t *flight = (splpy_flight_t *)self;
+
+    (void)closure;
+
+    return PyLong_FromUnsignedLongLong(NULL == flight->reader ? 0 : flight->reader->nr_missed);
+}
+
+static
+PyMethodDef splpy_flight_methods[] = {
+    { "read", (PyCFunction)(void (*)(void))_splpy_flight_read, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("read(max=65536) -> Batch\n\nEverything recorded since the last read, up to max samples. "
+                "Never waits.") },
+    { NULL, NULL, 0, NULL },
+};
+
+static
+PyGetSetDef splpy_flight_getset[] = {
+    { "nr_missed", _splpy_flight_get_nr_missed, NULL,
+        PyDoc_STR("Records overwritten before they could be read"), NULL },
+    { NULL, NULL, NULL, NULL, NULL },
+};
+
+static
+PyTypeObject splpy_flight_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gm1356.FlightReader",
+    .tp_doc = PyDoc_STR("FlightReader(path, from_oldest=False)\n\n"
+            "Follow the flight recorder splread -F writes to, through a read-only shared mapping"),
+    .tp_basicsize = sizeof(splpy_flight_t),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = _splpy_flight_init,
+    .tp_dealloc = _splpy_flight_dealloc,
+    .tp_methods = splpy_flight_methods,
+    .tp_getset = splpy_flight_getset,
+};
+
+/*
+ * Module
+ */
+
+static
+PyObject *_splpy_nr_calls(PyObject *self, PyObject *unused)
+{
+    (void)self;
+    (void)unused;
+
+    return PyLong_FromUnsignedLongLong(spl_meter_nr_calls());
+}
+
+static
+PyMethodDef splpy_methods[] = {
+    { "nr_calls", _splpy_nr_calls, METH_NOARGS, PyDoc_STR("Calls made into hidapi so far, by every Meter") },
+    { NULL, NULL, 0, NULL },
+};
+
+static
+PyModuleDef splpy_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "gm1356",
+    .m_doc = PyDoc_STR("Read GM1356 sound level meters, or splread's flight recorder, a batch at a time"),
+    .m_size = -1,
+    .m_methods = splpy_methods,
+};
+
+PyMODINIT_FUNC PyInit_gm1356(void)
+{
+    PyObject *module = NULL;
+
+    if (0 != hid_init()) {
+        PyErr_SetString(PyExc_OSError, "Failed to initialize hidapi");
+        return NULL;
+    }
+
+    if (0 > PyType_Ready(&splpy_batch_type) || 0 > PyType_Ready(&splpy_meter_type) ||
+            0 > PyType_Ready(&splpy_flight_type))
+    {
+        return NULL;
+    }
+
+    if (NULL == (module = PyModule_Create(&splpy_module))) {
+        return NULL;
+    }
+
+    if (0 > PyModule_AddObjectRef(module, "Batch", (PyObject *)&splpy_batch_type) ||
+            0 > PyModule_AddObjectRef(module, "Meter", (PyObject *)&splpy_meter_type) ||
+            0 > PyModule_AddObjectRef(module, "FlightReader", (PyObject *)&splpy_flight_type) ||
+            0 > PyModule_AddStringConstant(module, "SAMPLE_FORMAT", SPLPY_SAMPLE_FORMAT))
+    {
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
@@ -6,67 +6,99 @@
  * This software may be modified and distributed under the terms
  * of the BSD license.  See the LICENSE file for details.
  */
+#include <gm1356.h>
+#include <splarena.h>
+#include <splburst.h>
+#include <splcommon.h>
+#include <splcompact.h>
+#include <splevent.h>
+#include <splflight.h>
+#include <splfmt.h>
+#include <splhub.h>
+#include <splload.h>
+#include <splmeter.h>
+#include <splphase.h>
+#include <splplugin.h>
+#include <splpool.h>
+#include <splring.h>
+#include <splrule.h>
+#include <splshard.h>
+#include <splstore.h>
+#include <splwheel.h>
+
 #include <hidapi.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
-#define GM1356_SPLMETER_VID         0x64bd
-#define GM1356_SPLMETER_PID         0x74e3
-
-#define GM1356_FAST_MODE            0x40
-#define GM1356_HOLD_MAX_MODE        0x20
-#define GM1356_MEASURE_DBC          0x10
+#define SPLREAD_COMPACT_INTERVAL_SEC    600
 
-#define GM1356_RANGE_30_130_DB      0x0
-#define GM1356_RANGE_30_80_DB       0x1
-#define GM1356_RANGE_50_100_DB      0x2
-#define GM1356_RANGE_60_110_DB      0x3
-#define GM1356_RANGE_80_130_DB      0x4
+/* Granularity of the poll scheduler */
+#define SPLREAD_TICK_MS                 10
 
-#define GM1356_FLAGS_RANGE_MASK     0xf
+/*
+ * In low-wakeup mode, polls due within the same (coarser) tick are handled in one wakeup, the
+ * kernel may let our sleeps run this much late (up to 1% of the shortest poll interval), and
+ * meters are let suspend after being idle for this long, when they're polled rarely enough
+ */
+#define SPLREAD_LOW_WAKE_TICK_MS        100
+#define SPLREAD_LOW_WAKE_MAX_SLACK_MS   100
+#define SPLREAD_AUTOSUSPEND_DELAY_MS    1000
 
-#define GM1356_COMMAND_CAPTURE      0xb3
-#define GM1356_COMMAND_CONFIGURE    0x56
+/* How often to report round trip latency per USB hub */
+#define SPLREAD_HUB_REPORT_SEC          300
 
-#define SEV_SUCCESS     "S"
-#define SEV_INFO        "I"
-#define SEV_WARNING     "W"
-#define SEV_ERROR       "E"
-#define SEV_FATAL       "F"
+/*
+ * In line protocol mode, lines are written out in batches of this many (by default), or once
+ * the oldest line in the batch is this old, whichever comes first
+ */
+#define SPLREAD_LP_BATCH_LINES          5000
+#define SPLREAD_LP_FLUSH_MS             1000
 
-#define MESSAGE(subsys, severity, ident, message, ...) \
-        do { \
-            fprintf(stderr, "%%" subsys "-" severity "-" ident ", " message " (%s:%d in %s)\n", ##__VA_ARGS__, __FILE__, __LINE__, __FUNCTION__); \
-        } while (0)
-#define SPL_MSG(sev, ident, message, ...)     MESSAGE("SPL", sev, ident, message, ##__VA_ARGS__)
+/*
+ * Plugins are handed a batch once it's full, or once this often, whichever comes first, so
+ * they see every sample at least this promptly without being called for each one
+ */
+#define SPLREAD_PLUGIN_FLUSH_MS         1000
 
-#define ASSERT_ARG(_x_) \
-    do { \
-        if (!(_x_)) { \
-            SPL_MSG(SEV_FATAL, "BAD-AGUMENTS", "Bad arguments - %s:%d (function %s): " #_x_ " is FALSE", __FILE__, __LINE__, __FUNCTION__); \
-            return A_E_BADARGS; \
-        } \
-    } while (0)
+/* Requests we remember having sent to a device, waiting on a response */
+#define SPLREAD_MAX_OUTSTANDING         4
+/* Give up on a request, as lost, once it's this old (or two polls old, if that's longer) */
+#define SPLREAD_RESP_EXPIRE_MS          250
 
-#define DIAG(...) /* Define as an alias to MESSAGE for debug output */
+/* Start shedding load when polls start this late, by default */
+#define SPLREAD_LAG_LIMIT_MS            500
 
-#define FAILED(_x_)                 (0 != (_x_))
+/*
+ * With workers, how often to check on them, how long to wait before restarting one that's
+ * stopped, and how long one may spend talking to its meters (at the least) before it's taken
+ * to be hung. Workers get this long to finish up when we're stopping.
+ */
+#define SPLREAD_SHARD_CHECK_MS          1000
+#define SPLREAD_SHARD_RESPAWN_SEC       5
+#define SPLREAD_SHARD_HANG_MIN_SEC      10
+#define SPLREAD_SHARD_STOP_MS           2000
+/* Records taken off a worker's ring at once */
+#define SPLREAD_SHARD_DRAIN_RECS        32
 
-#define A_OK                        0
-#define A_E_NOTFOUND                -1
-#define A_E_BADARGS                 -2
-#define A_E_INVAL                   -3
-#define A_E_EMPTY                   -4
-#define A_E_TIMEOUT                 -5
+/* In fixed-footprint mode, how much anonymous memory may grow past what it was at startup */
+#define SPLREAD_RSS_SLACK_KIB           256
+#define SPLREAD_STDOUT_BUF_LEN          8192
 
 const char *gm1356_range_str[] = {
     "30-130",
@@ -88,11 +120,324 @@ bool measure_dbc = false;
 static
 unsigned config_range = GM1356_RANGE_30_130_DB;
 
+/* Default polling interval, for devices that don't have their own */
 static
 uint64_t interval_ms = 500ul;
 
+/*
+ * Devices asked for by serial number (-S), each with its own polling interval. The index
+ * in this list is the device index recorded in the store.
+ */
+struct splread_dev_config {
+    /* As given to -S; converted to serial once there's somewhere to put it */
+    const char *serial_arg;
+    wchar_t *serial;
+    /* 0 to use the default interval */
+    uint64_t interval_ms;
+};
+
+static
+struct splread_dev_config *config_devs = NULL;
+
+static
+size_t config_nr_devs = 0;
+
+static
+bool config_all_devices = false;
+
+static
+bool config_no_stagger = false;
+
+static
+const char *config_store_dir = NULL;
+
+static
+uint16_t config_event_threshold_ddb = 0;
+
+static
+bool config_retention = false;
+
+static
+bool config_burst = false;
+
+static
+struct spl_burst_config config_burst_cfg;
+
+static
+bool config_phase_lock = false;
+
+static
+const char *config_flight_path = NULL;
+
+static
+size_t config_flight_slots = SPL_FLIGHT_DEFAULT_SLOTS;
+
+static
+struct spl_retention config_retention_policy;
+
+/*
+ * The output template, compiled once at startup, and a buffer big enough for any record it
+ * can produce
+ */
+static
+bool config_have_template = false;
+
+static
+struct spl_fmt_tmpl out_tmpl;
+
+static
+char *out_buf = NULL;
+
+/* Print InfluxDB line protocol for this measurement, rather than JSON */
+static
+const char *config_lp_measurement = NULL;
+
+static
+size_t config_lp_batch_lines = SPLREAD_LP_BATCH_LINES;
+
+/* How late polls can start before we shed load; 0 never sheds */
+static
+uint64_t config_lag_limit_ms = SPLREAD_LAG_LIMIT_MS;
+
+static
+struct spl_load load;
+
+/* Alert rules, loaded from this file */
+static
+const char *config_rules_path = NULL;
+
+static
+struct spl_rule_set *rule_set = NULL;
+
+/* Processing stages loaded from shared objects, each given as path[:args] */
+static
+const char *config_plugins[SPL_PLUGIN_MAX];
+
+static
+size_t config_nr_plugins = 0;
+
+static
+struct spl_plugins *plugins = NULL;
+
+/* Run analysis stages (evaluating alert rules, and plugins) on a pool of worker threads */
+static
+bool config_pool = false;
+
+static
+unsigned config_pool_threads = 0;
+
+static
+unsigned config_pool_jobs = 0;
+
+static
+struct spl_pool *pool = NULL;
+
+/* Set aside this much memory at startup and allocate nothing once polling starts (0 if not) */
+static
+size_t config_arena_kib = 0;
+
+/* Poll devices from worker processes, one per USB bus, hub or device, rather than from this one */
+static
+const char *config_shard_by = NULL;
+
+/* Talk to devices through their hidraw nodes with io_uring, rather than through hidapi */
+static
+bool config_ring = false;
+
+static
+struct spl_ring *ring = NULL;
+
+/*
+ * io_uring's system calls made to get samples (splmeter counts hidapi calls for us), and
+ * the samples they got us
+ */
+static
+uint64_t nr_io_calls = 0;
+
+static
+uint64_t nr_io_samples = 0;
+
+/* Keep wakeups to a minimum, for meters that are polled rarely */
+static
+bool config_low_wake = false;
+
+/* Times the poll loop has woken up, and when (and how many context switches in) we last said */
+static
+uint64_t nr_wakeups = 0;
+
+static
+uint64_t wakeups_since_ns = 0;
+
+static
+long wakeups_since_nvcsw = 0;
+
+/* Anonymous memory resident once startup was done, in KiB */
+static
+unsigned long rss_baseline_kib = 0;
+
+static
+unsigned rules_stage = 0;
+
+/*
+ * A capture request sent to a device. The meter's responses don't say which request they
+ * answer, but they do come back in order, so each report read is matched to the oldest
+ * request still outstanding.
+ */
+struct splread_req {
+    uint64_t seq;
+    /* When it was sent, on the monotonic clock */
+    uint64_t sent_ns;
+    /* We've given up on it, but it keeps its place so a late response to it isn't taken for a newer one's */
+    bool expired;
+};
+
+/*
+ * An open device, and its place in the poll schedule
+ */
+struct splread_dev {
+    /* Index of the device, as recorded in the store */
+    uint16_t id;
+    char *path;
+    wchar_t *serial;
+    /* How often samples are reported */
+    uint64_t interval_ms;
+    /* How often the device is actually polled; shorter than interval_ms in burst mode */
+    uint64_t poll_ms;
+    /* When the next sample is due to be reported, in burst mode */
+    uint64_t next_report_ns;
+    /* Index of the USB hub this device hangs off, in hubs */
+    size_t hub;
+    /* Index of the worker that polls this device, in shards */
+    size_t shard;
+    /* The shortest round trips seen lately, for placing each measurement in time */
+    struct spl_meter_rtt rtt;
+    hid_device *hid;
+    /* The device's hidraw node, opened for the io_uring engine (or -1) */
+    int ring_fd;
+    /* Still waiting on the response to this poll's request, with the io_uring engine */
+    bool awaiting;
+    /* The serial number, for output templates */
+    char *serial_str;
+    size_t serial_len;
+    /* The measurement and tags that start every line protocol line for this device */
+    char *lp_prefix;
+    size_t lp_prefix_len;
+    /* The same, for alerts */
+    char *lp_alert_prefix;
+    size_t lp_alert_prefix_len;
+    /* Windowed aggregates and alert state, if there are rules */
+    struct spl_rule_eval *rules;
+    /* Samples that could have been printed, for decimating the output under load */
+    uint64_t nr_out;
+    struct spl_timer timer;
+    /* When (on the monotonic clock) the current poll of this device was due */
+    uint64_t due_ns;
+    /* When the current capture request was sent */
+    uint64_t sent_ns;
+    /* Requests not yet answered, oldest first, starting at req_head in a ring */
+    struct splread_req reqs[SPLREAD_MAX_OUTSTANDING];
+    unsigned req_head;
+    unsigned nr_reqs;
+    uint64_t next_seq;
+    /* Responses to requests we'd given up waiting for, and discarded */
+    uint64_t nr_late;
+    /* Reports that didn't answer any request we know of */
+    uint64_t nr_orphaned;
+    /* Requests that never got a response */
+    uint64_t nr_lost;
+    /* Link in the list of devices due to be polled this tick */
+    struct splread_dev *next_due;
+    struct spl_event_detector evt_det;
+    struct spl_burst burst;
+    /* The meter's refresh cadence, and the last report seen, when phase locking */
+    struct spl_phase phase;
+    uint8_t last_report[3];
+};
+
+static
+struct splread_dev *devs = NULL;
+
+static
+size_t nr_devs = 0;
+
+/*
+ * Devices sharing a USB 2.0 hub share its transaction translator, so requests to them
+ * queue up behind each other. We spread polls of devices on the same hub across their
+ * interval, and track how long round trips take on each hub.
+ */
+struct splread_hub {
+    char name[SPL_USB_PORT_LEN];
+    size_t nr_devs;
+    struct spl_latency lat;
+};
+
+static
+struct splread_hub *hubs = NULL;
+
+static
+size_t nr_hubs = 0;
+
+/*
+ * A worker process, polling a group of devices and passing their reports back through a
+ * shared ring
+ */
+struct splread_shard {
+    char name[SPL_USB_PORT_LEN];
+    size_t nr_devs;
+    struct spl_shard_ring *ring;
+    /* 0 if the worker isn't running */
+    pid_t pid;
+    /* When to start it again, if it isn't */
+    uint64_t respawn_ns;
+    /* Talking to the meters for longer than this means the worker is hung */
+    uint64_t hang_ns;
+    uint64_t nr_samples;
+    uint64_t nr_restarts;
+};
+
+static
+struct splread_shard *shards = NULL;
+
+static
+size_t nr_shards = 0;
+
+/* In a worker, the ring back to the supervisor */
 static
-wchar_t *config_serial = NULL;
+struct spl_shard_ring *shard_ring = NULL;
+
+static
+struct spl_timer shard_check_timer;
+
+static
+struct spl_wheel poll_wheel;
+
+static
+struct spl_timer hub_report_timer;
+
+static
+struct spl_timer plugin_flush_timer;
+
+/*
+ * The batch of line protocol lines not yet written out, with room for a whole batch of the
+ * longest lines
+ */
+static
+char *lp_batch = NULL;
+
+static
+size_t lp_batch_len = 0;
+
+static
+size_t lp_batch_lines = 0;
+
+static
+struct spl_timer lp_flush_timer;
+
+static
+struct splread_dev *due_list = NULL;
+
+static
+struct spl_flight *flight = NULL;
 
 /*
  * App state - whether or not we've been asked to terminate
@@ -112,197 +457,308 @@ void _sigint_handler(int signal)
 }
 
 static
-uint64_t get_time_ns(void)
+struct splread_dev *_splread_add_dev(struct hid_device_info const *info, size_t id, uint64_t dev_interval_ms)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return (uint64_t)ts.tv_sec *  1000000000ull + ts.tv_nsec;
+    struct splread_dev *dev = NULL;
+
+    if (id >= nr_devs) {
+        struct splread_dev *new_devs = spl_realloc(devs, (id + 1) * sizeof(struct splread_dev));
+
+        if (NULL == new_devs) {
+            return NULL;
+        }
+
+        memset(&new_devs[nr_devs], 0, (id + 1 - nr_devs) * sizeof(struct splread_dev));
+        devs = new_devs;
+        nr_devs = id + 1;
+    }
+
+    dev = &devs[id];
+    dev->id = (uint16_t)id;
+    dev->ring_fd = -1;
+    dev->interval_ms = 0 == dev_interval_ms ? interval_ms : dev_interval_ms;
+    dev->poll_ms = dev->interval_ms;
+
+    if (NULL == (dev->path = spl_strdup(info->path))) {
+        return NULL;
+    }
+
+    if (NULL != info->serial_number && NULL == (dev->serial = spl_wcsdup(info->serial_number))) {
+        return NULL;
+    }
+
+    return dev;
 }
 
+/**
+ * Convert the serial numbers given with -S to wide strings, to compare with what hidapi
+ * reports. This waits until after startup has set up the arena, if there is one.
+ */
 static
-int splread_find_device(hid_device **pdev, uint16_t vid, uint16_t pid, wchar_t const *serial)
+int splread_convert_serials(void)
 {
     int ret = A_OK;
 
-    struct hid_device_info *devs = NULL,
-                           *cur_dev = NULL;
-    hid_device *dev = NULL;
-    size_t nr_devs = 0;
-    uint16_t tgt_pid = 0,
-             tgt_vid = 0;
+    for (size_t i = 0; i < config_nr_devs; i++) {
+        struct splread_dev_config *dev_cfg = &config_devs[i];
+        size_t len = 0;
+
+        if ((size_t)-1 == (len = mbstowcs(NULL, dev_cfg->serial_arg, 0))) {
+            SPL_MSG(SEV_FATAL, "BAD-SERIAL", "Serial number %s is not valid in this locale", dev_cfg->serial_arg);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (NULL == (dev_cfg->serial = spl_zalloc((len + 1) * sizeof(wchar_t)))) {
+            SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory for serial numbers, aborting.");
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        mbstowcs(dev_cfg->serial, dev_cfg->serial_arg, len + 1);
+    }
+
+done:
+    return ret;
+}
 
-    ASSERT_ARG(NULL != pdev);
+/**
+ * Find and open the devices to poll: the ones asked for by serial number, or if none were,
+ * every attached meter (with -a) or the only attached meter.
+ */
+static
+int splread_find_devices(uint16_t vid, uint16_t pid)
+{
+    int ret = A_OK;
 
-    *pdev = NULL;
+    struct hid_device_info *hid_devs = NULL,
+                           *cur_dev = NULL;
 
-    devs = hid_enumerate(vid, pid);
-    if (NULL == devs) {
+    hid_devs = hid_enumerate(vid, pid);
+    if (NULL == hid_devs) {
         SPL_MSG(SEV_INFO, "NO-DEVICE", "Could not find devices of type %04x:%04x", vid, pid);
         ret = A_E_NOTFOUND;
         goto done;
     }
 
-    cur_dev = devs;
-    while (NULL != cur_dev) {
+    for (cur_dev = hid_devs; NULL != cur_dev; cur_dev = cur_dev->next) {
+        struct splread_dev *dev = NULL;
+
         SPL_MSG(SEV_INFO, "DEVICE", "Device found: %04hx:%04hx path: %s serial: %ls",
                 cur_dev->vendor_id, cur_dev->product_id, cur_dev->path, cur_dev->serial_number);
 
-        if (NULL != serial) {
-            /* Only count devices where the serial number matches */
-            if (0 == wcscmp(serial, cur_dev->serial_number)) {
-                tgt_vid = cur_dev->vendor_id;
-                tgt_pid = cur_dev->product_id;
-                nr_devs++;
+        if (0 != config_nr_devs) {
+            /* Only take devices where the serial number matches */
+            size_t i = 0;
+
+            if (NULL == cur_dev->serial_number) {
+                continue;
+            }
+
+            for (i = 0; i < config_nr_devs; i++) {
+                if (0 == wcscmp(config_devs[i].serial, cur_dev->serial_number)) {
+                    break;
+                }
+            }
+
+            if (i == config_nr_devs) {
+                continue;
+            }
+
+            if (i < nr_devs && NULL != devs[i].path) {
+                SPL_MSG(SEV_ERROR, "MULTIPLE-DEVICES", "Found multiple devices with serial number %ls, aborting.",
+                        cur_dev->serial_number);
+                ret = A_E_INVAL;
+                goto done;
             }
+
+            dev = _splread_add_dev(cur_dev, i, config_devs[i].interval_ms);
         } else {
-            /* Just count all the devices we find */
-            tgt_vid = cur_dev->vendor_id;
-            tgt_pid = cur_dev->product_id;
-            nr_devs++;
+            /* Just take all the devices we find */
+            dev = _splread_add_dev(cur_dev, nr_devs, interval_ms);
         }
 
-        cur_dev = cur_dev->next;
+        if (NULL == dev) {
+            SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory tracking devices, aborting.");
+            ret = A_E_NOMEM;
+            goto done;
+        }
     }
 
-    if (nr_devs > 1) {
-        SPL_MSG(SEV_ERROR, "MULTIPLE-DEVICES", "Found multiple devices, don't know which one to open, aborting.");
+    if (0 == config_nr_devs && false == config_all_devices && nr_devs > 1) {
+        SPL_MSG(SEV_ERROR, "MULTIPLE-DEVICES", "Found multiple devices, don't know which one to open, aborting. "
+                "Use -S to pick some, or -a to use them all.");
         ret = A_E_INVAL;
         goto done;
     }
 
+    for (size_t i = 0; i < config_nr_devs; i++) {
+        if (i >= nr_devs || NULL == devs[i].path) {
+            SPL_MSG(SEV_ERROR, "NO-DEVICES", "Found no device with serial number %ls, aborting.", config_devs[i].serial);
+            ret = A_E_EMPTY;
+            goto done;
+        }
+    }
+
     if (0 == nr_devs) {
         SPL_MSG(SEV_ERROR, "NO-DEVICES", "Found no devices that match criteria, aborting.");
         ret = A_E_EMPTY;
         goto done;
     }
 
-    /* Open the HID device */
-    if (NULL == (dev = hid_open(tgt_vid, tgt_pid, serial))) {
-        SPL_MSG(SEV_ERROR, "CANT-OPEN", "Failed to open device %04x:%04x s/n: %ls - aborting", tgt_vid, tgt_pid, serial);
-        ret = A_E_NOTFOUND;
-        goto done;
-    }
-
-    *pdev = dev;
+    for (size_t i = 0; i < nr_devs; i++) {
+        struct splread_dev *dev = &devs[i];
 
-done:
-    if (NULL != devs) {
-        hid_free_enumeration(devs);
-        devs = NULL;
+        if (0 > spl_asprintf(&dev->serial_str, "%ls", NULL == dev->serial ? L"" : dev->serial)) {
+            dev->serial_str = NULL;
+            ret = A_E_NOMEM;
+            goto done;
+        }
+        dev->serial_len = strlen(dev->serial_str);
     }
 
-    if (FAILED(ret)) {
-        if (NULL != dev) {
-            hid_close(dev);
-            dev = NULL;
-        }
+done:
+    if (NULL != hid_devs) {
+        hid_free_enumeration(hid_devs);
+        hid_devs = NULL;
     }
 
     return ret;
 }
 
+/**
+ * Open the HID devices. With workers, each worker opens its own, and the supervisor none.
+ */
 static
-int splread_send_req(hid_device *dev, uint8_t *report)
+int splread_open_devices(void)
 {
     int ret = A_OK;
 
-    int written = 0;
+    for (size_t i = 0; i < nr_devs; i++) {
+        struct splread_dev *dev = &devs[i];
 
-    ASSERT_ARG(NULL != dev);
-    ASSERT_ARG(NULL != report);
+        if (NULL == (dev->hid = hid_open_path(dev->path))) {
+            SPL_MSG(SEV_ERROR, "CANT-OPEN", "Failed to open device %s s/n: %ls - aborting", dev->path, dev->serial);
+            ret = A_E_NOTFOUND;
+            goto done;
+        }
 
-    if (8 != (written = hid_write(dev, report, 8))) {
-        SPL_MSG(SEV_ERROR, "REQUEST-FAIL", "Failed to write 8 bytes to device (wrote %d): %ls", written, hid_error(dev));
-        ret = A_E_INVAL;
-        goto done;
+        SPL_MSG(SEV_INFO, "DEVICE-OPEN", "Polling device %u (%s, s/n %ls) every %llu ms", dev->id, dev->path,
+                dev->serial, (unsigned long long)dev->interval_ms);
     }
 
-    DIAG("Wrote %d bytes, waiting for response", written);
-
 done:
     return ret;
 }
 
 static
-int splread_read_resp(hid_device *dev, uint8_t *response, size_t response_len, unsigned timeout_ns)
+void splread_close_devices(void)
 {
-    int ret = A_OK;
+    for (size_t i = 0; i < nr_devs; i++) {
+        struct splread_dev *dev = &devs[i];
 
-    int read_bytes = 0;
-    uint64_t start_time = 0;
+        if (NULL != dev->hid) {
+            hid_close(dev->hid);
+        }
+        if (0 <= dev->ring_fd) {
+            close(dev->ring_fd);
+        }
+        spl_free(dev->path);
+        spl_free(dev->serial);
+        spl_free(dev->serial_str);
+        spl_free(dev->lp_prefix);
+        spl_free(dev->lp_alert_prefix);
+        spl_rule_eval_free(&dev->rules);
+        spl_burst_cleanup(&dev->burst);
+    }
 
-    ASSERT_ARG(NULL != dev);
-    ASSERT_ARG(NULL != response);
-    ASSERT_ARG(8 <= response_len);
+    spl_free(devs);
+    devs = NULL;
+    nr_devs = 0;
 
-    start_time = get_time_ns();
+    spl_free(hubs);
+    hubs = NULL;
+    nr_hubs = 0;
+}
 
-    while (8 != read_bytes) {
-        int nr_bytes = 0;
-        if (0 > (nr_bytes = hid_read_timeout(dev, &response[read_bytes], response_len + 1 - read_bytes, timeout_ns/1000000ul))) {
-            SPL_MSG(SEV_ERROR, "READ-FAIL", "Failed to read back an 8 byte report (got %d): %ls", read_bytes, hid_error(dev));
-            ret = A_E_INVAL;
-            goto done;
-        }
+/**
+ * Let a meter that's polled rarely be suspended between polls. Sending it a request resumes it,
+ * so there's nothing to do to wake it up; resuming shows up as a longer round trip.
+ */
+static
+void splread_allow_autosuspend(struct splread_dev const *dev, const char *port)
+{
+    unsigned bus = 0,
+             addr = 0,
+             intf = 0;
 
-        read_bytes += nr_bytes;
+    if (dev->poll_ms < 4 * SPLREAD_AUTOSUSPEND_DELAY_MS) {
+        /* It'd barely have suspended before being woken up again */
+        return;
+    }
 
-        if (get_time_ns() - start_time > timeout_ns) {
-            SPL_MSG(SEV_WARNING, "TIMEOUT", "Timeout waiting for response from device, skipping this read");
-            ret = A_E_TIMEOUT;
-            goto done;
-        }
+    /* libusb holds the device open through usbfs, which keeps it from ever suspending */
+    if (3 == sscanf(dev->path, "%x:%x:%x", &bus, &addr, &intf)) {
+        SPL_MSG(SEV_WARNING, "AUTOSUSPEND-NEEDS-HIDRAW", "Device %u can't be suspended between polls through "
+                "hidapi's libusb backend, build with HIDAPI_BACKEND=hidraw for that", dev->id);
+        return;
     }
 
-#ifdef DEBUG_MESSAGES
-    SPL_MSG(SEV_INFO, "RESPONSE", "%02x:%02x:%02x:%02x - %02x:%02x:%02x:%02x",
-            response[0],
-            response[1],
-            response[2],
-            response[3],
-            response[4],
-            response[5],
-            response[6],
-            response[7]);
-#endif
+    if (FAILED(spl_usb_allow_autosuspend(port, SPLREAD_AUTOSUSPEND_DELAY_MS))) {
+        SPL_MSG(SEV_WARNING, "AUTOSUSPEND-FAIL", "Could not let device %u suspend between polls, it will stay "
+                "awake", dev->id);
+        return;
+    }
 
-done:
-    return ret;
+    SPL_MSG(SEV_INFO, "AUTOSUSPEND", "Device %u will be suspended after %u ms idle", dev->id,
+            SPLREAD_AUTOSUSPEND_DELAY_MS);
 }
 
+/**
+ * Work out which hub each device is plugged into. Devices whose topology can't be found
+ * are lumped together, which just means they're staggered as if they shared a hub.
+ */
 static
-int splread_set_config(hid_device *dev, unsigned int range, bool fast, bool dbc)
+int splread_group_hubs(void)
 {
     int ret = A_OK;
 
-    uint8_t command[8] = { 0x0 };
-    int rret = A_OK;
+    if (NULL == (hubs = spl_zalloc(nr_devs * sizeof(struct splread_hub)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
 
-    ASSERT_ARG(NULL != dev);
-    ASSERT_ARG(range <= 0x4);
+    for (size_t i = 0; i < nr_devs; i++) {
+        struct splread_dev *dev = &devs[i];
+        char port[SPL_USB_PORT_LEN],
+             hub[SPL_USB_PORT_LEN];
+        size_t h = 0;
 
-    command[0] = GM1356_COMMAND_CONFIGURE;
-    command[1] |= range;
+        if (FAILED(spl_usb_port_path(dev->path, port, sizeof(port)))) {
+            SPL_MSG(SEV_WARNING, "NO-TOPOLOGY", "Could not find the USB port of device %u (%s)", dev->id, dev->path);
+            snprintf(hub, sizeof(hub), "unknown");
+        } else {
+            spl_usb_hub_name(port, hub, sizeof(hub));
+            SPL_MSG(SEV_INFO, "DEVICE-HUB", "Device %u is on port %s of hub %s", dev->id, port, hub);
 
-    if (true == fast) {
-        command[1] |= GM1356_FAST_MODE;
-    }
+            if (true == config_low_wake) {
+                splread_allow_autosuspend(dev, port);
+            }
+        }
 
-    if (true == dbc) {
-        command[1] |= GM1356_MEASURE_DBC;
-    }
+        for (h = 0; h < nr_hubs; h++) {
+            if (0 == strcmp(hubs[h].name, hub)) {
+                break;
+            }
+        }
 
-    if (FAILED(splread_send_req(dev, command))) {
-        SPL_MSG(SEV_FATAL, "CONFIG-FAIL", "Failed to set configuration for SPL meter, aborting");
-        ret = A_E_INVAL;
-        goto done;
-    }
+        if (h == nr_hubs) {
+            snprintf(hubs[h].name, sizeof(hubs[h].name), "%s", hub);
+            nr_hubs++;
+        }
 
-    /* Always wait 500ms for the configuration to succeed */
-    if (FAILED(rret = splread_read_resp(dev, command, sizeof(command), 500ul * 1000ul * 1000ul))) {
-        SPL_MSG(SEV_FATAL, "CONFIG-NO-ACK", "Did not get the configuration packet acknowledgement, aborting.");
-        ret = A_E_INVAL;
-        goto done;
+        dev->hub = h;
+        hubs[h].nr_devs++;
     }
 
 done:
@@ -310,17 +766,399 @@ done:
 }
 
 static
-void _print_help(const char *name)
+void splread_report_hubs(void)
 {
-    printf("Usage: %s -i [interval ms] [-h] [-f] [-C] [-r {range}] [-S {serial number}]\n", name);
-    printf("Where: \n");
-    printf(" -i         - polling interval for the device, in milliseconds\n");
-    printf(" -h         - get help (this message)\n");
-    printf(" -f         - use fast mode\n");
-    printf(" -C         - measure dBc instead of dBa\n");
-    printf(" -S         - serial number of device to use (optional - if not set, will use first device found\n");
-    printf(" -r [range] - specify the range to operate in (in dB). One of:\n");
-    printf("            30-130\n");
+    for (size_t h = 0; h < nr_hubs; h++) {
+        struct splread_hub const *hub = &hubs[h];
+
+        if (0 == hub->lat.nr) {
+            continue;
+        }
+
+        SPL_MSG(SEV_INFO, "HUB-LATENCY", "Hub %s (%zu devices): %llu polls, round trip mean %.2f ms, p50 < %.2f ms, "
+                "p99 < %.2f ms, max %.2f ms", hub->name, hub->nr_devs, (unsigned long long)hub->lat.nr,
+                (double)hub->lat.sum_ns / hub->lat.nr / 1e6,
+                (double)spl_latency_quantile(&hub->lat, 0.5) / 1e6,
+                (double)spl_latency_quantile(&hub->lat, 0.99) / 1e6,
+                (double)hub->lat.max_ns / 1e6);
+    }
+}
+
+static
+void splread_report_stage(struct spl_pool_stats const *stats)
+{
+    SPL_MSG(SEV_INFO, "POOL-LATENCY", "Stage %s: %llu jobs, waited mean %.2f ms, p99 < %.2f ms, max %.2f ms; ran mean "
+            "%.2f ms, p99 < %.2f ms, max %.2f ms; pool full %llu times", stats->name, (unsigned long long)stats->run.nr,
+            (double)stats->wait.sum_ns / stats->wait.nr / 1e6,
+            (double)spl_latency_quantile(&stats->wait, 0.99) / 1e6,
+            (double)stats->wait.max_ns / 1e6,
+            (double)stats->run.sum_ns / stats->run.nr / 1e6,
+            (double)spl_latency_quantile(&stats->run, 0.99) / 1e6,
+            (double)stats->run.max_ns / 1e6,
+            (unsigned long long)stats->nr_busy);
+}
+
+static
+void splread_report_pool(void)
+{
+    struct spl_pool_stats stats;
+
+    if (NULL != pool && NULL != rule_set && !FAILED(spl_pool_stats(pool, rules_stage, &stats)) && 0 != stats.run.nr) {
+        splread_report_stage(&stats);
+    }
+
+    for (size_t i = 0; i < spl_plugins_count(plugins); i++) {
+        uint64_t nr_dropped = 0;
+
+        if (FAILED(spl_plugins_stats(plugins, i, &stats, &nr_dropped))) {
+            continue;
+        }
+
+        if (0 == stats.run.nr) {
+            /* Nothing has been handed over yet */
+        } else if (NULL != pool) {
+            splread_report_stage(&stats);
+        } else {
+            SPL_MSG(SEV_INFO, "PLUGIN-LATENCY", "Plugin %s: %llu batches, ran mean %.2f ms, p99 < %.2f ms, max %.2f ms, "
+                    "on the polling thread", stats.name, (unsigned long long)stats.run.nr,
+                    (double)stats.run.sum_ns / stats.run.nr / 1e6,
+                    (double)spl_latency_quantile(&stats.run, 0.99) / 1e6,
+                    (double)stats.run.max_ns / 1e6);
+        }
+
+        if (0 != nr_dropped) {
+            SPL_MSG(SEV_WARNING, "PLUGIN-BEHIND", "Plugin %s couldn't keep up; %llu samples dropped so far", stats.name,
+                    (unsigned long long)nr_dropped);
+        }
+    }
+}
+
+/**
+ * Match a report to the oldest outstanding request. Returns false if there wasn't one. If the
+ * request had expired, the report is its late response, and the caller should throw it away.
+ */
+static
+bool splread_req_match(struct splread_dev *dev, struct splread_req *req)
+{
+    if (0 == dev->nr_reqs) {
+        return false;
+    }
+
+    *req = dev->reqs[dev->req_head];
+    dev->req_head = (dev->req_head + 1) % SPLREAD_MAX_OUTSTANDING;
+    dev->nr_reqs--;
+
+    return true;
+}
+
+/**
+ * Remember a request as sent. If too many are outstanding, the oldest is assumed lost.
+ */
+static
+void splread_req_sent(struct splread_dev *dev, uint64_t sent_ns)
+{
+    struct splread_req *req = NULL;
+
+    if (SPLREAD_MAX_OUTSTANDING == dev->nr_reqs) {
+        struct splread_req lost;
+
+        splread_req_match(dev, &lost);
+        dev->nr_lost++;
+    }
+
+    req = &dev->reqs[(dev->req_head + dev->nr_reqs) % SPLREAD_MAX_OUTSTANDING];
+    req->seq = dev->next_seq++;
+    req->sent_ns = sent_ns;
+    req->expired = false;
+    dev->nr_reqs++;
+
+    dev->sent_ns = sent_ns;
+}
+
+/**
+ * Give up on requests that have gone unanswered for too long. They stay in place for one more
+ * expiry period, so that a response that does turn up is consumed by the request it answers,
+ * rather than being recorded as the answer to a newer one; after that they're counted as lost.
+ */
+static
+void splread_expire_reqs(struct splread_dev *dev, uint64_t now_ns)
+{
+    uint64_t expire_ns = SPLREAD_RESP_EXPIRE_MS * SPL_NS_PER_MS;
+
+    if (2 * dev->poll_ms * SPL_NS_PER_MS > expire_ns) {
+        expire_ns = 2 * dev->poll_ms * SPL_NS_PER_MS;
+    }
+
+    while (0 != dev->nr_reqs && now_ns - dev->reqs[dev->req_head].sent_ns > 2 * expire_ns) {
+        struct splread_req lost;
+
+        splread_req_match(dev, &lost);
+        dev->nr_lost++;
+    }
+
+    for (unsigned i = 0; i < dev->nr_reqs; i++) {
+        struct splread_req *req = &dev->reqs[(dev->req_head + i) % SPLREAD_MAX_OUTSTANDING];
+
+        if (now_ns - req->sent_ns <= expire_ns) {
+            break;
+        }
+
+        req->expired = true;
+    }
+}
+
+/**
+ * Before sending a new request, throw away any reports already waiting: they answer earlier
+ * requests (or none at all), and reading one as the answer to the new request would put us a
+ * whole poll behind. Then give up on requests too old to be answered.
+ */
+static
+int splread_drain_stale(struct splread_dev *dev, uint64_t now_ns)
+{
+    int ret = A_OK;
+
+    for (;;) {
+        uint8_t report[9];
+        struct splread_req req;
+        int tret = A_OK;
+
+        if (A_E_EMPTY == (tret = spl_meter_read_waiting(dev->hid, report, sizeof(report)))) {
+            break;
+        } else if (FAILED(tret)) {
+            SPL_MSG(SEV_ERROR, "READ-FAIL", "Failed to drain stale reports from device %u", dev->id);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (true == splread_req_match(dev, &req)) {
+            DIAG("Discarding late response to request %llu", (unsigned long long)req.seq);
+            dev->nr_late++;
+        } else {
+            dev->nr_orphaned++;
+        }
+    }
+
+    splread_expire_reqs(dev, now_ns);
+
+done:
+    return ret;
+}
+
+static
+void splread_report_responses(void)
+{
+    for (size_t i = 0; i < nr_devs; i++) {
+        struct splread_dev const *dev = &devs[i];
+
+        if (0 == dev->nr_late && 0 == dev->nr_orphaned && 0 == dev->nr_lost) {
+            continue;
+        }
+
+        SPL_MSG(SEV_INFO, "DEVICE-RESPONSES", "Device %u: %llu requests, %llu late responses discarded, %llu orphaned "
+                "reports, %llu requests never answered", dev->id, (unsigned long long)dev->next_seq,
+                (unsigned long long)dev->nr_late, (unsigned long long)dev->nr_orphaned,
+                (unsigned long long)dev->nr_lost);
+    }
+}
+
+/**
+ * What it's costing us, in calls into hidapi or the kernel, to get each sample
+ */
+static
+void splread_report_io(void)
+{
+    if (0 == nr_io_samples) {
+        return;
+    }
+
+    if (NULL != ring) {
+        SPL_MSG(SEV_INFO, "IO-CALLS", "%.2f system calls per sample, through io_uring (%llu samples)",
+                (double)nr_io_calls / nr_io_samples, (unsigned long long)nr_io_samples);
+    } else {
+        SPL_MSG(SEV_INFO, "IO-CALLS", "%.2f hidapi calls per sample, each at least one system call (%llu samples)",
+                (double)spl_meter_nr_calls() / nr_io_samples, (unsigned long long)nr_io_samples);
+    }
+}
+
+/**
+ * How often the poll loop, and the process as a whole, has had to wake up since we last said
+ */
+static
+void splread_report_wakeups(void)
+{
+    struct rusage ru;
+    uint64_t now_ns = get_mono_time_ns();
+    double secs = (double)(now_ns - wakeups_since_ns) / 1e9;
+
+    /* Polling never started */
+    if (0 == wakeups_since_ns) {
+        return;
+    }
+
+    if (0 > getrusage(RUSAGE_SELF, &ru) || secs <= 0) {
+        return;
+    }
+
+    /* Every time a thread sleeps and is woken up again is a voluntary context switch */
+    SPL_MSG(SEV_INFO, "WAKEUPS", "Over %.0f s, the poll loop woke %.2f times a second, all threads %.2f times a second",
+            secs, (double)nr_wakeups / secs, (double)(ru.ru_nvcsw - wakeups_since_nvcsw) / secs);
+
+    nr_wakeups = 0;
+    wakeups_since_ns = now_ns;
+    wakeups_since_nvcsw = ru.ru_nvcsw;
+}
+
+/**
+ * Anonymous memory we have resident, in KiB. Read without stdio, which would allocate.
+ */
+static
+unsigned long splread_rss_anon_kib(void)
+{
+    char buf[1536];
+    char const *field = NULL;
+    ssize_t len = 0;
+    int fd = -1;
+
+    if (0 > (fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC))) {
+        return 0;
+    }
+
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (0 >= len) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    if (NULL == (field = strstr(buf, "RssAnon:"))) {
+        return 0;
+    }
+
+    return strtoul(field + strlen("RssAnon:"), NULL, 10);
+}
+
+/**
+ * In fixed-footprint mode, check that we're still where we were once startup was done
+ */
+static
+void splread_check_footprint(bool at_exit)
+{
+    unsigned long rss_kib = 0;
+
+    if (false == spl_arena_active() || 0 == rss_baseline_kib) {
+        return;
+    }
+
+    rss_kib = splread_rss_anon_kib();
+
+    if (rss_kib > rss_baseline_kib + SPLREAD_RSS_SLACK_KIB) {
+        SPL_MSG(SEV_ERROR, "MEMORY-GREW", "Anonymous memory grew from %lu KiB at startup to %lu KiB",
+                rss_baseline_kib, rss_kib);
+    } else if (true == at_exit) {
+        SPL_MSG(SEV_INFO, "MEMORY-STEADY", "Anonymous memory %lu KiB, %lu KiB at startup", rss_kib,
+                rss_baseline_kib);
+    }
+}
+
+/**
+ * How each worker is keeping up: what it's passed on, and how often it's had to be restarted
+ */
+static
+void splread_report_shards(void)
+{
+    for (size_t i = 0; i < nr_shards; i++) {
+        struct splread_shard const *shard = &shards[i];
+
+        if (NULL == shard->ring) {
+            continue;
+        }
+
+        SPL_MSG(SEV_INFO, "SHARD", "Worker for %s (%zu devices): %llu samples, %llu restarts, %llu samples "
+                "dropped with the ring full", shard->name, shard->nr_devs,
+                (unsigned long long)shard->nr_samples, (unsigned long long)shard->nr_restarts,
+                (unsigned long long)spl_shard_nr_dropped(shard->ring));
+    }
+}
+
+static
+void _splread_plugin_flush_due(struct spl_timer *timer, void *arg)
+{
+    (void)arg;
+
+    spl_plugins_flush(plugins);
+    spl_wheel_add(&poll_wheel, timer, get_mono_time_ns() + SPLREAD_PLUGIN_FLUSH_MS * SPL_NS_PER_MS);
+}
+
+static
+void _splread_hub_report_due(struct spl_timer *timer, void *arg)
+{
+    (void)arg;
+
+    splread_report_hubs();
+    splread_report_responses();
+    splread_report_pool();
+    splread_report_io();
+    splread_report_wakeups();
+    splread_report_shards();
+    splread_check_footprint(false);
+    spl_wheel_add(&poll_wheel, timer, get_mono_time_ns() + SPLREAD_HUB_REPORT_SEC * SPL_NS_PER_SEC);
+}
+
+static
+void _print_help(const char *name)
+{
+    printf("Usage: %s -i [interval ms] [-h] [-f] [-C] [-r {range}] [-a] [-S {serial number}[:{interval ms}]] [-D {store dir}] [-T {threshold dB}] [-R {retention}]\n", name);
+    printf("Where: \n");
+    printf(" -i         - polling interval for the device, in milliseconds (the default for all devices, with several)\n");
+    printf(" -h         - get help (this message)\n");
+    printf(" -f         - use fast mode\n");
+    printf(" -C         - measure dBc instead of dBa\n");
+    printf(" -S         - serial number of device to use (optional - if not set, will use first device found)\n");
+    printf("            May be given more than once, to poll several devices, each optionally with its own\n");
+    printf("            polling interval, e.g. -S 1234:100 -S 5678:5000\n");
+    printf(" -a         - poll every attached device, rather than insisting on just one\n");
+    printf(" -s         - poll devices on the same USB hub all at once, rather than staggering them\n");
+    printf(" -D [dir]   - also record every sample to the binary store in the given directory\n");
+    printf(" -T [dB]    - record exceedance events at or above this level to the store's event index (needs -D)\n");
+    printf(" -R [spec]  - compact old data in the store in the background, according to a retention policy\n");
+    printf("            such as raw=14d,1s=90d,1m=forever (needs -D)\n");
+    printf(" -L [name]  - print InfluxDB line protocol for the named measurement, rather than JSON. Lines are\n");
+    printf("            written in batches of up to %u (append :{lines} to change that), or after %u ms\n",
+            SPLREAD_LP_BATCH_LINES, SPLREAD_LP_FLUSH_MS);
+    printf(" -A [file]  - raise alerts from the rules in the given file, such as\n");
+    printf("            loud: LAeq_1min > 70 && L90_15min > 55 for 3 windows\n");
+    printf(" -X [so]    - load a plugin, a shared object given as path[:args], to process samples in batches.\n");
+    printf("            May be given up to %d times\n", SPL_PLUGIN_MAX);
+    printf(" -j [n[:jobs]] - evaluate alert rules and run plugins on n worker threads (0 for one per CPU),\n");
+    printf("            with at most jobs queued or running at once (by default, four per thread)\n");
+    printf(" -l [ms]    - when polls start this late, shed load: first burst capture and phase-lock relearning,\n");
+    printf("            then printing every sample (the store, events and alerts always see every sample).\n");
+    printf("            The default is %u ms; 0 never sheds load\n", SPLREAD_LAG_LIMIT_MS);
+    printf(" -U         - talk to meters through their hidraw nodes with io_uring, sending every request due\n");
+    printf("            in one system call (needs the hidraw backend, and Linux 5.11 or later)\n");
+    printf(" -W         - low-wakeup mode, for meters polled every several seconds or more: polls are\n");
+    printf("            scheduled more coarsely, sleeps may run slightly late, and meters are let suspend\n");
+    printf("            between polls (needs root, and the hidraw backend). Can't be used with -B\n");
+    printf(" -G [group] - poll devices from worker processes, one for each USB bus, hub or device (give bus,\n");
+    printf("            hub or device). A worker that dies or hangs is restarted without disturbing the others.\n");
+    printf("            Can't be used with -B or -M\n");
+    printf(" -M [KiB]   - fixed-footprint mode: set aside this much memory up front, and allocate nothing\n");
+    printf("            once polling has started. Can't be used with -R\n");
+    printf(" -P         - learn each meter's own refresh cadence, and poll just after each refresh\n");
+    printf(" -O [tmpl]  - print records according to an output template: a comma separated list of\n");
+    printf("            [name=]field[:style], where field is one of level (style 0, 1 or 2 decimal places),\n");
+    printf("            mode, weighting, range, time (style utc, iso, s, ms, us or ns), timeerr (how far the time\n");
+    printf("            could be off, in microseconds), device or serial.\n");
+    printf("            The default is %s\n", SPL_FMT_TMPL_DEFAULT);
+    printf(" -F [file]  - keep the most recent raw reports in a flight recorder file, which survives crashes\n");
+    printf("            (dump it with spltool flight). Append :{records} to size it; the default is %u\n",
+            SPL_FLIGHT_DEFAULT_SLOTS);
+    printf(" -B [spec]  - burst mode: poll at a high rate, and save full-rate clips around loud events to the\n");
+    printf("            store (needs -D). Given as {interval ms}:{pre-trigger s}:{post-trigger s}:{trigger dB},\n");
+    printf("            e.g. 50:10:10:90. Output carries on at the normal interval\n");
+    printf(" -r [range] - specify the range to operate in (in dB). One of:\n");
+    printf("            30-130\n");
     printf("            30-80\n");
     printf("            50-100\n");
     printf("            60-110\n");
@@ -356,9 +1194,10 @@ void _parse_args(int argc, char *const *argv)
 {
     int a = -1;
 
-    size_t serial_len = 0;
+    char *sep = NULL;
+    struct splread_dev_config *dev_cfg = NULL;
 
-    while (-1 != (a = getopt(argc, argv, "i:fCr:S:h"))) {
+    while (-1 != (a = getopt(argc, argv, "i:fCr:asS:D:T:R:B:F:PO:L:A:X:j:l:M:UWG:h"))) {
         switch (a) {
         case 'i':
             interval_ms = strtoull(optarg, NULL, 0);
@@ -388,107 +1227,1580 @@ void _parse_args(int argc, char *const *argv)
             }
             break;
 
+        case 'a':
+            config_all_devices = true;
+            SPL_MSG(SEV_INFO, "ALL-DEVICES", "Polling all attached devices.");
+            break;
+
+        case 's':
+            config_no_stagger = true;
+            SPL_MSG(SEV_INFO, "NO-STAGGER", "Not staggering polls of devices that share a hub.");
+            break;
+
         case 'S':
-            /* This is a bit shady, but will work */
-            serial_len = strlen(optarg);
-            config_serial = calloc(serial_len + 1, sizeof(wchar_t));
-            mbstowcs(config_serial, optarg, serial_len + 1);
-            SPL_MSG(SEV_INFO, "DEVICE-SERIAL-NUMBER", "Using device with serial number %S", config_serial);
+            if (NULL == (dev_cfg = realloc(config_devs, (config_nr_devs + 1) * sizeof(struct splread_dev_config)))) {
+                SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory parsing arguments, aborting.");
+                exit(EXIT_FAILURE);
+            }
+            config_devs = dev_cfg;
+            dev_cfg = &config_devs[config_nr_devs++];
+            dev_cfg->interval_ms = 0;
+
+            /* An optional per-device polling interval follows the serial number */
+            if (NULL != (sep = strrchr(optarg, ':'))) {
+                *sep = '\0';
+                dev_cfg->interval_ms = strtoull(sep + 1, NULL, 0);
+            }
+
+            dev_cfg->serial_arg = optarg;
+            dev_cfg->serial = NULL;
+            SPL_MSG(SEV_INFO, "DEVICE-SERIAL-NUMBER", "Using device with serial number %s", optarg);
             break;
-        }
-    }
-}
 
-int main(int argc, char *const *argv)
-{
-    int ret = EXIT_FAILURE;
+        case 'D':
+            config_store_dir = optarg;
+            SPL_MSG(SEV_INFO, "STORE-DIR", "Recording samples to store in %s", config_store_dir);
+            break;
 
-    hid_device *dev = NULL;
-    struct sigaction sa = { .sa_handler = _sigint_handler };
+        case 'T':
+            config_event_threshold_ddb = (uint16_t)(strtod(optarg, NULL) * 10.0 + 0.5);
+            SPL_MSG(SEV_INFO, "EVENT-THRESHOLD", "Recording exceedance events at or above %u.%u dB",
+                    config_event_threshold_ddb / 10, config_event_threshold_ddb % 10);
+            break;
 
-    SPL_MSG(SEV_INFO, "STARTUP", "Starting the Chinese SPL Meter Reader");
+        case 'R':
+            if (FAILED(spl_retention_parse(&config_retention_policy, optarg))) {
+                SPL_MSG(SEV_FATAL, "BAD-RETENTION", "Could not parse retention policy '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            config_retention = true;
+            SPL_MSG(SEV_INFO, "RETENTION", "Compacting the store with retention policy %s", optarg);
+            break;
 
-    /* Catch SIGINT */
-    if (0 > sigaction(SIGINT, &sa, NULL)) {
-        SPL_MSG(SEV_FATAL, "STARTUP", "Failed to set up SIGINT handler, bizarre. Aborting.");
-        exit(EXIT_FAILURE);
-    }
+        case 'O':
+            if (FAILED(spl_fmt_tmpl_compile(&out_tmpl, optarg))) {
+                exit(EXIT_FAILURE);
+            }
+            config_have_template = true;
+            SPL_MSG(SEV_INFO, "OUTPUT-TEMPLATE", "Printing records as %s", optarg);
+            break;
 
-    if (0 > sigaction(SIGTERM, &sa, NULL)) {
-        SPL_MSG(SEV_FATAL, "STARTUP", "Failed to set up SIGTERM handler, bizarre. Aborting.");
-        exit(EXIT_FAILURE);
-    }
+        case 'L':
+            config_lp_measurement = optarg;
+            /* An optional batch size, in lines, follows the measurement name */
+            if (NULL != (sep = strrchr(optarg, ':'))) {
+                *sep = '\0';
+                config_lp_batch_lines = strtoull(sep + 1, NULL, 0);
+                if (0 == config_lp_batch_lines) {
+                    SPL_MSG(SEV_FATAL, "BAD-LP-BATCH", "Bad line protocol batch size '%s'", sep + 1);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            SPL_MSG(SEV_INFO, "LINE-PROTOCOL", "Printing line protocol for measurement %s, in batches of up to %zu lines",
+                    config_lp_measurement, config_lp_batch_lines);
+            break;
 
-    /* Parse command line arguments */
-    _parse_args(argc, argv);
+        case 'A':
+            config_rules_path = optarg;
+            break;
 
-    /* Search for the first connected device. TODO: suport Serial as an argument, a */
-    if (FAILED(splread_find_device(&dev, GM1356_SPLMETER_VID, GM1356_SPLMETER_PID, NULL))) {
-        goto done;
-    }
+        case 'X':
+            if (SPL_PLUGIN_MAX == config_nr_plugins) {
+                SPL_MSG(SEV_FATAL, "TOO-MANY-PLUGINS", "At most %d plugins can be loaded, aborting.", SPL_PLUGIN_MAX);
+                exit(EXIT_FAILURE);
+            }
+            config_plugins[config_nr_plugins++] = optarg;
+            break;
 
-    DIAG("HID device: %p", dev);
+        case 'j': {
+                char *end = NULL;
 
-    /* Set the configuration we just read in */
-    if (FAILED(splread_set_config(dev, config_range, fast_mode, measure_dbc))) {
-        SPL_MSG(SEV_FATAL, "BAD-CONFIG", "Failed to load configuration, aborting.");
-        goto done;
-    }
+                config_pool = true;
+                config_pool_threads = strtoul(optarg, &end, 0);
+                if (':' == *end) {
+                    config_pool_jobs = strtoul(end + 1, NULL, 0);
+                }
+            }
+            break;
 
-    do {
-        int tret = A_OK;
-        uint8_t report[8] = { GM1356_COMMAND_CAPTURE };
+        case 'l':
+            config_lag_limit_ms = strtoull(optarg, NULL, 0);
+            if (0 == config_lag_limit_ms) {
+                SPL_MSG(SEV_INFO, "NO-LOAD-SHEDDING", "Never shedding load, however far behind we fall.");
+            }
+            break;
 
-        /* Send a capture/trigger command */
-        if (FAILED(splread_send_req(dev, report))) {
-            SPL_MSG(SEV_FATAL, "BAD-REQ", "Failed to send read data request");
-            goto done;
-        }
+        case 'M':
+            if (0 == (config_arena_kib = strtoull(optarg, NULL, 0))) {
+                SPL_MSG(SEV_FATAL, "BAD-ARENA-SIZE", "Bad fixed-footprint size '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
 
-        /* Read the response; if we time out, just fire up the loop again */
-        if (FAILED(tret = splread_read_resp(dev, report, sizeof(report), interval_ms * 1000000ull))) {
-            if (A_E_TIMEOUT != tret) {
-                SPL_MSG(SEV_FATAL, "BAD-RESP", "Did not get response, aborting.");
-                goto done;
-            } else {
-                continue;
+        case 'U':
+            config_ring = true;
+            SPL_MSG(SEV_INFO, "IO-URING", "Using io_uring to talk to meters.");
+            break;
+
+        case 'W':
+            config_low_wake = true;
+            SPL_MSG(SEV_INFO, "LOW-WAKE", "Keeping wakeups to a minimum between polls.");
+            break;
+
+        case 'G':
+            if (0 != strcmp(optarg, "bus") && 0 != strcmp(optarg, "hub") && 0 != strcmp(optarg, "device")) {
+                SPL_MSG(SEV_FATAL, "BAD-SHARD", "Unknown way to group devices into workers '%s', should be bus, hub "
+                        "or device", optarg);
+                exit(EXIT_FAILURE);
             }
-        } else {
-            uint16_t deci_db = report[0] << 8 | report[1];
-            uint8_t flags = report[2],
-                    range_v = report[2] & 0xf;
-            time_t now = time(NULL);
-            struct tm *gmt = gmtime(&now);
+            config_shard_by = optarg;
+            SPL_MSG(SEV_INFO, "SHARDS", "Polling devices from a worker process per %s", config_shard_by);
+            break;
 
-#ifdef DEBUG_MESSAGES
-            SPL_MSG(SEV_INFO, "MEASUREMENT", "%4.2f dB%c SPL (%s, range %s)", (double)deci_db/10.0,
-                    flags & GM1356_MEASURE_DBC ? 'C' : 'A',
-                    flags & GM1356_FAST_MODE ? "FAST" : "SLOW",
-                    range > 0x4 ? "UNKNOWN" : gm1356_range_str[range_v]
-                    );
-#endif
+        case 'P':
+            config_phase_lock = true;
+            SPL_MSG(SEV_INFO, "PHASE-LOCK", "Locking polls to each meter's refresh cadence.");
+            break;
+
+        case 'F':
+            config_flight_path = optarg;
+            /* An optional size, in records, follows the file name */
+            if (NULL != (sep = strrchr(optarg, ':'))) {
+                *sep = '\0';
+                config_flight_slots = strtoull(sep + 1, NULL, 0);
+                if (0 == config_flight_slots) {
+                    SPL_MSG(SEV_FATAL, "BAD-FLIGHT-SIZE", "Bad flight recorder size '%s'", sep + 1);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            SPL_MSG(SEV_INFO, "FLIGHT-RECORDER", "Keeping the last %zu reports in %s", config_flight_slots,
+                    config_flight_path);
+            break;
 
-            fprintf(stdout, "{\"measured\":%4.2f,\"mode\":\"%s\",\"freqMode\":\"%s\","
-                    "\"range\":\"%s\",\"timestamp\":\"%04i-%02i-%02i %02i:%02i:%02i UTC\"}\n",
-                    (double)deci_db/10.0,
-                    flags & GM1356_FAST_MODE ? "fast" : "slow",
-                    flags & GM1356_MEASURE_DBC ? "dBC" : "dBA",
-                    range_v > 0x4 ? "UNKNOWN" : gm1356_range_str[range_v],
-                    gmt->tm_year + 1900, gmt->tm_mon + 1, gmt->tm_mday, gmt->tm_hour, gmt->tm_min, gmt->tm_sec
-                   );
-            fflush(stdout);
+        case 'B':
+            if (FAILED(spl_burst_parse(&config_burst_cfg, optarg))) {
+                exit(EXIT_FAILURE);
+            }
+            config_burst = true;
+            SPL_MSG(SEV_INFO, "BURST", "Burst recording every %llu ms, clips from %llu s before to %llu s after %u.%u dB",
+                    (unsigned long long)config_burst_cfg.interval_ms,
+                    (unsigned long long)(config_burst_cfg.pre_ns / SPL_NS_PER_SEC),
+                    (unsigned long long)(config_burst_cfg.post_ns / SPL_NS_PER_SEC),
+                    config_burst_cfg.trigger_ddb / 10, config_burst_cfg.trigger_ddb % 10);
+            break;
         }
+    }
 
-        /* Sleep until the next measurement interval */
-        usleep(interval_ms * 1000ul);
-    } while (true == running);
+    if (0 != config_event_threshold_ddb && NULL == config_store_dir) {
+        SPL_MSG(SEV_FATAL, "EVENTS-NEED-STORE", "Exceedance events are recorded in the store, please specify a store directory with -D");
+        exit(EXIT_FAILURE);
+    }
 
-    ret = EXIT_SUCCESS;
-done:
-    if (NULL != dev) {
-        hid_close(dev);
+    if (true == config_have_template && NULL != config_lp_measurement) {
+        SPL_MSG(SEV_FATAL, "TEMPLATE-AND-LINE-PROTOCOL", "Output templates are for JSON, they can't be used with line protocol");
+        exit(EXIT_FAILURE);
     }
 
-    return ret;
-}
+    if (true == config_burst && true == config_phase_lock) {
+        SPL_MSG(SEV_FATAL, "BURST-AND-PHASE-LOCK", "Burst mode already polls at a fixed high rate, it can't be phase locked");
+        exit(EXIT_FAILURE);
+    }
+
+    if (true == config_burst && NULL == config_store_dir) {
+        SPL_MSG(SEV_FATAL, "BURST-NEEDS-STORE", "Burst clips are saved in the store, please specify a store directory with -D");
+        exit(EXIT_FAILURE);
+    }
+
+    if (true == config_retention && NULL == config_store_dir) {
+        SPL_MSG(SEV_FATAL, "RETENTION-NEEDS-STORE", "A retention policy needs a store, please specify a store directory with -D");
+        exit(EXIT_FAILURE);
+    }
+
+    if (true == config_burst && true == config_low_wake) {
+        SPL_MSG(SEV_FATAL, "BURST-AND-LOW-WAKE", "Burst mode polls many times a second, it can't keep wakeups down");
+        exit(EXIT_FAILURE);
+    }
 
+    if (NULL != config_shard_by && true == config_burst) {
+        SPL_MSG(SEV_FATAL, "SHARDS-AND-BURST", "Burst clips are cut from every sample as it's read, which workers "
+                "don't do; burst mode can't be used with -G");
+        exit(EXIT_FAILURE);
+    }
+
+    if (NULL != config_shard_by && 0 != config_arena_kib) {
+        SPL_MSG(SEV_FATAL, "SHARDS-AND-FIXED-FOOTPRINT", "Workers are forked, and restarted, after startup, so "
+                "fixed-footprint mode can't be used with -G");
+        exit(EXIT_FAILURE);
+    }
+
+    if (true == config_retention && 0 != config_arena_kib) {
+        SPL_MSG(SEV_FATAL, "RETENTION-AND-FIXED-FOOTPRINT", "Compaction allocates as it goes, so it can't run in "
+                "fixed-footprint mode; run spltool compact from cron instead");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static
+void _splread_poll_due(struct spl_timer *timer, void *arg)
+{
+    struct splread_dev *dev = arg;
+
+    (void)timer;
+
+    dev->next_due = due_list;
+    due_list = dev;
+}
+
+/**
+ * Write out whatever line protocol is batched up
+ */
+static
+void splread_lp_flush(void)
+{
+    if (0 == lp_batch_len) {
+        return;
+    }
+
+    fwrite(lp_batch, 1, lp_batch_len, stdout);
+    fflush(stdout);
+
+    lp_batch_len = 0;
+    lp_batch_lines = 0;
+    spl_wheel_del(&poll_wheel, &lp_flush_timer);
+}
+
+static
+void _splread_lp_flush_due(struct spl_timer *timer, void *arg)
+{
+    (void)timer;
+    (void)arg;
+
+    splread_lp_flush();
+}
+
+static
+void splread_lp_append(struct splread_dev *dev, struct spl_sample const *sample)
+{
+    if (0 == lp_batch_lines) {
+        /* Don't let the first line of the batch wait forever if samples are few and far between */
+        spl_wheel_add(&poll_wheel, &lp_flush_timer, get_mono_time_ns() + SPLREAD_LP_FLUSH_MS * SPL_NS_PER_MS);
+    }
+
+    lp_batch_len = spl_fmt_sample_lp(lp_batch + lp_batch_len, dev->lp_prefix, dev->lp_prefix_len, sample) - lp_batch;
+
+    if (++lp_batch_lines == config_lp_batch_lines) {
+        splread_lp_flush();
+    }
+}
+
+/**
+ * A plugin published a record. Plugins may be running on the pool's workers, so the whole
+ * line goes out under stdout's lock.
+ */
+static
+int _splread_publish(char const *record, size_t len, void *arg)
+{
+    int ret = A_OK;
+
+    (void)arg;
+
+    flockfile(stdout);
+    if (len != fwrite_unlocked(record, 1, len, stdout) || EOF == putc_unlocked('\n', stdout) ||
+            0 != fflush_unlocked(stdout))
+    {
+        ret = A_E_IO;
+    }
+    funlockfile(stdout);
+
+    return ret;
+}
+
+/**
+ * An alert was raised or cleared. It goes to the log, and to the output in whatever format
+ * that's in.
+ */
+static
+void _splread_alert(struct spl_alert const *alert, void *arg)
+{
+    struct splread_dev *dev = arg;
+    char ts[SPL_FMT_UTC_LEN + 1];
+
+    *spl_fmt_utc(ts, alert->ts_ns) = '\0';
+
+    SPL_MSG(SEV_WARNING, "ALERT", "Rule %s %s on device %u, window ending %s", alert->rule,
+            true == alert->raised ? "raised" : "cleared", dev->id, ts);
+
+    /* A plugin can publish from a pool worker at any moment, so hold stdout for the whole record */
+    flockfile(stdout);
+
+    if (NULL != config_lp_measurement) {
+        /* Anything already batched came first */
+        splread_lp_flush();
+
+        /* The prefix ends with the space before the fields; the rule is another tag */
+        fwrite(dev->lp_alert_prefix, 1, dev->lp_alert_prefix_len - 1, stdout);
+        fprintf(stdout, ",rule=%s raised=%di", alert->rule, true == alert->raised);
+        for (size_t i = 0; i < alert->nr_values; i++) {
+            if (alert->values[i] == alert->values[i]) {
+                fprintf(stdout, ",%s=%.1f", alert->names[i], alert->values[i]);
+            }
+        }
+        fprintf(stdout, " %llu\n", (unsigned long long)alert->ts_ns);
+    } else {
+        fprintf(stdout, "{\"alert\":\"%s\",\"state\":\"%s\",\"device\":%u,\"serial\":\"%s\",\"timestamp\":\"%s\"",
+                alert->rule, true == alert->raised ? "raised" : "cleared", dev->id, dev->serial_str, ts);
+        for (size_t i = 0; i < alert->nr_values; i++) {
+            if (alert->values[i] == alert->values[i]) {
+                fprintf(stdout, ",\"%s\":%.1f", alert->names[i], alert->values[i]);
+            } else {
+                fprintf(stdout, ",\"%s\":null", alert->names[i]);
+            }
+        }
+        fprintf(stdout, "}\n");
+    }
+
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+/**
+ * Whether the sample just read from dev is due to be output. When we're polling faster than
+ * the interval, only some samples are; the rest are only analysed.
+ */
+static
+bool splread_output_due(struct splread_dev *dev)
+{
+    if (false == config_burst && (false == config_phase_lock || false == dev->phase.learning)) {
+        return true;
+    }
+
+    if (dev->due_ns < dev->next_report_ns) {
+        return false;
+    }
+
+    dev->next_report_ns += dev->interval_ms * SPL_NS_PER_MS;
+    if (dev->next_report_ns <= dev->due_ns) {
+        dev->next_report_ns = dev->due_ns + dev->interval_ms * SPL_NS_PER_MS;
+    }
+
+    return true;
+}
+
+static
+void splread_handle_report(struct splread_dev *dev, uint8_t const *report, uint64_t ts_ns, uint16_t ts_err_us,
+        bool output_due, struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    uint16_t deci_db = report[0] << 8 | report[1];
+    uint8_t flags = report[2];
+    struct spl_sample sample = {
+        .ts_ns = ts_ns,
+        .deci_db = deci_db,
+        .device = dev->id,
+        .flags = flags,
+        .ts_err_us = ts_err_us,
+    };
+    struct spl_event evt;
+
+    if (true == config_burst) {
+        if (true == spl_load_shed_analyses(&load)) {
+            load.nr_analysis_shed++;
+        } else {
+            /* Every sample goes to the burst recorder */
+            spl_burst_feed(&dev->burst, &sample, config_store_dir);
+        }
+    }
+
+    if (NULL != dev->rules) {
+        /* Rules see every sample, however fast we're polling */
+        spl_rule_eval_feed(dev->rules, &sample, _splread_alert, dev);
+    }
+
+    if (NULL != plugins) {
+        /* So do plugins */
+        spl_plugins_feed(plugins, &sample);
+    }
+
+    if (false == output_due) {
+        return;
+    }
+
+#ifdef DEBUG_MESSAGES
+    SPL_MSG(SEV_INFO, "MEASUREMENT", "%4.2f dB%c SPL (%s, range %s)", (double)deci_db/10.0,
+            flags & GM1356_MEASURE_DBC ? 'C' : 'A',
+            flags & GM1356_FAST_MODE ? "FAST" : "SLOW",
+            gm1356_range_name(flags)
+            );
+#endif
+
+    if (0 != dev->nr_out++ % spl_load_decimation(&load)) {
+        load.nr_output_shed++;
+    } else if (NULL != config_lp_measurement) {
+        splread_lp_append(dev, &sample);
+    } else {
+        fwrite(out_buf, 1, spl_fmt_tmpl_run(out_buf, &out_tmpl, &sample, dev->serial_str, dev->serial_len) - out_buf,
+                stdout);
+        fflush(stdout);
+    }
+
+    if (NULL != store) {
+        spl_store_append(store, &sample);
+    }
+
+    if (NULL != evt_idx && true == spl_event_detector_feed(&dev->evt_det, &sample, &evt)) {
+        spl_event_index_append(evt_idx, &evt);
+    }
+}
+
+static
+void splread_report_load(void)
+{
+    SPL_MSG(SEV_INFO, "LOAD-SHED", "Overloaded %llu times, worst lag %.1f ms; shed %llu analysis samples and %llu "
+            "output records", (unsigned long long)load.nr_overloads, (double)load.worst_lag_ns / 1e6,
+            (unsigned long long)load.nr_analysis_shed, (unsigned long long)load.nr_output_shed);
+}
+
+/**
+ * Feed the overload controller how late this round of polls started, and act on any change
+ * of shedding level
+ */
+static
+void splread_update_load(uint64_t lag_ns, uint64_t now_ns)
+{
+    unsigned prev_level = load.level;
+
+    if (0 == config_lag_limit_ms || false == spl_load_update(&load, lag_ns, now_ns)) {
+        return;
+    }
+
+    if (load.level > prev_level) {
+        SPL_MSG(SEV_WARNING, "OVERLOAD", "Polls are running up to %.1f ms late; %s", (double)load.worst_lag_ns / 1e6,
+                SPL_LOAD_SHED_ANALYSES == load.level ? "pausing burst capture and phase-lock relearning" : "thinning output");
+    } else if (SPL_LOAD_NORMAL != load.level) {
+        SPL_MSG(SEV_INFO, "OVERLOAD-EASING", "Load is easing; %s", SPL_LOAD_SHED_ANALYSES == load.level ?
+                "printing every sample again" : "printing more samples");
+    } else {
+        SPL_MSG(SEV_INFO, "OVERLOAD-RECOVERED", "Load is back to normal, resuming burst capture and phase-lock relearning");
+        splread_report_load();
+    }
+
+    if (SPL_LOAD_DECIMATE_2 <= load.level) {
+        SPL_MSG(SEV_INFO, "OVERLOAD-DECIMATE", "Printing one in %u samples", spl_load_decimation(&load));
+    }
+
+    if (SPL_LOAD_NORMAL == prev_level) {
+        /* Save any clips in progress, rather than leaving them hanging */
+        for (size_t i = 0; i < nr_devs && true == config_burst; i++) {
+            spl_burst_flush(&devs[i].burst, config_store_dir);
+        }
+    }
+}
+
+/**
+ * A response to the request just sent to dev turned up
+ */
+static
+void splread_got_report(struct splread_dev *dev, uint8_t const *report, struct splread_req const *req,
+        struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    uint64_t recv_ns = get_mono_time_ns(),
+             ts_ns = get_time_ns();
+    uint16_t ts_err_us = 0;
+
+    /* The measurement was taken some time during the round trip, not when the response got here */
+    ts_ns = spl_meter_midpoint(&dev->rtt, req->sent_ns, recv_ns, ts_ns, &ts_err_us);
+
+    nr_io_samples++;
+    spl_latency_add(&hubs[dev->hub].lat, recv_ns - req->sent_ns);
+
+    if (NULL != flight) {
+        spl_flight_record(flight, ts_ns, dev->id, report);
+    }
+
+    if (true == config_phase_lock) {
+        bool changed = 0 != memcmp(dev->last_report, report, sizeof(dev->last_report));
+
+        memcpy(dev->last_report, report, sizeof(dev->last_report));
+
+        if (true == spl_phase_feed(&dev->phase, dev->sent_ns, changed)) {
+            SPL_MSG(SEV_INFO, "PHASE-LOCK", "Device %u refreshes every %.1f ms, polling %.1f ms after each refresh",
+                    dev->id, (double)dev->phase.period_ns / 1e6, (double)SPL_PHASE_GUARD_MS);
+        }
+    }
+
+    if (NULL != shard_ring) {
+        /* In a worker, the supervisor does everything else */
+        struct spl_shard_rec rec = {
+            .ts_ns = ts_ns,
+            .device = dev->id,
+            .output_due = splread_output_due(dev),
+            .ts_err_us = ts_err_us,
+        };
+
+        memcpy(rec.report, report, sizeof(rec.report));
+        spl_shard_push(shard_ring, &rec);
+        return;
+    }
+
+    splread_handle_report(dev, report, ts_ns, ts_err_us, splread_output_due(dev), store, evt_idx);
+}
+
+/**
+ * Poll the due devices through hidapi: send all the capture requests first, so the meters
+ * work on them at the same time, then collect the responses one device at a time
+ */
+static
+int splread_exchange_hid(struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    int ret = A_OK;
+
+    for (struct splread_dev *dev = due_list; NULL != dev; dev = dev->next_due) {
+        uint8_t report[8] = { GM1356_COMMAND_CAPTURE };
+
+        if (FAILED(splread_drain_stale(dev, get_mono_time_ns()))) {
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        splread_req_sent(dev, get_mono_time_ns());
+
+        /* Send a capture/trigger command */
+        if (FAILED(spl_meter_send(dev->hid, report))) {
+            SPL_MSG(SEV_FATAL, "BAD-REQ", "Failed to send read data request to device %u", dev->id);
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+    for (struct splread_dev *dev = due_list; NULL != dev; dev = dev->next_due) {
+        int tret = A_OK;
+        uint8_t report[8] = { 0 };
+        uint64_t deadline_ns = dev->sent_ns + dev->poll_ms * SPL_NS_PER_MS;
+        struct splread_req req = { .seq = 0 };
+
+        /* Read until the response to this request turns up; if we time out, just wait for the next poll */
+        do {
+            uint64_t read_ns = get_mono_time_ns();
+
+            if (read_ns >= deadline_ns) {
+                tret = A_E_TIMEOUT;
+                break;
+            }
+
+            if (FAILED(tret = spl_meter_read(dev->hid, report, sizeof(report), deadline_ns - read_ns))) {
+                break;
+            }
+
+            if (false == splread_req_match(dev, &req)) {
+                dev->nr_orphaned++;
+                req.seq = UINT64_MAX;
+            } else if (true == req.expired || req.seq + 1 != dev->next_seq) {
+                /* A response to an earlier request that turned up after we'd drained, or given up on it */
+                dev->nr_late++;
+                req.seq = UINT64_MAX;
+            }
+        } while (req.seq + 1 != dev->next_seq);
+
+        if (FAILED(tret)) {
+            if (A_E_TIMEOUT != tret) {
+                SPL_MSG(SEV_FATAL, "BAD-RESP", "Did not get response from device %u, aborting.", dev->id);
+                ret = A_E_INVAL;
+                goto done;
+            }
+            continue;
+        }
+
+        splread_got_report(dev, report, &req, store, evt_idx);
+    }
+
+done:
+    return ret;
+}
+
+struct splread_ring_ctx {
+    struct spl_store *store;
+    struct spl_event_index *evt_idx;
+    /* Devices polled this time around that haven't answered yet */
+    size_t nr_awaiting;
+};
+
+static
+void _splread_ring_report(unsigned slot, void const *data, size_t len, void *arg)
+{
+    struct splread_ring_ctx *ctx = arg;
+    struct splread_dev *dev = &devs[slot];
+    struct splread_req req;
+    uint8_t report[8] = { 0 };
+
+    memcpy(report, data, len < sizeof(report) ? len : sizeof(report));
+
+    if (false == splread_req_match(dev, &req)) {
+        dev->nr_orphaned++;
+    } else if (true == req.expired || false == dev->awaiting || req.seq + 1 != dev->next_seq) {
+        /* A response to a request we'd already given up on */
+        dev->nr_late++;
+    } else {
+        dev->awaiting = false;
+        ctx->nr_awaiting--;
+        splread_got_report(dev, report, &req, ctx->store, ctx->evt_idx);
+    }
+}
+
+/**
+ * Poll the due devices through io_uring: every capture request goes to the kernel in one
+ * system call, which then waits for the responses to come back, in whatever order
+ */
+static
+int splread_exchange_ring(struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    int ret = A_OK;
+
+    struct splread_ring_ctx ctx = {
+        .store = store,
+        .evt_idx = evt_idx,
+    };
+    uint64_t syscalls_before = spl_ring_nr_syscalls(ring);
+
+    /* Anything that turned up since last time is matched to its (old) request first */
+    if (FAILED(ret = spl_ring_reap(ring, 0, 0, _splread_ring_report, &ctx)) && A_E_TIMEOUT != ret) {
+        goto done;
+    }
+    ret = A_OK;
+
+    for (struct splread_dev *dev = due_list; NULL != dev; dev = dev->next_due) {
+        uint8_t report[8] = { GM1356_COMMAND_CAPTURE };
+        int wret = A_OK;
+
+        splread_expire_reqs(dev, get_mono_time_ns());
+
+        /* Ring slots are places in devs, which (in a worker) aren't always device indices */
+        if (A_E_BUSY == (wret = spl_ring_queue_write(ring, (unsigned)(dev - devs), report, sizeof(report)))) {
+            SPL_MSG(SEV_WARNING, "REQUEST-STUCK", "The last request to device %u still hasn't gone out, skipping "
+                    "this poll", dev->id);
+            continue;
+        } else if (FAILED(wret)) {
+            ret = wret;
+            goto done;
+        }
+
+        splread_req_sent(dev, get_mono_time_ns());
+        dev->awaiting = true;
+        ctx.nr_awaiting++;
+    }
+
+    while (0 != ctx.nr_awaiting) {
+        uint64_t now_ns = get_mono_time_ns(),
+                 deadline_ns = UINT64_MAX;
+        int rret = A_OK;
+
+        /* Give up on devices that are out of time, and wait no longer than the next one will be */
+        for (struct splread_dev *dev = due_list; NULL != dev; dev = dev->next_due) {
+            uint64_t dev_deadline_ns = dev->sent_ns + dev->poll_ms * SPL_NS_PER_MS;
+
+            if (false == dev->awaiting) {
+                continue;
+            }
+
+            if (dev_deadline_ns <= now_ns) {
+                SPL_MSG(SEV_WARNING, "TIMEOUT", "Timeout waiting for response from device %u, skipping this read",
+                        dev->id);
+                dev->awaiting = false;
+                ctx.nr_awaiting--;
+            } else if (dev_deadline_ns < deadline_ns) {
+                deadline_ns = dev_deadline_ns;
+            }
+        }
+
+        if (0 == ctx.nr_awaiting) {
+            break;
+        }
+
+        if (FAILED(rret = spl_ring_reap(ring, ctx.nr_awaiting, deadline_ns - now_ns, _splread_ring_report, &ctx)) &&
+                A_E_TIMEOUT != rret)
+        {
+            SPL_MSG(SEV_FATAL, "BAD-RESP", "Lost contact with devices, aborting.");
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+done:
+    nr_io_calls += spl_ring_nr_syscalls(ring) - syscalls_before;
+    return ret;
+}
+
+/**
+ * Poll every device on the due list, then schedule the next poll.
+ */
+static
+int splread_poll_due(struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    int ret = A_OK;
+
+    uint64_t now_ns = get_mono_time_ns(),
+             lag_ns = 0;
+
+    for (struct splread_dev *dev = due_list; NULL != dev; dev = dev->next_due) {
+        if (now_ns > dev->due_ns && now_ns - dev->due_ns > lag_ns) {
+            lag_ns = now_ns - dev->due_ns;
+        }
+    }
+
+    if (FAILED(ret = NULL != ring ? splread_exchange_ring(store, evt_idx) : splread_exchange_hid(store, evt_idx))) {
+        goto done;
+    }
+
+    now_ns = get_mono_time_ns();
+    splread_update_load(lag_ns, now_ns);
+
+    for (struct splread_dev *dev = due_list; NULL != dev; dev = dev->next_due) {
+        /* Under load, burst mode's faster polling is the first thing to go */
+        uint64_t poll_ms = true == spl_load_shed_analyses(&load) ? dev->interval_ms : dev->poll_ms;
+
+        if (true == config_phase_lock) {
+            if (true == spl_load_shed_analyses(&load) && true == spl_phase_hold(&dev->phase, now_ns)) {
+                load.nr_analysis_shed++;
+            }
+            dev->due_ns = spl_phase_next_poll(&dev->phase, dev->due_ns, dev->interval_ms * SPL_NS_PER_MS, now_ns);
+        } else {
+            /* Keep to the schedule, unless we've fallen more than a whole interval behind */
+            dev->due_ns += poll_ms * SPL_NS_PER_MS;
+            if (dev->due_ns <= now_ns) {
+                dev->due_ns = now_ns + poll_ms * SPL_NS_PER_MS;
+            }
+        }
+        spl_wheel_add(&poll_wheel, &dev->timer, dev->due_ns);
+    }
+
+done:
+    due_list = NULL;
+    return ret;
+}
+
+/**
+ * Switch every device over to the io_uring engine, talking to its hidraw node directly
+ */
+static
+int splread_ring_start(void)
+{
+    int ret = A_OK;
+
+    int *fds = NULL;
+
+    if (NULL == (fds = spl_zalloc(nr_devs * sizeof(int)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < nr_devs; i++) {
+        struct splread_dev *dev = &devs[i];
+
+        if (0 != strncmp(dev->path, "/dev/", strlen("/dev/"))) {
+            SPL_MSG(SEV_FATAL, "RING-NEEDS-HIDRAW", "Device %u (%s) isn't a hidraw node; the io_uring engine needs "
+                    "hidapi's hidraw backend, build with HIDAPI_BACKEND=hidraw", dev->id, dev->path);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (0 > (dev->ring_fd = open(dev->path, O_RDWR | O_CLOEXEC))) {
+            SPL_MSG(SEV_FATAL, "RING-OPEN-FAIL", "Failed to open %s: %s", dev->path, strerror(errno));
+            ret = A_E_IO;
+            goto done;
+        }
+
+        /* Left open, hidapi's handle would just queue up a copy of every report */
+        hid_close(dev->hid);
+        dev->hid = NULL;
+
+        fds[i] = dev->ring_fd;
+    }
+
+    if (FAILED(ret = spl_ring_new(&ring, fds, nr_devs))) {
+        goto done;
+    }
+
+    SPL_MSG(SEV_INFO, "RING", "Polling %zu devices through io_uring", nr_devs);
+
+done:
+    spl_free(fds);
+    return ret;
+}
+
+/**
+ * Let the kernel run our timers a little late, so it can fold their wakeups in with others
+ */
+static
+void splread_set_timer_slack(void)
+{
+    uint64_t min_poll_ms = UINT64_MAX,
+             slack_ns = 0;
+
+    for (size_t i = 0; i < nr_devs; i++) {
+        if (devs[i].poll_ms < min_poll_ms) {
+            min_poll_ms = devs[i].poll_ms;
+        }
+    }
+
+    slack_ns = min_poll_ms * SPL_NS_PER_MS / 100;
+    if (slack_ns > SPLREAD_LOW_WAKE_MAX_SLACK_MS * SPL_NS_PER_MS) {
+        slack_ns = SPLREAD_LOW_WAKE_MAX_SLACK_MS * SPL_NS_PER_MS;
+    }
+
+    if (0 > prctl(PR_SET_TIMERSLACK, (unsigned long)slack_ns, 0, 0, 0)) {
+        SPL_MSG(SEV_WARNING, "TIMER-SLACK-FAIL", "Could not set timer slack: %s", strerror(errno));
+        return;
+    }
+
+    SPL_MSG(SEV_INFO, "TIMER-SLACK", "Letting timers run up to %.1f ms late", (double)slack_ns / 1e6);
+}
+
+/**
+ * Configure the open devices, then poll them until we're asked to stop
+ */
+static
+int splread_run(struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    int ret = A_OK;
+
+    uint64_t start_ns = 0;
+
+    /* Set the configuration we just read in */
+    for (size_t i = 0; i < nr_devs; i++) {
+        if (FAILED(spl_meter_configure(devs[i].hid, config_range, fast_mode, measure_dbc))) {
+            SPL_MSG(SEV_FATAL, "BAD-CONFIG", "Failed to load configuration into device %u, aborting.", devs[i].id);
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+    if (true == config_ring && FAILED(ret = splread_ring_start())) {
+        goto done;
+    }
+
+    if (true == config_low_wake) {
+        splread_set_timer_slack();
+    }
+
+    start_ns = get_mono_time_ns();
+    spl_load_init(&load, config_lag_limit_ms * SPL_NS_PER_MS, start_ns);
+    spl_wheel_init(&poll_wheel, (true == config_low_wake ? SPLREAD_LOW_WAKE_TICK_MS : SPLREAD_TICK_MS) * SPL_NS_PER_MS,
+            start_ns);
+    wakeups_since_ns = start_ns;
+
+    /*
+     * The n devices on a hub are first polled at evenly spaced points across their interval.
+     * Since each keeps to a fixed rate from then on, they stay spread out.
+     */
+    for (size_t h = 0; h < nr_hubs; h++) {
+        size_t slot = 0;
+
+        for (size_t i = 0; i < nr_devs; i++) {
+            struct splread_dev *dev = &devs[i];
+
+            if (h != dev->hub) {
+                continue;
+            }
+
+            dev->due_ns = start_ns;
+            if (false == config_no_stagger) {
+                dev->due_ns += dev->poll_ms * SPL_NS_PER_MS * slot / hubs[h].nr_devs;
+            }
+            dev->next_report_ns = dev->due_ns;
+            slot++;
+
+            if (true == config_phase_lock) {
+                spl_phase_init(&dev->phase, dev->due_ns);
+            }
+
+            spl_timer_init(&dev->timer, _splread_poll_due, dev);
+            spl_wheel_add(&poll_wheel, &dev->timer, dev->due_ns);
+        }
+    }
+
+    spl_timer_init(&hub_report_timer, _splread_hub_report_due, NULL);
+    spl_wheel_add(&poll_wheel, &hub_report_timer, start_ns + SPLREAD_HUB_REPORT_SEC * SPL_NS_PER_SEC);
+
+    if (NULL != plugins) {
+        spl_timer_init(&plugin_flush_timer, _splread_plugin_flush_due, NULL);
+        spl_wheel_add(&poll_wheel, &plugin_flush_timer, start_ns + SPLREAD_PLUGIN_FLUSH_MS * SPL_NS_PER_MS);
+    }
+
+    if (true == spl_arena_active()) {
+        char *stdout_buf = NULL;
+
+        /* stdio would otherwise allocate its buffer on the first record we print */
+        if (NULL == (stdout_buf = spl_zalloc(SPLREAD_STDOUT_BUF_LEN))) {
+            ret = A_E_NOMEM;
+            goto done;
+        }
+        setvbuf(stdout, stdout_buf, _IOFBF, SPLREAD_STDOUT_BUF_LEN);
+
+        spl_arena_seal();
+        rss_baseline_kib = splread_rss_anon_kib();
+        SPL_MSG(SEV_INFO, "FIXED-FOOTPRINT", "Startup used %zu of %zu KiB set aside, %lu KiB resident; allocating "
+                "nothing more", spl_arena_used() / 1024, spl_arena_size() / 1024, rss_baseline_kib);
+    }
+
+    do {
+        uint64_t now_ns = get_mono_time_ns(),
+                 next_ns = spl_wheel_next_ns(&poll_wheel);
+
+        if (next_ns > now_ns) {
+            /* Sleep until the wheel next needs turning; a signal cuts this short */
+            struct timespec ts = {
+                .tv_sec = next_ns / SPL_NS_PER_SEC,
+                .tv_nsec = next_ns % SPL_NS_PER_SEC,
+            };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            nr_wakeups++;
+            continue;
+        }
+
+        spl_wheel_advance(&poll_wheel, now_ns);
+
+        if (NULL != shard_ring) {
+            /* So the supervisor can tell we're stuck talking to a meter, rather than asleep */
+            spl_shard_set_busy(shard_ring, true);
+        }
+
+        ret = splread_poll_due(store, evt_idx);
+
+        if (NULL != shard_ring) {
+            spl_shard_set_busy(shard_ring, false);
+        }
+
+        if (FAILED(ret)) {
+            goto done;
+        }
+    } while (true == running);
+
+done:
+    return ret;
+}
+
+/**
+ * Put each device in a worker's group: the USB bus or hub it's on, or a group of its own
+ */
+static
+int splread_group_shards(void)
+{
+    int ret = A_OK;
+
+    if (NULL == (shards = spl_zalloc(nr_devs * sizeof(struct splread_shard)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < nr_devs; i++) {
+        struct splread_dev *dev = &devs[i];
+        char name[SPL_USB_PORT_LEN],
+             port[SPL_USB_PORT_LEN];
+        size_t s = 0;
+
+        if (0 == strcmp(config_shard_by, "device")) {
+            snprintf(name, sizeof(name), "device %u", dev->id);
+        } else if (0 == strcmp(config_shard_by, "hub")) {
+            snprintf(name, sizeof(name), "%s", hubs[dev->hub].name);
+        } else if (FAILED(spl_usb_port_path(dev->path, port, sizeof(port)))) {
+            snprintf(name, sizeof(name), "unknown");
+        } else {
+            /* The bus is the first part of the port path */
+            snprintf(name, sizeof(name), "usb%.*s", (int)strcspn(port, "-"), port);
+        }
+
+        for (s = 0; s < nr_shards; s++) {
+            if (0 == strcmp(shards[s].name, name)) {
+                break;
+            }
+        }
+
+        if (s == nr_shards) {
+            snprintf(shards[s].name, sizeof(shards[s].name), "%s", name);
+            nr_shards++;
+        }
+
+        dev->shard = s;
+        shards[s].nr_devs++;
+        /* At worst, a worker waits out a poll on every one of its meters in turn */
+        shards[s].hang_ns += 2 * dev->poll_ms * SPL_NS_PER_MS;
+    }
+
+    for (size_t s = 0; s < nr_shards; s++) {
+        if (shards[s].hang_ns < SPLREAD_SHARD_HANG_MIN_SEC * SPL_NS_PER_SEC) {
+            shards[s].hang_ns = SPLREAD_SHARD_HANG_MIN_SEC * SPL_NS_PER_SEC;
+        }
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * In a freshly forked worker: poll the devices in shard s, passing what they report up the
+ * ring, until the supervisor tells us to stop. Never returns.
+ */
+static
+void splread_worker(size_t s, pid_t supervisor)
+{
+    int ret = A_OK;
+
+    size_t nr_mine = 0;
+
+    spl_log_after_fork();
+
+    /* Go when the supervisor does, and leave ^C to the supervisor, which stops us itself */
+    if (0 > prctl(PR_SET_PDEATHSIG, SIGTERM, 0, 0, 0) || supervisor != getppid()) {
+        _exit(EXIT_FAILURE);
+    }
+    signal(SIGINT, SIG_IGN);
+
+    /* Everything but polling is left to the supervisor */
+    shard_ring = shards[s].ring;
+    nr_shards = 0;
+    pool = NULL;
+    plugins = NULL;
+    flight = NULL;
+
+    for (size_t i = 0; i < nr_devs; i++) {
+        if (s == devs[i].shard) {
+            devs[nr_mine++] = devs[i];
+        }
+    }
+    nr_devs = nr_mine;
+
+    for (size_t h = 0; h < nr_hubs; h++) {
+        hubs[h].nr_devs = 0;
+    }
+    for (size_t i = 0; i < nr_devs; i++) {
+        hubs[devs[i].hub].nr_devs++;
+    }
+
+    if (A_OK == (ret = splread_open_devices())) {
+        ret = splread_run(NULL, NULL);
+    }
+
+    splread_report_hubs();
+    splread_report_responses();
+    splread_report_io();
+    splread_report_wakeups();
+    if (0 != load.nr_overloads) {
+        splread_report_load();
+    }
+
+    spl_ring_free(&ring);
+    for (size_t i = 0; i < nr_devs; i++) {
+        if (NULL != devs[i].hid) {
+            hid_close(devs[i].hid);
+        }
+        if (0 <= devs[i].ring_fd) {
+            close(devs[i].ring_fd);
+        }
+    }
+    hid_exit();
+
+    spl_log_stop();
+
+    /* Without running atexit handlers or flushing stdio, both of which are the supervisor's */
+    _exit(FAILED(ret) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static
+int splread_spawn_shard(size_t s)
+{
+    int ret = A_OK;
+
+    struct splread_shard *shard = &shards[s];
+    pid_t supervisor = getpid(),
+          pid = -1;
+
+    /* A worker that was killed may have left this set */
+    spl_shard_set_busy(shard->ring, false);
+
+    if (0 > (pid = fork())) {
+        SPL_MSG(SEV_ERROR, "WORKER-FORK-FAIL", "Failed to start a worker for %s: %s", shard->name, strerror(errno));
+        shard->respawn_ns = get_mono_time_ns() + SPLREAD_SHARD_RESPAWN_SEC * SPL_NS_PER_SEC;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (0 == pid) {
+        splread_worker(s, supervisor);
+    }
+
+    shard->pid = pid;
+
+    SPL_MSG(SEV_INFO, "WORKER-START", "Started worker %d for %s, polling %zu devices", (int)pid, shard->name,
+            shard->nr_devs);
+
+done:
+    return ret;
+}
+
+/**
+ * Reap workers that have stopped, restart them once they've been stopped a while, and kill
+ * any that have been stuck talking to their meters for too long
+ */
+static
+void _splread_shard_check_due(struct spl_timer *timer, void *arg)
+{
+    uint64_t now_ns = get_mono_time_ns();
+
+    (void)arg;
+
+    for (size_t i = 0; i < nr_shards; i++) {
+        struct splread_shard *shard = &shards[i];
+        uint64_t busy_since_ns = spl_shard_busy_since_ns(shard->ring);
+        int status = 0;
+
+        if (0 == shard->pid) {
+            if (now_ns >= shard->respawn_ns && true == running) {
+                shard->nr_restarts++;
+                splread_spawn_shard(i);
+            }
+            continue;
+        }
+
+        if (shard->pid == waitpid(shard->pid, &status, WNOHANG)) {
+            if (WIFSIGNALED(status)) {
+                SPL_MSG(SEV_ERROR, "WORKER-EXITED", "Worker %d for %s was killed by signal %d, restarting it in %u s",
+                        (int)shard->pid, shard->name, WTERMSIG(status), SPLREAD_SHARD_RESPAWN_SEC);
+            } else {
+                SPL_MSG(SEV_ERROR, "WORKER-EXITED", "Worker %d for %s exited with status %d, restarting it in %u s",
+                        (int)shard->pid, shard->name, WEXITSTATUS(status), SPLREAD_SHARD_RESPAWN_SEC);
+            }
+            shard->pid = 0;
+            shard->respawn_ns = now_ns + SPLREAD_SHARD_RESPAWN_SEC * SPL_NS_PER_SEC;
+        } else if (0 != busy_since_ns && now_ns - busy_since_ns > shard->hang_ns) {
+            SPL_MSG(SEV_ERROR, "WORKER-HUNG", "Worker %d for %s has been talking to its meters for %.1f s, killing it",
+                    (int)shard->pid, shard->name, (double)(now_ns - busy_since_ns) / 1e9);
+            kill(shard->pid, SIGKILL);
+        }
+    }
+
+    spl_wheel_add(&poll_wheel, timer, now_ns + SPLREAD_SHARD_CHECK_MS * SPL_NS_PER_MS);
+}
+
+/**
+ * Take everything the workers have passed up, and handle it as if we'd read it ourselves
+ */
+static
+void splread_drain_shards(struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    for (size_t i = 0; i < nr_shards; i++) {
+        struct spl_shard_rec recs[SPLREAD_SHARD_DRAIN_RECS];
+        size_t nr = 0;
+
+        if (NULL == shards[i].ring) {
+            continue;
+        }
+
+        /* Clear the wakeup first, so a report added while we're draining wakes us again */
+        spl_shard_ack(shards[i].ring);
+
+        while (0 != (nr = spl_shard_pop(shards[i].ring, recs, SPLREAD_SHARD_DRAIN_RECS))) {
+            for (size_t r = 0; r < nr; r++) {
+                struct splread_dev *dev = NULL;
+
+                if (recs[r].device >= nr_devs) {
+                    continue;
+                }
+                dev = &devs[recs[r].device];
+
+                if (NULL != flight) {
+                    spl_flight_record(flight, recs[r].ts_ns, dev->id, recs[r].report);
+                }
+
+                splread_handle_report(dev, recs[r].report, recs[r].ts_ns, recs[r].ts_err_us, 0 != recs[r].output_due,
+                        store, evt_idx);
+            }
+
+            shards[i].nr_samples += nr;
+        }
+    }
+}
+
+/**
+ * Stop every worker, politely at first
+ */
+static
+void splread_stop_shards(void)
+{
+    uint64_t stop_ns = get_mono_time_ns() + SPLREAD_SHARD_STOP_MS * SPL_NS_PER_MS;
+
+    for (size_t i = 0; i < nr_shards; i++) {
+        if (0 < shards[i].pid) {
+            kill(shards[i].pid, SIGTERM);
+        }
+    }
+
+    for (size_t i = 0; i < nr_shards; i++) {
+        struct splread_shard *shard = &shards[i];
+
+        while (0 < shard->pid) {
+            struct timespec ts = { .tv_nsec = 10 * SPL_NS_PER_MS };
+
+            if (shard->pid == waitpid(shard->pid, NULL, WNOHANG)) {
+                shard->pid = 0;
+                break;
+            }
+
+            if (get_mono_time_ns() >= stop_ns) {
+                SPL_MSG(SEV_WARNING, "WORKER-STUCK", "Worker %d for %s didn't stop when asked, killing it",
+                        (int)shard->pid, shard->name);
+                kill(shard->pid, SIGKILL);
+                waitpid(shard->pid, NULL, 0);
+                shard->pid = 0;
+                break;
+            }
+
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+/**
+ * Start a worker for each group of devices, and handle everything they read until we're
+ * asked to stop, restarting any that die or hang along the way
+ */
+static
+int splread_supervise(struct spl_store *store, struct spl_event_index *evt_idx)
+{
+    int ret = A_OK;
+
+    struct pollfd *pfds = NULL;
+    uint64_t start_ns = 0;
+
+    if (FAILED(ret = splread_group_shards())) {
+        SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory grouping devices into workers, aborting.");
+        goto done;
+    }
+
+    if (NULL == (pfds = spl_zalloc(nr_shards * sizeof(struct pollfd)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < nr_shards; i++) {
+        if (FAILED(ret = spl_shard_ring_new(&shards[i].ring, SPL_SHARD_DEFAULT_SLOTS))) {
+            goto done;
+        }
+
+        pfds[i].fd = spl_shard_fd(shards[i].ring);
+        pfds[i].events = POLLIN;
+    }
+
+    start_ns = get_mono_time_ns();
+    spl_load_init(&load, config_lag_limit_ms * SPL_NS_PER_MS, start_ns);
+    spl_wheel_init(&poll_wheel, SPLREAD_TICK_MS * SPL_NS_PER_MS, start_ns);
+    wakeups_since_ns = start_ns;
+
+    for (size_t i = 0; i < nr_shards; i++) {
+        if (FAILED(ret = splread_spawn_shard(i))) {
+            goto done;
+        }
+    }
+
+    spl_timer_init(&shard_check_timer, _splread_shard_check_due, NULL);
+    spl_wheel_add(&poll_wheel, &shard_check_timer, start_ns + SPLREAD_SHARD_CHECK_MS * SPL_NS_PER_MS);
+
+    spl_timer_init(&hub_report_timer, _splread_hub_report_due, NULL);
+    spl_wheel_add(&poll_wheel, &hub_report_timer, start_ns + SPLREAD_HUB_REPORT_SEC * SPL_NS_PER_SEC);
+
+    if (NULL != plugins) {
+        spl_timer_init(&plugin_flush_timer, _splread_plugin_flush_due, NULL);
+        spl_wheel_add(&poll_wheel, &plugin_flush_timer, start_ns + SPLREAD_PLUGIN_FLUSH_MS * SPL_NS_PER_MS);
+    }
+
+    do {
+        uint64_t now_ns = get_mono_time_ns(),
+                 next_ns = spl_wheel_next_ns(&poll_wheel);
+
+        if (next_ns > now_ns) {
+            /* Sleep until a worker has something for us, or the wheel next needs turning */
+            if (0 < poll(pfds, nr_shards, (int)((next_ns - now_ns + SPL_NS_PER_MS - 1) / SPL_NS_PER_MS))) {
+                splread_drain_shards(store, evt_idx);
+            }
+            nr_wakeups++;
+            continue;
+        }
+
+        spl_wheel_advance(&poll_wheel, now_ns);
+    } while (true == running);
+
+done:
+    splread_stop_shards();
+
+    /* Whatever the workers read before they stopped */
+    splread_drain_shards(store, evt_idx);
+    splread_report_shards();
+
+    for (size_t i = 0; i < nr_shards; i++) {
+        spl_shard_ring_free(&shards[i].ring);
+    }
+    spl_free(shards);
+    shards = NULL;
+    nr_shards = 0;
+
+    spl_free(pfds);
+
+    return ret;
+}
+
+int main(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    struct spl_store *store = NULL;
+    struct spl_compactor *compactor = NULL;
+    struct spl_event_index *evt_idx = NULL;
+    struct spl_event evt;
+    struct sigaction sa = { .sa_handler = _sigint_handler };
+
+    SPL_MSG(SEV_INFO, "STARTUP", "Starting the Chinese SPL Meter Reader");
+
+    /* Catch SIGINT */
+    if (0 > sigaction(SIGINT, &sa, NULL)) {
+        SPL_MSG(SEV_FATAL, "STARTUP", "Failed to set up SIGINT handler, bizarre. Aborting.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (0 > sigaction(SIGTERM, &sa, NULL)) {
+        SPL_MSG(SEV_FATAL, "STARTUP", "Failed to set up SIGTERM handler, bizarre. Aborting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Parse command line arguments */
+    _parse_args(argc, argv);
+
+    /* From here on, a stuck stderr (or journal) can't hold up polling */
+    spl_log_start();
+
+    if (0 != config_arena_kib && FAILED(spl_arena_init(config_arena_kib * 1024))) {
+        goto done;
+    }
+
+    if (FAILED(splread_convert_serials()) || FAILED(splread_find_devices(GM1356_SPLMETER_VID, GM1356_SPLMETER_PID))) {
+        goto done;
+    }
+
+    /* With several devices, the default output says which device each record came from */
+    if (false == config_have_template &&
+            FAILED(spl_fmt_tmpl_compile(&out_tmpl, nr_devs > 1 ? SPL_FMT_TMPL_DEFAULT_MULTI : SPL_FMT_TMPL_DEFAULT)))
+    {
+        goto done;
+    }
+
+    if (NULL == (out_buf = spl_zalloc(out_tmpl.max_len + SPL_FMT_TMPL_SLACK))) {
+        SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory setting up output, aborting.");
+        goto done;
+    }
+
+    if (NULL != config_lp_measurement) {
+        size_t max_line = 0;
+
+        for (size_t i = 0; i < nr_devs; i++) {
+            struct splread_dev *dev = &devs[i];
+
+            if (FAILED(spl_fmt_lp_prefix(&dev->lp_prefix, &dev->lp_prefix_len, config_lp_measurement, dev->id,
+                            dev->serial_str)))
+            {
+                goto done;
+            }
+
+            if (dev->lp_prefix_len + SPL_FMT_LP_MAX_FIELDS > max_line) {
+                max_line = dev->lp_prefix_len + SPL_FMT_LP_MAX_FIELDS;
+            }
+        }
+
+        if (NULL == (lp_batch = spl_zalloc(max_line * config_lp_batch_lines))) {
+            SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory setting up line protocol batches, aborting.");
+            goto done;
+        }
+
+        spl_timer_init(&lp_flush_timer, _splread_lp_flush_due, NULL);
+    }
+
+    if (true == config_pool) {
+        if (NULL == config_rules_path && 0 == config_nr_plugins) {
+            SPL_MSG(SEV_WARNING, "POOL-UNUSED", "No alert rules to evaluate or plugins to run, so not starting any "
+                    "analysis workers");
+        } else if (FAILED(spl_pool_new(&pool, config_pool_threads, config_pool_jobs))) {
+            SPL_MSG(SEV_FATAL, "NO-POOL", "Failed to start the analysis workers, aborting.");
+            goto done;
+        } else {
+            SPL_MSG(SEV_INFO, "POOL", "Running analysis stages on %u worker threads", spl_pool_nr_workers(pool));
+        }
+    }
+
+    if (NULL != config_rules_path) {
+        /* Weighting letters in the rules are checked against -C, so this waits until all options are in */
+        if (FAILED(spl_rule_set_load(&rule_set, config_rules_path, measure_dbc))) {
+            SPL_MSG(SEV_FATAL, "BAD-RULES", "Failed to load alert rules from %s, aborting.", config_rules_path);
+            goto done;
+        }
+
+        SPL_MSG(SEV_INFO, "RULES", "Loaded alert rules from %s, evaluated in steps of %llu s", config_rules_path,
+                (unsigned long long)spl_rule_set_granule_sec(rule_set));
+
+        if (NULL != pool && FAILED(spl_pool_stage(pool, "rules", &rules_stage))) {
+            SPL_MSG(SEV_FATAL, "NO-POOL", "Failed to set up alert rules on the analysis workers, aborting.");
+            goto done;
+        }
+
+        for (size_t i = 0; i < nr_devs; i++) {
+            struct splread_dev *dev = &devs[i];
+            char *measurement = NULL;
+            int tret = A_OK;
+
+            if (FAILED(spl_rule_eval_new(&dev->rules, rule_set, dev->id, pool, rules_stage))) {
+                SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory setting up alert rules, aborting.");
+                goto done;
+            }
+
+            if (NULL == config_lp_measurement) {
+                continue;
+            }
+
+            if (0 > asprintf(&measurement, "%s_alert", config_lp_measurement)) {
+                goto done;
+            }
+
+            tret = spl_fmt_lp_prefix(&dev->lp_alert_prefix, &dev->lp_alert_prefix_len, measurement, dev->id,
+                    dev->serial_str);
+            free(measurement);
+
+            if (FAILED(tret)) {
+                goto done;
+            }
+        }
+    }
+
+    if (0 != config_nr_plugins) {
+        if (FAILED(spl_plugins_new(&plugins, nr_devs, pool, _splread_publish, NULL))) {
+            goto done;
+        }
+
+        for (size_t i = 0; i < config_nr_plugins; i++) {
+            if (FAILED(spl_plugins_load(plugins, config_plugins[i]))) {
+                SPL_MSG(SEV_FATAL, "BAD-PLUGIN", "Failed to load plugin %s, aborting.", config_plugins[i]);
+                goto done;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nr_devs && true == config_burst; i++) {
+        struct splread_dev *dev = &devs[i];
+
+        if (FAILED(spl_burst_init(&dev->burst, &config_burst_cfg, dev->id))) {
+            SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory setting up burst recording, aborting.");
+            goto done;
+        }
+
+        if (config_burst_cfg.interval_ms < dev->poll_ms) {
+            dev->poll_ms = config_burst_cfg.interval_ms;
+        }
+    }
+
+    if (NULL != config_flight_path && FAILED(spl_flight_open(&flight, config_flight_path, config_flight_slots))) {
+        SPL_MSG(SEV_FATAL, "BAD-FLIGHT-RECORDER", "Failed to set up flight recorder %s, aborting.", config_flight_path);
+        goto done;
+    }
+
+    if (FAILED(splread_group_hubs())) {
+        SPL_MSG(SEV_FATAL, "NO-MEMORY", "Out of memory tracking USB hubs, aborting.");
+        goto done;
+    }
+
+    if (NULL != config_store_dir) {
+        if (FAILED(spl_store_open(&store, config_store_dir))) {
+            SPL_MSG(SEV_FATAL, "BAD-STORE", "Failed to open sample store %s, aborting.", config_store_dir);
+            goto done;
+        }
+
+        if (0 != config_event_threshold_ddb) {
+            if (FAILED(spl_event_index_open(&evt_idx, config_store_dir, true))) {
+                SPL_MSG(SEV_FATAL, "BAD-EVENT-INDEX", "Failed to open event index in %s, aborting.", config_store_dir);
+                goto done;
+            }
+
+            for (size_t i = 0; i < nr_devs; i++) {
+                spl_event_detector_init(&devs[i].evt_det, devs[i].id, config_event_threshold_ddb);
+            }
+        }
+
+        if (true == config_retention) {
+            if (FAILED(spl_compactor_start(&compactor, config_store_dir, &config_retention_policy, SPLREAD_COMPACT_INTERVAL_SEC))) {
+                SPL_MSG(SEV_FATAL, "BAD-COMPACTOR", "Failed to start store compaction, aborting.");
+                goto done;
+            }
+        }
+    }
+
+    if (NULL != config_shard_by) {
+        /* Workers open the devices they poll themselves */
+        hid_exit();
+
+        if (FAILED(splread_supervise(store, evt_idx))) {
+            goto done;
+        }
+    } else if (FAILED(splread_open_devices()) || FAILED(splread_run(store, evt_idx))) {
+        goto done;
+    }
+
+    ret = EXIT_SUCCESS;
+done:
+    if (NULL != evt_idx) {
+        /* Don't lose an event that was still running when we were asked to stop */
+        for (size_t i = 0; i < nr_devs; i++) {
+            if (true == spl_event_detector_finish(&devs[i].evt_det, &evt)) {
+                spl_event_index_append(evt_idx, &evt);
+            }
+        }
+        spl_event_index_close(&evt_idx);
+    }
+
+    for (size_t i = 0; i < nr_devs && true == config_burst; i++) {
+        spl_burst_flush(&devs[i].burst, config_store_dir);
+    }
+
+    spl_compactor_stop(&compactor);
+    spl_store_close(&store);
+
+    spl_flight_close(&flight);
+
+    /* Alerts from the last windows the workers looked at still need to go out */
+    for (size_t i = 0; i < nr_devs; i++) {
+        if (NULL != devs[i].rules) {
+            spl_rule_eval_drain(devs[i].rules, _splread_alert, &devs[i]);
+        }
+    }
+    if (NULL != plugins) {
+        spl_plugins_flush(plugins);
+    }
+    splread_report_pool();
+    spl_pool_free(&pool);
+
+    /* What the plugins logged has to be out before their code (and data) goes away */
+    spl_log_flush();
+    spl_plugins_free(&plugins);
+
+    splread_lp_flush();
+    spl_free(lp_batch);
+
+    splread_report_hubs();
+    splread_report_responses();
+    splread_report_io();
+    spl_ring_free(&ring);
+    splread_report_wakeups();
+    splread_check_footprint(true);
+    if (0 != load.nr_overloads) {
+        splread_report_load();
+    }
+    splread_close_devices();
+
+    spl_free(out_buf);
+    spl_rule_set_free(&rule_set);
+
+    spl_log_stop();
+
+    return ret;
+}
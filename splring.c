@@ -0,0 +1,345 @@
+/* splring.c -- Batched hidraw I/O through io_uring
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splring.h>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* What a completion was for, in the low bit of its user data; the slot is in the rest */
+#define SPL_RING_OP_READ            0ull
+#define SPL_RING_OP_WRITE           1ull
+
+struct spl_ring_slot {
+    bool write_busy;
+};
+
+struct spl_ring {
+    int fd;
+    unsigned nr_slots;
+    uint64_t nr_syscalls;
+    /* Writes queued or sent whose completion we haven't seen yet */
+    unsigned nr_writes;
+
+    /* The submission queue, shared with the kernel */
+    void *sq_ptr;
+    size_t sq_len;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    /* The completion queue, in the same mapping as the submission queue */
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /*
+     * Two buffers per slot, read then write, registered with the kernel as one. They're mapped
+     * separately, not allocated, since the kernel can still be writing to them as we exit.
+     */
+    uint8_t *bufs;
+    size_t bufs_len;
+    struct spl_ring_slot *slots;
+};
+
+static
+uint8_t *_ring_buf(struct spl_ring *ring, unsigned slot, uint64_t op)
+{
+    return ring->bufs + (2 * slot + op) * SPL_RING_REPORT_LEN;
+}
+
+/**
+ * Fill in the next free submission queue entry. It's not seen by the kernel until the next
+ * io_uring_enter().
+ */
+static
+void _ring_queue(struct spl_ring *ring, uint8_t opcode, unsigned slot, uint64_t op, size_t len)
+{
+    uint32_t tail = *ring->sq_tail,
+             idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = (int32_t)slot;
+    sqe->addr = (uint64_t)(uintptr_t)_ring_buf(ring, slot, op);
+    sqe->len = (uint32_t)len;
+    /* hidraw isn't seekable, so read and write wherever the file is */
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = 0;
+    sqe->user_data = ((uint64_t)slot << 1) | op;
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static
+void _ring_queue_read(struct spl_ring *ring, unsigned slot)
+{
+    _ring_queue(ring, IORING_OP_READ_FIXED, slot, SPL_RING_OP_READ, SPL_RING_REPORT_LEN);
+}
+
+int spl_ring_new(struct spl_ring **pring, int const *fds, unsigned nr_fds)
+{
+    int ret = A_OK;
+
+    struct spl_ring *ring = NULL;
+    struct io_uring_params params;
+    struct iovec iov;
+    size_t cq_len = 0;
+
+    ASSERT_ARG(NULL != pring);
+    ASSERT_ARG(NULL != fds);
+    ASSERT_ARG(0 != nr_fds);
+
+    *pring = NULL;
+
+    memset(&params, 0, sizeof(params));
+
+    if (NULL == (ring = spl_zalloc(sizeof(*ring)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    ring->fd = -1;
+    ring->sq_ptr = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    ring->bufs = MAP_FAILED;
+    ring->nr_slots = nr_fds;
+
+    /* At most a read and a write are ever outstanding per slot */
+    if (0 > (ring->fd = (int)syscall(__NR_io_uring_setup, 2 * nr_fds, &params))) {
+        SPL_MSG(SEV_ERROR, "RING-SETUP-FAIL", "Failed to set up io_uring: %s", strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    /* Waiting with a timeout, without a separate timeout request, needs a 5.11 or later kernel */
+    if (0 == (params.features & IORING_FEAT_SINGLE_MMAP) || 0 == (params.features & IORING_FEAT_EXT_ARG)) {
+        SPL_MSG(SEV_ERROR, "RING-TOO-OLD", "This kernel's io_uring is too old, it needs 5.11 or later");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > ring->sq_len) {
+        ring->sq_len = cq_len;
+    }
+
+    if (MAP_FAILED == (ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQ_RING)))
+    {
+        SPL_MSG(SEV_ERROR, "RING-SETUP-FAIL", "Failed to map io_uring queues: %s", strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (MAP_FAILED == (ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES)))
+    {
+        SPL_MSG(SEV_ERROR, "RING-SETUP-FAIL", "Failed to map io_uring submission entries: %s", strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    ring->sq_head = (uint32_t *)((uint8_t *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)((uint8_t *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)((uint8_t *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)((uint8_t *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (uint32_t *)((uint8_t *)ring->sq_ptr + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)((uint8_t *)ring->sq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)((uint8_t *)ring->sq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->sq_ptr + params.cq_off.cqes);
+
+    ring->bufs_len = 2 * nr_fds * SPL_RING_REPORT_LEN;
+    if (MAP_FAILED == (ring->bufs = mmap(NULL, ring->bufs_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0)) ||
+            NULL == (ring->slots = spl_zalloc(nr_fds * sizeof(struct spl_ring_slot))))
+    {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    /* With the buffers and files registered, the kernel needn't look them up on every request */
+    iov.iov_base = ring->bufs;
+    iov.iov_len = ring->bufs_len;
+
+    if (0 > syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) ||
+            0 > syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, nr_fds))
+    {
+        SPL_MSG(SEV_ERROR, "RING-REGISTER-FAIL", "Failed to register buffers and files with io_uring: %s",
+                strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    /* These go to the kernel with the first batch of requests */
+    for (unsigned i = 0; i < nr_fds; i++) {
+        _ring_queue_read(ring, i);
+    }
+
+    *pring = ring;
+
+done:
+    if (FAILED(ret)) {
+        spl_ring_free(&ring);
+    }
+
+    return ret;
+}
+
+void spl_ring_free(struct spl_ring **pring)
+{
+    struct spl_ring *ring = NULL;
+
+    if (NULL == pring || NULL == *pring) {
+        return;
+    }
+
+    ring = *pring;
+
+    /* Closing the ring cancels the reads still posted */
+    if (MAP_FAILED != ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+
+    if (MAP_FAILED != ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+
+    if (0 <= ring->fd) {
+        close(ring->fd);
+    }
+
+    if (MAP_FAILED != ring->bufs) {
+        munmap(ring->bufs, ring->bufs_len);
+    }
+
+    spl_free(ring->slots);
+    spl_free(ring);
+
+    *pring = NULL;
+}
+
+int spl_ring_queue_write(struct spl_ring *ring, unsigned slot, void const *buf, size_t len)
+{
+    int ret = A_OK;
+
+    ASSERT_ARG(NULL != ring);
+    ASSERT_ARG(slot < ring->nr_slots);
+    ASSERT_ARG(NULL != buf);
+    ASSERT_ARG(len <= SPL_RING_REPORT_LEN);
+
+    if (true == ring->slots[slot].write_busy) {
+        ret = A_E_BUSY;
+        goto done;
+    }
+
+    memcpy(_ring_buf(ring, slot, SPL_RING_OP_WRITE), buf, len);
+    _ring_queue(ring, IORING_OP_WRITE_FIXED, slot, SPL_RING_OP_WRITE, len);
+    ring->slots[slot].write_busy = true;
+    ring->nr_writes++;
+
+done:
+    return ret;
+}
+
+int spl_ring_reap(struct spl_ring *ring, unsigned nr_reports, uint64_t timeout_ns, spl_ring_report_cb_t cb,
+        void *arg)
+{
+    int ret = A_E_TIMEOUT;
+
+    uint32_t head = 0;
+
+    ASSERT_ARG(NULL != ring);
+    ASSERT_ARG(NULL != cb);
+
+    if (0 != nr_reports) {
+        struct __kernel_timespec ts = {
+            .tv_sec = timeout_ns / SPL_NS_PER_SEC,
+            .tv_nsec = timeout_ns % SPL_NS_PER_SEC,
+        };
+        struct io_uring_getevents_arg wait = {
+            .ts = (uint64_t)(uintptr_t)&ts,
+        };
+        uint32_t to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        ring->nr_syscalls++;
+
+        /*
+         * Every write completes, one way or another, so wait for those as well as the reports;
+         * that way finishing a write doesn't wake us up on its own. Running out of time, or a
+         * signal, just means there's less to reap.
+         */
+        if (0 > syscall(__NR_io_uring_enter, ring->fd, to_submit, nr_reports + ring->nr_writes,
+                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &wait, sizeof(wait)) &&
+                ETIME != errno && EINTR != errno && EBUSY != errno)
+        {
+            SPL_MSG(SEV_ERROR, "RING-ENTER-FAIL", "Failed to submit to io_uring: %s", strerror(errno));
+            ret = A_E_IO;
+            goto done;
+        }
+    }
+
+    for (head = *ring->cq_head; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); head++) {
+        struct io_uring_cqe const *cqe = &ring->cqes[head & ring->cq_mask];
+        unsigned slot = (unsigned)(cqe->user_data >> 1);
+        uint64_t op = cqe->user_data & 1;
+        int res = cqe->res;
+
+        if (SPL_RING_OP_WRITE == op) {
+            ring->slots[slot].write_busy = false;
+            ring->nr_writes--;
+            if (0 > res) {
+                SPL_MSG(SEV_ERROR, "RING-WRITE-FAIL", "Failed to write to device in slot %u: %s", slot,
+                        strerror(-res));
+                ret = A_E_IO;
+            }
+            continue;
+        }
+
+        if (0 < res) {
+            if (A_E_TIMEOUT == ret) {
+                ret = A_OK;
+            }
+            cb(slot, _ring_buf(ring, slot, SPL_RING_OP_READ), (size_t)res, arg);
+        } else if (0 > res && -EINTR != res && -EAGAIN != res) {
+            SPL_MSG(SEV_ERROR, "RING-READ-FAIL", "Failed to read from device in slot %u: %s", slot, strerror(-res));
+            ret = A_E_IO;
+            continue;
+        }
+
+        /* The buffer's been handed on, so the next report can go into it, with the next batch */
+        _ring_queue_read(ring, slot);
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+done:
+    return ret;
+}
+
+uint64_t spl_ring_nr_syscalls(struct spl_ring const *ring)
+{
+    return ring->nr_syscalls;
+}
@@ -0,0 +1,57 @@
+/* splring.h -- Batched hidraw I/O through io_uring
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each device (a hidraw file descriptor) has a slot in the ring. A read is always posted
+ * against every slot, into a buffer registered with the kernel up front, so responses are
+ * picked up without a read() each. Requests are queued up with spl_ring_queue_write(), and
+ * go to the kernel, along with any reads that need posting again, in the same single
+ * io_uring_enter() that waits for responses in spl_ring_reap().
+ */
+#define SPL_RING_REPORT_LEN         64
+
+struct spl_ring;
+
+/**
+ * Called for each report read; report is only valid until the callback returns
+ */
+typedef void (*spl_ring_report_cb_t)(unsigned slot, void const *report, size_t len, void *arg);
+
+/**
+ * Set up a ring for the given file descriptors, which become slots 0 to nr_fds - 1. The
+ * descriptors stay the caller's to close, after the ring is freed.
+ */
+int spl_ring_new(struct spl_ring **pring, int const *fds, unsigned nr_fds);
+void spl_ring_free(struct spl_ring **pring);
+
+/**
+ * Queue a write to the given slot. Nothing is sent until the next spl_ring_reap(). Returns
+ * A_E_BUSY if the last write to that slot hasn't completed yet.
+ */
+int spl_ring_queue_write(struct spl_ring *ring, unsigned slot, void const *buf, size_t len);
+
+/**
+ * Send everything queued, then wait up to timeout_ns for nr_reports reports to be read (and
+ * for every write sent to complete), and hand every report read to cb. With nr_reports of 0,
+ * nothing is sent and there's no system call; only what has already completed is picked up.
+ * Returns A_E_TIMEOUT if no reports were read.
+ */
+int spl_ring_reap(struct spl_ring *ring, unsigned nr_reports, uint64_t timeout_ns, spl_ring_report_cb_t cb,
+        void *arg);
+
+/**
+ * How many system calls the ring has made, since it was set up
+ */
+uint64_t spl_ring_nr_syscalls(struct spl_ring const *ring);
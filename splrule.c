@@ -0,0 +1,1208 @@
+/* splrule.c -- Alert rules over windowed aggregates, compiled to bytecode
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splkern.h>
+#include <splrule.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum spl_rule_agg_kind {
+    SPL_RULE_AGG_LEQ,
+    SPL_RULE_AGG_LMAX,
+    SPL_RULE_AGG_LMIN,
+    SPL_RULE_AGG_LN,
+};
+
+struct spl_rule_agg {
+    uint8_t kind;
+    /* N, for L{N} */
+    uint8_t pct;
+    uint64_t len_sec;
+};
+
+enum spl_rule_opcode {
+    SPL_RULE_OP_CONST,
+    SPL_RULE_OP_AGG,
+    SPL_RULE_OP_ADD,
+    SPL_RULE_OP_SUB,
+    SPL_RULE_OP_LT,
+    SPL_RULE_OP_LE,
+    SPL_RULE_OP_GT,
+    SPL_RULE_OP_GE,
+    SPL_RULE_OP_EQ,
+    SPL_RULE_OP_NE,
+    SPL_RULE_OP_AND,
+    SPL_RULE_OP_OR,
+    SPL_RULE_OP_NOT,
+};
+
+struct spl_rule_op {
+    uint8_t op;
+    /* Index of the constant, or of the aggregate in the set */
+    uint8_t arg;
+};
+
+struct spl_rule {
+    char name[SPL_RULE_MAX_NAME + 1];
+    /* The expression, in postfix order */
+    size_t nr_ops;
+    struct spl_rule_op ops[SPL_RULE_MAX_OPS];
+    size_t nr_consts;
+    double consts[SPL_RULE_MAX_OPS];
+    unsigned for_windows;
+    /* The shortest window in the rule; the rule is evaluated each time one closes */
+    uint64_t period_sec;
+    size_t nr_aggs;
+    uint8_t aggs[SPL_RULE_MAX_RULE_AGGS];
+    char agg_names[SPL_RULE_MAX_RULE_AGGS][SPL_RULE_MAX_NAME + 1];
+};
+
+struct spl_rule_set {
+    size_t nr_rules;
+    struct spl_rule rules[SPL_RULE_MAX_RULES];
+    size_t nr_aggs;
+    struct spl_rule_agg aggs[SPL_RULE_MAX_AGGS];
+    uint64_t granule_sec;
+};
+
+/*
+ * Partial aggregates for one granule
+ */
+struct spl_rule_granule {
+    /* The granule number plus one, or 0 if the slot holds nothing */
+    uint64_t gran;
+    uint32_t nr;
+    uint16_t min_ddb;
+    uint16_t max_ddb;
+    double energy;
+};
+
+struct spl_rule_eval {
+    struct spl_rule_set const *set;
+    uint16_t device;
+    uint64_t granule_ns;
+    bool need_energy;
+    bool need_extremes;
+    bool need_hist;
+    /* Enough granules for the longest window */
+    size_t nr_slots;
+    struct spl_rule_granule *slots;
+    /* nr_slots histograms of SPL_RULE_HIST_BINS bins, and one to merge them into, if needed */
+    uint32_t *hist;
+    uint32_t *hist_merged;
+    bool started;
+    /* The granule being filled; written atomically, for jobs to check against */
+    uint64_t cur;
+    /* Aggregate values, worked out at most once per window close */
+    double values[SPL_RULE_MAX_AGGS];
+    uint64_t values_at[SPL_RULE_MAX_AGGS];
+    unsigned streak[SPL_RULE_MAX_RULES];
+    bool raised[SPL_RULE_MAX_RULES];
+
+    /*
+     * Evaluating on a pool. The feeding thread owns pend_first and pend_end, the closed
+     * granules not yet handed to a job. While busy is set, a job owns job_first, job_end,
+     * the rule state above and the outbox; once it clears, they're the feeding thread's again.
+     */
+    struct spl_pool *pool;
+    struct spl_pool_job job;
+    bool busy;
+    uint64_t pend_first;
+    uint64_t pend_end;
+    uint64_t job_first;
+    uint64_t job_end;
+    size_t nr_outbox;
+    /* Alerts found by a job, or by the feeding thread when there's no pool */
+    struct spl_alert *outbox;
+    /* Granules never evaluated because the pool fell too far behind */
+    uint64_t nr_dropped;
+};
+
+/*
+ * Recursive descent parser for expressions, emitting postfix bytecode as it goes
+ */
+struct _rule_parser {
+    const char *p;
+    struct spl_rule_set *set;
+    struct spl_rule *rule;
+    bool dbc;
+    size_t depth;
+};
+
+static
+int _parse_or(struct _rule_parser *parser);
+
+static
+void _skip_space(struct _rule_parser *parser)
+{
+    while (isspace((unsigned char)*parser->p)) {
+        parser->p++;
+    }
+}
+
+static
+bool _accept(struct _rule_parser *parser, const char *tok)
+{
+    size_t len = strlen(tok);
+
+    _skip_space(parser);
+
+    if (0 != strncmp(parser->p, tok, len)) {
+        return false;
+    }
+
+    parser->p += len;
+
+    return true;
+}
+
+static
+int _bad_rule(struct _rule_parser *parser, const char *what)
+{
+    SPL_MSG(SEV_ERROR, "BAD-RULE", "Rule '%s': %s at '%s'", parser->rule->name, what, parser->p);
+    return A_E_INVAL;
+}
+
+static
+int _emit(struct _rule_parser *parser, uint8_t op, uint8_t arg)
+{
+    struct spl_rule *rule = parser->rule;
+
+    if (SPL_RULE_MAX_OPS == rule->nr_ops) {
+        return _bad_rule(parser, "expression is too long");
+    }
+
+    rule->ops[rule->nr_ops].op = op;
+    rule->ops[rule->nr_ops].arg = arg;
+    rule->nr_ops++;
+
+    /* Track how deep the evaluation stack gets */
+    if (SPL_RULE_OP_CONST == op || SPL_RULE_OP_AGG == op) {
+        if (SPL_RULE_MAX_STACK == ++parser->depth) {
+            return _bad_rule(parser, "expression is nested too deeply");
+        }
+    } else if (SPL_RULE_OP_NOT != op) {
+        parser->depth--;
+    }
+
+    return A_OK;
+}
+
+/**
+ * Parse a window length, such as 30s, 15min or 1h
+ */
+static
+bool _parse_len(const char *str, size_t len, uint64_t *plen_sec)
+{
+    uint64_t n = 0,
+             mult = 0;
+    size_t i = 0;
+
+    for (i = 0; i < len && isdigit((unsigned char)str[i]); i++) {
+        n = n * 10 + (str[i] - '0');
+    }
+
+    if (0 == i || 0 == n) {
+        return false;
+    }
+
+    if (len - i == 1 && 's' == str[i]) {
+        mult = 1;
+    } else if (len - i == 3 && 0 == strncmp(&str[i], "min", 3)) {
+        mult = 60;
+    } else if (len - i == 1 && 'h' == str[i]) {
+        mult = 3600;
+    } else {
+        return false;
+    }
+
+    *plen_sec = n * mult;
+
+    return true;
+}
+
+/**
+ * Parse an aggregate, such as LAeq_1min or L90_15min, and add it to the rule (and the set)
+ */
+static
+int _parse_agg(struct _rule_parser *parser)
+{
+    struct spl_rule *rule = parser->rule;
+    struct spl_rule_set *set = parser->set;
+    const char *start = parser->p,
+               *end = start,
+               *s = start + 1,
+               *us = NULL;
+    struct spl_rule_agg agg = { 0 };
+    size_t idx = 0,
+           ridx = 0;
+
+    while (isalnum((unsigned char)*end) || '_' == *end) {
+        end++;
+    }
+
+    us = memchr(start, '_', end - start);
+
+    if ('L' != *start || NULL == us) {
+        return _bad_rule(parser, "expected an aggregate such as LAeq_1min");
+    }
+
+    /* An optional weighting, which has to match what the meter measures */
+    if (('A' == *s || 'C' == *s) && s + 1 < us) {
+        if (('C' == *s) != parser->dbc) {
+            return _bad_rule(parser, "weighting doesn't match what the meter is set to measure");
+        }
+        s++;
+    }
+
+    if (us - s == 2 && 0 == strncmp(s, "eq", 2)) {
+        agg.kind = SPL_RULE_AGG_LEQ;
+    } else if (us - s == 3 && 0 == strncmp(s, "max", 3)) {
+        agg.kind = SPL_RULE_AGG_LMAX;
+    } else if (us - s == 3 && 0 == strncmp(s, "min", 3)) {
+        agg.kind = SPL_RULE_AGG_LMIN;
+    } else if ((us - s == 1 && isdigit((unsigned char)s[0]) && '0' != s[0]) ||
+            (us - s == 2 && isdigit((unsigned char)s[0]) && isdigit((unsigned char)s[1]) && '0' != s[0]))
+    {
+        agg.kind = SPL_RULE_AGG_LN;
+        agg.pct = 1 == us - s ? s[0] - '0' : (s[0] - '0') * 10 + (s[1] - '0');
+    } else {
+        return _bad_rule(parser, "unknown aggregate");
+    }
+
+    if (false == _parse_len(us + 1, end - us - 1, &agg.len_sec)) {
+        return _bad_rule(parser, "bad window length (expected e.g. 30s, 15min or 1h)");
+    }
+
+    if ((size_t)(end - start) > SPL_RULE_MAX_NAME) {
+        return _bad_rule(parser, "aggregate name is too long");
+    }
+
+    /* Share aggregates between rules */
+    for (idx = 0; idx < set->nr_aggs; idx++) {
+        if (set->aggs[idx].kind == agg.kind && set->aggs[idx].pct == agg.pct && set->aggs[idx].len_sec == agg.len_sec) {
+            break;
+        }
+    }
+
+    if (idx == set->nr_aggs) {
+        if (SPL_RULE_MAX_AGGS == set->nr_aggs) {
+            return _bad_rule(parser, "too many different aggregates");
+        }
+        set->aggs[set->nr_aggs++] = agg;
+    }
+
+    for (ridx = 0; ridx < rule->nr_aggs; ridx++) {
+        if (rule->aggs[ridx] == idx) {
+            break;
+        }
+    }
+
+    if (ridx == rule->nr_aggs) {
+        if (SPL_RULE_MAX_RULE_AGGS == rule->nr_aggs) {
+            return _bad_rule(parser, "too many aggregates in one rule");
+        }
+        rule->aggs[rule->nr_aggs] = idx;
+        memcpy(rule->agg_names[rule->nr_aggs], start, end - start);
+        rule->agg_names[rule->nr_aggs][end - start] = '\0';
+        rule->nr_aggs++;
+    }
+
+    if (0 == rule->period_sec || agg.len_sec < rule->period_sec) {
+        rule->period_sec = agg.len_sec;
+    }
+
+    parser->p = end;
+
+    return _emit(parser, SPL_RULE_OP_AGG, idx);
+}
+
+static
+int _parse_primary(struct _rule_parser *parser)
+{
+    int ret = A_OK;
+
+    struct spl_rule *rule = parser->rule;
+    char *end = NULL;
+    double v = 0.0;
+
+    _skip_space(parser);
+
+    if (true == _accept(parser, "(")) {
+        if (FAILED(ret = _parse_or(parser))) {
+            goto done;
+        }
+        if (false == _accept(parser, ")")) {
+            ret = _bad_rule(parser, "expected ')'");
+        }
+    } else if (true == _accept(parser, "!")) {
+        if (!FAILED(ret = _parse_primary(parser))) {
+            ret = _emit(parser, SPL_RULE_OP_NOT, 0);
+        }
+    } else if (isdigit((unsigned char)*parser->p) || '.' == *parser->p) {
+        v = strtod(parser->p, &end);
+        if (end == parser->p) {
+            ret = _bad_rule(parser, "bad number");
+            goto done;
+        }
+        parser->p = end;
+        rule->consts[rule->nr_consts] = v;
+        ret = _emit(parser, SPL_RULE_OP_CONST, rule->nr_consts++);
+    } else if ('L' == *parser->p) {
+        ret = _parse_agg(parser);
+    } else {
+        ret = _bad_rule(parser, "expected a number, an aggregate or '('");
+    }
+
+done:
+    return ret;
+}
+
+static
+int _parse_sum(struct _rule_parser *parser)
+{
+    int ret = A_OK;
+
+    if (FAILED(ret = _parse_primary(parser))) {
+        goto done;
+    }
+
+    for (;;) {
+        uint8_t op = 0;
+
+        if (true == _accept(parser, "+")) {
+            op = SPL_RULE_OP_ADD;
+        } else if (true == _accept(parser, "-")) {
+            op = SPL_RULE_OP_SUB;
+        } else {
+            break;
+        }
+
+        if (FAILED(ret = _parse_primary(parser)) || FAILED(ret = _emit(parser, op, 0))) {
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
+
+static
+int _parse_cmp(struct _rule_parser *parser)
+{
+    int ret = A_OK;
+
+    uint8_t op = 0;
+
+    if (FAILED(ret = _parse_sum(parser))) {
+        goto done;
+    }
+
+    /* Longest first, so <= isn't taken for < */
+    if (true == _accept(parser, "<=")) {
+        op = SPL_RULE_OP_LE;
+    } else if (true == _accept(parser, ">=")) {
+        op = SPL_RULE_OP_GE;
+    } else if (true == _accept(parser, "==")) {
+        op = SPL_RULE_OP_EQ;
+    } else if (true == _accept(parser, "!=")) {
+        op = SPL_RULE_OP_NE;
+    } else if (true == _accept(parser, "<")) {
+        op = SPL_RULE_OP_LT;
+    } else if (true == _accept(parser, ">")) {
+        op = SPL_RULE_OP_GT;
+    } else {
+        goto done;
+    }
+
+    if (FAILED(ret = _parse_sum(parser))) {
+        goto done;
+    }
+
+    ret = _emit(parser, op, 0);
+
+done:
+    return ret;
+}
+
+static
+int _parse_and(struct _rule_parser *parser)
+{
+    int ret = A_OK;
+
+    if (FAILED(ret = _parse_cmp(parser))) {
+        goto done;
+    }
+
+    while (true == _accept(parser, "&&")) {
+        if (FAILED(ret = _parse_cmp(parser)) || FAILED(ret = _emit(parser, SPL_RULE_OP_AND, 0))) {
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
+
+static
+int _parse_or(struct _rule_parser *parser)
+{
+    int ret = A_OK;
+
+    if (FAILED(ret = _parse_and(parser))) {
+        goto done;
+    }
+
+    while (true == _accept(parser, "||")) {
+        if (FAILED(ret = _parse_and(parser)) || FAILED(ret = _emit(parser, SPL_RULE_OP_OR, 0))) {
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
+
+static
+uint64_t _gcd(uint64_t a, uint64_t b)
+{
+    while (0 != b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+int spl_rule_set_add(struct spl_rule_set *set, const char *line, bool dbc)
+{
+    int ret = A_OK;
+
+    struct _rule_parser parser = { .set = set, .dbc = dbc };
+    struct spl_rule *rule = NULL;
+    const char *colon = NULL;
+    size_t name_len = 0,
+           nr_aggs = 0;
+    uint64_t granule_sec = 0;
+    char *end = NULL;
+
+    ASSERT_ARG(NULL != set);
+    ASSERT_ARG(NULL != line);
+
+    nr_aggs = set->nr_aggs;
+
+    if (SPL_RULE_MAX_RULES == set->nr_rules) {
+        SPL_MSG(SEV_ERROR, "BAD-RULE", "Too many rules (at most %d)", SPL_RULE_MAX_RULES);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    rule = &set->rules[set->nr_rules];
+    memset(rule, 0, sizeof(*rule));
+    rule->for_windows = 1;
+    parser.rule = rule;
+
+    while (isspace((unsigned char)*line)) {
+        line++;
+    }
+
+    if (NULL == (colon = strchr(line, ':'))) {
+        SPL_MSG(SEV_ERROR, "BAD-RULE", "Expected a rule name and a colon at '%s'", line);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    name_len = colon - line;
+    if (0 == name_len || name_len > SPL_RULE_MAX_NAME) {
+        SPL_MSG(SEV_ERROR, "BAD-RULE", "Rule names must be 1 to %d characters, at '%s'", SPL_RULE_MAX_NAME, line);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* Rule names go into JSON and line protocol as they are, so keep them plain */
+    for (size_t i = 0; i < name_len; i++) {
+        if (!isalnum((unsigned char)line[i]) && '_' != line[i] && '-' != line[i]) {
+            SPL_MSG(SEV_ERROR, "BAD-RULE", "Rule names can only have letters, digits, '_' and '-', at '%s'", line);
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+    memcpy(rule->name, line, name_len);
+    rule->name[name_len] = '\0';
+
+    parser.p = colon + 1;
+
+    if (FAILED(ret = _parse_or(&parser))) {
+        goto done;
+    }
+
+    if (true == _accept(&parser, "for")) {
+        _skip_space(&parser);
+        rule->for_windows = strtoul(parser.p, &end, 10);
+        if (end == parser.p || 0 == rule->for_windows) {
+            ret = _bad_rule(&parser, "expected a number of windows");
+            goto done;
+        }
+        parser.p = end;
+        if (false == _accept(&parser, "windows")) {
+            _accept(&parser, "window");
+        }
+    }
+
+    _skip_space(&parser);
+
+    if ('\0' != *parser.p) {
+        ret = _bad_rule(&parser, "unexpected text");
+        goto done;
+    }
+
+    if (0 == rule->nr_aggs) {
+        SPL_MSG(SEV_ERROR, "BAD-RULE", "Rule '%s' doesn't use any aggregates", rule->name);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* See whether the windows still fit with this rule's windows added */
+    granule_sec = set->granule_sec;
+    for (size_t i = nr_aggs; i < set->nr_aggs; i++) {
+        granule_sec = _gcd(granule_sec, set->aggs[i].len_sec);
+    }
+
+    for (size_t i = 0; i < set->nr_aggs; i++) {
+        if (set->aggs[i].len_sec / granule_sec > SPL_RULE_MAX_GRANULES) {
+            SPL_MSG(SEV_ERROR, "BAD-RULE", "Rule '%s': windows of %llu s don't fit in %d steps of %llu s; use window "
+                    "lengths with more in common", rule->name, (unsigned long long)set->aggs[i].len_sec,
+                    SPL_RULE_MAX_GRANULES, (unsigned long long)granule_sec);
+            ret = A_E_INVAL;
+            goto done;
+        }
+    }
+
+    set->granule_sec = granule_sec;
+    set->nr_rules++;
+
+done:
+    if (FAILED(ret)) {
+        /* Drop any aggregates only this rule used */
+        set->nr_aggs = nr_aggs;
+    }
+
+    return ret;
+}
+
+int spl_rule_set_load(struct spl_rule_set **pset, const char *path, bool dbc)
+{
+    int ret = A_OK;
+
+    struct spl_rule_set *set = NULL;
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+
+    ASSERT_ARG(NULL != pset);
+    ASSERT_ARG(NULL != path);
+
+    *pset = NULL;
+
+    if (NULL == (set = spl_zalloc(sizeof(*set)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (NULL == (fp = fopen(path, "r"))) {
+        SPL_MSG(SEV_ERROR, "RULES-OPEN-FAIL", "Failed to open rules file %s: %s", path, strerror(errno));
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    while (0 < getline(&line, &line_cap, fp)) {
+        char *comment = strchr(line, '#'),
+             *p = line;
+
+        if (NULL != comment) {
+            *comment = '\0';
+        }
+
+        line[strcspn(line, "\r\n")] = '\0';
+
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+
+        if ('\0' == *p) {
+            continue;
+        }
+
+        if (FAILED(ret = spl_rule_set_add(set, p, dbc))) {
+            goto done;
+        }
+    }
+
+    if (0 == set->nr_rules) {
+        SPL_MSG(SEV_ERROR, "NO-RULES", "No rules in %s", path);
+        ret = A_E_EMPTY;
+        goto done;
+    }
+
+    *pset = set;
+
+done:
+    free(line);
+
+    if (NULL != fp) {
+        fclose(fp);
+    }
+
+    if (FAILED(ret)) {
+        spl_rule_set_free(&set);
+    }
+
+    return ret;
+}
+
+void spl_rule_set_free(struct spl_rule_set **pset)
+{
+    if (NULL == pset || NULL == *pset) {
+        return;
+    }
+
+    spl_free(*pset);
+    *pset = NULL;
+}
+
+uint64_t spl_rule_set_granule_sec(struct spl_rule_set const *set)
+{
+    return set->granule_sec;
+}
+
+static
+void _eval_job(struct spl_pool_job *job);
+
+int spl_rule_eval_new(struct spl_rule_eval **peval, struct spl_rule_set const *set, uint16_t device,
+        struct spl_pool *pool, unsigned stage)
+{
+    int ret = A_OK;
+
+    struct spl_rule_eval *eval = NULL;
+
+    ASSERT_ARG(NULL != peval);
+    ASSERT_ARG(NULL != set);
+    ASSERT_ARG(0 != set->granule_sec);
+
+    *peval = NULL;
+
+    if (NULL == (eval = spl_zalloc(sizeof(*eval)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    eval->set = set;
+    eval->device = device;
+    eval->granule_ns = set->granule_sec * SPL_NS_PER_SEC;
+
+    /* Only keep what the rules actually use */
+    for (size_t i = 0; i < set->nr_aggs; i++) {
+        struct spl_rule_agg const *agg = &set->aggs[i];
+        size_t nr_granules = agg->len_sec / set->granule_sec;
+
+        if (nr_granules > eval->nr_slots) {
+            eval->nr_slots = nr_granules;
+        }
+
+        switch (agg->kind) {
+        case SPL_RULE_AGG_LEQ:
+            eval->need_energy = true;
+            break;
+        case SPL_RULE_AGG_LMAX:
+        case SPL_RULE_AGG_LMIN:
+            eval->need_extremes = true;
+            break;
+        case SPL_RULE_AGG_LN:
+            eval->need_hist = true;
+            break;
+        }
+    }
+
+    if (NULL != pool) {
+        /* Leave room for the pool to run behind without its granules being reused under it */
+        eval->nr_slots += SPL_RULE_SLACK_GRANULES;
+        eval->pool = pool;
+        eval->job.fn = _eval_job;
+        eval->job.stage = stage;
+    }
+
+    /* Room for every rule to fire on every granule a job can be handed */
+    if (NULL == (eval->outbox = spl_zalloc((NULL != pool ? SPL_RULE_SLACK_GRANULES : 1) * set->nr_rules *
+                    sizeof(struct spl_alert))))
+    {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (NULL == (eval->slots = spl_zalloc(eval->nr_slots * sizeof(*eval->slots)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (true == eval->need_hist &&
+            (NULL == (eval->hist = spl_zalloc(eval->nr_slots * SPL_RULE_HIST_BINS * sizeof(uint32_t))) ||
+             NULL == (eval->hist_merged = spl_zalloc(SPL_RULE_HIST_BINS * sizeof(uint32_t)))))
+    {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    *peval = eval;
+
+done:
+    if (FAILED(ret)) {
+        spl_rule_eval_free(&eval);
+    }
+
+    return ret;
+}
+
+void spl_rule_eval_free(struct spl_rule_eval **peval)
+{
+    struct spl_rule_eval *eval = NULL;
+
+    if (NULL == peval || NULL == *peval) {
+        return;
+    }
+
+    eval = *peval;
+
+    spl_free(eval->outbox);
+    spl_free(eval->hist_merged);
+    spl_free(eval->hist);
+    spl_free(eval->slots);
+    spl_free(eval);
+
+    *peval = NULL;
+}
+
+/**
+ * Work out an aggregate over the window ending with granule last
+ */
+static
+double _eval_agg(struct spl_rule_eval *eval, struct spl_rule_agg const *agg, uint64_t last)
+{
+    size_t nr_granules = agg->len_sec / eval->set->granule_sec;
+    uint64_t nr = 0,
+             target = 0,
+             seen = 0;
+    uint16_t min_ddb = UINT16_MAX,
+             max_ddb = 0;
+    double energy = 0.0;
+
+    if (SPL_RULE_AGG_LN == agg->kind) {
+        memset(eval->hist_merged, 0, SPL_RULE_HIST_BINS * sizeof(uint32_t));
+    }
+
+    for (size_t i = 0; i < nr_granules && i <= last; i++) {
+        uint64_t g = last - i;
+        size_t slot = g % eval->nr_slots;
+        struct spl_rule_granule const *gran = &eval->slots[slot];
+
+        if (g + 1 != gran->gran || 0 == gran->nr) {
+            continue;
+        }
+
+        nr += gran->nr;
+
+        switch (agg->kind) {
+        case SPL_RULE_AGG_LEQ:
+            energy += gran->energy;
+            break;
+        case SPL_RULE_AGG_LMAX:
+            if (gran->max_ddb > max_ddb) {
+                max_ddb = gran->max_ddb;
+            }
+            break;
+        case SPL_RULE_AGG_LMIN:
+            if (gran->min_ddb < min_ddb) {
+                min_ddb = gran->min_ddb;
+            }
+            break;
+        case SPL_RULE_AGG_LN: {
+                uint32_t const *hist = &eval->hist[slot * SPL_RULE_HIST_BINS];
+
+                for (size_t b = 0; b < SPL_RULE_HIST_BINS; b++) {
+                    eval->hist_merged[b] += hist[b];
+                }
+            }
+            break;
+        }
+    }
+
+    if (0 == nr) {
+        return NAN;
+    }
+
+    switch (agg->kind) {
+    case SPL_RULE_AGG_LEQ:
+        return 10.0 * log10(energy / (double)nr);
+    case SPL_RULE_AGG_LMAX:
+        return (double)max_ddb / 10.0;
+    case SPL_RULE_AGG_LMIN:
+        return (double)min_ddb / 10.0;
+    }
+
+    /* The level exceeded N% of the time: walk down from the top until N% of samples are at or above */
+    target = (nr * agg->pct + 99) / 100;
+    for (size_t b = SPL_RULE_HIST_BINS; b > 0; b--) {
+        seen += eval->hist_merged[b - 1];
+        if (seen >= target) {
+            return (double)(b - 1) / 10.0;
+        }
+    }
+
+    return 0.0;
+}
+
+static inline
+bool _truth(double v)
+{
+    /* An empty window (NaN) is never true */
+    return v == v && 0.0 != v;
+}
+
+static
+bool _eval_rule(struct spl_rule_eval *eval, struct spl_rule const *rule, uint64_t last)
+{
+    double stack[SPL_RULE_MAX_STACK];
+    size_t sp = 0;
+
+    for (size_t i = 0; i < rule->nr_ops; i++) {
+        struct spl_rule_op const *op = &rule->ops[i];
+        double a = 0.0,
+               b = 0.0;
+
+        switch (op->op) {
+        case SPL_RULE_OP_CONST:
+            stack[sp++] = rule->consts[op->arg];
+            continue;
+        case SPL_RULE_OP_AGG:
+            if (last + 1 != eval->values_at[op->arg]) {
+                eval->values[op->arg] = _eval_agg(eval, &eval->set->aggs[op->arg], last);
+                eval->values_at[op->arg] = last + 1;
+            }
+            stack[sp++] = eval->values[op->arg];
+            continue;
+        case SPL_RULE_OP_NOT:
+            stack[sp - 1] = _truth(stack[sp - 1]) ? 0.0 : 1.0;
+            continue;
+        }
+
+        b = stack[--sp];
+        a = stack[sp - 1];
+
+        /* Comparisons with NaN are all false in C, except for != */
+        switch (op->op) {
+        case SPL_RULE_OP_ADD:   a = a + b; break;
+        case SPL_RULE_OP_SUB:   a = a - b; break;
+        case SPL_RULE_OP_LT:    a = a < b; break;
+        case SPL_RULE_OP_LE:    a = a <= b; break;
+        case SPL_RULE_OP_GT:    a = a > b; break;
+        case SPL_RULE_OP_GE:    a = a >= b; break;
+        case SPL_RULE_OP_EQ:    a = a == b; break;
+        case SPL_RULE_OP_NE:    a = a == a && b == b && a != b; break;
+        case SPL_RULE_OP_AND:   a = _truth(a) && _truth(b); break;
+        case SPL_RULE_OP_OR:    a = _truth(a) || _truth(b); break;
+        }
+
+        stack[sp - 1] = a;
+    }
+
+    return _truth(stack[0]);
+}
+
+/**
+ * Granule g has closed; evaluate every rule whose shortest window ends with it. Alerts raised
+ * or cleared are written to alerts (room for one per rule), and the number of them returned.
+ */
+static
+size_t _eval_close(struct spl_rule_eval *eval, uint64_t g, struct spl_alert *alerts)
+{
+    struct spl_rule_set const *set = eval->set;
+    size_t nr_alerts = 0;
+
+    for (size_t r = 0; r < set->nr_rules; r++) {
+        struct spl_rule const *rule = &set->rules[r];
+        struct spl_alert *alert = &alerts[nr_alerts];
+        bool hit = false;
+
+        if (0 != (g + 1) % (rule->period_sec / set->granule_sec)) {
+            continue;
+        }
+
+        hit = _eval_rule(eval, rule, g);
+
+        if (true == hit) {
+            eval->streak[r]++;
+            if (true == eval->raised[r] || eval->streak[r] < rule->for_windows) {
+                continue;
+            }
+        } else {
+            eval->streak[r] = 0;
+            if (false == eval->raised[r]) {
+                continue;
+            }
+        }
+
+        eval->raised[r] = hit;
+
+        alert->rule = rule->name;
+        alert->device = eval->device;
+        alert->raised = hit;
+        alert->ts_ns = (g + 1) * eval->granule_ns;
+        alert->nr_values = rule->nr_aggs;
+        for (size_t i = 0; i < rule->nr_aggs; i++) {
+            alert->names[i] = rule->agg_names[i];
+            alert->values[i] = eval->values[rule->aggs[i]];
+        }
+
+        nr_alerts++;
+    }
+
+    return nr_alerts;
+}
+
+/**
+ * Whether the granules making up every window ending with g are all still in the ring
+ */
+static inline
+bool _eval_still_held(struct spl_rule_eval *eval, uint64_t g)
+{
+    return __atomic_load_n(&eval->cur, __ATOMIC_RELAXED) <= g + SPL_RULE_SLACK_GRANULES;
+}
+
+/**
+ * Evaluate the granules handed to a job, into the outbox
+ */
+static
+void _eval_job_range(struct spl_rule_eval *eval)
+{
+    for (uint64_t g = eval->job_first; g < eval->job_end; g++) {
+        unsigned streak[SPL_RULE_MAX_RULES];
+        bool raised[SPL_RULE_MAX_RULES];
+        size_t nr_alerts = 0;
+
+        if (false == _eval_still_held(eval, g)) {
+            eval->nr_dropped++;
+            continue;
+        }
+
+        memcpy(streak, eval->streak, sizeof(streak));
+        memcpy(raised, eval->raised, sizeof(raised));
+
+        nr_alerts = _eval_close(eval, g, &eval->outbox[eval->nr_outbox]);
+
+        /*
+         * As with the flight recorder: if the feeding thread moved on far enough to start
+         * reusing any of these granules while we were reading them, forget this evaluation
+         */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (false == _eval_still_held(eval, g)) {
+            memcpy(eval->streak, streak, sizeof(streak));
+            memcpy(eval->raised, raised, sizeof(raised));
+            eval->nr_dropped++;
+            continue;
+        }
+
+        eval->nr_outbox += nr_alerts;
+    }
+}
+
+static
+void _eval_job(struct spl_pool_job *job)
+{
+    struct spl_rule_eval *eval = (struct spl_rule_eval *)((char *)job - offsetof(struct spl_rule_eval, job));
+
+    _eval_job_range(eval);
+
+    __atomic_store_n(&eval->busy, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pass on the alerts in the outbox, once no job owns it
+ */
+static
+void _eval_deliver(struct spl_rule_eval *eval, spl_rule_alert_cb_t cb, void *arg)
+{
+    for (size_t i = 0; i < eval->nr_outbox; i++) {
+        cb(&eval->outbox[i], arg);
+    }
+    eval->nr_outbox = 0;
+}
+
+/**
+ * Pass on what the last job found, and hand any granules that have closed since to a new one
+ */
+static
+void _eval_collect(struct spl_rule_eval *eval, spl_rule_alert_cb_t cb, void *arg)
+{
+    if (true == __atomic_load_n(&eval->busy, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    _eval_deliver(eval, cb, arg);
+
+    if (eval->pend_first == eval->pend_end) {
+        return;
+    }
+
+    eval->job_first = eval->pend_first;
+    eval->job_end = eval->pend_end;
+    eval->busy = true;
+
+    if (FAILED(spl_pool_submit(eval->pool, &eval->job))) {
+        /* The pool is full; try again with the next sample */
+        eval->busy = false;
+        return;
+    }
+
+    eval->pend_first = eval->pend_end;
+}
+
+static
+void _eval_start_granule(struct spl_rule_eval *eval, uint64_t g)
+{
+    size_t slot = g % eval->nr_slots;
+    struct spl_rule_granule *gran = &eval->slots[slot];
+
+    gran->gran = g + 1;
+    gran->nr = 0;
+    gran->min_ddb = UINT16_MAX;
+    gran->max_ddb = 0;
+    gran->energy = 0.0;
+
+    if (true == eval->need_hist) {
+        memset(&eval->hist[slot * SPL_RULE_HIST_BINS], 0, SPL_RULE_HIST_BINS * sizeof(uint32_t));
+    }
+}
+
+void spl_rule_eval_feed(struct spl_rule_eval *eval, struct spl_sample const *sample, spl_rule_alert_cb_t cb,
+        void *arg)
+{
+    uint64_t g = sample->ts_ns / eval->granule_ns;
+    struct spl_rule_granule *gran = NULL;
+    uint16_t ddb = sample->deci_db;
+
+    if (false == eval->started) {
+        eval->started = true;
+        eval->cur = g;
+        _eval_start_granule(eval, g);
+    } else if (g > eval->cur) {
+        /*
+         * Close every granule up to this one. After a long gap, every window has emptied out
+         * (and every rule has been evaluated on its empty windows) well before we catch up,
+         * so skip the rest.
+         */
+        for (uint64_t c = eval->cur; c < g; c++) {
+            if (c - eval->cur > 2 * eval->nr_slots) {
+                break;
+            }
+
+            if (NULL == eval->pool) {
+                size_t nr_alerts = _eval_close(eval, c, eval->outbox);
+
+                for (size_t i = 0; i < nr_alerts; i++) {
+                    cb(&eval->outbox[i], arg);
+                }
+            } else {
+                if (eval->pend_first == eval->pend_end) {
+                    eval->pend_first = c;
+                }
+                eval->pend_end = c + 1;
+            }
+        }
+
+        /* Granules the pool hasn't got to yet, that are about to be reused, are lost */
+        if (NULL != eval->pool && eval->pend_first != eval->pend_end &&
+                g > eval->pend_first + SPL_RULE_SLACK_GRANULES)
+        {
+            uint64_t first = g - SPL_RULE_SLACK_GRANULES;
+
+            if (first > eval->pend_end) {
+                first = eval->pend_end;
+            }
+            eval->nr_dropped += first - eval->pend_first;
+            eval->pend_first = first;
+        }
+
+        /* Let any job know before the oldest granule is reused */
+        __atomic_store_n(&eval->cur, g, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        _eval_start_granule(eval, g);
+    }
+
+    /* If the clock stepped backwards, count the sample towards the current granule */
+    gran = &eval->slots[eval->cur % eval->nr_slots];
+    gran->nr++;
+
+    if (true == eval->need_energy) {
+        gran->energy += spl_kern_energy(ddb);
+    }
+
+    if (true == eval->need_extremes) {
+        if (ddb < gran->min_ddb) {
+            gran->min_ddb = ddb;
+        }
+        if (ddb > gran->max_ddb) {
+            gran->max_ddb = ddb;
+        }
+    }
+
+    if (true == eval->need_hist) {
+        eval->hist[(eval->cur % eval->nr_slots) * SPL_RULE_HIST_BINS +
+                   (ddb < SPL_RULE_HIST_BINS ? ddb : SPL_RULE_HIST_BINS - 1)]++;
+    }
+
+    if (NULL != eval->pool) {
+        _eval_collect(eval, cb, arg);
+    }
+}
+
+void spl_rule_eval_drain(struct spl_rule_eval *eval, spl_rule_alert_cb_t cb, void *arg)
+{
+    struct timespec wait = { .tv_sec = 0, .tv_nsec = SPL_NS_PER_MS };
+
+    if (NULL == eval->pool) {
+        return;
+    }
+
+    while (true == __atomic_load_n(&eval->busy, __ATOMIC_ACQUIRE)) {
+        nanosleep(&wait, NULL);
+    }
+
+    /* The outbox only has room for one job's worth, so pass on the last job's first */
+    _eval_deliver(eval, cb, arg);
+
+    /* Whatever is left, we evaluate here */
+    eval->job_first = eval->pend_first;
+    eval->job_end = eval->pend_end;
+    eval->pend_first = eval->pend_end;
+    _eval_job_range(eval);
+
+    _eval_deliver(eval, cb, arg);
+
+    if (0 != eval->nr_dropped) {
+        SPL_MSG(SEV_WARNING, "RULES-BEHIND", "Device %u: %llu rule evaluations were skipped, the analysis "
+                "workers fell too far behind", eval->device, (unsigned long long)eval->nr_dropped);
+    }
+}
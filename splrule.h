@@ -0,0 +1,123 @@
+/* splrule.h -- Alert rules over windowed aggregates, compiled to bytecode
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+#include <splpool.h>
+#include <splstore.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A rules file holds one rule per line, as a name, a colon and an expression, optionally
+ * followed by "for N windows":
+ *
+ *     # Loud, on top of a raised background
+ *     loud: LAeq_1min > 70 && L90_15min > 55 for 3 windows
+ *
+ * Expressions are built from numbers, aggregates, + and -, the comparisons < <= > >= == !=,
+ * !, && and ||, and parentheses. An aggregate is a level, an underscore and a window length
+ * in s, min or h:
+ *   Leq_{len}      the equivalent continuous level over the window
+ *   Lmax_{len}     the highest level
+ *   Lmin_{len}     the lowest level
+ *   L{N}_{len}     the level exceeded N% of the time, for N from 1 to 99 (e.g. L90_15min)
+ * A weighting letter may follow the L (LAeq_1min, LC10_1h); it must match what the meter is
+ * set to measure. An aggregate over a window with no samples in it is never true in any
+ * comparison.
+ *
+ * Windows are aligned to the UNIX epoch, and slide along in steps of the greatest common
+ * divisor of all of the window lengths in all of the rules (a granule). Each device keeps a
+ * ring of per-granule partial aggregates, holding only what the rules need: energy sums for
+ * Leq, the extremes for Lmax and Lmin, and a histogram per granule only if a rule uses L{N}.
+ *
+ * A rule is evaluated when its shortest window closes, i.e. every time that much time has
+ * passed, against each aggregate's most recent window. An alert is raised once the rule has
+ * been true for the required number of evaluations in a row, and cleared when it next isn't.
+ */
+#define SPL_RULE_MAX_RULES          32
+#define SPL_RULE_MAX_NAME           32
+/* Distinct aggregates, across all rules */
+#define SPL_RULE_MAX_AGGS           32
+/* Aggregates used by any one rule */
+#define SPL_RULE_MAX_RULE_AGGS      8
+#define SPL_RULE_MAX_OPS            64
+#define SPL_RULE_MAX_STACK          16
+/* The most granules a window can span */
+#define SPL_RULE_MAX_GRANULES       1440
+
+/*
+ * When rules are evaluated on a pool, how many granules the pool can fall behind before
+ * evaluations are skipped
+ */
+#define SPL_RULE_SLACK_GRANULES     8
+
+/* Histogram bins for L{N}: one per deci-dB, as in splkern */
+#define SPL_RULE_HIST_BINS          2048
+
+struct spl_rule_set;
+struct spl_rule_eval;
+
+struct spl_alert {
+    const char *rule;
+    uint16_t device;
+    /* True when the alert is raised, false when it clears */
+    bool raised;
+    /* When the window that raised (or cleared) it closed, in ns since the UNIX epoch */
+    uint64_t ts_ns;
+    /* The aggregates the rule uses, as written in the rule, and their values (NaN if empty) */
+    size_t nr_values;
+    const char *names[SPL_RULE_MAX_RULE_AGGS];
+    double values[SPL_RULE_MAX_RULE_AGGS];
+};
+
+typedef void (*spl_rule_alert_cb_t)(struct spl_alert const *alert, void *arg);
+
+/**
+ * Load and compile a rules file. dbc says whether the meters measure dBC (rather than dBA),
+ * for checking weighting letters.
+ */
+int spl_rule_set_load(struct spl_rule_set **pset, const char *path, bool dbc);
+
+/**
+ * Compile a single rule into a set, as if it were a line of a rules file
+ */
+int spl_rule_set_add(struct spl_rule_set *set, const char *line, bool dbc);
+
+void spl_rule_set_free(struct spl_rule_set **pset);
+
+/**
+ * Length of a granule, in seconds
+ */
+uint64_t spl_rule_set_granule_sec(struct spl_rule_set const *set);
+
+/**
+ * Set up the per-device state for evaluating a set of rules. With a pool, rules are evaluated
+ * by jobs of the given stage rather than by the thread feeding samples, so it never waits on
+ * a long percentile scan; the alerts are still passed to the callback on the feeding thread,
+ * with the first sample fed after the job finishes.
+ */
+int spl_rule_eval_new(struct spl_rule_eval **peval, struct spl_rule_set const *set, uint16_t device,
+        struct spl_pool *pool, unsigned stage);
+void spl_rule_eval_free(struct spl_rule_eval **peval);
+
+/**
+ * Feed a sample. If this closes any windows, the rules due are evaluated, and cb is called for
+ * each alert raised or cleared.
+ */
+void spl_rule_eval_feed(struct spl_rule_eval *eval, struct spl_sample const *sample, spl_rule_alert_cb_t cb,
+        void *arg);
+
+/**
+ * When evaluating on a pool, wait for any job in flight, evaluate any windows that have closed
+ * since, and pass on the alerts. Call before freeing.
+ */
+void spl_rule_eval_drain(struct spl_rule_eval *eval, spl_rule_alert_cb_t cb, void *arg);
@@ -0,0 +1,174 @@
+/* splshard.c -- Shared memory rings from acquisition workers to their supervisor
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splshard.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SPL_SHARD_CACHELINE         64
+
+/*
+ * The whole ring, header and records, is one shared mapping. The writer's and reader's
+ * positions are on cache lines of their own, so the two processes don't fight over them.
+ */
+struct spl_shard_ring {
+    uint64_t nr_slots;
+    size_t map_len;
+    int wake_fd;
+    uint8_t _pad0[SPL_SHARD_CACHELINE - 20];
+
+    /* Written by the worker */
+    uint64_t head;
+    uint64_t nr_dropped;
+    uint64_t busy_since_ns;
+    uint8_t _pad1[SPL_SHARD_CACHELINE - 24];
+
+    /* Written by the supervisor */
+    uint64_t tail;
+    uint8_t _pad2[SPL_SHARD_CACHELINE - 8];
+
+    struct spl_shard_rec recs[];
+};
+
+int spl_shard_ring_new(struct spl_shard_ring **pring, size_t nr_slots)
+{
+    int ret = A_OK;
+
+    struct spl_shard_ring *ring = NULL;
+    uint64_t slots = 1;
+    size_t map_len = 0;
+    void *map = MAP_FAILED;
+
+    ASSERT_ARG(NULL != pring);
+    ASSERT_ARG(0 != nr_slots);
+
+    *pring = NULL;
+
+    while (slots < nr_slots) {
+        slots <<= 1;
+    }
+
+    map_len = sizeof(*ring) + slots * sizeof(struct spl_shard_rec);
+
+    if (MAP_FAILED == (map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0))) {
+        SPL_MSG(SEV_ERROR, "SHARD-RING-FAIL", "Failed to map a shard ring of %zu bytes: %s", map_len, strerror(errno));
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    ring = map;
+    ring->nr_slots = slots;
+    ring->map_len = map_len;
+
+    if (0 > (ring->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+        SPL_MSG(SEV_ERROR, "SHARD-RING-FAIL", "Failed to create an eventfd for a shard ring: %s", strerror(errno));
+        munmap(map, map_len);
+        ret = A_E_IO;
+        goto done;
+    }
+
+    *pring = ring;
+
+done:
+    return ret;
+}
+
+void spl_shard_ring_free(struct spl_shard_ring **pring)
+{
+    struct spl_shard_ring *ring = NULL;
+
+    if (NULL == pring || NULL == *pring) {
+        return;
+    }
+
+    ring = *pring;
+
+    close(ring->wake_fd);
+    munmap(ring, ring->map_len);
+
+    *pring = NULL;
+}
+
+bool spl_shard_push(struct spl_shard_ring *ring, struct spl_shard_rec const *rec)
+{
+    uint64_t head = ring->head,
+             tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint64_t one = 1;
+
+    if (head - tail == ring->nr_slots) {
+        __atomic_store_n(&ring->nr_dropped, ring->nr_dropped + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    ring->recs[head & (ring->nr_slots - 1)] = *rec;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    /*
+     * Only wake the supervisor if it might have found the ring empty and gone to sleep. The
+     * fence pairs with the one in spl_shard_pop(): either it sees our record, or we see that
+     * it had caught up to us.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_RELAXED)) {
+        if (0 > write(ring->wake_fd, &one, sizeof(one))) {
+            /* The counter is saturated, so the supervisor has plenty of reason to wake already */
+        }
+    }
+
+    return true;
+}
+
+size_t spl_shard_pop(struct spl_shard_ring *ring, struct spl_shard_rec *recs, size_t nr_recs)
+{
+    uint64_t tail = ring->tail,
+             head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t nr = 0;
+
+    while (nr < nr_recs && tail != head) {
+        recs[nr++] = ring->recs[tail & (ring->nr_slots - 1)];
+        tail++;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return nr;
+}
+
+int spl_shard_fd(struct spl_shard_ring const *ring)
+{
+    return ring->wake_fd;
+}
+
+void spl_shard_ack(struct spl_shard_ring *ring)
+{
+    uint64_t count = 0;
+
+    if (0 > read(ring->wake_fd, &count, sizeof(count))) {
+        /* Nothing to clear */
+    }
+}
+
+void spl_shard_set_busy(struct spl_shard_ring *ring, bool busy)
+{
+    __atomic_store_n(&ring->busy_since_ns, true == busy ? get_mono_time_ns() : 0, __ATOMIC_RELAXED);
+}
+
+uint64_t spl_shard_busy_since_ns(struct spl_shard_ring const *ring)
+{
+    return __atomic_load_n(&ring->busy_since_ns, __ATOMIC_RELAXED);
+}
+
+uint64_t spl_shard_nr_dropped(struct spl_shard_ring const *ring)
+{
+    return __atomic_load_n(&ring->nr_dropped, __ATOMIC_RELAXED);
+}
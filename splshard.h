@@ -0,0 +1,82 @@
+/* splshard.h -- Shared memory rings from acquisition workers to their supervisor
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A shard ring carries reports from one worker process, which polls some of the meters, to
+ * the supervisor, which does everything else with them. The ring is mapped shared and
+ * anonymous, so it's set up by the supervisor before the worker is forked, and outlives
+ * the worker: a worker started in place of one that died carries on where it left off.
+ *
+ * There is only ever one writer (the worker) and one reader (the supervisor). The worker
+ * only signals the ring's eventfd when it writes to an empty ring, and the supervisor always
+ * empties the ring once woken, so a steady stream of reports costs one wakeup per batch the
+ * supervisor picks up, not one per report.
+ */
+#define SPL_SHARD_DEFAULT_SLOTS     4096
+
+struct spl_shard_rec {
+    uint64_t ts_ns;
+    uint16_t device;
+    /* Whether the sample is due to be output, or only to be analysed */
+    uint8_t output_due;
+    uint8_t _resv0;
+    /* As in struct spl_sample */
+    uint16_t ts_err_us;
+    uint16_t _resv1;
+    /* The report exactly as it came back from the device */
+    uint8_t report[8];
+} __attribute__((packed));
+
+struct spl_shard_ring;
+
+/**
+ * Set up a ring with room for nr_slots records (rounded up to a power of two)
+ */
+int spl_shard_ring_new(struct spl_shard_ring **pring, size_t nr_slots);
+void spl_shard_ring_free(struct spl_shard_ring **pring);
+
+/**
+ * Add a record, from the worker. Returns false (and counts it) if the ring is full.
+ */
+bool spl_shard_push(struct spl_shard_ring *ring, struct spl_shard_rec const *rec);
+
+/**
+ * Take up to nr_recs records, oldest first, from the supervisor. Never waits.
+ */
+size_t spl_shard_pop(struct spl_shard_ring *ring, struct spl_shard_rec *recs, size_t nr_recs);
+
+/**
+ * The file descriptor that's readable when the supervisor should empty the ring, and
+ * clearing it, before emptying the ring
+ */
+int spl_shard_fd(struct spl_shard_ring const *ring);
+void spl_shard_ack(struct spl_shard_ring *ring);
+
+/**
+ * The worker is starting (busy) or has finished (not busy) talking to its meters. The
+ * supervisor uses this to tell a worker that's hung from one that's just asleep.
+ */
+void spl_shard_set_busy(struct spl_shard_ring *ring, bool busy);
+
+/**
+ * When the worker started talking to its meters, on the monotonic clock, or 0 if it isn't
+ */
+uint64_t spl_shard_busy_since_ns(struct spl_shard_ring const *ring);
+
+/**
+ * Records dropped because the ring was full
+ */
+uint64_t spl_shard_nr_dropped(struct spl_shard_ring const *ring);
@@ -0,0 +1,876 @@
+/* splstore.c -- Append-only binary sample store
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splarena.h>
+#include <splcrc.h>
+#include <splstore.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define SPL_STORE_BATCH             256
+
+/* How long after rolling over to keep the previous segment open, for samples that arrive late */
+#define SPL_STORE_STRAGGLER_SEC     60ull
+
+/* Batch size used when writing out a whole segment at once */
+#define SPL_SEG_WRITE_BATCH         4096
+
+/*
+ * A raw segment open for appending, and the records waiting to go into it
+ */
+struct _store_seg {
+    /* File descriptor of the segment, or -1 */
+    int fd;
+    /* Start of the span covered by the segment */
+    uint64_t start_ns;
+    /* Sequence number of the next batch written to the segment */
+    uint32_t next_seq;
+    struct spl_sample batch[SPL_STORE_BATCH];
+    size_t nr_batch;
+    /* Samples from several devices don't arrive in time order, so batch[0] isn't always the oldest */
+    uint64_t batch_oldest_ns;
+};
+
+struct spl_store {
+    /* Directory holding the segments */
+    char *path;
+    /* The same directory, open, so rolling over to a new segment doesn't have to build a path */
+    int dir_fd;
+    /* The segment samples are going into */
+    struct _store_seg cur;
+    /*
+     * The one before it, kept open for a little while after rolling over, so that samples from
+     * devices polled just before the boundary, which can be handed to us just after a newer
+     * one, don't make us reopen (and recover) it each time
+     */
+    struct _store_seg prev;
+};
+
+static
+int _store_write_all(int fd, void const *buf, size_t len)
+{
+    uint8_t const *ptr = buf;
+
+    while (len > 0) {
+        ssize_t written = write(fd, ptr, len);
+
+        if (0 > written) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return A_E_IO;
+        }
+
+        ptr += written;
+        len -= written;
+    }
+
+    return A_OK;
+}
+
+void spl_batch_seal(struct spl_batch_header *bhdr, uint32_t seq, void const *recs, size_t nr_recs, size_t rec_size)
+{
+    bhdr->magic = SPL_BATCH_MAGIC;
+    bhdr->seq = seq;
+    bhdr->nr_recs = nr_recs;
+    bhdr->crc = 0;
+    bhdr->crc = spl_crc32c(spl_crc32c(0, bhdr, sizeof(*bhdr)), recs, nr_recs * rec_size);
+}
+
+/**
+ * Walk the batches in buf, stopping at the first one that is truncated, out of sequence or
+ * fails its CRC. Returns the length of the intact prefix of buf.
+ */
+size_t spl_batch_scan(uint8_t const *buf, size_t len, size_t rec_size, uint32_t *pnext_seq, size_t *pnr_recs,
+        size_t *pnr_batches)
+{
+    size_t off = 0,
+           nr_recs = 0,
+           nr_batches = 0;
+    uint32_t seq = 0;
+
+    while (off + sizeof(struct spl_batch_header) <= len) {
+        struct spl_batch_header bhdr;
+        size_t payload = 0;
+        uint32_t crc = 0;
+
+        memcpy(&bhdr, buf + off, sizeof(bhdr));
+
+        if (SPL_BATCH_MAGIC != bhdr.magic || seq != bhdr.seq) {
+            break;
+        }
+
+        payload = (size_t)bhdr.nr_recs * rec_size;
+        if (payload > len - off - sizeof(bhdr)) {
+            break;
+        }
+
+        crc = bhdr.crc;
+        bhdr.crc = 0;
+        if (crc != spl_crc32c(spl_crc32c(0, &bhdr, sizeof(bhdr)), buf + off + sizeof(bhdr), payload)) {
+            break;
+        }
+
+        off += sizeof(bhdr) + payload;
+        nr_recs += bhdr.nr_recs;
+        nr_batches++;
+        seq++;
+    }
+
+    if (NULL != pnext_seq) *pnext_seq = seq;
+    if (NULL != pnr_recs) *pnr_recs = nr_recs;
+    if (NULL != pnr_batches) *pnr_batches = nr_batches;
+
+    return off;
+}
+
+static
+void _seg_header_seal(struct spl_seg_header *hdr)
+{
+    hdr->crc = 0;
+    hdr->crc = spl_crc32c(0, hdr, sizeof(*hdr));
+}
+
+static
+bool _seg_header_valid(struct spl_seg_header const *hdr)
+{
+    struct spl_seg_header check = *hdr;
+
+    if (SPL_SEG_MAGIC != hdr->magic || SPL_SEG_VERSION != hdr->version || 0 == hdr->rec_size) {
+        return false;
+    }
+
+    check.crc = 0;
+
+    return hdr->crc == spl_crc32c(0, &check, sizeof(check));
+}
+
+/**
+ * Check an existing segment that we are about to append to, and cut off anything after the
+ * last intact batch. Only has to read the batch headers and checksum the payloads, so even a
+ * full segment takes a millisecond or so.
+ */
+static
+int _store_recover_fd(int fd, const char *seg_name, uint32_t *pnext_seq)
+{
+    int ret = A_OK;
+
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    size_t valid_len = 0;
+
+    if (0 > fstat(fd, &st)) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct spl_seg_header)) {
+        SPL_MSG(SEV_WARNING, "SEGMENT-TORN-HEADER", "Segment %s has a torn header, it will be rewritten", seg_name);
+        ret = A_E_EMPTY;
+        goto done;
+    }
+
+    if (MAP_FAILED == (ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (false == _seg_header_valid(ptr) || sizeof(struct spl_sample) != ((struct spl_seg_header const *)ptr)->rec_size) {
+        SPL_MSG(SEV_ERROR, "BAD-SEGMENT", "Segment %s has a bad header, refusing to append to it", seg_name);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    valid_len = sizeof(struct spl_seg_header) +
+        spl_batch_scan((uint8_t const *)ptr + sizeof(struct spl_seg_header), st.st_size - sizeof(struct spl_seg_header),
+                sizeof(struct spl_sample), pnext_seq, NULL, NULL);
+
+    if (valid_len != (size_t)st.st_size) {
+        SPL_MSG(SEV_WARNING, "SEGMENT-TORN-TAIL", "Truncating torn tail of segment %s from %lld to %zu bytes",
+                seg_name, (long long)st.st_size, valid_len);
+        if (0 > ftruncate(fd, valid_len)) {
+            ret = A_E_IO;
+            goto done;
+        }
+    }
+
+done:
+    if (MAP_FAILED != ptr) {
+        munmap(ptr, st.st_size);
+    }
+
+    return ret;
+}
+
+static
+int _store_open_segment(struct spl_store *store, struct _store_seg *seg, uint64_t ts_ns)
+{
+    int ret = A_OK;
+
+    uint64_t span_ns = SPL_SEG_RAW_SPAN_SEC * SPL_NS_PER_SEC,
+             start_ns = ts_ns - (ts_ns % span_ns);
+    char seg_name[SPL_SEG_NAME_LEN];
+    struct stat st,
+                cur;
+    int fd = -1;
+    uint32_t next_seq = 0;
+
+    snprintf(seg_name, sizeof(seg_name), "raw-%012llu.seg", (unsigned long long)(start_ns / SPL_NS_PER_SEC));
+
+    /*
+     * Hold a shared lock on the segment for as long as we append to it. spltool import takes
+     * an exclusive one while it replaces a segment (by renaming a new file over it), so if it
+     * got there first, wait for it to finish, then open whatever file is there now.
+     */
+    for (;;) {
+        if (0 > (fd = openat(store->dir_fd, seg_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644))) {
+            SPL_MSG(SEV_ERROR, "SEGMENT-OPEN-FAIL", "Failed to open segment %s/%s: %s", store->path, seg_name,
+                    strerror(errno));
+            ret = A_E_IO;
+            goto done;
+        }
+
+        while (0 > flock(fd, LOCK_SH) && EINTR == errno) {
+        }
+
+        if (0 > fstat(fd, &st)) {
+            ret = A_E_IO;
+            goto done;
+        }
+
+        if (0 == fstatat(store->dir_fd, seg_name, &cur, 0) && cur.st_dev == st.st_dev && cur.st_ino == st.st_ino) {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    if (0 != st.st_size) {
+        ret = _store_recover_fd(fd, seg_name, &next_seq);
+        if (A_E_EMPTY == ret) {
+            /* Torn header, so there was never any data in here; start from scratch */
+            if (0 > ftruncate(fd, 0)) {
+                ret = A_E_IO;
+                goto done;
+            }
+            st.st_size = 0;
+            ret = A_OK;
+        } else if (FAILED(ret)) {
+            goto done;
+        }
+    }
+
+    if (0 == st.st_size) {
+        struct spl_seg_header hdr = {
+            .magic = SPL_SEG_MAGIC,
+            .version = SPL_SEG_VERSION,
+            .rec_size = sizeof(struct spl_sample),
+            .kind = SPL_SEG_KIND_RAW,
+            .start_ns = start_ns,
+            .span_ns = span_ns,
+        };
+
+        _seg_header_seal(&hdr);
+
+        if (FAILED(ret = _store_write_all(fd, &hdr, sizeof(hdr)))) {
+            SPL_MSG(SEV_ERROR, "SEGMENT-HEADER-FAIL", "Failed to write header of segment %s", seg_name);
+            goto done;
+        }
+    }
+
+    seg->fd = fd;
+    seg->start_ns = start_ns;
+    seg->next_seq = next_seq;
+    seg->nr_batch = 0;
+    fd = -1;
+
+done:
+    if (-1 != fd) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+static
+int _store_find_latest(const char *path, void *arg)
+{
+    char **latest = arg;
+
+    /* Segments are visited in time order, so the last two we see are the newest */
+    free(latest[0]);
+    latest[0] = latest[1];
+
+    if (NULL == (latest[1] = strdup(path))) {
+        return A_E_NOMEM;
+    }
+
+    return A_OK;
+}
+
+/**
+ * The only segments a crash can leave a torn tail on are the ones that were being written:
+ * the newest one, and the one before it if we'd only just rolled over. Check them once at
+ * startup, so that readers never have to deal with it.
+ */
+static
+void _store_recover(struct spl_store *store)
+{
+    char *latest[2] = { NULL, NULL };
+
+    spl_store_for_each_segment(store->path, "raw-", 0, 0, _store_find_latest, latest);
+
+    for (size_t i = 0; i < 2; i++) {
+        int fd = -1;
+
+        if (NULL == latest[i]) {
+            continue;
+        }
+
+        if (0 > (fd = open(latest[i], O_RDWR | O_CLOEXEC))) {
+            continue;
+        }
+
+        /* If spltool import has it locked, it's about to be replaced anyway */
+        if (0 == flock(fd, LOCK_SH | LOCK_NB) && A_E_EMPTY == _store_recover_fd(fd, latest[i], NULL)) {
+            unlink(latest[i]);
+        }
+
+        close(fd);
+        free(latest[i]);
+    }
+}
+
+int spl_store_open(struct spl_store **pstore, const char *path)
+{
+    int ret = A_OK;
+
+    struct spl_store *store = NULL;
+
+    ASSERT_ARG(NULL != pstore);
+    ASSERT_ARG(NULL != path);
+
+    *pstore = NULL;
+
+    if (0 > mkdir(path, 0755) && EEXIST != errno) {
+        SPL_MSG(SEV_ERROR, "STORE-MKDIR-FAIL", "Failed to create store directory %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (NULL == (store = spl_zalloc(sizeof(*store)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    store->cur.fd = -1;
+    store->prev.fd = -1;
+
+    if (NULL == (store->path = spl_strdup(path))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (0 > (store->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+        SPL_MSG(SEV_ERROR, "STORE-OPEN-FAIL", "Failed to open store directory %s: %s", path, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    _store_recover(store);
+
+    *pstore = store;
+
+done:
+    if (FAILED(ret)) {
+        spl_store_close(&store);
+    }
+
+    return ret;
+}
+
+static
+int _store_seg_flush(struct _store_seg *seg)
+{
+    int ret = A_OK;
+
+    struct spl_batch_header bhdr;
+    struct iovec iov[2];
+    size_t len = 0;
+    ssize_t written = 0;
+
+    if (0 == seg->nr_batch) {
+        goto done;
+    }
+
+    spl_batch_seal(&bhdr, seg->next_seq, seg->batch, seg->nr_batch, sizeof(struct spl_sample));
+
+    iov[0].iov_base = &bhdr;
+    iov[0].iov_len = sizeof(bhdr);
+    iov[1].iov_base = seg->batch;
+    iov[1].iov_len = seg->nr_batch * sizeof(struct spl_sample);
+    len = iov[0].iov_len + iov[1].iov_len;
+
+    /* One write per batch, so a crash can only ever tear the last one */
+    do {
+        written = writev(seg->fd, iov, 2);
+    } while (0 > written && EINTR == errno);
+
+    if ((ssize_t)len != written) {
+        SPL_MSG(SEV_ERROR, "STORE-WRITE-FAIL", "Failed to write %zu records to the store: %s", seg->nr_batch,
+                0 > written ? strerror(errno) : "short write");
+        ret = A_E_IO;
+
+        /* Don't leave a partial batch behind for the next one to be appended after */
+        if (0 < written) {
+            off_t end = lseek(seg->fd, 0, SEEK_END);
+            if (0 <= end && 0 > ftruncate(seg->fd, end - written)) {
+                SPL_MSG(SEV_ERROR, "STORE-UNDO-FAIL", "Failed to remove partial batch from the store");
+            }
+        }
+    } else {
+        seg->next_seq++;
+    }
+
+    seg->nr_batch = 0;
+
+done:
+    return ret;
+}
+
+static
+void _store_seg_close(struct _store_seg *seg)
+{
+    if (-1 == seg->fd) {
+        return;
+    }
+
+    _store_seg_flush(seg);
+    close(seg->fd);
+    seg->fd = -1;
+}
+
+static
+bool _store_seg_covers(struct _store_seg const *seg, uint64_t ts_ns)
+{
+    return -1 != seg->fd && ts_ns >= seg->start_ns && ts_ns - seg->start_ns < SPL_SEG_RAW_SPAN_SEC * SPL_NS_PER_SEC;
+}
+
+/**
+ * Write out a full batch, or anything that has been sitting around for more than a second,
+ * going by the timestamp of the latest sample
+ */
+static
+int _store_seg_flush_due(struct _store_seg *seg, uint64_t now_ns)
+{
+    if (SPL_STORE_BATCH == seg->nr_batch ||
+            (0 != seg->nr_batch && now_ns > seg->batch_oldest_ns && now_ns - seg->batch_oldest_ns >= SPL_NS_PER_SEC))
+    {
+        return _store_seg_flush(seg);
+    }
+
+    return A_OK;
+}
+
+int spl_store_flush(struct spl_store *store)
+{
+    int ret = A_OK,
+        tret = A_OK;
+
+    ASSERT_ARG(NULL != store);
+
+    if (FAILED(tret = _store_seg_flush(&store->prev))) {
+        ret = tret;
+    }
+
+    if (FAILED(tret = _store_seg_flush(&store->cur))) {
+        ret = tret;
+    }
+
+    return ret;
+}
+
+int spl_store_append(struct spl_store *store, struct spl_sample const *sample)
+{
+    int ret = A_OK;
+
+    struct _store_seg *seg = NULL;
+
+    ASSERT_ARG(NULL != store);
+    ASSERT_ARG(NULL != sample);
+
+    if (true == _store_seg_covers(&store->cur, sample->ts_ns)) {
+        seg = &store->cur;
+    } else if (true == _store_seg_covers(&store->prev, sample->ts_ns)) {
+        seg = &store->prev;
+    } else if (-1 == store->cur.fd || sample->ts_ns > store->cur.start_ns) {
+        /* Roll over to a new segment, keeping the current one open for stragglers */
+        _store_seg_close(&store->prev);
+        store->prev = store->cur;
+        store->cur.fd = -1;
+
+        if (FAILED(ret = _store_open_segment(store, &store->cur, sample->ts_ns))) {
+            goto done;
+        }
+        seg = &store->cur;
+    } else {
+        /* Older than either segment we have open, so the clock must have been stepped back */
+        _store_seg_close(&store->prev);
+
+        if (FAILED(ret = _store_open_segment(store, &store->prev, sample->ts_ns))) {
+            goto done;
+        }
+        seg = &store->prev;
+    }
+
+    if (0 == seg->nr_batch || sample->ts_ns < seg->batch_oldest_ns) {
+        seg->batch_oldest_ns = sample->ts_ns;
+    }
+
+    seg->batch[seg->nr_batch++] = *sample;
+
+    if (FAILED(ret = _store_seg_flush_due(&store->cur, sample->ts_ns))) {
+        goto done;
+    }
+
+    if (FAILED(ret = _store_seg_flush_due(&store->prev, sample->ts_ns))) {
+        goto done;
+    }
+
+    if (-1 != store->prev.fd && sample->ts_ns >= store->cur.start_ns + SPL_STORE_STRAGGLER_SEC * SPL_NS_PER_SEC) {
+        _store_seg_close(&store->prev);
+    }
+
+done:
+    return ret;
+}
+
+void spl_store_close(struct spl_store **pstore)
+{
+    struct spl_store *store = NULL;
+
+    if (NULL == pstore || NULL == *pstore) {
+        return;
+    }
+
+    store = *pstore;
+
+    _store_seg_close(&store->prev);
+    _store_seg_close(&store->cur);
+
+    if (0 <= store->dir_fd) {
+        close(store->dir_fd);
+    }
+
+    spl_free(store->path);
+    spl_free(store);
+
+    *pstore = NULL;
+}
+
+/**
+ * Call cb for every segment in the store whose name starts with prefix (e.g. "raw-") and
+ * whose span could overlap [from_ns, to_ns), in time order. A to_ns of 0 means no upper
+ * bound. Iteration stops early if cb returns anything other than A_OK.
+ */
+int spl_store_for_each_segment(const char *dir, const char *prefix, uint64_t from_ns, uint64_t to_ns,
+        spl_seg_iter_cb_t cb, void *arg)
+{
+    int ret = A_OK;
+
+    struct dirent **names = NULL;
+    int nr_names = 0;
+    size_t prefix_len = 0;
+    char *path = NULL;
+
+    ASSERT_ARG(NULL != dir);
+    ASSERT_ARG(NULL != prefix);
+    ASSERT_ARG(NULL != cb);
+
+    prefix_len = strlen(prefix);
+
+    if (0 > (nr_names = scandir(dir, &names, NULL, alphasort))) {
+        SPL_MSG(SEV_ERROR, "STORE-SCAN-FAIL", "Failed to list store directory %s: %s", dir, strerror(errno));
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    for (int i = 0; i < nr_names; i++) {
+        const char *name = names[i]->d_name;
+        uint64_t seg_start_ns = 0;
+        size_t name_len = strlen(name);
+
+        if (0 != strncmp(name, prefix, prefix_len) || name_len < 4 || 0 != strcmp(name + name_len - 4, ".seg")) {
+            continue;
+        }
+
+        seg_start_ns = strtoull(name + prefix_len, NULL, 10) * SPL_NS_PER_SEC;
+
+        /* Segments are sorted, so once one starts past the window, we're done */
+        if (0 != to_ns && seg_start_ns >= to_ns) {
+            break;
+        }
+
+        /* We don't know the span without opening the file, so only skip segments that start
+         * before the next segment of the same kind that also starts before from_ns */
+        if (i + 1 < nr_names && 0 == strncmp(names[i + 1]->d_name, prefix, prefix_len) &&
+                strtoull(names[i + 1]->d_name + prefix_len, NULL, 10) * SPL_NS_PER_SEC <= from_ns)
+        {
+            continue;
+        }
+
+        if (0 > asprintf(&path, "%s/%s", dir, name)) {
+            path = NULL;
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        ret = cb(path, arg);
+
+        free(path);
+        path = NULL;
+
+        if (FAILED(ret)) {
+            goto done;
+        }
+    }
+
+done:
+    if (NULL != names) {
+        for (int i = 0; i < nr_names; i++) {
+            free(names[i]);
+        }
+        free(names);
+    }
+
+    return ret;
+}
+
+/**
+ * Write out a complete segment to tmp_name, sync it, then rename it over name, both relative
+ * to dir_fd, such that name either doesn't exist (or still holds what it did) or holds the
+ * whole segment, even across a crash or power loss. tmp_name is removed if anything fails.
+ */
+static
+int _seg_write_atomic(int dir_fd, const char *name, const char *tmp_name, struct spl_seg_header const *hdr,
+        void const *recs, size_t nr_recs)
+{
+    int ret = A_OK;
+
+    int fd = -1;
+    struct spl_seg_header sealed;
+    uint8_t const *ptr = recs;
+    uint32_t seq = 0;
+
+    sealed = *hdr;
+    _seg_header_seal(&sealed);
+
+    if (0 > (fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))) {
+        SPL_MSG(SEV_ERROR, "SEGMENT-CREATE-FAIL", "Failed to create %s: %s", tmp_name, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if (FAILED(ret = _store_write_all(fd, &sealed, sizeof(sealed)))) {
+        goto write_fail;
+    }
+
+    while (nr_recs > 0) {
+        struct spl_batch_header bhdr;
+        size_t nr = nr_recs < SPL_SEG_WRITE_BATCH ? nr_recs : SPL_SEG_WRITE_BATCH;
+
+        spl_batch_seal(&bhdr, seq++, ptr, nr, hdr->rec_size);
+
+        if (FAILED(ret = _store_write_all(fd, &bhdr, sizeof(bhdr))) ||
+                FAILED(ret = _store_write_all(fd, ptr, nr * hdr->rec_size)))
+        {
+            goto write_fail;
+        }
+
+        ptr += nr * hdr->rec_size;
+        nr_recs -= nr;
+    }
+
+    if (0 > fdatasync(fd) || 0 > renameat(dir_fd, tmp_name, dir_fd, name)) {
+        SPL_MSG(SEV_ERROR, "SEGMENT-COMMIT-FAIL", "Failed to commit %s: %s", name, strerror(errno));
+        ret = A_E_IO;
+        goto done;
+    }
+
+    goto done;
+
+write_fail:
+    SPL_MSG(SEV_ERROR, "SEGMENT-WRITE-FAIL", "Failed to write %s: %s", tmp_name, strerror(errno));
+
+done:
+    if (-1 != fd) {
+        close(fd);
+    }
+
+    if (FAILED(ret) && -1 != fd) {
+        unlinkat(dir_fd, tmp_name, 0);
+    }
+
+    return ret;
+}
+
+int spl_seg_write_atomic(const char *path, struct spl_seg_header const *hdr, void const *recs, size_t nr_recs)
+{
+    int ret = A_OK;
+
+    char *tmp_path = NULL;
+
+    ASSERT_ARG(NULL != path);
+    ASSERT_ARG(NULL != hdr);
+    ASSERT_ARG(NULL != recs || 0 == nr_recs);
+
+    if (0 > asprintf(&tmp_path, "%s.tmp", path)) {
+        tmp_path = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    ret = _seg_write_atomic(AT_FDCWD, path, tmp_path, hdr, recs, nr_recs);
+
+done:
+    free(tmp_path);
+    return ret;
+}
+
+int spl_seg_write_atomic_at(int dir_fd, const char *name, struct spl_seg_header const *hdr, void const *recs,
+        size_t nr_recs)
+{
+    int ret = A_OK;
+
+    char tmp_name[SPL_SEG_NAME_LEN + 8];
+
+    ASSERT_ARG(0 <= dir_fd);
+    ASSERT_ARG(NULL != name);
+    ASSERT_ARG(NULL != hdr);
+    ASSERT_ARG(NULL != recs || 0 == nr_recs);
+
+    if ((int)sizeof(tmp_name) <= snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name)) {
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    ret = _seg_write_atomic(dir_fd, name, tmp_name, hdr, recs, nr_recs);
+
+done:
+    return ret;
+}
+
+int spl_seg_map(struct spl_seg_map *map, const char *path)
+{
+    int ret = A_OK;
+
+    int fd = -1;
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    struct spl_seg_header const *hdr = NULL;
+
+    ASSERT_ARG(NULL != map);
+    ASSERT_ARG(NULL != path);
+
+    memset(map, 0, sizeof(*map));
+
+    if (0 > (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    if (0 > fstat(fd, &st)) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct spl_seg_header)) {
+        ret = A_E_EMPTY;
+        goto done;
+    }
+
+    if (MAP_FAILED == (ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))) {
+        ret = A_E_IO;
+        goto done;
+    }
+
+    hdr = ptr;
+
+    if (false == _seg_header_valid(hdr)) {
+        SPL_MSG(SEV_WARNING, "BAD-SEGMENT", "File %s is not a valid segment, skipping", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    map->hdr = hdr;
+    map->base = ptr;
+    map->map_len = st.st_size;
+    map->valid_len = sizeof(*hdr) +
+        spl_batch_scan(map->base + sizeof(*hdr), st.st_size - sizeof(*hdr), hdr->rec_size, NULL,
+                &map->nr_recs, &map->nr_batches);
+
+    if (map->valid_len != map->map_len) {
+        SPL_MSG(SEV_WARNING, "SEGMENT-TORN-TAIL", "Ignoring %zu bytes of damaged data at the end of %s",
+                map->map_len - map->valid_len, path);
+    }
+
+done:
+    if (FAILED(ret) && MAP_FAILED != ptr) {
+        munmap(ptr, st.st_size);
+    }
+
+    if (-1 != fd) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+/**
+ * Step through the intact batches of a mapped segment. Start with *poff set to 0.
+ */
+bool spl_seg_next_batch(struct spl_seg_map const *map, size_t *poff, void const **precs, size_t *pnr_recs)
+{
+    struct spl_batch_header bhdr;
+
+    if (0 == *poff) {
+        *poff = sizeof(struct spl_seg_header);
+    }
+
+    if (*poff + sizeof(bhdr) > map->valid_len) {
+        return false;
+    }
+
+    memcpy(&bhdr, map->base + *poff, sizeof(bhdr));
+
+    *precs = map->base + *poff + sizeof(bhdr);
+    *pnr_recs = bhdr.nr_recs;
+    *poff += sizeof(bhdr) + (size_t)bhdr.nr_recs * map->hdr->rec_size;
+
+    return true;
+}
+
+void spl_seg_unmap(struct spl_seg_map *map)
+{
+    if (NULL == map || NULL == map->hdr) {
+        return;
+    }
+
+    munmap((void *)map->hdr, map->map_len);
+    memset(map, 0, sizeof(*map));
+}
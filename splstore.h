@@ -0,0 +1,130 @@
+/* splstore.h -- Append-only binary sample store
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The store is a directory of segment files. Each segment covers a fixed, aligned span of
+ * wall-clock time and is named after the UNIX time (in seconds) its span starts at, so a
+ * lexical sort of the directory is also a time sort:
+ *
+ *   <dir>/raw-<start seconds, 12 digits>.seg
+ *
+ * A segment is a header followed by a sequence of batches. Each batch is a small header
+ * carrying a sequence number and a CRC32C, followed by a packed array of fixed-size records.
+ * A batch is written with a single write(), so after a crash or power loss the only damage
+ * is a torn or missing final batch, which is found (and cut off) by walking the batch
+ * headers and checking each CRC - no need to look at individual records.
+ *
+ * splread holds a shared flock() on the raw segment it's appending to. Anything else that
+ * replaces a raw segment (spltool import) takes an exclusive one on the segment first, and
+ * leaves it alone if it can't get it.
+ *
+ * Older data is compacted into rollup segments (see splcompact.h), which hold one record
+ * per device per bucket of res_sec seconds, and are named after their resolution:
+ *
+ *   <dir>/r<resolution seconds>-<start seconds, 12 digits>.seg
+ */
+#define SPL_SEG_MAGIC               0x53504c53ul /* 'SPLS' */
+#define SPL_SEG_VERSION             2
+
+#define SPL_BATCH_MAGIC             0x53504c42ul /* 'SPLB' */
+
+#define SPL_SEG_KIND_RAW            0
+#define SPL_SEG_KIND_ROLLUP         1
+
+#define SPL_SEG_RAW_SPAN_SEC        3600ull
+
+/* Room for any segment or clip file name the tools generate, without its directory */
+#define SPL_SEG_NAME_LEN            64
+
+struct spl_seg_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    uint32_t kind;
+    /* Resolution of a rollup segment, in seconds; 0 for raw segments */
+    uint32_t res_sec;
+    uint64_t start_ns;
+    uint64_t span_ns;
+    uint32_t _resv;
+    /* CRC32C of this header, computed with this field set to 0 */
+    uint32_t crc;
+} __attribute__((packed));
+
+struct spl_batch_header {
+    uint32_t magic;
+    /* Position of this batch in its file, starting from 0 */
+    uint32_t seq;
+    uint32_t nr_recs;
+    /* CRC32C of this header (computed with this field set to 0) and the records that follow */
+    uint32_t crc;
+} __attribute__((packed));
+
+/**
+ * A rollup record, summarizing all the samples from one device in one bucket
+ */
+struct spl_rollup {
+    /* Start of the bucket, in nanoseconds since the UNIX epoch */
+    uint64_t ts_ns;
+    uint32_t nr_samples;
+    uint16_t min_ddb;
+    uint16_t max_ddb;
+    /* Equivalent continuous level over the bucket */
+    uint16_t leq_ddb;
+    uint16_t device;
+    /* Flags of the last sample in the bucket */
+    uint8_t flags;
+    uint8_t _resv0;
+    uint16_t _resv1;
+} __attribute__((packed));
+
+struct spl_store;
+
+/**
+ * A segment mapped read-only into memory. Only the intact batches are visible through the
+ * map; anything after the first bad batch is ignored.
+ */
+struct spl_seg_map {
+    struct spl_seg_header const *hdr;
+    uint8_t const *base;
+    /* Offset just past the last intact batch */
+    size_t valid_len;
+    size_t nr_recs;
+    size_t nr_batches;
+    size_t map_len;
+};
+
+int spl_store_open(struct spl_store **pstore, const char *path);
+int spl_store_append(struct spl_store *store, struct spl_sample const *sample);
+int spl_store_flush(struct spl_store *store);
+void spl_store_close(struct spl_store **pstore);
+
+typedef int (*spl_seg_iter_cb_t)(const char *path, void *arg);
+
+int spl_store_for_each_segment(const char *dir, const char *prefix, uint64_t from_ns, uint64_t to_ns,
+        spl_seg_iter_cb_t cb, void *arg);
+
+int spl_seg_write_atomic(const char *path, struct spl_seg_header const *hdr, void const *recs, size_t nr_recs);
+/* The same, for a segment named relative to an open directory; name must be shorter than SPL_SEG_NAME_LEN */
+int spl_seg_write_atomic_at(int dir_fd, const char *name, struct spl_seg_header const *hdr, void const *recs,
+        size_t nr_recs);
+
+int spl_seg_map(struct spl_seg_map *map, const char *path);
+bool spl_seg_next_batch(struct spl_seg_map const *map, size_t *poff, void const **precs, size_t *pnr_recs);
+void spl_seg_unmap(struct spl_seg_map *map);
+
+void spl_batch_seal(struct spl_batch_header *bhdr, uint32_t seq, void const *recs, size_t nr_recs, size_t rec_size);
+size_t spl_batch_scan(uint8_t const *buf, size_t len, size_t rec_size, uint32_t *pnext_seq, size_t *pnr_recs,
+        size_t *pnr_batches);
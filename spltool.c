@@ -0,0 +1,884 @@
+/* spltool.c -- Offline tools for working with the splread sample store
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <gm1356.h>
+#include <splcommon.h>
+#include <splcompact.h>
+#include <splevent.h>
+#include <splexport.h>
+#include <splflight.h>
+#include <splfmt.h>
+#include <splimport.h>
+#include <splkern.h>
+#include <splstore.h>
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct spltool_cmd {
+    const char *name;
+    const char *help;
+    int (*run)(int argc, char *const *argv);
+};
+
+/**
+ * Parse a point in time given on the command line. Accepts either seconds since the UNIX
+ * epoch, or a UTC date in the form YYYY-MM-DD[{T| }HH:MM[:SS]].
+ */
+static
+bool _parse_time(const char *arg, uint64_t *pts_ns)
+{
+    struct tm tm;
+    char *end = NULL;
+    unsigned long long secs = 0;
+    static const char *formats[] = {
+        "%Y-%m-%dT%H:%M:%S",
+        "%Y-%m-%d %H:%M:%S",
+        "%Y-%m-%dT%H:%M",
+        "%Y-%m-%d %H:%M",
+        "%Y-%m-%d",
+    };
+
+    secs = strtoull(arg, &end, 10);
+    if ('\0' == *end) {
+        *pts_ns = secs * SPL_NS_PER_SEC;
+        return true;
+    }
+
+    for (size_t i = 0; i < sizeof(formats)/sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(arg, formats[i], &tm);
+        if (NULL != end && '\0' == *end) {
+            *pts_ns = (uint64_t)timegm(&tm) * SPL_NS_PER_SEC;
+            return true;
+        }
+    }
+
+    SPL_MSG(SEV_FATAL, "BAD-TIME", "Could not parse '%s' as a time", arg);
+
+    return false;
+}
+
+static
+void _format_time(char *buf, size_t len, uint64_t ts_ns)
+{
+    time_t secs = ts_ns / SPL_NS_PER_SEC;
+    struct tm gmt;
+
+    gmtime_r(&secs, &gmt);
+    snprintf(buf, len, "%04i-%02i-%02i %02i:%02i:%02i.%03u UTC",
+            gmt.tm_year + 1900, gmt.tm_mon + 1, gmt.tm_mday, gmt.tm_hour, gmt.tm_min, gmt.tm_sec,
+            (unsigned)((ts_ns % SPL_NS_PER_SEC) / SPL_NS_PER_MS));
+}
+
+static
+void _print_event(struct spl_event const *evt, void *arg)
+{
+    char start[48],
+         end[48];
+
+    (void)arg;
+
+    _format_time(start, sizeof(start), evt->start_ns);
+    _format_time(end, sizeof(end), evt->end_ns);
+
+    printf("{\"start\":\"%s\",\"end\":\"%s\",\"duration\":%.3f,\"peak\":%u.%u,\"leq\":%u.%u,"
+            "\"device\":%u,\"samples\":%u}\n",
+            start, end, (double)(evt->end_ns - evt->start_ns) / (double)SPL_NS_PER_SEC,
+            evt->peak_ddb / 10, evt->peak_ddb % 10,
+            evt->leq_ddb / 10, evt->leq_ddb % 10,
+            evt->device, evt->nr_samples);
+}
+
+static
+int _cmd_events(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    int a = -1;
+    const char *store_dir = NULL;
+    struct spl_event_index *idx = NULL;
+    struct spl_event_query query = { 0 };
+
+    while (-1 != (a = getopt(argc, argv, "d:s:e:t:p:m:D:"))) {
+        switch (a) {
+        case 'd':
+            store_dir = optarg;
+            break;
+        case 's':
+            if (false == _parse_time(optarg, &query.from_ns)) {
+                goto done;
+            }
+            break;
+        case 'e':
+            if (false == _parse_time(optarg, &query.to_ns)) {
+                goto done;
+            }
+            break;
+        case 't':
+            query.min_leq_ddb = (uint16_t)(strtod(optarg, NULL) * 10.0 + 0.5);
+            break;
+        case 'p':
+            query.min_peak_ddb = (uint16_t)(strtod(optarg, NULL) * 10.0 + 0.5);
+            break;
+        case 'm':
+            query.min_duration_ns = strtoull(optarg, NULL, 0) * SPL_NS_PER_MS;
+            break;
+        case 'D':
+            query.filter_device = true;
+            query.device = (uint16_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto done;
+        }
+    }
+
+    if (NULL == store_dir) {
+        SPL_MSG(SEV_FATAL, "NO-STORE", "Please specify the store directory with -d");
+        goto done;
+    }
+
+    if (FAILED(spl_event_index_open(&idx, store_dir, false))) {
+        goto done;
+    }
+
+    if (FAILED(spl_event_index_query(idx, &query, _print_event, NULL))) {
+        SPL_MSG(SEV_ERROR, "QUERY-FAIL", "Failed to query the event index in %s", store_dir);
+        goto done;
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    spl_event_index_close(&idx);
+    return ret;
+}
+
+/**
+ * A growable array of levels, pulled out of the store for benchmarking
+ */
+struct spltool_trace {
+    uint16_t *ddb;
+    size_t nr;
+    size_t cap;
+};
+
+static
+int _trace_load_segment(const char *path, void *arg)
+{
+    int ret = A_OK;
+
+    struct spltool_trace *trace = arg;
+    struct spl_seg_map map;
+    struct spl_sample const *samples = NULL;
+    void const *recs = NULL;
+    size_t off = 0,
+           nr_recs = 0;
+
+    if (FAILED(spl_seg_map(&map, path))) {
+        /* Skip anything we can't read */
+        goto done;
+    }
+
+    if (trace->nr + map.nr_recs > trace->cap) {
+        size_t new_cap = (trace->nr + map.nr_recs) * 2;
+        uint16_t *new_ddb = realloc(trace->ddb, new_cap * sizeof(uint16_t));
+
+        if (NULL == new_ddb) {
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        trace->ddb = new_ddb;
+        trace->cap = new_cap;
+    }
+
+    while (true == spl_seg_next_batch(&map, &off, &recs, &nr_recs)) {
+        samples = recs;
+        for (size_t i = 0; i < nr_recs; i++) {
+            trace->ddb[trace->nr++] = samples[i].deci_db;
+        }
+    }
+
+done:
+    spl_seg_unmap(&map);
+    return ret;
+}
+
+static
+double _bench_elapsed_ns(struct timespec const *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)(end.tv_sec - start->tv_sec) * 1e9 + (double)(end.tv_nsec - start->tv_nsec);
+}
+
+static
+int _cmd_bench_kernels(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    int a = -1;
+    const char *store_dir = NULL;
+    unsigned iters = 100;
+    struct spltool_trace trace = { 0 };
+    struct spl_kern_ops const *impls[8];
+    size_t nr_impls = 0;
+    static uint32_t ref_hist[SPL_KERN_MAX_DDB + 1],
+                    hist[SPL_KERN_MAX_DDB + 1];
+    double ref_energy = 0.0;
+    uint16_t ref_min = 0,
+             ref_max = 0;
+    double *energy = NULL;
+
+    while (-1 != (a = getopt(argc, argv, "d:n:"))) {
+        switch (a) {
+        case 'd':
+            store_dir = optarg;
+            break;
+        case 'n':
+            iters = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto done;
+        }
+    }
+
+    if (NULL == store_dir || 0 == iters) {
+        SPL_MSG(SEV_FATAL, "NO-STORE", "Please specify the store directory with -d, and a non-zero iteration count");
+        goto done;
+    }
+
+    if (FAILED(spl_store_for_each_segment(store_dir, "raw-", 0, 0, _trace_load_segment, &trace))) {
+        goto done;
+    }
+
+    if (0 == trace.nr) {
+        SPL_MSG(SEV_FATAL, "EMPTY-STORE", "No raw samples found in %s", store_dir);
+        goto done;
+    }
+
+    if (NULL == (energy = calloc(trace.nr, sizeof(double)))) {
+        goto done;
+    }
+
+    nr_impls = spl_kern_available(impls, sizeof(impls)/sizeof(impls[0]));
+
+    printf("%zu samples from %s, %u iterations, dispatching to '%s'\n", trace.nr, store_dir, iters, spl_kern->name);
+    printf("%-8s %14s %14s %14s %14s\n", "impl", "energy_sum", "to_energy", "minmax", "histogram");
+
+    for (size_t k = 0; k < nr_impls; k++) {
+        struct spl_kern_ops const *ops = impls[k];
+        struct timespec start;
+        double ns[4],
+               e = 0.0;
+        uint16_t lo = 0,
+                 hi = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned i = 0; i < iters; i++) {
+            e = ops->energy_sum(trace.ddb, trace.nr);
+        }
+        ns[0] = _bench_elapsed_ns(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned i = 0; i < iters; i++) {
+            ops->to_energy(trace.ddb, energy, trace.nr);
+        }
+        ns[1] = _bench_elapsed_ns(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned i = 0; i < iters; i++) {
+            ops->minmax(trace.ddb, trace.nr, &lo, &hi);
+        }
+        ns[2] = _bench_elapsed_ns(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned i = 0; i < iters; i++) {
+            memset(hist, 0, sizeof(hist));
+            ops->histogram(trace.ddb, trace.nr, hist, SPL_KERN_MAX_DDB + 1);
+        }
+        ns[3] = _bench_elapsed_ns(&start);
+
+        /* The first implementation is always the scalar reference */
+        if (0 == k) {
+            ref_energy = e;
+            ref_min = lo;
+            ref_max = hi;
+            memcpy(ref_hist, hist, sizeof(hist));
+        } else if (fabs(e - ref_energy) > fabs(ref_energy) * 1e-9 ||
+                lo != ref_min || hi != ref_max ||
+                0 != memcmp(hist, ref_hist, sizeof(hist)))
+        {
+            SPL_MSG(SEV_ERROR, "KERNEL-MISMATCH", "Implementation '%s' disagrees with the scalar reference", ops->name);
+            goto done;
+        }
+
+        printf("%-8s", ops->name);
+        for (size_t i = 0; i < 4; i++) {
+            printf(" %8.3f ns/smp", ns[i] / ((double)iters * (double)trace.nr));
+        }
+        printf("\n");
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    free(energy);
+    free(trace.ddb);
+    return ret;
+}
+
+/**
+ * Format a sample with printf, the way splread did before it had output templates
+ */
+static
+int _bench_fmt_printf(char *buf, size_t len, struct spl_sample const *sample)
+{
+    time_t now = sample->ts_ns / SPL_NS_PER_SEC;
+    struct tm gmt;
+
+    gmtime_r(&now, &gmt);
+
+    return snprintf(buf, len, "{\"measured\":%4.2f,\"mode\":\"%s\",\"freqMode\":\"%s\","
+            "\"range\":\"%s\",\"timestamp\":\"%04i-%02i-%02i %02i:%02i:%02i UTC\"}\n",
+            (double)sample->deci_db/10.0,
+            sample->flags & GM1356_FAST_MODE ? "fast" : "slow",
+            sample->flags & GM1356_MEASURE_DBC ? "dBC" : "dBA",
+            gm1356_range_name(sample->flags),
+            gmt.tm_year + 1900, gmt.tm_mon + 1, gmt.tm_mday, gmt.tm_hour, gmt.tm_min, gmt.tm_sec);
+}
+
+static
+int _cmd_bench_format(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    int a = -1;
+    size_t nr = 1000000;
+    const char *spec = NULL;
+    struct spl_sample *samples = NULL;
+    struct spl_fmt_tmpl *def_tmpl = NULL,
+                        *user_tmpl = NULL;
+    char *buf = NULL;
+    size_t buf_len = 0;
+    struct timespec start;
+    double ns = 0.0;
+    uint64_t total = 0;
+    static const uint8_t flags[] = {
+        GM1356_RANGE_30_130_DB,
+        GM1356_FAST_MODE | GM1356_RANGE_30_80_DB,
+        GM1356_MEASURE_DBC | GM1356_RANGE_50_100_DB,
+        GM1356_FAST_MODE | GM1356_MEASURE_DBC | GM1356_RANGE_60_110_DB,
+        GM1356_RANGE_80_130_DB,
+    };
+
+    while (-1 != (a = getopt(argc, argv, "n:t:"))) {
+        switch (a) {
+        case 'n':
+            nr = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            spec = optarg;
+            break;
+        default:
+            goto done;
+        }
+    }
+
+    if (0 == nr) {
+        SPL_MSG(SEV_FATAL, "BAD-COUNT", "Please specify a non-zero number of records with -n");
+        goto done;
+    }
+
+    if (NULL == (samples = calloc(nr, sizeof(*samples))) ||
+            NULL == (def_tmpl = calloc(1, sizeof(*def_tmpl))) ||
+            NULL == (user_tmpl = calloc(1, sizeof(*user_tmpl))))
+    {
+        goto done;
+    }
+
+    if (FAILED(spl_fmt_tmpl_compile(def_tmpl, SPL_FMT_TMPL_DEFAULT)) ||
+            (NULL != spec && FAILED(spl_fmt_tmpl_compile(user_tmpl, spec))))
+    {
+        goto done;
+    }
+
+    /* A day or so of samples from 2019 onward, 8 a second, with levels all over the place */
+    for (size_t i = 0; i < nr; i++) {
+        samples[i].ts_ns = 1546300800ull * SPL_NS_PER_SEC + i * 125 * SPL_NS_PER_MS;
+        samples[i].deci_db = 300 + (uint16_t)((i * 7919) % 1001);
+        samples[i].device = i % 4;
+        samples[i].flags = flags[i % (sizeof(flags)/sizeof(flags[0]))];
+    }
+
+    buf_len = SPL_FMT_MAX_RECORD;
+    if (def_tmpl->max_len > buf_len) {
+        buf_len = def_tmpl->max_len;
+    }
+    if (user_tmpl->max_len > buf_len) {
+        buf_len = user_tmpl->max_len;
+    }
+    buf_len += SPL_FMT_TMPL_SLACK;
+
+    /* Two records' worth, so the outputs can be compared side by side */
+    if (NULL == (buf = malloc(2 * buf_len))) {
+        goto done;
+    }
+
+    /* The default template must produce exactly what splread always has */
+    for (size_t i = 0; i < nr; i++) {
+        char *fixed_end = spl_fmt_sample_json(buf, &samples[i]),
+             *tmpl_end = spl_fmt_tmpl_run(buf + buf_len, def_tmpl, &samples[i], "", 0);
+        size_t fixed_len = fixed_end - buf;
+        int printf_len = _bench_fmt_printf(buf + buf_len, buf_len, &samples[i]);
+
+        if (fixed_len != (size_t)(tmpl_end - (buf + buf_len)) || 0 != memcmp(buf, buf + buf_len, fixed_len)) {
+            SPL_MSG(SEV_ERROR, "FORMAT-MISMATCH", "Default template disagrees with the fixed formatter on record %zu", i);
+            goto done;
+        }
+
+        if ((size_t)printf_len != fixed_len || 0 != memcmp(buf, buf + buf_len, fixed_len)) {
+            SPL_MSG(SEV_ERROR, "FORMAT-MISMATCH", "Fixed formatter disagrees with printf on record %zu", i);
+            goto done;
+        }
+    }
+
+    printf("%zu records, output identical for printf, fixed and default template\n", nr);
+    printf("%-10s %12s %12s\n", "formatter", "ns/record", "MB/s");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    total = 0;
+    for (size_t i = 0; i < nr; i++) {
+        total += _bench_fmt_printf(buf, buf_len, &samples[i]);
+    }
+    ns = _bench_elapsed_ns(&start);
+    printf("%-10s %12.1f %12.1f\n", "printf", ns / nr, (double)total * 1e3 / ns);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    total = 0;
+    for (size_t i = 0; i < nr; i++) {
+        total += spl_fmt_sample_json(buf, &samples[i]) - buf;
+    }
+    ns = _bench_elapsed_ns(&start);
+    printf("%-10s %12.1f %12.1f\n", "fixed", ns / nr, (double)total * 1e3 / ns);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    total = 0;
+    for (size_t i = 0; i < nr; i++) {
+        total += spl_fmt_tmpl_run(buf, def_tmpl, &samples[i], "", 0) - buf;
+    }
+    ns = _bench_elapsed_ns(&start);
+    printf("%-10s %12.1f %12.1f\n", "template", ns / nr, (double)total * 1e3 / ns);
+
+    if (NULL != spec) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        total = 0;
+        for (size_t i = 0; i < nr; i++) {
+            total += spl_fmt_tmpl_run(buf, user_tmpl, &samples[i], "0123456789", 10) - buf;
+        }
+        ns = _bench_elapsed_ns(&start);
+        printf("%-10s %12.1f %12.1f\n", "-t", ns / nr, (double)total * 1e3 / ns);
+        printf("Sample: %.*s", (int)(spl_fmt_tmpl_run(buf, user_tmpl, &samples[0], "0123456789", 10) - buf), buf);
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    free(buf);
+    free(user_tmpl);
+    free(def_tmpl);
+    free(samples);
+    return ret;
+}
+
+static
+int _cmd_compact(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    int a = -1;
+    const char *store_dir = NULL;
+    struct spl_retention policy;
+    bool have_policy = false;
+    uint64_t now_ns = get_time_ns();
+
+    while (-1 != (a = getopt(argc, argv, "d:R:n:"))) {
+        switch (a) {
+        case 'd':
+            store_dir = optarg;
+            break;
+        case 'R':
+            if (FAILED(spl_retention_parse(&policy, optarg))) {
+                SPL_MSG(SEV_FATAL, "BAD-RETENTION", "Could not parse retention policy '%s'", optarg);
+                goto done;
+            }
+            have_policy = true;
+            break;
+        case 'n':
+            if (false == _parse_time(optarg, &now_ns)) {
+                goto done;
+            }
+            break;
+        default:
+            goto done;
+        }
+    }
+
+    if (NULL == store_dir || false == have_policy) {
+        SPL_MSG(SEV_FATAL, "NO-STORE", "Please specify the store directory with -d and a retention policy with -R");
+        goto done;
+    }
+
+    if (FAILED(spl_compact_run(store_dir, &policy, now_ns))) {
+        goto done;
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    return ret;
+}
+
+static
+int _cmd_export(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    int a = -1;
+    const char *out_path = NULL;
+    struct spl_export_opts opts = {
+        .format = SPL_EXPORT_JSONL,
+        .nr_threads = 1,
+        .out_fd = STDOUT_FILENO,
+    };
+    struct spl_export_stats stats;
+    struct timespec start;
+    double secs = 0.0;
+
+    while (-1 != (a = getopt(argc, argv, "d:s:e:f:r:j:o:D:c"))) {
+        switch (a) {
+        case 'd':
+            opts.dir = optarg;
+            break;
+        case 's':
+            if (false == _parse_time(optarg, &opts.from_ns)) {
+                goto done;
+            }
+            break;
+        case 'e':
+            if (false == _parse_time(optarg, &opts.to_ns)) {
+                goto done;
+            }
+            break;
+        case 'f':
+            if (0 == strcmp(optarg, "csv")) {
+                opts.format = SPL_EXPORT_CSV;
+            } else if (0 == strcmp(optarg, "jsonl")) {
+                opts.format = SPL_EXPORT_JSONL;
+            } else {
+                SPL_MSG(SEV_FATAL, "BAD-FORMAT", "Unknown export format '%s', must be csv or jsonl", optarg);
+                goto done;
+            }
+            break;
+        case 'r':
+            opts.res_sec = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            opts.nr_threads = strtoul(optarg, NULL, 0);
+            if (0 == opts.nr_threads) {
+                opts.nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'c':
+            opts.clips = true;
+            break;
+        case 'D':
+            opts.filter_device = true;
+            opts.device = (uint16_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto done;
+        }
+    }
+
+    if (NULL == opts.dir) {
+        SPL_MSG(SEV_FATAL, "NO-STORE", "Please specify the store directory with -d");
+        goto done;
+    }
+
+    if (true == opts.clips && (false == opts.filter_device || 0 != opts.res_sec)) {
+        SPL_MSG(SEV_FATAL, "CLIPS-NEED-DEVICE", "Clips are kept per device, please specify one with -D (and no -r)");
+        goto done;
+    }
+
+    if (NULL != out_path && 0 > (opts.out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))) {
+        SPL_MSG(SEV_FATAL, "EXPORT-OPEN-FAIL", "Failed to open %s for writing", out_path);
+        goto done;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (FAILED(spl_export(&opts, &stats))) {
+        goto done;
+    }
+
+    secs = _bench_elapsed_ns(&start) / 1e9;
+
+    SPL_MSG(SEV_INFO, "EXPORT-DONE", "Exported %llu records from %llu segments, %llu bytes in %.3f s (%.1f MB/s)",
+            (unsigned long long)stats.nr_recs, (unsigned long long)stats.nr_segments,
+            (unsigned long long)stats.nr_bytes, secs, secs > 0.0 ? (double)stats.nr_bytes / secs / 1e6 : 0.0);
+
+    ret = EXIT_SUCCESS;
+
+done:
+    if (NULL != out_path && 0 <= opts.out_fd) {
+        close(opts.out_fd);
+    }
+
+    return ret;
+}
+
+static
+int _cmd_import(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    int a = -1;
+    struct spl_import_opts opts = {
+        .nr_threads = 1,
+    };
+    struct spl_import_stats stats;
+    struct timespec start;
+    double secs = 0.0;
+
+    while (-1 != (a = getopt(argc, argv, "d:D:j:"))) {
+        switch (a) {
+        case 'd':
+            opts.dir = optarg;
+            break;
+        case 'D':
+            opts.device = (uint16_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            opts.nr_threads = strtoul(optarg, NULL, 0);
+            if (0 == opts.nr_threads) {
+                opts.nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+        default:
+            goto done;
+        }
+    }
+
+    if (NULL == opts.dir) {
+        SPL_MSG(SEV_FATAL, "NO-STORE", "Please specify the store directory with -d");
+        goto done;
+    }
+
+    if (optind >= argc) {
+        SPL_MSG(SEV_FATAL, "NO-ARCHIVES", "Please give at least one archive to import");
+        goto done;
+    }
+
+    opts.paths = &argv[optind];
+    opts.nr_paths = argc - optind;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (FAILED(spl_import(&opts, &stats))) {
+        goto done;
+    }
+
+    secs = _bench_elapsed_ns(&start) / 1e9;
+
+    SPL_MSG(SEV_INFO, "IMPORT-DONE", "Imported %llu samples (skipped %llu lines, %llu already in the store, %llu "
+            "refused) into %llu segments (%llu merged), %llu bytes in %.3f s (%.1f MB/s)",
+            (unsigned long long)stats.nr_samples, (unsigned long long)stats.nr_skipped,
+            (unsigned long long)stats.nr_dups, (unsigned long long)stats.nr_refused,
+            (unsigned long long)stats.nr_segments, (unsigned long long)stats.nr_merged,
+            (unsigned long long)stats.nr_bytes, secs, secs > 0.0 ? (double)stats.nr_bytes / secs / 1e6 : 0.0);
+
+    ret = EXIT_SUCCESS;
+
+done:
+    return ret;
+}
+
+struct _flight_dump_state {
+    bool csv;
+    bool raw;
+};
+
+static
+int _print_flight_rec(struct spl_flight_rec const *rec, void *arg)
+{
+    struct _flight_dump_state const *state = arg;
+    char line[SPL_FMT_MAX_RECORD];
+    char *p = line;
+    struct spl_sample sample = {
+        .ts_ns = rec->ts_ns,
+        .deci_db = rec->report[0] << 8 | rec->report[1],
+        .device = rec->device,
+        .flags = rec->report[2],
+    };
+
+    if (true == state->raw) {
+        printf("%llu,%u,%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n", (unsigned long long)rec->ts_ns, rec->device,
+                rec->report[0], rec->report[1], rec->report[2], rec->report[3],
+                rec->report[4], rec->report[5], rec->report[6], rec->report[7]);
+        return A_OK;
+    }
+
+    p = true == state->csv ? spl_fmt_sample_csv(p, &sample) : spl_fmt_sample_json(p, &sample);
+    fwrite(line, 1, p - line, stdout);
+
+    return A_OK;
+}
+
+static
+int _cmd_flight(int argc, char *const *argv)
+{
+    int ret = EXIT_FAILURE;
+
+    int a = -1;
+    const char *path = NULL;
+    size_t last = 0;
+    struct _flight_dump_state state = { .csv = false };
+
+    while (-1 != (a = getopt(argc, argv, "F:n:f:x"))) {
+        switch (a) {
+        case 'F':
+            path = optarg;
+            break;
+        case 'n':
+            last = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            if (0 == strcmp(optarg, "csv")) {
+                state.csv = true;
+            } else if (0 != strcmp(optarg, "jsonl")) {
+                SPL_MSG(SEV_FATAL, "BAD-FORMAT", "Unknown format '%s', must be csv or jsonl", optarg);
+                goto done;
+            }
+            break;
+        case 'x':
+            state.raw = true;
+            break;
+        default:
+            goto done;
+        }
+    }
+
+    if (NULL == path) {
+        SPL_MSG(SEV_FATAL, "NO-FLIGHT-RECORDER", "Please specify the flight recorder file with -F");
+        goto done;
+    }
+
+    if (true == state.csv && false == state.raw) {
+        fputs(SPL_FMT_SAMPLE_CSV_HEADER, stdout);
+    }
+
+    if (FAILED(spl_flight_dump(path, last, _print_flight_rec, &state))) {
+        goto done;
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    return ret;
+}
+
+static
+const struct spltool_cmd spltool_cmds[] = {
+    {
+        "events",
+        "-d {store dir} [-s {from}] [-e {to}] [-t {min Leq dB}] [-p {min peak dB}] [-m {min duration ms}] [-D {device}]\n"
+        "            List exceedance events from the event index that overlap the given window",
+        _cmd_events
+    },
+    {
+        "bench-kernels",
+        "-d {store dir} [-n {iterations}]\n"
+        "            Benchmark every aggregation kernel implementation on the raw samples in a store",
+        _cmd_bench_kernels
+    },
+    {
+        "bench-format",
+        "[-n {records}] [-t {output template}]\n"
+        "            Check that the default output template matches the fixed JSON formatter byte for byte, and\n"
+        "            benchmark both (and printf, and optionally another template) on synthetic samples",
+        _cmd_bench_format
+    },
+    {
+        "compact",
+        "-d {store dir} -R {retention} [-n {now}]\n"
+        "            Run one compaction pass over a store, as splread -R does in the background",
+        _cmd_compact
+    },
+    {
+        "export",
+        "-d {store dir} [-f csv|jsonl] [-r {resolution s} | -c] [-s {from}] [-e {to}] [-D {device}] [-j {threads}] [-o {file}]\n"
+        "            Export raw samples (or rollups, with -r, or a device's burst clips, with -c) as CSV or JSON Lines.\n"
+        "            -j 0 uses every CPU",
+        _cmd_export
+    },
+    {
+        "import",
+        "-d {store dir} [-D {device}] [-j {threads}] {archive}...\n"
+        "            Import JSON Lines archives of splread's output into a store. -j 0 uses every CPU",
+        _cmd_import
+    },
+    {
+        "flight",
+        "-F {flight recorder file} [-n {last N}] [-f csv|jsonl] [-x]\n"
+        "            Dump the reports held in a flight recorder, oldest first. -x prints the raw reports in hex",
+        _cmd_flight
+    },
+};
+
+static
+void _print_help(const char *name)
+{
+    printf("Usage: %s {command} [options]\n", name);
+    printf("Where {command} is one of:\n");
+    for (size_t i = 0; i < sizeof(spltool_cmds)/sizeof(spltool_cmds[0]); i++) {
+        printf(" %-10s %s\n", spltool_cmds[i].name, spltool_cmds[i].help);
+    }
+    printf("Times are seconds since the UNIX epoch, or UTC dates as YYYY-MM-DD[ HH:MM[:SS]]\n");
+}
+
+int main(int argc, char *const *argv)
+{
+    if (argc < 2) {
+        _print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof(spltool_cmds)/sizeof(spltool_cmds[0]); i++) {
+        if (0 == strcmp(spltool_cmds[i].name, argv[1])) {
+            return spltool_cmds[i].run(argc - 1, argv + 1);
+        }
+    }
+
+    _print_help(argv[0]);
+
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,209 @@
+/* splwheel.c -- Hierarchical timer wheel for scheduling device polls
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#include <splwheel.h>
+
+#include <string.h>
+
+void spl_wheel_init(struct spl_wheel *wheel, uint64_t tick_ns, uint64_t now_ns)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick_ns = 0 == tick_ns ? 1 : tick_ns;
+    wheel->base_ns = now_ns;
+}
+
+void spl_timer_init(struct spl_timer *timer, spl_timer_fn_t fn, void *arg)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+static
+void _wheel_link(struct spl_wheel *wheel, struct spl_timer *timer)
+{
+    uint64_t expires = timer->expires,
+             delta = 0;
+    struct spl_timer **slot = NULL;
+    unsigned level = 0;
+
+    if (expires < wheel->now) {
+        /* Already late, run it on the next tick we process */
+        expires = wheel->now;
+    }
+
+    delta = expires - wheel->now;
+
+    if (delta > SPL_WHEEL_MAX_TICKS) {
+        delta = SPL_WHEEL_MAX_TICKS;
+        expires = wheel->now + delta;
+        timer->expires = expires;
+    }
+
+    /* Find the finest level whose span covers the delta */
+    while (level < SPL_WHEEL_LEVELS - 1 && delta >= (1ull << (SPL_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    slot = &wheel->slots[level][(expires >> (SPL_WHEEL_BITS * level)) & SPL_WHEEL_MASK];
+
+    timer->next = *slot;
+    if (NULL != timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static
+void _wheel_unlink(struct spl_timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (NULL != timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void spl_wheel_add(struct spl_wheel *wheel, struct spl_timer *timer, uint64_t expires_ns)
+{
+    if (true == spl_timer_pending(timer)) {
+        spl_wheel_del(wheel, timer);
+    }
+
+    if (expires_ns <= wheel->base_ns) {
+        timer->expires = 0;
+    } else {
+        timer->expires = (expires_ns - wheel->base_ns + wheel->tick_ns - 1) / wheel->tick_ns;
+    }
+
+    _wheel_link(wheel, timer);
+    wheel->nr_timers++;
+}
+
+void spl_wheel_del(struct spl_wheel *wheel, struct spl_timer *timer)
+{
+    if (false == spl_timer_pending(timer)) {
+        return;
+    }
+
+    _wheel_unlink(timer);
+    wheel->nr_timers--;
+}
+
+/**
+ * Move every timer in the given slot of a coarse level down to where it now belongs
+ */
+static
+void _wheel_cascade(struct spl_wheel *wheel, unsigned level, unsigned idx)
+{
+    struct spl_timer *timer = wheel->slots[level][idx];
+
+    wheel->slots[level][idx] = NULL;
+
+    while (NULL != timer) {
+        struct spl_timer *next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        _wheel_link(wheel, timer);
+        timer = next;
+    }
+}
+
+uint64_t spl_wheel_next_ns(struct spl_wheel const *wheel)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (0 == wheel->nr_timers) {
+        return UINT64_MAX;
+    }
+
+    /* Level 0 holds everything due in the next SPL_WHEEL_SLOTS ticks, one tick per slot */
+    for (uint64_t tick = wheel->now; tick < wheel->now + SPL_WHEEL_SLOTS; tick++) {
+        if (NULL != wheel->slots[0][tick & SPL_WHEEL_MASK]) {
+            next = tick;
+            break;
+        }
+    }
+
+    /*
+     * Anything further out sits in a coarser slot, and we only need to be back when that slot is
+     * cascaded. Empty slots are skipped, so an idle wheel doesn't wake once a turn of level 0
+     * just to find nothing to do. A slot of level n is cascaded on the first tick of its span.
+     */
+    for (unsigned level = 1; level < SPL_WHEEL_LEVELS; level++) {
+        unsigned shift = SPL_WHEEL_BITS * level;
+        uint64_t span = 1ull << shift,
+                 first = (wheel->now + span - 1) >> shift << shift;
+
+        for (uint64_t tick = first; tick < first + SPL_WHEEL_SLOTS * span && tick < next; tick += span) {
+            if (NULL != wheel->slots[level][(tick >> shift) & SPL_WHEEL_MASK]) {
+                next = tick;
+                break;
+            }
+        }
+    }
+
+    return wheel->base_ns + next * wheel->tick_ns;
+}
+
+size_t spl_wheel_advance(struct spl_wheel *wheel, uint64_t now_ns)
+{
+    size_t nr_fired = 0;
+    uint64_t target = 0;
+
+    if (now_ns < wheel->base_ns) {
+        return 0;
+    }
+
+    target = (now_ns - wheel->base_ns) / wheel->tick_ns;
+
+    while (wheel->now <= target) {
+        unsigned idx = wheel->now & SPL_WHEEL_MASK;
+        struct spl_timer *timer = NULL;
+
+        if (0 == wheel->nr_timers) {
+            /* Nothing to run or cascade, just catch up */
+            wheel->now = target + 1;
+            break;
+        }
+
+        /* At the start of each turn of a level, pull the next slot of the level above down */
+        if (0 == idx) {
+            for (unsigned level = 1; level < SPL_WHEEL_LEVELS; level++) {
+                unsigned lidx = (wheel->now >> (SPL_WHEEL_BITS * level)) & SPL_WHEEL_MASK;
+                _wheel_cascade(wheel, level, lidx);
+                if (0 != lidx) {
+                    break;
+                }
+            }
+        }
+
+        timer = wheel->slots[0][idx];
+        wheel->slots[0][idx] = NULL;
+
+        /* Detach the whole slot first, so callbacks are free to re-arm into it */
+        while (NULL != timer) {
+            struct spl_timer *next = timer->next;
+
+            timer->next = NULL;
+            timer->pprev = NULL;
+            wheel->nr_timers--;
+            nr_fired++;
+
+            timer->fn(timer, timer->arg);
+
+            timer = next;
+        }
+
+        wheel->now++;
+    }
+
+    return nr_fired;
+}
@@ -0,0 +1,89 @@
+/* splwheel.h -- Hierarchical timer wheel for scheduling device polls
+ *
+ * Copyright (C) 2019 Phil Vachon <phil@security-embedded.com>
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#pragma once
+
+#include <splcommon.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Time is counted in ticks of a fixed length, chosen when the wheel is set up. Level 0 has
+ * one slot per tick; each level above it has slots SPL_WHEEL_SLOTS times coarser. Timers
+ * further out than level 0 can resolve sit in a coarse slot until the wheel comes around to
+ * it, at which point they are cascaded down a level. Adding and removing a timer is O(1),
+ * and so is expiring one, give or take the (amortized) cascades.
+ */
+#define SPL_WHEEL_BITS              6
+#define SPL_WHEEL_SLOTS             (1u << SPL_WHEEL_BITS)
+#define SPL_WHEEL_MASK              (SPL_WHEEL_SLOTS - 1)
+#define SPL_WHEEL_LEVELS            4
+
+/* The furthest ahead, in ticks, a timer can be set. Anything later is clamped to this. */
+#define SPL_WHEEL_MAX_TICKS         ((1ull << (SPL_WHEEL_BITS * SPL_WHEEL_LEVELS)) - 1)
+
+struct spl_timer;
+
+typedef void (*spl_timer_fn_t)(struct spl_timer *timer, void *arg);
+
+/**
+ * A timer is embedded in whatever it schedules. It is owned by the wheel between
+ * spl_wheel_add() and either expiry or spl_wheel_del().
+ */
+struct spl_timer {
+    struct spl_timer *next;
+    struct spl_timer **pprev;
+    /* Tick at which this timer fires */
+    uint64_t expires;
+    spl_timer_fn_t fn;
+    void *arg;
+};
+
+struct spl_wheel {
+    /* Length of a tick */
+    uint64_t tick_ns;
+    /* Time (on whatever clock the caller uses) of tick 0 */
+    uint64_t base_ns;
+    /* The next tick to be processed; every tick before this one has been run */
+    uint64_t now;
+    size_t nr_timers;
+    struct spl_timer *slots[SPL_WHEEL_LEVELS][SPL_WHEEL_SLOTS];
+};
+
+void spl_wheel_init(struct spl_wheel *wheel, uint64_t tick_ns, uint64_t now_ns);
+
+void spl_timer_init(struct spl_timer *timer, spl_timer_fn_t fn, void *arg);
+
+static inline
+bool spl_timer_pending(struct spl_timer const *timer)
+{
+    return NULL != timer->pprev;
+}
+
+/**
+ * Arm timer to fire at expires_ns, rounded up to the next tick. If the timer is already
+ * pending, it is moved. Times in the past fire on the next call to spl_wheel_advance().
+ */
+void spl_wheel_add(struct spl_wheel *wheel, struct spl_timer *timer, uint64_t expires_ns);
+
+void spl_wheel_del(struct spl_wheel *wheel, struct spl_timer *timer);
+
+/**
+ * The time by which spl_wheel_advance() next needs to be called, or UINT64_MAX if no timers
+ * are pending. This can be earlier than the next timer actually due, when a coarser slot
+ * holding it needs to be cascaded; slots with nothing in them never cause an early call.
+ */
+uint64_t spl_wheel_next_ns(struct spl_wheel const *wheel);
+
+/**
+ * Run every timer due at or before now_ns. Timers are disarmed before their callback is run,
+ * so a callback can re-arm its own timer. Returns the number of timers that fired.
+ */
+size_t spl_wheel_advance(struct spl_wheel *wheel, uint64_t now_ns);